@@ -333,6 +333,7 @@ void sieve_tool_deinit(struct sieve_tool **_tool)
 
 	/* Deinitialize Sieve engine */
 	sieve_deinit(&tool->svinst);
+	sieve_caches_deinit();
 
 	/* Free raw mail */
 
@@ -397,6 +398,36 @@ void sieve_tool_init_mail_user(struct sieve_tool *tool)
 	ns->flags |= NAMESPACE_FLAG_NOQUOTA | NAMESPACE_FLAG_NOACL;
 }
 
+struct mail_user *sieve_tool_create_mail_user(struct sieve_tool *tool)
+{
+	struct mail_user *mail_user_dovecot = tool->mail_user_dovecot;
+	struct mail_user *mail_user;
+	const char *errstr = NULL;
+
+	/* Reuse the userdb fields of the existing user, so that no new auth
+	   lookup is needed */
+	struct settings_instance *set_instance =
+		mail_storage_service_user_get_settings_instance(
+			mail_user_dovecot->service_user);
+	const char *const code_override_fields[] = {
+		(tool->homedir == NULL ? NULL :
+		 t_strconcat("mail_home=", tool->homedir, NULL)),
+		NULL
+	};
+	struct mail_storage_service_input input = {
+		.service = tool->name,
+		.username = tool->username,
+		.set_instance = set_instance,
+		.userdb_fields = mail_user_dovecot->userdb_fields,
+		.code_override_fields = code_override_fields,
+		.no_userdb_lookup = TRUE,
+	};
+	if (mail_storage_service_lookup_next(tool->storage_service, &input,
+					     &mail_user, &errstr) <= 0)
+		i_fatal("User lookup failed: %s", errstr);
+	return mail_user;
+}
+
 static void sieve_tool_init_mail_raw_user(struct sieve_tool *tool)
 {
 	if (tool->mail_raw_user == NULL) {
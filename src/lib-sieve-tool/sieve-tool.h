@@ -39,6 +39,9 @@ void sieve_tool_deinit(struct sieve_tool **_tool);
  */
 
 void sieve_tool_init_mail_user(struct sieve_tool *tool);
+/* Create a new, independent mail user for the tool's user (e.g. for a
+   forked worker process). */
+struct mail_user *sieve_tool_create_mail_user(struct sieve_tool *tool);
 
 struct mail *
 sieve_tool_open_file_as_mail(struct sieve_tool *tool, const char *path);
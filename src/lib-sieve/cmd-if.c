@@ -89,8 +89,12 @@ struct cmd_if_context_data {
 
 	int const_condition;
 
-	bool jump_generated;
-	sieve_size_t exit_jump;
+	/* Jumps to the end of the if-elsif-else structure */
+	struct sieve_jumplist *exit_jumps;
+
+	/* Final command only: code position the exit jumps were resolved to */
+	bool exits_resolved;
+	sieve_size_t exit_address;
 };
 
 static void
@@ -102,8 +106,6 @@ cmd_if_initialize_context_data(struct sieve_command *cmd,
 	/* Assign context */
 	cmd_data = p_new(sieve_command_pool(cmd),
 			 struct cmd_if_context_data, 1);
-	cmd_data->exit_jump = 0;
-	cmd_data->jump_generated = FALSE;
 
 	/* Update linked list of contexts */
 	cmd_data->previous = previous;
@@ -198,18 +200,88 @@ cmd_if_validate_const(struct sieve_validator *valdtr ATTR_UNUSED,
  */
 
 static void
-cmd_if_resolve_exit_jumps(struct sieve_binary_block *sblock,
-			  struct cmd_if_context_data *cmd_data)
+cmd_if_add_exit_jump(struct sieve_command *cmd,
+		     struct sieve_binary_block *sblock, sieve_size_t jump)
+{
+	struct cmd_if_context_data *cmd_data =
+		(struct cmd_if_context_data *)cmd->data;
+
+	if (cmd_data->exit_jumps == NULL) {
+		cmd_data->exit_jumps =
+			sieve_jumplist_create(sieve_command_pool(cmd), sblock);
+	}
+	sieve_jumplist_add(cmd_data->exit_jumps, jump);
+}
+
+static void
+cmd_if_add_exit_jumps(struct sieve_command *cmd,
+		      struct sieve_binary_block *sblock,
+		      const struct sieve_jumplist *jlist)
+{
+	const sieve_size_t *jumps;
+	unsigned int count, i;
+
+	jumps = array_get(&jlist->jumps, &count);
+	for (i = 0; i < count; i++)
+		cmd_if_add_exit_jump(cmd, sblock, jumps[i]);
+}
+
+static void
+cmd_if_thread_nested_exit_jumps(const struct sieve_codegen_env *cgenv,
+				struct sieve_command *cmd,
+				sieve_size_t block_end)
 {
+	struct sieve_ast_node *last = sieve_ast_command_last(cmd->ast_node);
+	struct cmd_if_context_data *nested;
+
+	if (cgenv->optimization_level < 1)
+		return;
+
+	/* When the block ends with a nested if-elsif-else structure, its exit
+	   jumps were resolved to the end of our block, i.e. to the position of
+	   our own exit. Take these jumps over, so that they are resolved to the
+	   final destination directly rather than jumping to a jump. */
+	if (last == NULL || last->command == NULL)
+		return;
+	if (!sieve_command_is(last->command, cmd_if) &&
+	    !sieve_command_is(last->command, cmd_elsif) &&
+	    !sieve_command_is(last->command, cmd_else))
+		return;
+
+	/* Commands following a constant true branch generate no code */
+	nested = (struct cmd_if_context_data *)last->command->data;
+	while (nested != NULL && !nested->exits_resolved &&
+	       nested->const_condition == 0)
+		nested = nested->previous;
+
+	if (nested == NULL || !nested->exits_resolved ||
+	    nested->exit_jumps == NULL || nested->exit_address != block_end)
+		return;
+
+	cmd_if_add_exit_jumps(cmd, cgenv->sblock, nested->exit_jumps);
+}
+
+static void
+cmd_if_resolve_exit_jumps(struct sieve_command *cmd,
+			  struct sieve_binary_block *sblock)
+{
+	struct cmd_if_context_data *cmd_data =
+		(struct cmd_if_context_data *)cmd->data;
 	struct cmd_if_context_data *if_ctx = cmd_data->previous;
 
-	/* Iterate backwards through all if-command contexts and resolve the
-	   exit jumps to the current code position. */
+	/* Iterate backwards through all if-command contexts and collect the
+	   exit jumps. */
 	while (if_ctx != NULL) {
-		if (if_ctx->jump_generated)
-			sieve_binary_resolve_offset(sblock, if_ctx->exit_jump);
+		if (if_ctx->exit_jumps != NULL)
+			cmd_if_add_exit_jumps(cmd, sblock, if_ctx->exit_jumps);
 		if_ctx = if_ctx->previous;
 	}
+
+	/* Resolve them to the current code position */
+	if (cmd_data->exit_jumps != NULL)
+		sieve_jumplist_resolve(cmd_data->exit_jumps);
+	cmd_data->exits_resolved = TRUE;
+	cmd_data->exit_address = sieve_binary_block_get_size(sblock);
 }
 
 static bool
@@ -221,6 +293,7 @@ cmd_if_generate(const struct sieve_codegen_env *cgenv,
 		(struct cmd_if_context_data *)cmd->data;
 	struct sieve_ast_node *test;
 	struct sieve_jumplist jmplist;
+	sieve_size_t block_end;
 
 	/* Generate test condition */
 	if (cmd_data->const_condition < 0) {
@@ -237,12 +310,23 @@ cmd_if_generate(const struct sieve_codegen_env *cgenv,
 		if (!sieve_generate_block(cgenv, cmd->ast_node))
 			return FALSE;
 	}
+	block_end = sieve_binary_block_get_size(sblock);
 
 	/* Are we the final command in this if-elsif-else structure? */
 	if (cmd_data->next == NULL || cmd_data->const_condition == 1) {
-		/* Yes, Resolve previous exit jumps to this point */
-		cmd_if_resolve_exit_jumps(sblock, cmd_data);
-	} else if (cmd_data->const_condition < 0) {
+		/* Yes, resolve all exit jumps to this point. When the test
+		   fails, execution continues here as well. */
+		if (cmd_data->const_condition != 0) {
+			cmd_if_thread_nested_exit_jumps(cgenv, cmd,
+							block_end);
+		}
+		if (cmd_data->const_condition < 0)
+			cmd_if_add_exit_jumps(cmd, sblock, &jmplist);
+		cmd_if_resolve_exit_jumps(cmd, sblock);
+		return TRUE;
+	}
+
+	if (cmd_data->const_condition < 0) {
 		/* No, generate jump to end of if-elsif-else structure (resolved
 		   later). This of course is not necessary if the {} block
 		   contains a command like stop at top level that
@@ -251,13 +335,13 @@ cmd_if_generate(const struct sieve_codegen_env *cgenv,
 		if (!sieve_command_block_exits_unconditionally(cmd)) {
 			sieve_operation_emit(sblock, NULL,
 					     &sieve_jmp_operation);
-			cmd_data->exit_jump =
-				sieve_binary_emit_offset(sblock, 0);
-			cmd_data->jump_generated = TRUE;
+			cmd_if_add_exit_jump(
+				cmd, sblock,
+				sieve_binary_emit_offset(sblock, 0));
+			cmd_if_thread_nested_exit_jumps(cgenv, cmd,
+							block_end);
 		}
-	}
 
-	if (cmd_data->const_condition < 0) {
 		/* Case false ...
 		   (subsequent elsif/else commands might generate more) */
 		sieve_jumplist_resolve(&jmplist);
@@ -270,6 +354,7 @@ static bool
 cmd_else_generate(const struct sieve_codegen_env *cgenv,
 		  struct sieve_command *cmd)
 {
+	struct sieve_binary_block *sblock = cgenv->sblock;
 	struct cmd_if_context_data *cmd_data =
 		(struct cmd_if_context_data *)cmd->data;
 
@@ -279,7 +364,9 @@ cmd_else_generate(const struct sieve_codegen_env *cgenv,
 			return FALSE;
 
 		/* } End: resolve all exit blocks */
-		cmd_if_resolve_exit_jumps(cgenv->sblock, cmd_data);
+		cmd_if_thread_nested_exit_jumps(
+			cgenv, cmd, sieve_binary_block_get_size(sblock));
+		cmd_if_resolve_exit_jumps(cmd, sblock);
 	}
 
 	return TRUE;
@@ -551,7 +551,6 @@ act_redirect_execute(const struct sieve_action_exec_env *aenv,
 {
 	const struct sieve_action *action = aenv->action;
 	const struct sieve_execute_env *eenv = aenv->exec_env;
-	struct sieve_instance *svinst = eenv->svinst;
 	struct act_redirect_context *ctx =
 		(struct act_redirect_context *)action->context;
 	struct act_redirect_transaction *trans = tr_context;
@@ -574,8 +573,9 @@ act_redirect_execute(const struct sieve_action_exec_env *aenv,
 		if (mail_get_message_id_no_validation(msgdata->mail, &msg_id) > 0)
 			trans->msg_id = p_strdup(pool, msg_id);
 		else {
-			msg_id = sieve_message_get_new_id(svinst);
-			trans->msg_id = trans->new_msg_id = p_strdup(pool, msg_id);
+			/* Same for all redirects of the message */
+			trans->msg_id = trans->new_msg_id =
+				sieve_message_context_get_new_id(msgctx);
 		}
 	}
 
@@ -9,6 +9,7 @@
 #include "sieve-comparators.h"
 #include "sieve-interpreter.h"
 #include "sieve-match.h"
+#include "sieve-match-keyset.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -17,6 +18,7 @@
  * Forward declarations
  */
 
+static void mcht_contains_match_init(struct sieve_match_context *mctx);
 static int
 mcht_contains_match_key(struct sieve_match_context *mctx,
 			const char *val, size_t val_size,
@@ -30,20 +32,34 @@ const struct sieve_match_type_def contains_match_type = {
 	SIEVE_OBJECT("contains", &match_type_operand,
 		     SIEVE_MATCH_TYPE_CONTAINS),
 	.validate_context = sieve_match_substring_validate_context,
-	.match_key = mcht_contains_match_key
+	.match_init = mcht_contains_match_init,
+	.match_keys = sieve_match_keyset_match_keys,
+	.match_key = mcht_contains_match_key,
+	.match_stream_init = sieve_match_keyset_stream_init,
+	.match_stream_begin = sieve_match_keyset_stream_begin,
+	.match_stream_more = sieve_match_keyset_stream_more,
 };
 
 /*
  * Match-type implementation
  */
 
-/* FIXME: Naive substring match implementation. Should switch to more efficient
-          algorithm if large values need to be searched (e.g. message body).
-  
-          The inner loop polls the interpreter CPU time limit periodically so
-          that a single O(N*M) match on a large value cannot run for many times
-          the configured sieve_max_cpu_time (which is otherwise only checked
-	  between bytecode operations).
+static void mcht_contains_match_init(struct sieve_match_context *mctx)
+{
+	/* The i;octet and i;ascii-casemap comparators match all keys at once
+	   using a key set; mcht_contains_match_key() is used otherwise. */
+	sieve_match_keyset_match_init(mctx, SIEVE_MATCH_KEYSET_CONTAINS);
+}
+
+/* Naive substring match, used only for comparators other than i;octet and
+   i;ascii-casemap (those match all keys at once through the Aho-Corasick key
+   set). FIXME: should switch to a more efficient algorithm for these as well
+   if large values need to be searched (e.g. message body).
+
+   The inner loop polls the interpreter CPU time limit periodically so that a
+   single O(N*M) match on a large value cannot run for many times the
+   configured sieve_max_cpu_time (which is otherwise only checked between
+   bytecode operations).
  */
 #define SIEVE_CONTAINS_CPU_CHECK_INTERVAL 4096
 
@@ -8,6 +8,7 @@
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
 #include "sieve-match.h"
+#include "sieve-match-keyset.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -16,6 +17,7 @@
  * Forward declarations
  */
 
+static void mcht_is_match_init(struct sieve_match_context *mctx);
 static int
 mcht_is_match_key(struct sieve_match_context *mctx,
 		  const char *val, size_t val_size,
@@ -27,6 +29,8 @@ mcht_is_match_key(struct sieve_match_context *mctx,
 
 const struct sieve_match_type_def is_match_type = {
 	SIEVE_OBJECT("is", &match_type_operand, SIEVE_MATCH_TYPE_IS),
+	.match_init = mcht_is_match_init,
+	.match_keys = sieve_match_keyset_match_keys,
 	.match_key = mcht_is_match_key
 };
 
@@ -34,6 +38,11 @@ const struct sieve_match_type_def is_match_type = {
  * Match-type implementation
  */
 
+static void mcht_is_match_init(struct sieve_match_context *mctx)
+{
+	sieve_match_keyset_match_init(mctx, SIEVE_MATCH_KEYSET_IS);
+}
+
 static int
 mcht_is_match_key(struct sieve_match_context *mctx ATTR_UNUSED,
 		  const char *val, size_t val_size,
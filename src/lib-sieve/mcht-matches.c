@@ -4,15 +4,16 @@
  */
 
 #include "lib.h"
+#include "array.h"
 #include "str.h"
 
+#include "sieve-binary.h"
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
 #include "sieve-interpreter.h"
 #include "sieve-match.h"
 
 #include <string.h>
-#include <stdio.h>
 
 /*
  * Forward declarations
@@ -34,493 +35,477 @@ const struct sieve_match_type_def matches_match_type = {
 };
 
 /*
- * Match-type implementation
+ * Compiled key
  */
 
-/* Quick 'n dirty debug */
-//#define MATCH_DEBUG
-#ifdef MATCH_DEBUG
-#define debug_printf(...) printf ("match debug: " __VA_ARGS__)
-#else
-#define debug_printf(...)
-#endif
-
-/* FIXME: Naive implementation, substitute this with dovecot src/lib/str-find.c
- *
- * The inner loop polls the interpreter CPU time limit periodically so that a
- * single O(N*M) search on a large value cannot run for many times the
- * configured sieve_max_cpu_time. Returns 1 on match, 0 on exhaustion, or -1
- * when the CPU time limit was exceeded (mctx->exec_status is set).
+/* A key is compiled into a sequence of sections separated by '*' wildcards:
+
+     <key>     = <section>*<section>*<section>...
+     <section> = sequence of literal strings and '?' wildcards
+
+   Escape sequences are resolved during compilation. The first section is
+   anchored at the beginning of the value and the last section is anchored at
+   its end. All sections in between are matched at their leftmost occurrence,
+   which never needs to be reconsidered once the next section is found. So,
+   the value is scanned only once.
+
+   Compiled keys are cached with the binary, which means that constant keys
+   are compiled only once while the binary is loaded.
  */
-#define SIEVE_MATCHES_CPU_CHECK_INTERVAL 4096
 
-static int
-_string_find(struct sieve_match_context *mctx,
-	     const struct sieve_comparator *cmp,
-	     const char **valp, const char *vend,
-	     const char **keyp, const char *kend,
-	     unsigned int *counter)
+struct mcht_matches_part {
+	/* Literal string; NULL for '?' */
+	const char *literal;
+	size_t size;
+};
+ARRAY_DEFINE_TYPE(mcht_matches_part, struct mcht_matches_part);
+
+struct mcht_matches_section {
+	const struct mcht_matches_part *parts;
+	unsigned int count;
+
+	/* Number of leading '?' parts */
+	unsigned int lead_any;
+	/* Size of a match in bytes (if the comparator is not multi-byte) */
+	size_t size;
+};
+
+struct mcht_matches_key {
+	const struct mcht_matches_section *sections;
+	unsigned int count;
+};
+
+static void
+mcht_matches_section_finish(ARRAY_TYPE(mcht_matches_part) *parts,
+			    struct mcht_matches_section *section)
 {
-	while ((*valp < vend) && (*keyp < kend)) {
-		if (!cmp->def->char_match(cmp, valp, vend, keyp, kend))
-			(*valp)++;
-
-		if (++(*counter) >= SIEVE_MATCHES_CPU_CHECK_INTERVAL) {
-			*counter = 0;
-			if (sieve_runtime_cpu_limit_exceeded(mctx->runenv)) {
-				sieve_runtime_error(
-					mctx->runenv, NULL,
-					"execution exceeded CPU time limit");
-				mctx->exec_status =
-					SIEVE_EXEC_RESOURCE_LIMIT;
-				return -1;
-			}
-		}
+	unsigned int i;
+
+	section->parts = array_get(parts, &section->count);
+	for (i = 0; i < section->count; i++) {
+		if (section->parts[i].literal == NULL &&
+		    section->lead_any == i)
+			section->lead_any++;
+		section->size += section->parts[i].size;
 	}
+}
 
-	return (*keyp == kend ? 1 : 0);
+static void
+mcht_matches_literal_flush(pool_t pool, ARRAY_TYPE(mcht_matches_part) *parts,
+			   string_t *literal)
+{
+	struct mcht_matches_part *part;
+
+	if (str_len(literal) == 0)
+		return;
+
+	part = array_append_space(parts);
+	part->literal = p_memdup(pool, str_data(literal), str_len(literal));
+	part->size = str_len(literal);
+	str_truncate(literal, 0);
 }
 
-static char
-_scan_key_section(string_t *section, const char **wcardp, const char *key_end)
+static struct mcht_matches_key *
+mcht_matches_key_compile(pool_t pool, const char *key, size_t key_size)
 {
-	/* Find next wildcard and resolve escape sequences */
-	str_truncate(section, 0);
-	while (*wcardp < key_end && **wcardp != '*' && **wcardp != '?') {
-		if (**wcardp == '\\') {
-			(*wcardp)++;
-			if (*wcardp == key_end) {
-				str_append_c(section,'\\');
-				break;
+	struct mcht_matches_key *mkey;
+	ARRAY(struct mcht_matches_section) sections;
+	ARRAY_TYPE(mcht_matches_part) parts;
+	struct mcht_matches_section *section;
+	struct mcht_matches_part *part;
+	const char *kp = key, *kend = key + key_size;
+	string_t *literal;
+
+	literal = t_str_new(key_size);
+	p_array_init(&sections, pool, 4);
+	p_array_init(&parts, pool, 4);
+	section = array_append_space(&sections);
+
+	while (kp < kend) {
+		switch (*kp) {
+		case '\\':
+			kp++;
+			if (kp == kend) {
+				/* Trailing '\' is literal */
+				str_append_c(literal, '\\');
+				continue;
 			}
+			break;
+		case '?':
+			mcht_matches_literal_flush(pool, &parts, literal);
+			part = array_append_space(&parts);
+			part->size = 1;
+			kp++;
+			continue;
+		case '*':
+			mcht_matches_literal_flush(pool, &parts, literal);
+			mcht_matches_section_finish(&parts, section);
+			p_array_init(&parts, pool, 4);
+			section = array_append_space(&sections);
+			kp++;
+			continue;
+		default:
+			break;
 		}
-		str_append_c(section, **wcardp);
-		(*wcardp)++;
+		str_append_c(literal, *kp);
+		kp++;
 	}
+	mcht_matches_literal_flush(pool, &parts, literal);
+	mcht_matches_section_finish(&parts, section);
 
-	/* Record wildcard character or \0 */
-	if (*wcardp < key_end) {
-		return **wcardp;
+	mkey = p_new(pool, struct mcht_matches_key, 1);
+	mkey->sections = array_get(&sections, &mkey->count);
+	return mkey;
+}
+
+static const struct mcht_matches_key *
+mcht_matches_key_get(struct sieve_match_context *mctx,
+		     const char *key, size_t key_size)
+{
+	struct sieve_binary *sbin = mctx->runenv->sbin;
+	struct mcht_matches_key *mkey;
+	const char *cache_key;
+	pool_t pool;
+
+	if (sbin == NULL || memchr(key, '\0', key_size) != NULL) {
+		return mcht_matches_key_compile(pool_datastack_create(),
+						key, key_size);
 	}
 
-	i_assert(*wcardp == key_end);
-	return '\0';
+	cache_key = t_strconcat("matches:", key, NULL);
+	mkey = sieve_binary_runtime_cache_lookup(sbin, cache_key);
+	if (mkey != NULL)
+		return mkey;
+
+	pool = sieve_binary_runtime_cache_pool(sbin);
+	if (pool == NULL) {
+		return mcht_matches_key_compile(pool_datastack_create(),
+						key, key_size);
+	}
+	mkey = mcht_matches_key_compile(pool, key, key_size);
+	sieve_binary_runtime_cache_insert(sbin, cache_key, mkey);
+	return mkey;
 }
 
-static int
-mcht_matches_match_key(struct sieve_match_context *mctx,
-		       const char *val, size_t val_size,
-		       const char *key, size_t key_size)
-{
-	const struct sieve_comparator *cmp = mctx->comparator;
-	struct sieve_match_values *mvalues;
-	string_t *mvalue = NULL, *mchars = NULL;
-	string_t *section, *subsection;
-	const char *vend, *kend, *vp, *kp, *wp, *pvp;
-	bool backtrack = FALSE; /* TRUE: match of '?'-connected sections failed
-				 */
-	char wcard = '\0';      /* Current wildcard */
-	char next_wcard = '\0'; /* Next  widlcard */
-	unsigned int key_offset = 0;
-	unsigned int counter = 0;
+/*
+ * Match-type implementation
+ */
 
-	if (cmp->def == NULL || cmp->def->char_match == NULL)
-		return 0;
+/* Matching is mostly linear in the size of the value, but adversarial keys
+   can still require many attempts at finding a section. So, the CPU time limit
+   is polled periodically; a single search on a large value cannot then run for
+   many times the configured sieve_max_cpu_time.
+ */
+#define SIEVE_MATCHES_CPU_CHECK_INTERVAL 4096
 
-	/* Key sections */
-	section = t_str_new(32);    /* Section (after beginning or *) */
-	subsection = t_str_new(32); /* Sub-section (after ?) */
+enum mcht_matches_mode {
+	/* Comparator-specific character matching */
+	MCHT_MATCHES_MODE_GENERIC = 0,
+	/* Byte-wise matching (i;octet) */
+	MCHT_MATCHES_MODE_OCTET,
+	/* Byte-wise case-insensitive matching (i;ascii-casemap) */
+	MCHT_MATCHES_MODE_ASCII_CASEMAP,
+};
 
-	/* Mark end of value and key */
-	vend = (const char *) val + val_size;
-	kend = (const char *) key + key_size;
+struct mcht_matches_context {
+	struct sieve_match_context *mctx;
+	const struct sieve_comparator *cmp;
+	enum mcht_matches_mode mode;
 
-	/* Initialize pointers */
-	vp = val;                   /* Value pointer */
-	kp = key;                   /* Key pointer */
-	wp = key;                   /* Wildcard (key) pointer */
+	/* Characters matched by '?' in the last section match */
+	string_t *chars;
 
-	/* Start match values list if requested */
-	if ((mvalues = sieve_match_values_start(mctx->runenv)) != NULL) {
-		/* Skip ${0} for now; added when match succeeds */
-		sieve_match_values_add(mvalues, NULL);
+	unsigned int counter;
+};
 
-		mvalue = t_str_new(32);     /* Match value (*) */
-		mchars = t_str_new(32);     /* Match characters (.?..?.??) */
+static int mcht_matches_poll(struct mcht_matches_context *mmctx)
+{
+	struct sieve_match_context *mctx = mmctx->mctx;
+
+	if (++mmctx->counter < SIEVE_MATCHES_CPU_CHECK_INTERVAL)
+		return 0;
+	mmctx->counter = 0;
+
+	if (!sieve_runtime_cpu_limit_exceeded(mctx->runenv))
+		return 0;
+
+	sieve_runtime_error(mctx->runenv, NULL,
+			    "execution exceeded CPU time limit");
+	mctx->exec_status = SIEVE_EXEC_RESOURCE_LIMIT;
+	return -1;
+}
+
+static bool
+mcht_matches_literal(struct mcht_matches_context *mmctx,
+		     const struct mcht_matches_part *part,
+		     const char **vp, const char *vend)
+{
+	const struct sieve_comparator *cmp = mmctx->cmp;
+	const char *kp = part->literal;
+
+	switch (mmctx->mode) {
+	case MCHT_MATCHES_MODE_OCTET:
+		if ((size_t)(vend - *vp) < part->size ||
+		    memcmp(*vp, part->literal, part->size) != 0)
+			return FALSE;
+		break;
+	case MCHT_MATCHES_MODE_ASCII_CASEMAP:
+		if ((size_t)(vend - *vp) < part->size ||
+		    i_memcasecmp(*vp, part->literal, part->size) != 0)
+			return FALSE;
+		break;
+	case MCHT_MATCHES_MODE_GENERIC:
+		return cmp->def->char_match(cmp, vp, vend,
+					    &kp, kp + part->size);
 	}
 
-	/* Match the pattern:
-	     <pattern> = <section>*<section>*<section>...
-	     <section> = <sub-section>?<sub-section>?<sub-section>...
-
-	   Escape sequences \? and \* need special attention.
-	 */
-
-	debug_printf("=== Start ===\n");
-	debug_printf("  key:   %s\n", t_strdup_until(key, kend));
-	debug_printf("  value: %s\n", t_strdup_until(val, vend));
-
-	/* Loop until either key or value ends */
-	while (kp < kend && vp < vend) {
-		const char *needle, *nend;
-
-		if (++counter >= SIEVE_MATCHES_CPU_CHECK_INTERVAL) {
-			counter = 0;
-			if (sieve_runtime_cpu_limit_exceeded(mctx->runenv)) {
-				sieve_runtime_error(
-					mctx->runenv, NULL,
-					"execution exceeded CPU time limit");
-				mctx->exec_status =
-					SIEVE_EXEC_RESOURCE_LIMIT;
-				sieve_match_values_abort(&mvalues);
-				return -1;
-			}
-		}
+	*vp += part->size;
+	return TRUE;
+}
 
-		if (!backtrack) {
-			/* Search the next '*' wildcard in the key string */
+/* Match section at the given position; advances *vp past the match. */
+static bool
+mcht_matches_section_at(struct mcht_matches_context *mmctx,
+			const struct mcht_matches_section *section,
+			const char **vp, const char *vend)
+{
+	const char *p = *vp;
+	unsigned int i;
 
-			wcard = next_wcard;
+	if (mmctx->chars != NULL)
+		str_truncate(mmctx->chars, 0);
 
-			/* Find the needle to look for in the string */
-			key_offset = 0;
-			for (;;) {
-				next_wcard =
-					_scan_key_section(section, &wp, kend);
+	for (i = 0; i < section->count; i++) {
+		const struct mcht_matches_part *part = &section->parts[i];
 
-				if (wcard == '\0' || str_len(section) > 0)
-					break;
-				if (next_wcard == '*')
-					break;
+		if (part->literal != NULL) {
+			if (!mcht_matches_literal(mmctx, part, &p, vend))
+				return FALSE;
+			continue;
+		}
 
-				if (wp < kend)
-					wp++;
-				else
-					break;
-				key_offset++;
-			}
+		/* '?' */
+		if (p >= vend)
+			return FALSE;
+		if (mmctx->chars != NULL)
+			str_append_c(mmctx->chars, *p);
+		p++;
+	}
 
-			debug_printf("found wildcard '%c' at pos [%d]\n",
-				     next_wcard, (int)(wp - key));
+	*vp = p;
+	return TRUE;
+}
 
-			if (mvalues != NULL)
-				str_truncate(mvalue, 0);
+static const char *
+mcht_matches_find_literal(struct mcht_matches_context *mmctx,
+			  const struct mcht_matches_part *part,
+			  const char *vp, const char *vend)
+{
+	bool casemap = (mmctx->mode == MCHT_MATCHES_MODE_ASCII_CASEMAP);
+	const char *literal = part->literal;
+	size_t size = part->size;
+	char first = (casemap ? i_tolower(literal[0]) : literal[0]);
+	const char *last;
+
+	i_assert(size > 0);
+	if ((size_t)(vend - vp) < size)
+		return NULL;
+	last = vend - size;
+
+	while (vp <= last) {
+		if (!casemap || !i_isalpha(first)) {
+			vp = memchr(vp, first, last - vp + 1);
+			if (vp == NULL)
+				return NULL;
 		} else {
-			/* Backtracked; '*' wildcard is retained */
-			debug_printf("backtracked");
-			backtrack = FALSE;
+			while (vp <= last && i_tolower(*vp) != first)
+				vp++;
+			if (vp > last)
+				return NULL;
 		}
 
-		/* Determine what we are looking for */
-		needle = str_c(section);
-		nend = PTR_OFFSET(needle, str_len(section));
-
-		debug_printf("  section needle:  '%s'\n",
-			     t_strdup_until(needle, nend));
-		debug_printf("  section key:     '%s'\n",
-			     t_strdup_until(kp, kend));
-		debug_printf("  section remnant: '%s'\n",
-			     t_strdup_until(wp, kend));
-		debug_printf("  value remnant:   '%s'\n",
-			     t_strdup_until(vp, vend));
-		debug_printf("  key offset:      %d\n", key_offset);
-
-		pvp = vp;
-		if (next_wcard == '\0') {
-			if (wcard == '\0') {
-				/* No current wildcard; match needs to happen
-				   right at the beginning */
-				debug_printf("next_wcard = NULL && wcard = NUL; "
-					     "needle should be equal to value.\n");
-
-				if ((vend - vp) != (nend - needle) ||
-				    !cmp->def->char_match(cmp, &vp, vend, &needle, nend)) {
-					debug_printf("  key not equal to value\n");
-					break;
-				}
-
-			} else {
-				const char *qp, *qend;
-				size_t slen;
-
-				/* No more wildcards; find the needle substring
-				   at the end of string */
-				debug_printf("next_wcard = NUL; "
-					     "must find needle at end\n");
-
-				/* Check if the value is still large enough to
-				   contain both the '?'-matched prefix
-				   (key_offset chars) and the trailing section.
-				 */
-				slen = str_len(section);
-				if ((vp + slen + key_offset) > vend) {
-					debug_printf("  wont match: "
-						     "value is too short\n");
-					break;
-				}
-
-				/* Move value pointer to where the needle should
-				   be */
-				vp = vend - slen;
-
-				/* Record match values */
-				qend = vp;
-				qp = vp - key_offset;
-
-				/* Compare needle to end of value string */
-				if (!cmp->def->char_match(cmp, &vp, vend,
-							   &needle, nend)) {
-					debug_printf("  match at end failed\n");
-					break;
-				}
-
-				/* Add match values */
-				if (mvalues != NULL) {
-					i_assert(qp >= pvp);
-					str_append_data(mvalue, pvp, qp - pvp);
-
-					/* Append '*' match value */
-					sieve_match_values_add(mvalues, mvalue);
-
-					/* Append any initial '?' match values
-					 */
-					for (; qp < qend; qp++) {
-						sieve_match_values_add_char(
-							mvalues, *qp);
-					}
-				}
-			}
+		if ((casemap ? i_memcasecmp(vp, literal, size) :
+			       memcmp(vp, literal, size)) == 0)
+			return vp;
+		vp++;
+	}
+	return NULL;
+}
 
-			/* Finish match */
-			kp = kend;
-			vp = vend;
+/* Find the leftmost occurrence of the section at or after *vp. Returns 1 when
+   found, with *start_r pointing to its start and *vp to its end. */
+static int
+mcht_matches_section_find(struct mcht_matches_context *mmctx,
+			  const struct mcht_matches_section *section,
+			  const char **vp, const char *vend,
+			  const char **start_r)
+{
+	const struct mcht_matches_part *literal = NULL;
+	const char *p = *vp, *end;
+
+	if (mmctx->mode != MCHT_MATCHES_MODE_GENERIC &&
+	    section->lead_any < section->count)
+		literal = &section->parts[section->lead_any];
+
+	while (p <= vend) {
+		if (literal != NULL) {
+			/* Skip directly to the next candidate position */
+			if ((size_t)(vend - p) < section->lead_any)
+				return 0;
+			p = mcht_matches_find_literal(
+				mmctx, literal, p + section->lead_any, vend);
+			if (p == NULL)
+				return 0;
+			p -= section->lead_any;
+		}
 
-			debug_printf("  matched end of value\n");
-			break;
-		} else {
-			/* Next wildcard found; match needle before next
-			   wildcard */
-
-			/* Stored value pointer for backtrack */
-			const char *prv = NULL;
-			/* Stored key pointer for backtrack */
-			const char *prk = NULL;
-			/* Stored wildcard pointer for backtrack */
-			const char *prw = NULL;
-			const char *chars;
-
-			/* Reset '?' match values */
-			if (mvalues != NULL)
-				str_truncate(mchars, 0);
-
-			if (wcard == '\0') {
-				/* No current wildcard; match needs to happen
-				   right at the beginning */
-				debug_printf("wcard = NUL; "
-					     "needle should be found at the beginning.\n");
-				debug_printf("  begin needle: '%s'\n",
-					     t_strdup_until(needle, nend));
-				debug_printf("  begin value:  '%s'\n",
-					     t_strdup_until(vp, vend));
-
-				if (!cmp->def->char_match(cmp, &vp, vend, &needle, nend)) {
-					debug_printf("  failed to find needle at beginning\n");
-					break;
-				}
-
-			} else {
-				/* Current wildcard present; match needle
-				   between current and next wildcard */
-				debug_printf("wcard != NUL; "
-					     "must find needle at an offset (>= %d).\n",
-					     key_offset);
-
-				/* Match may happen at any offset
-				   (>= key offset): find substring */
-				vp += key_offset;
-				if (vp >= vend) {
-					debug_printf("  failed to find needle at an offset\n");
-					break;
-				}
-				int fres = _string_find(mctx, cmp, &vp, vend,
-							&needle, nend, &counter);
-				if (fres < 0) {
-					sieve_match_values_abort(&mvalues);
-					return -1;
-				}
-				if (fres == 0) {
-					debug_printf("  failed to find needle at an offset\n");
-					break;
-				}
-
-				prv = vp - str_len(section);
-				prk = kp;
-				prw = wp;
-
-				/* Append match values */
-				if (mvalues != NULL) {
-					const char *qend = vp - str_len(section);
-					const char *qp = qend - key_offset;
-
-					/* Append '*' match value */
-					str_append_data(mvalue, pvp, qp - pvp);
-
-					/* Append any initial '?' match values
-					   (those that caused the key offset).
-					 */
-					for (; qp < qend; qp++)
-						str_append_c(mchars, *qp);
-				}
-			}
+		end = p;
+		if (mcht_matches_section_at(mmctx, section, &end, vend)) {
+			*start_r = p;
+			*vp = end;
+			return 1;
+		}
+		if (mcht_matches_poll(mmctx) < 0)
+			return -1;
+		p++;
+	}
+	return 0;
+}
 
-			/* Update wildcard and key pointers for next wildcard
-			   scan */
-			if (wp < kend)
-				wp++;
-			kp = wp;
-
-			/* Scan successive '?' wildcards */
-			while (next_wcard == '?') {
-				bool match_failed_empty = FALSE;
-
-				debug_printf("next_wcard = '?'; "
-					     "need to match arbitrary character\n");
-
-				i_assert(vp <= vend);
-				if (vp == vend)
-					match_failed_empty = TRUE;
-				else {
-					/* Add match value */
-					if (mvalues != NULL)
-						str_append_c(mchars, *vp);
-
-					vp++;
-
-					/* Scan for next '?' wildcard */
-					next_wcard = _scan_key_section(subsection, &wp, kend);
-					debug_printf("found next wildcard '%c' at pos [%d] "
-						     "(fixed match)\n",
-						     next_wcard, (int)(wp - key));
-
-					/* Determine what we are looking for */
-					needle = str_c(subsection);
-					nend = needle + str_len(subsection);
-
-					debug_printf("  sub key:       '%s'\n",
-						     t_strdup_until(needle, nend));
-					debug_printf("  value remnant: '%s'\n",
-						     t_strdup_until(vp, vend));
-				}
-
-				/* Try matching the needle at fixed position */
-				if (match_failed_empty ||
-				    (needle == nend && next_wcard == '\0' && vp < vend) ||
-				    !cmp->def->char_match(cmp, &vp, vend, &needle, nend)) {
-
-					/* Match failed: now we have a problem. We need to
-					   backtrack to the previous '*' wildcard occurrence
-					   and start scanning for the next possible match.
-					 */
-
-					debug_printf("  failed fixed match\n");
-
-					/* Start backtrack */
-					if (prv != NULL && prv + 1 < vend) {
-						/* Restore pointers */
-						vp = prv;
-						kp = prk;
-						wp = prw;
-
-						/* Skip forward one value character to scan
-						   the next possible match */
-						if (mvalues != NULL)
-							str_append_c(mvalue, *vp);
-						vp++;
-
-						/* Set wildcard state appropriately */
-						wcard = '*';
-						next_wcard = '?';
-
-						/* Backtrack */
-						backtrack = TRUE;
-
-						debug_printf("  BACKTRACK\n");
-					}
-
-					/* Break '?' wildcard scanning loop */
-					break;
-				}
-
-				/* Update wildcard and key pointers for next wildcard scan */
-				if (wp < kend)
-					wp++;
-				kp = wp;
-			}
+/* Find the section such that it ends exactly at the end of the value. */
+static int
+mcht_matches_section_find_end(struct mcht_matches_context *mmctx,
+			      const struct mcht_matches_section *section,
+			      const char *vp, const char *vend,
+			      const char **start_r)
+{
+	const char *p, *end;
+
+	if (mmctx->mode != MCHT_MATCHES_MODE_GENERIC) {
+		/* Size of the match is known */
+		if ((size_t)(vend - vp) < section->size)
+			return 0;
+		p = vend - section->size;
+		if (!mcht_matches_section_at(mmctx, section, &p, vend))
+			return 0;
+		*start_r = vend - section->size;
+		return 1;
+	}
 
-			if (!backtrack) {
-				unsigned int i;
+	for (p = vp; p <= vend; p++) {
+		end = p;
+		if (mcht_matches_section_at(mmctx, section, &end, vend) &&
+		    end == vend) {
+			*start_r = p;
+			return 1;
+		}
+		if (mcht_matches_poll(mmctx) < 0)
+			return -1;
+	}
+	return 0;
+}
 
-				if (next_wcard == '?') {
-					debug_printf("failed to match '?'\n");
-					break;
-				}
+static void
+mcht_matches_values_add_chars(struct mcht_matches_context *mmctx,
+			      struct sieve_match_values *mvalues)
+{
+	const unsigned char *chars;
+	size_t i, size;
 
-				if (mvalues != NULL) {
-					if (prv != NULL)
-						sieve_match_values_add(mvalues, mvalue);
+	if (mvalues == NULL)
+		return;
 
-					chars = (const char *) str_data(mchars);
+	chars = str_data(mmctx->chars);
+	size = str_len(mmctx->chars);
+	for (i = 0; i < size; i++)
+		sieve_match_values_add_char(mvalues, chars[i]);
+}
 
-					for (i = 0; i < str_len(mchars); i++)
-						sieve_match_values_add_char(mvalues, chars[i]);
-				}
+static int
+mcht_matches_match_key(struct sieve_match_context *mctx,
+		       const char *val, size_t val_size,
+		       const char *key, size_t key_size)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+	const struct mcht_matches_key *mkey;
+	const struct mcht_matches_section *section;
+	struct mcht_matches_context mmctx;
+	struct sieve_match_values *mvalues;
+	const char *vend, *vp, *start;
+	string_t *mvalue = NULL;
+	unsigned int i;
+	int ret;
 
-				if (next_wcard != '*') {
-					debug_printf("failed to match at end of string\n");
-					break;
-				}
-			}
-		}
+	if (cmp->def == NULL || cmp->def->char_match == NULL)
+		return 0;
 
-		/* Check whether string ends in a wildcard
-		   (avoid scanning the rest of the string)
-		 */
-		if (kp == kend && next_wcard == '*') {
-			/* Add the rest of the string as match value */
-			if (mvalues != NULL) {
-				str_truncate(mvalue, 0);
-				i_assert(vend >= vp);
-				str_append_data(mvalue, vp, vend - vp);
-				sieve_match_values_add(mvalues, mvalue);
-			}
+	mkey = mcht_matches_key_get(mctx, key, key_size);
 
-			/* Finish match */
-			kp = kend;
-			vp = vend;
+	i_zero(&mmctx);
+	mmctx.mctx = mctx;
+	mmctx.cmp = cmp;
+	if (cmp->def == &i_octet_comparator)
+		mmctx.mode = MCHT_MATCHES_MODE_OCTET;
+	else if (cmp->def == &i_ascii_casemap_comparator)
+		mmctx.mode = MCHT_MATCHES_MODE_ASCII_CASEMAP;
+	else
+		mmctx.mode = MCHT_MATCHES_MODE_GENERIC;
 
-			debug_printf("key ends with '*'\n");
-			break;
-		}
+	/* Start match values list if requested */
+	if ((mvalues = sieve_match_values_start(mctx->runenv)) != NULL) {
+		/* Skip ${0} for now; added when match succeeds */
+		sieve_match_values_add(mvalues, NULL);
 
-		debug_printf("== Loop ==\n");
+		mvalue = t_str_new(32);     /* Match value (*) */
+		mmctx.chars = t_str_new(32); /* Match characters (?) */
 	}
 
-	/* Eat away a trailing series of *s */
-	if (vp == vend) {
-		while (kp < kend && *kp == '*')
-			kp++;
+	vp = val;
+	vend = val + val_size;
+
+	/* First section must match at the beginning */
+	ret = (mcht_matches_section_at(&mmctx, &mkey->sections[0],
+				       &vp, vend) ? 1 : 0);
+	if (ret > 0 && mkey->count == 1) {
+		/* No '*' wildcard; value must be exhausted */
+		ret = (vp == vend ? 1 : 0);
 	}
+	if (ret > 0)
+		mcht_matches_values_add_chars(&mmctx, mvalues);
 
-	/* By definition, the match is only successful if both value and key
-	   pattern are exhausted and we're not still trying to match '?' while
-	   the value is empty.
-	 */
-	bool matched = (kp == kend && vp == vend && next_wcard != '?');
+	/* Sections between '*' wildcards match at their leftmost position */
+	for (i = 1; ret > 0 && i < mkey->count; i++) {
+		const char *pvp = vp;
 
-	debug_printf("=== Finish ===\n");
-	debug_printf("  result: %s\n", matched ? "true" : "false");
+		section = &mkey->sections[i];
+		if (i < mkey->count - 1) {
+			ret = mcht_matches_section_find(&mmctx, section,
+							&vp, vend, &start);
+		} else {
+			/* Last section must match at the end */
+			ret = mcht_matches_section_find_end(&mmctx, section,
+							    vp, vend, &start);
+			vp = vend;
+		}
+		if (ret <= 0)
+			break;
+
+		if (mvalues != NULL) {
+			/* Append '*' match value */
+			str_truncate(mvalue, 0);
+			str_append_data(mvalue, pvp, start - pvp);
+			sieve_match_values_add(mvalues, mvalue);
 
-	if (matched) {
+			/* Append '?' match values */
+			mcht_matches_values_add_chars(&mmctx, mvalues);
+		}
+	}
+
+	if (ret < 0) {
+		sieve_match_values_abort(&mvalues);
+		return -1;
+	}
+	if (ret > 0) {
 		/* Activate new match values after successful match */
 		if (mvalues != NULL) {
 			/* Set ${0} */
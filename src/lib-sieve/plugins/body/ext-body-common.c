@@ -11,6 +11,7 @@
 #include "sieve-common.h"
 #include "sieve-stringlist.h"
 #include "sieve-code.h"
+#include "sieve-match.h"
 #include "sieve-message.h"
 #include "sieve-interpreter.h"
 
@@ -103,3 +104,127 @@ ext_body_stringlist_reset(struct sieve_stringlist *_strlist)
 
 	strlist->body_parts_iter = strlist->body_parts;
 }
+
+/*
+ * Body test matching
+ */
+
+/* For large messages the body parts are not collected in memory when the
+   match type can match the values in a streamed fashion. The decoded content
+   is then passed to the matcher block by block while the message is parsed.
+ */
+
+struct ext_body_stream_context {
+	struct sieve_match_context *mctx;
+	int match;
+};
+
+static bool ext_body_stream_part_begin(void *context)
+{
+	struct ext_body_stream_context *sctx = context;
+
+	sctx->match = sieve_match_stream_begin(sctx->mctx);
+	return (sctx->match == 0);
+}
+
+static bool
+ext_body_stream_part_more(void *context, const void *data, size_t size)
+{
+	struct ext_body_stream_context *sctx = context;
+
+	sctx->match = sieve_match_stream_more(sctx->mctx, data, size);
+	return (sctx->match == 0);
+}
+
+static const struct sieve_message_body_stream_callbacks
+ext_body_stream_callbacks = {
+	.part_begin = ext_body_stream_part_begin,
+	.part_more = ext_body_stream_part_more,
+};
+
+static int
+ext_body_match_stream(const struct sieve_runtime_env *renv,
+		      enum tst_body_transform transform,
+		      const char *const *content_types,
+		      const struct sieve_match_type *mcht,
+		      const struct sieve_comparator *cmp,
+		      struct sieve_stringlist *key_list, int *exec_status)
+{
+	static const char *const _no_content_types[] = { "", NULL };
+	struct ext_body_stream_context sctx;
+	int ret;
+
+	*exec_status = SIEVE_EXEC_OK;
+
+	i_zero(&sctx);
+	if ((sctx.mctx = sieve_match_begin(renv, mcht, cmp)) == NULL)
+		return 0;
+
+	ret = sieve_match_stream_init(sctx.mctx, key_list);
+	if (ret <= 0) {
+		if (ret == 0) {
+			/* Not supported; use the normal match */
+			(void)sieve_match_end(&sctx.mctx, NULL);
+			return -2;
+		}
+		return sieve_match_end(&sctx.mctx, exec_status);
+	}
+
+	if (content_types == NULL)
+		content_types = _no_content_types;
+
+	switch (transform) {
+	case TST_BODY_TRANSFORM_RAW:
+		ret = sieve_message_body_stream_raw(
+			renv, &ext_body_stream_callbacks, &sctx);
+		break;
+	case TST_BODY_TRANSFORM_CONTENT:
+		ret = sieve_message_body_stream_content(
+			renv, content_types, &ext_body_stream_callbacks, &sctx);
+		break;
+	default:
+		i_unreached();
+	}
+
+	(void)sieve_match_end(&sctx.mctx, exec_status);
+	if (ret <= 0) {
+		*exec_status = ret;
+		return -1;
+	}
+	if (*exec_status <= 0)
+		return -1;
+	return (sctx.match < 0 ? -1 : (sctx.match > 0 ? 1 : 0));
+}
+
+int ext_body_match(const struct sieve_runtime_env *renv,
+		   enum tst_body_transform transform,
+		   const char *const *content_types,
+		   const struct sieve_match_type *mcht,
+		   const struct sieve_comparator *cmp,
+		   struct sieve_stringlist *key_list, int *exec_status)
+{
+	struct sieve_stringlist *value_list;
+	int match, ret;
+
+	/* Decide before starting the match, so that the trace output is not
+	   produced twice when streaming turns out to be impossible */
+	if (transform != TST_BODY_TRANSFORM_TEXT &&
+	    sieve_match_stream_possible(renv, mcht) &&
+	    sieve_message_body_stream_wanted(renv)) {
+		match = ext_body_match_stream(renv, transform, content_types,
+					      mcht, cmp, key_list,
+					      exec_status);
+		if (match != -2)
+			return match;
+	}
+
+	/* Extract requested parts */
+	ret = ext_body_get_part_list(renv, transform, content_types,
+				     &value_list);
+	if (ret <= 0) {
+		*exec_status = ret;
+		return -1;
+	}
+
+	return sieve_match(renv, mcht, cmp, value_list, key_list, exec_status);
+}
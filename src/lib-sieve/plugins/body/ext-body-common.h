@@ -38,4 +38,14 @@ int ext_body_get_part_list(const struct sieve_runtime_env *renv,
 			   const char *const *content_types,
 			   struct sieve_stringlist **strlist_r);
 
+/* Matches the requested body parts against the key list. Returns 1 for a
+   match, 0 for no match and -1 for an error, in which case exec_status is
+   set. */
+int ext_body_match(const struct sieve_runtime_env *renv,
+		   enum tst_body_transform transform,
+		   const char *const *content_types,
+		   const struct sieve_match_type *mcht,
+		   const struct sieve_comparator *cmp,
+		   struct sieve_stringlist *key_list, int *exec_status);
+
 #endif
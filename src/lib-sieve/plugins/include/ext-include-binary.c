@@ -185,6 +185,19 @@ ext_include_binary_script_include(struct ext_include_binary_context *binctx,
 	return incscript;
 }
 
+void ext_include_binary_script_set_linked(
+	struct ext_include_script_info *incscript, struct sieve_binary *sbin)
+{
+	i_assert(incscript->block == NULL);
+	i_assert(incscript->location == EXT_INCLUDE_LOCATION_GLOBAL);
+
+	/* Takes over the reference; unreferenced on binary_free */
+	incscript->linked_binary = sbin;
+	incscript->block =
+		sieve_binary_block_get(sbin, SBIN_SYSBLOCK_MAIN_PROGRAM);
+	incscript->flags |= EXT_INCLUDE_FLAG_LINKED;
+}
+
 struct ext_include_script_info *
 ext_include_binary_script_get_include_info(
 	struct ext_include_binary_context *binctx,
@@ -259,8 +272,12 @@ ext_include_binary_pre_save(const struct sieve_extension *ext ATTR_UNUSED,
 
 	for (i = 0; i < script_count; i++) {
 		struct ext_include_script_info *incscript = scripts[i];
+		bool embedded = (incscript->block != NULL &&
+				 incscript->linked_binary == NULL);
 
-		if (incscript->block != NULL) {
+		/* Linked scripts are referenced only by location and name;
+		   these are resolved again when the binary is loaded. */
+		if (embedded) {
 			sieve_binary_emit_unsigned(
 				sblock,
 				sieve_binary_block_get_id(incscript->block));
@@ -270,7 +287,7 @@ ext_include_binary_pre_save(const struct sieve_extension *ext ATTR_UNUSED,
 		sieve_binary_emit_byte(sblock, incscript->location);
 		sieve_binary_emit_cstring(sblock, incscript->script_name);
 		sieve_binary_emit_byte(sblock, incscript->flags);
-		if (incscript->block != NULL) {
+		if (embedded) {
 			sieve_script_binary_write_metadata(incscript->script,
 							   sblock);
 		}
@@ -360,7 +377,10 @@ ext_include_binary_open(const struct sieve_extension *ext,
 			return FALSE;
 		}
 
-		if (location >= EXT_INCLUDE_LOCATION_INVALID) {
+		if (location >= EXT_INCLUDE_LOCATION_INVALID ||
+		    ((flags & EXT_INCLUDE_FLAG_LINKED) != 0 &&
+		     (location != EXT_INCLUDE_LOCATION_GLOBAL ||
+		      inc_block_id != 0))) {
 			/* Binary is corrupt, recompile */
 			e_error(svinst->event,
 				"include: dependency block %d of binary %s "
@@ -390,6 +410,30 @@ ext_include_binary_open(const struct sieve_extension *ext,
 				return FALSE;
 			}
 
+		} else if ((flags & EXT_INCLUDE_FLAG_LINKED) != 0) {
+			struct ext_include_script_info *incscript;
+			struct sieve_binary *linked;
+
+			/* Link the shared binary of the global script */
+			if (ext_include_link_global_script(ext, script,
+							   &linked) <= 0) {
+				if (svinst->debug) {
+					e_debug(svinst->event, "include: "
+						"failed to link global script '%s' "
+						"in binary %s, so recompile",
+						str_c(script_name),
+						sieve_binary_path(sbin));
+				}
+				sieve_script_unref(&script);
+				return FALSE;
+			}
+
+			incscript = ext_include_binary_script_include(
+				binctx, location, str_c(script_name),
+				flags, script, NULL);
+			ext_include_binary_script_set_linked(incscript, linked);
+			sieve_script_unref(&script);
+			continue;
 		} else if (inc_block == NULL) {
 			/* Script exists, but it is missing from the binary,
 			   recompile no matter what. */
@@ -460,8 +504,10 @@ ext_include_binary_free(const struct sieve_extension *ext ATTR_UNUSED,
 	/* Release references to all included script objects */
 	hctx = hash_table_iterate_init(binctx->included_scripts);
 	while (hash_table_iterate(hctx, binctx->included_scripts,
-				  &key, &incscript))
+				  &key, &incscript)) {
 		sieve_script_unref(&incscript->script);
+		sieve_binary_unref(&incscript->linked_binary);
+	}
 	hash_table_iterate_deinit(&hctx);
 
 	hash_table_destroy(&binctx->included_scripts);
@@ -496,6 +542,13 @@ bool ext_include_binary_dump(const struct sieve_extension *ext,
 				ext_include_script_location_name(
 					incscript->location),
 				incscript->script_name);
+		} else if (incscript->linked_binary != NULL) {
+			sieve_binary_dump_sectionf(
+				denv, "Included %s script '%s' (LINKED: %s)",
+				ext_include_script_location_name(
+					incscript->location),
+				incscript->script_name,
+				sieve_binary_source(incscript->linked_binary));
 		} else {
 			unsigned int block_id =
 				sieve_binary_block_get_id(incscript->block);
@@ -38,6 +38,8 @@ struct ext_include_script_info {
 	enum ext_include_flags flags;
 
 	struct sieve_binary_block *block;
+	/* Shared binary the block belongs to for a linked global script */
+	struct sieve_binary *linked_binary;
 };
 
 struct ext_include_script_info *
@@ -47,6 +49,8 @@ ext_include_binary_script_include(struct ext_include_binary_context *binctx,
 				  enum ext_include_flags flags,
 				  struct sieve_script *script,
 				  struct sieve_binary_block *inc_block);
+void ext_include_binary_script_set_linked(
+	struct ext_include_script_info *incscript, struct sieve_binary *sbin);
 struct ext_include_script_info *
 ext_include_binary_script_get_include_info(
 	struct ext_include_binary_context *binctx,
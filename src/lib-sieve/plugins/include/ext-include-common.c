@@ -8,6 +8,7 @@
 
 #include "sieve-common.h"
 #include "sieve-error.h"
+#include "sieve.h"
 #include "sieve-script.h"
 #include "sieve-storage.h"
 #include "sieve-ast.h"
@@ -17,6 +18,8 @@
 #include "sieve-generator.h"
 #include "sieve-interpreter.h"
 
+#include "sieve-ext-variables.h"
+
 #include "ext-include-common.h"
 #include "ext-include-binary.h"
 #include "ext-include-variables.h"
@@ -167,6 +170,103 @@ int ext_include_open_script(const struct sieve_extension *ext,
 	return ret;
 }
 
+/*
+ * Linked global scripts
+ */
+
+static bool
+ext_include_binary_is_linkable(const struct sieve_extension *ext,
+			       struct sieve_binary *sbin)
+{
+	struct ext_include_binary_context *binctx;
+	struct sieve_variable_scope_binary *global_vars;
+	const struct ext_include_script_info *incscript;
+	unsigned int count, i;
+
+	if (sieve_binary_extension_get_context(sbin, ext) == NULL)
+		return TRUE;
+
+	/* Global variables are allocated in the scope of the including
+	   binary, so a script that uses these cannot be shared. */
+	global_vars = ext_include_binary_get_global_scope(ext, sbin);
+	if (global_vars != NULL &&
+	    sieve_variable_scope_binary_get_count(global_vars) > 0)
+		return FALSE;
+
+	/* Personal scripts differ between users */
+	binctx = ext_include_binary_get_context(ext, sbin);
+	count = ext_include_binary_script_get_count(binctx);
+	for (i = 1; i <= count; i++) {
+		incscript = ext_include_binary_script_get_included(binctx, i);
+		if (incscript->location != EXT_INCLUDE_LOCATION_GLOBAL)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+int ext_include_link_global_script(const struct sieve_extension *ext,
+				   struct sieve_script *script,
+				   struct sieve_binary **sbin_r)
+{
+	struct sieve_instance *svinst = ext->svinst;
+	struct ext_include_context *extctx = ext->context;
+	struct sieve_error_handler *ehandler;
+	struct sieve_binary *sbin;
+	enum sieve_error error_code;
+	int ret;
+
+	*sbin_r = NULL;
+
+	/* Scripts included from a shared binary are compiled into it */
+	if (extctx->linking)
+		return 0;
+
+	/* Load or compile the binary of the global script itself. This is done
+	   for every use, so that changes to the script or its binary are
+	   noticed. Binary objects are bound to the Sieve instance; the file
+	   image is shared through the process-wide binary cache instead. */
+	ehandler = sieve_master_ehandler_create(svinst, 0);
+	extctx->linking = TRUE;
+	ret = sieve_open_script(script, ehandler, 0, &sbin, &error_code);
+	extctx->linking = FALSE;
+	sieve_error_handler_unref(&ehandler);
+	if (ret < 0) {
+		e_debug(svinst->event, "include: "
+			"failed to open binary for global script '%s', "
+			"so it cannot be linked",
+			sieve_script_label(script));
+		return (error_code == SIEVE_ERROR_NOT_VALID ? 0 : -1);
+	}
+	if (!sieve_binary_loaded(sbin) &&
+	    sieve_save(sbin, FALSE, &error_code) < 0) {
+		/* Linking would compile the global script again every time
+		   the including binary is loaded; compile it into the
+		   including binary instead, which is then no longer linked. */
+		e_warning(svinst->event, "include: "
+			  "failed to save binary for global script '%s', "
+			  "so it is not linked",
+			  sieve_script_label(script));
+		sieve_close(&sbin);
+		return 0;
+	}
+
+	if (!ext_include_binary_is_linkable(ext, sbin)) {
+		e_debug(svinst->event, "include: "
+			"global script '%s' uses global variables or "
+			"personal includes, so it cannot be linked",
+			sieve_script_label(script));
+		sieve_close(&sbin);
+		return 0;
+	}
+
+	/* Keep the image in memory for the rest of the process, as far as
+	   the sieve_binary_cache_size limit allows */
+	sieve_binary_cache_pin(sbin);
+
+	*sbin_r = sbin;
+	return 1;
+}
+
 /*
  * AST context management
  */
@@ -555,6 +655,7 @@ int ext_include_generate_include(
 			included->flags &= ENUM_NEGATE(EXT_INCLUDE_FLAG_ONCE);
 	} else 	{
 		enum sieve_compile_flags cpflags = cgenv->flags;
+		struct sieve_binary *linked = NULL;
 
 		/* No, include new script */
 
@@ -569,6 +670,14 @@ int ext_include_generate_include(
 	 		return -1;
 		}
 
+		/* Link global script from its shared binary if configured;
+		   compile it into this binary if that is not possible. */
+		if (script != NULL && location == EXT_INCLUDE_LOCATION_GLOBAL &&
+		    extctx->set->link_global &&
+		    ext_include_link_global_script(this_ext, script,
+						   &linked) <= 0)
+			linked = NULL;
+
 		/* Allocate a new block in the binary and mark the script as
 		   included. */
 		if (script == NULL) {
@@ -580,6 +689,12 @@ int ext_include_generate_include(
 				binctx, location, script_name, flags, NULL,
 				NULL);
 			result = 0;
+		} else if (linked != NULL) {
+			/* Linked include */
+			included = ext_include_binary_script_include(
+				binctx, location, script_name, flags, script,
+				NULL);
+			ext_include_binary_script_set_linked(included, linked);
 		} else {
 			struct sieve_binary_block *inc_block =
 				sieve_binary_block_create(sbin);
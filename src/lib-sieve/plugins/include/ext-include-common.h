@@ -24,7 +24,10 @@ struct ext_include_binary_context;
 enum ext_include_flags { // stored in one byte
 	EXT_INCLUDE_FLAG_ONCE = 0x01,
 	EXT_INCLUDE_FLAG_OPTIONAL = 0x02,
-	EXT_INCLUDE_FLAG_MISSING_AT_UPLOAD = 0x04
+	EXT_INCLUDE_FLAG_MISSING_AT_UPLOAD = 0x04,
+	/* Global script is not compiled into the binary, but linked from its
+	   own shared binary when the binary is loaded */
+	EXT_INCLUDE_FLAG_LINKED = 0x08,
 };
 
 enum ext_include_script_location {
@@ -91,6 +94,15 @@ int ext_include_open_script(const struct sieve_extension *ext,
 			    struct sieve_script **script_r,
 			    enum sieve_error *error_code_r);
 
+/* Obtain the shared binary for a global script, so that it can be linked into
+   including binaries rather than being compiled into each of them. The binary
+   is checked against the script each time. Returns 1 when successful (with a
+   new reference in sbin_r), 0 when the script cannot be linked (it needs to be
+   compiled into the including binary instead) and -1 upon error. */
+int ext_include_link_global_script(const struct sieve_extension *ext,
+				   struct sieve_script *script,
+				   struct sieve_binary **sbin_r);
+
 /*
  * Context
  */
@@ -103,6 +115,9 @@ struct ext_include_context {
 
 	struct sieve_storage *personal_storage;
 
+	/* Compiling the shared binary of a linked global script */
+	bool linking:1;
+
 	const struct ext_include_settings *set;
 };
 
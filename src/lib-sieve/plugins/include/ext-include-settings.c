@@ -16,6 +16,7 @@
 static const struct setting_define ext_include_setting_defines[] = {
 	DEF(UINT, max_nesting_depth),
 	DEF(UINT, max_includes),
+	DEF(BOOL, link_global),
 
 	SETTING_DEFINE_LIST_END,
 };
@@ -23,6 +24,7 @@ static const struct setting_define ext_include_setting_defines[] = {
 static const struct ext_include_settings ext_include_default_settings = {
 	.max_nesting_depth = EXT_INCLUDE_DEFAULT_MAX_NESTING_DEPTH,
 	.max_includes = EXT_INCLUDE_DEFAULT_MAX_INCLUDES,
+	.link_global = FALSE,
 };
 
 const struct setting_parser_info ext_include_setting_parser_info = {
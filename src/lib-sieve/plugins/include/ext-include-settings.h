@@ -6,6 +6,7 @@ struct ext_include_settings {
 
 	unsigned int max_nesting_depth;
 	unsigned int max_includes;
+	bool link_global;
 };
 
 extern const struct setting_parser_info ext_include_setting_parser_info;
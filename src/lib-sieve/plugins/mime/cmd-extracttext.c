@@ -342,7 +342,9 @@ cmd_extracttext_operation_execute(const struct sieve_runtime_env *renv,
 	i_assert(mpart != NULL);
 
 	/* Get message part content */
-	sieve_message_part_get_data(mpart, &mpart_data, TRUE);
+	ret = sieve_message_part_get_data(renv, mpart, &mpart_data, TRUE);
+	if (ret <= 0)
+		return ret;
 
 	/* Apply ":first" limit, if any */
 	if (!have_first || (size_t)first > mpart_data.size) {
@@ -1,9 +1,23 @@
 /* Copyright (c) Pigeonhole authors, see top-level COPYING file */
 
+#include "lib.h"
+#include "hash.h"
+#include "llist.h"
+
 #include "sieve-common.h"
+#include "sieve-extensions.h"
 #include "sieve-match-types.h"
 
 #include "ext-regex-common.h"
+#include "dregex.h"
+
+/*
+ * Configuration
+ */
+
+#define EXT_REGEX_CACHE_MAX_ENTRIES 1024
+#define EXT_REGEX_CACHE_MAX_PATTERN_SIZE 4096
+#define EXT_REGEX_CACHE_MAX_PATTERN_BYTES (256 * 1024)
 
 /*
  * Regex match type operand
@@ -18,3 +32,170 @@ const struct sieve_operand_def regex_match_type_operand = {
 	.class = &sieve_match_type_operand_class,
 	.interface = &ext_match_types,
 };
+
+/*
+ * Compiled regex cache
+ */
+
+/* Regular expression keys are compiled only once per process for each distinct
+   combination of pattern and compile flags. Keys obtained from variables end up
+   here too, which is why the cache is bounded. Once it is full, the least
+   recently used expressions are evicted, so that keys that are used often
+   (e.g. the constant ones) stay cached. Expressions are reference-counted, so
+   an evicted expression remains valid for the match still using it.
+
+   The size of the cache is bounded by the total length of the cached
+   patterns, not by the memory used by the compiled expressions: lib-regex
+   does not report the latter. */
+
+struct ext_regex_code {
+	struct ext_regex_code *prev, *next;
+
+	int refcount;
+	char *key;
+	size_t pattern_len;
+	struct dregex_code *code;
+
+	bool cached:1;
+};
+
+struct ext_regex_cache {
+	HASH_TABLE(const char *, struct ext_regex_code *) codes;
+	/* Most recently used first */
+	struct ext_regex_code *head, *tail;
+
+	unsigned int count;
+	/* Total length of the cached patterns */
+	size_t pattern_bytes;
+};
+
+static struct ext_regex_cache *ext_regex_cache = NULL;
+
+static void ext_regex_cache_deinit(void);
+
+static struct ext_regex_cache *ext_regex_cache_get(void)
+{
+	if (ext_regex_cache != NULL)
+		return ext_regex_cache;
+
+	ext_regex_cache = i_new(struct ext_regex_cache, 1);
+	hash_table_create(&ext_regex_cache->codes, default_pool, 0,
+			  str_hash, strcmp);
+	sieve_extensions_register_cache(ext_regex_cache_deinit);
+	return ext_regex_cache;
+}
+
+static void
+ext_regex_cache_remove(struct ext_regex_cache *cache,
+		       struct ext_regex_code *rcode)
+{
+	i_assert(rcode->cached);
+
+	hash_table_remove(cache->codes, rcode->key);
+	DLLIST2_REMOVE(&cache->head, &cache->tail, rcode);
+	cache->count--;
+	cache->pattern_bytes -= rcode->pattern_len;
+	rcode->cached = FALSE;
+
+	ext_regex_code_unref(&rcode);
+}
+
+static void
+ext_regex_cache_make_room(struct ext_regex_cache *cache, size_t pattern_len)
+{
+	while (cache->tail != NULL &&
+	       (cache->count >= EXT_REGEX_CACHE_MAX_ENTRIES ||
+		(cache->pattern_bytes + pattern_len) >
+			EXT_REGEX_CACHE_MAX_PATTERN_BYTES))
+		ext_regex_cache_remove(cache, cache->tail);
+}
+
+int ext_regex_code_get(const char *pattern, int cflags,
+		       struct ext_regex_code **rcode_r, const char **error_r)
+{
+	struct ext_regex_cache *cache = ext_regex_cache_get();
+	struct ext_regex_code *rcode;
+	struct dregex_code *code;
+	const char *key;
+	size_t pattern_len = strlen(pattern);
+
+	*rcode_r = NULL;
+	*error_r = NULL;
+
+	key = t_strdup_printf("%x:%s", cflags, pattern);
+	rcode = hash_table_lookup(cache->codes, key);
+	if (rcode != NULL) {
+		if (rcode != cache->head) {
+			DLLIST2_REMOVE(&cache->head, &cache->tail, rcode);
+			DLLIST2_PREPEND(&cache->head, &cache->tail, rcode);
+		}
+		rcode->refcount++;
+		*rcode_r = rcode;
+		return 0;
+	}
+
+	code = dregex_code_create();
+	if (dregex_code_compile(code, pattern, cflags, error_r) != 0) {
+		dregex_code_free(&code);
+		return -1;
+	}
+
+	rcode = i_new(struct ext_regex_code, 1);
+	rcode->refcount = 1;
+	rcode->key = i_strdup(key);
+	rcode->pattern_len = pattern_len;
+	rcode->code = code;
+
+	if (pattern_len <= EXT_REGEX_CACHE_MAX_PATTERN_SIZE) {
+		ext_regex_cache_make_room(cache, pattern_len);
+
+		/* Reference held by the cache */
+		rcode->refcount++;
+		rcode->cached = TRUE;
+		hash_table_insert(cache->codes, rcode->key, rcode);
+		DLLIST2_PREPEND(&cache->head, &cache->tail, rcode);
+		cache->count++;
+		cache->pattern_bytes += pattern_len;
+	}
+
+	*rcode_r = rcode;
+	return 0;
+}
+
+void ext_regex_code_unref(struct ext_regex_code **_rcode)
+{
+	struct ext_regex_code *rcode = *_rcode;
+
+	*_rcode = NULL;
+	if (rcode == NULL)
+		return;
+
+	i_assert(rcode->refcount > 0);
+	if (--rcode->refcount > 0)
+		return;
+
+	i_assert(!rcode->cached);
+	dregex_code_free(&rcode->code);
+	i_free(rcode->key);
+	i_free(rcode);
+}
+
+struct dregex_code *ext_regex_code_get_dregex(struct ext_regex_code *rcode)
+{
+	return rcode->code;
+}
+
+static void ext_regex_cache_deinit(void)
+{
+	struct ext_regex_cache *cache = ext_regex_cache;
+
+	if (cache == NULL)
+		return;
+	ext_regex_cache = NULL;
+
+	while (cache->head != NULL)
+		ext_regex_cache_remove(cache, cache->head);
+
+	hash_table_destroy(&cache->codes);
+	i_free(cache);
+}
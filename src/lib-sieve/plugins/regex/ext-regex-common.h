@@ -1,6 +1,8 @@
 #ifndef EXT_REGEX_COMMON_H
 #define EXT_REGEX_COMMON_H
 
+struct dregex_code;
+
 /*
  * Extension
  */
@@ -19,6 +21,21 @@ extern const struct sieve_operand_def regex_match_type_operand;
 
 extern const struct sieve_match_type_def regex_match_type;
 
-#endif
+/*
+ * Compiled regex cache
+ */
 
+struct ext_regex_code;
 
+/* Obtain a reference to the compiled regular expression for the given pattern
+   and compile flags. The result is taken from (or added to) the process-wide
+   cache when possible. The caller must drop the reference using
+   ext_regex_code_unref(). Returns -1 when the pattern fails to compile, in
+   which case error_r is set. */
+int ext_regex_code_get(const char *pattern, int cflags,
+		       struct ext_regex_code **rcode_r, const char **error_r);
+void ext_regex_code_unref(struct ext_regex_code **_rcode);
+
+struct dregex_code *ext_regex_code_get_dregex(struct ext_regex_code *rcode);
+
+#endif
@@ -10,11 +10,9 @@
  *
  */
 
-/* FIXME: Regular expressions are compiled during compilation and
-   again during interpretation. This is suboptimal and should be
-   changed. This requires dumping the compiled regex to the binary.
-   Most likely, this will only be possible when we implement regular
-   expressions ourselves.
+/* NOTE: Compiled regular expressions cannot be dumped to the binary. Instead,
+   these are kept in a process-wide cache (see ext-regex-common.c), so that
+   constant keys are compiled only once per process.
  */
 
 /* NOTE: Extension does not support unicode equality operator `[=e=]` or
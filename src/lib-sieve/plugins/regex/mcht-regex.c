@@ -20,6 +20,7 @@
 #include "sieve-comparators.h"
 #include "sieve-match-types.h"
 #include "sieve-match.h"
+#include "sieve-ext-variables.h"
 
 #include "ext-regex-common.h"
 #include "dregex.h"
@@ -71,11 +72,15 @@ mcht_regex_validate_regexp(struct sieve_validator *valdtr,
 	const char *dregex_str = sieve_ast_argument_strc(key);
 	const char *error;
 
-	struct dregex_code *code = dregex_code_create();
-	ret = dregex_code_compile(code, dregex_str, cflags, &error);
-	dregex_code_free(&code);
+	struct ext_regex_code *rcode;
 
-	if (ret != 0) {
+	/* Compiling through the cache means that this expression need not be
+	   compiled again when the script is executed in this process */
+	ret = ext_regex_code_get(dregex_str, cflags, &rcode, &error);
+	if (ret == 0)
+		ext_regex_code_unref(&rcode);
+
+	if (ret < 0) {
 		sieve_argument_validate_error(
 			valdtr, key,
 			"invalid regular expression '%s' for regex match: %s",
@@ -114,8 +119,10 @@ mcht_regex_validate_context(struct sieve_validator *valdtr,
 			    struct sieve_match_type_context *mtctx,
 			    struct sieve_ast_argument *key_arg)
 {
+	struct sieve_instance *svinst = sieve_validator_svinst(valdtr);
 	const struct sieve_comparator *cmp = mtctx->comparator;
-	int cflags = DREGEX_NOSUB;
+	const struct sieve_extension *var_ext;
+	int cflags = 0;
 	struct _regex_key_context keyctx;
 	struct sieve_ast_argument *kitem;
 
@@ -135,6 +142,14 @@ mcht_regex_validate_context(struct sieve_validator *valdtr,
 		}
 	}
 
+	/* Match values are only produced when the variables extension is
+	   active. Use the same flags as mcht_regex_match_keys(), so that the
+	   expressions compiled here are found in the cache at runtime (the body
+	   test is the exception, since it never produces match values). */
+	if (sieve_ext_variables_get_extension(svinst, &var_ext) < 0 ||
+	    !sieve_ext_variables_is_active(var_ext, valdtr))
+		cflags |= DREGEX_NOSUB;
+
 	/* Validate regular expression keys */
 
 	keyctx.valdtr = valdtr;
@@ -154,7 +169,7 @@ mcht_regex_validate_context(struct sieve_validator *valdtr,
  */
 
 struct mcht_regex_key {
-	struct dregex_code *regexp;
+	struct ext_regex_code *regexp;
 	int status;
 };
 
@@ -162,7 +177,7 @@ struct mcht_regex_context {
 	ARRAY(struct mcht_regex_key) reg_expressions;
 	ARRAY_TYPE(const_string) pmatch;
 	bool all_compiled:1;
-	bool capture_groups;
+	bool capture_groups:1;
 };
 
 static void mcht_regex_match_init(struct sieve_match_context *mctx)
@@ -282,19 +297,20 @@ mcht_regex_match_keys(struct sieve_match_context *mctx,
 						if (!ctx->capture_groups)
 							cflags |= DREGEX_NOSUB;
 
-						struct dregex_code *code = dregex_code_create();
-						/* Compile regular expression */
-						rxret = dregex_code_compile(code, dregex_str, cflags, &error);
-						if (rxret != 0) {
+						struct ext_regex_code *rcode;
+
+						/* Obtain compiled regular expression */
+						rxret = ext_regex_code_get(dregex_str, cflags,
+									   &rcode, &error);
+						if (rxret < 0) {
 							sieve_runtime_error(renv, NULL,
 								"invalid regular expression '%s' for regex match: %s",
 								str_sanitize(dregex_str, 128),
 								error);
 							rkey->status = -1;
-							dregex_code_free(&code);
 						} else {
 							rkey->status = 1;
-							rkey->regexp = code;
+							rkey->regexp = rcode;
 						}
 					}
 				} else {
@@ -303,7 +319,8 @@ mcht_regex_match_keys(struct sieve_match_context *mctx,
 
 				if (rkey->status > 0) {
 					match = mcht_regex_match_key(
-						mctx, val, rkey->regexp);
+						mctx, val,
+						ext_regex_code_get_dregex(rkey->regexp));
 
 					if (trace) {
 						sieve_runtime_trace(renv, 0,
@@ -337,7 +354,8 @@ mcht_regex_match_keys(struct sieve_match_context *mctx,
 		while (match == 0 && i < count) {
 			if (rkeys[i].status > 0) {
 				match = mcht_regex_match_key(
-					mctx, val, rkeys[i].regexp);
+					mctx, val,
+					ext_regex_code_get_dregex(rkeys[i].regexp));
 
 				if (trace) {
 					sieve_runtime_trace(renv, 0,
@@ -364,6 +382,6 @@ void mcht_regex_match_deinit(struct sieve_match_context *mctx)
 	if (array_is_created(&ctx->reg_expressions)) {
 		rkeys = array_get_modifiable(&ctx->reg_expressions, &count);
 		for (i = 0; i < count; i++)
-			dregex_code_free(&rkeys[i].regexp);
+			ext_regex_code_unref(&rkeys[i].regexp);
 	}
 }
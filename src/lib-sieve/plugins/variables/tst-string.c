@@ -29,6 +29,10 @@ tst_string_registered(struct sieve_validator *valdtr,
 static bool
 tst_string_validate(struct sieve_validator *valdtr, struct sieve_command *tst);
 static bool
+tst_string_validate_const(struct sieve_validator *valdtr,
+			  struct sieve_command *tst, int *const_current,
+			  int const_next);
+static bool
 tst_string_generate(const struct sieve_codegen_env *cgenv,
 		    struct sieve_command *ctx);
 
@@ -41,6 +45,7 @@ const struct sieve_command_def tst_string = {
 	.block_required = FALSE,
 	.registered = tst_string_registered,
 	.validate = tst_string_validate,
+	.validate_const = tst_string_validate_const,
 	.generate = tst_string_generate,
 };
 
@@ -121,6 +126,111 @@ tst_string_validate(struct sieve_validator *valdtr, struct sieve_command *tst)
 					 &mcht_default, &cmp_default);
 }
 
+static bool
+tst_string_arg_is_const(struct sieve_ast_argument *arg)
+{
+	struct sieve_ast_argument *stritem;
+
+	if (sieve_ast_argument_type(arg) == SAAT_STRING) {
+		return (arg->argument != NULL &&
+			sieve_argument_is_string_literal(arg));
+	}
+
+	stritem = sieve_ast_strlist_first(arg);
+	while (stritem != NULL) {
+		if (stritem->argument == NULL ||
+		    !sieve_argument_is_string_literal(stritem))
+			return FALSE;
+		stritem = sieve_ast_strlist_next(stritem);
+	}
+	return TRUE;
+}
+
+static bool
+tst_string_const_match(const struct sieve_comparator *cmp,
+		       struct sieve_ast_argument *source,
+		       struct sieve_ast_argument *keys)
+{
+	struct sieve_ast_argument *src_item, *key_item;
+
+	src_item = (sieve_ast_argument_type(source) == SAAT_STRING ?
+		    source : sieve_ast_strlist_first(source));
+	while (src_item != NULL) {
+		string_t *val = sieve_ast_argument_str(src_item);
+
+		key_item = (sieve_ast_argument_type(keys) == SAAT_STRING ?
+			    keys : sieve_ast_strlist_first(keys));
+		while (key_item != NULL) {
+			string_t *key = sieve_ast_argument_str(key_item);
+
+			/* Same semantics as the :is match type at runtime */
+			if (str_len(val) == 0) {
+				if (str_len(key) == 0)
+					return TRUE;
+			} else if (cmp->def->compare(cmp, str_c(val),
+						     str_len(val), str_c(key),
+						     str_len(key)) == 0) {
+				return TRUE;
+			}
+
+			if (key_item == keys)
+				break;
+			key_item = sieve_ast_strlist_next(key_item);
+		}
+
+		if (src_item == source)
+			break;
+		src_item = sieve_ast_strlist_next(src_item);
+	}
+	return FALSE;
+}
+
+static bool
+tst_string_validate_const(struct sieve_validator *valdtr,
+			  struct sieve_command *tst, int *const_current,
+			  int const_next ATTR_UNUSED)
+{
+	struct sieve_instance *svinst = sieve_validator_svinst(valdtr);
+	const struct sieve_comparator cmp_default =
+		SIEVE_COMPARATOR_DEFAULT(i_ascii_casemap_comparator);
+	const struct sieve_comparator *cmp = &cmp_default;
+	struct sieve_ast_argument *arg = sieve_command_first_argument(tst);
+	struct sieve_ast_argument *source, *keys;
+
+	*const_current = -1;
+
+	if (svinst->set->optimization_level < 1)
+		return TRUE;
+
+	/* Only the plain :is match on literal strings can be evaluated at
+	   compile time; everything else depends on runtime state. */
+	while (arg != NULL && arg != tst->first_positional) {
+		if (sieve_argument_is_comparator(arg))
+			cmp = sieve_comparator_tag_get(arg);
+		else if (sieve_argument_is_match_type(arg)) {
+			const struct sieve_match_type_context *mtctx =
+				(const struct sieve_match_type_context *)
+				arg->argument->data;
+
+			if (mtctx == NULL || mtctx->match_type == NULL ||
+			    mtctx->match_type->def != &is_match_type)
+				return TRUE;
+		}
+		arg = sieve_ast_argument_next(arg);
+	}
+	if (cmp == NULL || cmp->def == NULL || cmp->def->compare == NULL)
+		return TRUE;
+
+	source = tst->first_positional;
+	keys = sieve_ast_argument_next(source);
+	if (source == NULL || keys == NULL ||
+	    !tst_string_arg_is_const(source) || !tst_string_arg_is_const(keys))
+		return TRUE;
+
+	*const_current = (tst_string_const_match(cmp, source, keys) ? 1 : 0);
+	return TRUE;
+}
+
 /*
  * Test generation
  */
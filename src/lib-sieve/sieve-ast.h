@@ -331,6 +331,7 @@ sieve_ast_stringlist_join(struct sieve_ast_argument *list,
 
 /* AST command node macros */
 #define sieve_ast_command_first(node) __AST_NODE_LIST_FIRST(node, commands)
+#define sieve_ast_command_last(node) __AST_NODE_LIST_LAST(node, commands)
 #define sieve_ast_command_count(node) __AST_NODE_LIST_COUNT(node, commands)
 #define sieve_ast_command_prev(command) __AST_LIST_PREV(command)
 #define sieve_ast_command_next(command) __AST_LIST_NEXT(command)
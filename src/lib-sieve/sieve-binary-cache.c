@@ -0,0 +1,503 @@
+/* Copyright (c) Pigeonhole authors, see top-level COPYING file */
+
+#include "lib.h"
+#include "hash.h"
+#include "llist.h"
+#include "read-full.h"
+
+#include "sieve-common.h"
+#include "sieve-settings.h"
+#include "sieve-error.h"
+
+#include "sieve-binary-private.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/*
+ * Binary image cache
+ */
+
+/* Long-running processes (e.g. LMTP with service_count > 1) load the same
+   binaries over and over again; most notably the global scripts, which are
+   executed for every delivery. Sieve binaries are bound to the Sieve instance
+   they were loaded for, so these cannot be shared between deliveries directly.
+   Instead, the raw file contents are kept in a process-wide LRU cache that is
+   bounded by the sieve_binary_cache_size setting. A cached image is only used
+   while a stat() of the binary file still matches.
+
+   Images can also be pinned, e.g. those of linked global scripts (see the
+   include extension). Pinned images are not evicted in favor of other images
+   and are kept until the binary file changes. They still count against the
+   size limit: an image is only pinned while it fits, and all pinned images are
+   dropped once the limit is lowered below their total size. When the cache is
+   disabled, nothing is pinned.
+
+   Images are normally mmap()ed rather than read, so that the page cache is
+   shared between processes running the same (global) scripts. This is not
+   done when mmap_disable or one of the NFS settings is enabled. A binary is
+   not always replaced atomically by rename(): Sieve itself rewrites the
+   header in place to record resource usage, and other tools (or a plain cp)
+   may truncate or rewrite the whole file in place. Accessing a mapping beyond
+   the end of a truncated file fails with SIGBUS. Therefore,
+   sieve_binary_image_verify() checks with stat() that the mapped file did not
+   change size before block data is accessed. A header rewrite changes neither
+   the size nor the blocks, so it is tolerated. When the path refers to a
+   different inode, the binary was replaced and the mapping still refers to
+   the intact old file. The file is not kept open, so that a large number of
+   cached images does not exhaust the file descriptors of the process. */
+
+struct sieve_binary_image {
+	int refcount;
+
+	char *path;
+	struct stat st;
+
+	void *data;
+	size_t size;
+
+	/* LRU list */
+	struct sieve_binary_image *prev, *next;
+
+	bool cached:1;
+	bool mapped:1;
+	bool pinned:1;
+};
+
+struct sieve_binary_cache {
+	HASH_TABLE(const char *, struct sieve_binary_image *) images;
+	struct sieve_binary_image *head, *tail;
+
+	uoff_t size, pinned_size;
+	struct sieve_binary_cache_stats stats;
+};
+
+static struct sieve_binary_cache *sieve_binary_cache = NULL;
+
+/*
+ * Image
+ */
+
+void sieve_binary_image_ref(struct sieve_binary_image *image)
+{
+	i_assert(image->refcount > 0);
+	image->refcount++;
+}
+
+void sieve_binary_image_unref(struct sieve_binary_image **_image)
+{
+	struct sieve_binary_image *image = *_image;
+
+	*_image = NULL;
+	if (image == NULL)
+		return;
+
+	i_assert(image->refcount > 0);
+	if (--image->refcount > 0)
+		return;
+
+	i_assert(!image->cached);
+	if (!image->mapped)
+		i_free(image->data);
+	else if (munmap(image->data, image->size) < 0)
+		i_error("munmap(%s) failed: %m", image->path);
+	i_free(image->path);
+	i_free(image);
+}
+
+const void *
+sieve_binary_image_get_data(const struct sieve_binary_image *image,
+			    size_t *size_r)
+{
+	*size_r = image->size;
+	return image->data;
+}
+
+const struct stat *
+sieve_binary_image_get_stat(const struct sieve_binary_image *image)
+{
+	return &image->st;
+}
+
+bool sieve_binary_image_verify(const struct sieve_binary_image *image)
+{
+	struct stat st;
+
+	if (!image->mapped)
+		return TRUE;
+
+	if (stat(image->path, &st) < 0) {
+		if (errno == ENOENT) {
+			/* Deleted; the mapped file itself is still intact */
+			return TRUE;
+		}
+		i_error("stat(%s) failed: %m", image->path);
+		return FALSE;
+	}
+	if (st.st_ino != image->st.st_ino ||
+	    !CMP_DEV_T(st.st_dev, image->st.st_dev)) {
+		/* Replaced; the mapped file itself is still intact */
+		return TRUE;
+	}
+	if ((uoff_t)st.st_size != image->size) {
+		/* Truncated or rewritten in place; only the header is ever
+		   updated in place without changing the size */
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static bool
+sieve_binary_image_is_current(const struct sieve_binary_image *image,
+			      const struct stat *st)
+{
+	return (image->st.st_ino == st->st_ino &&
+		CMP_DEV_T(image->st.st_dev, st->st_dev) &&
+		image->st.st_size == st->st_size &&
+		image->st.st_mtime == st->st_mtime &&
+		ST_MTIME_NSEC(image->st) == ST_MTIME_NSEC(*st) &&
+		image->st.st_ctime == st->st_ctime);
+}
+
+static struct sieve_binary_image *
+sieve_binary_image_create(const char *path, const struct stat *st,
+			  void *data, bool mapped)
+{
+	struct sieve_binary_image *image;
+
+	image = i_new(struct sieve_binary_image, 1);
+	image->refcount = 1;
+	image->path = i_strdup(path);
+	image->st = *st;
+	image->data = data;
+	image->size = st->st_size;
+	image->mapped = mapped;
+
+	return image;
+}
+
+int sieve_binary_image_map(struct sieve_binary *sbin, const char *path,
+			   int fd, const struct stat *st,
+			   struct sieve_binary_image **image_r)
+{
+	void *data;
+
+	*image_r = NULL;
+
+	if (st->st_size == 0 || sbin->svinst->mmap_disable)
+		return 0;
+
+	data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		e_debug(sbin->event, "open: "
+			"mmap() failed (reading binary instead): %m");
+		return 0;
+	}
+
+	*image_r = sieve_binary_image_create(path, st, data, TRUE);
+	return 1;
+}
+
+static int
+sieve_binary_image_read(struct sieve_binary *sbin, const char *path,
+			uoff_t max_size, struct sieve_binary_image **image_r)
+{
+	struct stat st;
+	void *data;
+	int fd, ret;
+
+	*image_r = NULL;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		/* Let the normal open path report the error */
+		return 0;
+	}
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    (uoff_t)st.st_size > max_size || st.st_size == 0) {
+		/* Not cacheable */
+		i_close_fd(&fd);
+		return 0;
+	}
+
+	ret = sieve_binary_image_map(sbin, path, fd, &st, image_r);
+	if (ret != 0) {
+		i_close_fd(&fd);
+		return ret;
+	}
+
+	data = i_malloc(st.st_size);
+	ret = read_full(fd, data, st.st_size);
+	if (ret <= 0) {
+		if (ret < 0) {
+			e_error(sbin->event, "read: "
+				"failed to read from binary: %m");
+		} else {
+			e_error(sbin->event, "read: "
+				"binary is truncated (more data expected)");
+		}
+		i_free(data);
+		i_close_fd(&fd);
+		return -1;
+	}
+	i_close_fd(&fd);
+
+	*image_r = sieve_binary_image_create(path, &st, data, FALSE);
+	return 1;
+}
+
+/*
+ * Cache
+ */
+
+static struct sieve_binary_cache *sieve_binary_cache_get_cache(void)
+{
+	if (sieve_binary_cache == NULL) {
+		sieve_binary_cache = i_new(struct sieve_binary_cache, 1);
+		hash_table_create(&sieve_binary_cache->images, default_pool, 0,
+				  str_hash, strcmp);
+	}
+	return sieve_binary_cache;
+}
+
+static void
+sieve_binary_cache_remove(struct sieve_binary_cache *cache,
+			  struct sieve_binary_image *image)
+{
+	i_assert(image->cached);
+
+	hash_table_remove(cache->images, image->path);
+	if (image->pinned) {
+		i_assert(cache->pinned_size >= image->size);
+		cache->pinned_size -= image->size;
+		cache->stats.pinned--;
+	} else {
+		DLLIST2_REMOVE(&cache->head, &cache->tail, image);
+
+		i_assert(cache->size >= image->size);
+		cache->size -= image->size;
+	}
+	cache->stats.count--;
+	if (image->mapped)
+		cache->stats.mapped--;
+	cache->stats.size = cache->size + cache->pinned_size;
+
+	image->cached = FALSE;
+	sieve_binary_image_unref(&image);
+}
+
+static void
+sieve_binary_cache_evict(struct sieve_binary_cache *cache, uoff_t max_size)
+{
+	while (cache->tail != NULL &&
+	       (cache->size + cache->pinned_size) > max_size) {
+		cache->stats.evictions++;
+		sieve_binary_cache_remove(cache, cache->tail);
+	}
+}
+
+static void
+sieve_binary_cache_apply_limit(struct sieve_binary_cache *cache,
+			       uoff_t max_size)
+{
+	struct hash_iterate_context *hctx;
+	const char *path;
+	struct sieve_binary_image *image;
+
+	sieve_binary_cache_evict(cache, max_size);
+	if (cache->pinned_size <= max_size)
+		return;
+
+	/* The limit was lowered below the size of the pinned images (only
+	   these are left now); drop them all */
+	hctx = hash_table_iterate_init(cache->images);
+	while (hash_table_iterate(hctx, cache->images, &path, &image)) {
+		cache->stats.evictions++;
+		sieve_binary_cache_remove(cache, image);
+	}
+	hash_table_iterate_deinit(&hctx);
+}
+
+int sieve_binary_cache_get(struct sieve_binary *sbin, const char *path,
+			   struct sieve_binary_image **image_r,
+			   enum sieve_error *error_code_r)
+{
+	struct sieve_binary_cache *cache = sieve_binary_cache_get_cache();
+	uoff_t max_size = sbin->svinst->set->binary_cache_size;
+	struct sieve_binary_image *image;
+	struct stat st;
+	int ret;
+
+	*image_r = NULL;
+
+	/* The limit is configured per instance; apply the current one */
+	sieve_binary_cache_apply_limit(cache, max_size);
+	if (max_size == 0) {
+		/* Cache disabled: don't bother with stat() */
+		return 0;
+	}
+
+	image = hash_table_lookup(cache->images, path);
+
+	if (stat(path, &st) < 0) {
+		if (errno == ENOENT) {
+			*error_code_r = SIEVE_ERROR_NOT_FOUND;
+			return -1;
+		}
+		/* Let the normal open path report the error */
+		return 0;
+	}
+
+	if (image != NULL) {
+		if (sieve_binary_image_is_current(image, &st)) {
+			cache->stats.hits++;
+			if (!image->pinned) {
+				DLLIST2_REMOVE(&cache->head, &cache->tail,
+					       image);
+				DLLIST2_PREPEND(&cache->head, &cache->tail,
+						image);
+			}
+
+			e_debug(sbin->event, "cache: "
+				"binary found in cache (hits=%u, misses=%u)",
+				cache->stats.hits, cache->stats.misses);
+
+			sieve_binary_image_ref(image);
+			*image_r = image;
+			return 1;
+		}
+
+		/* Binary changed on disk */
+		sieve_binary_cache_remove(cache, image);
+	}
+
+	cache->stats.misses++;
+	e_debug(sbin->event, "cache: "
+		"binary not found in cache (hits=%u, misses=%u)",
+		cache->stats.hits, cache->stats.misses);
+
+	ret = sieve_binary_image_read(sbin, path, max_size - cache->pinned_size,
+				      &image);
+	if (ret < 0) {
+		*error_code_r = SIEVE_ERROR_TEMP_FAILURE;
+		return -1;
+	}
+	if (ret == 0)
+		return 0;
+
+	/* Make room for the new image; it fits next to the pinned ones */
+	sieve_binary_cache_evict(cache, max_size - image->size);
+
+	image->cached = TRUE;
+	hash_table_insert(cache->images, image->path, image);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, image);
+	cache->size += image->size;
+	cache->stats.count++;
+	if (image->mapped)
+		cache->stats.mapped++;
+	cache->stats.size = cache->size + cache->pinned_size;
+
+	sieve_binary_image_ref(image);
+	*image_r = image;
+	return 1;
+}
+
+void sieve_binary_cache_pin(struct sieve_binary *sbin)
+{
+	struct sieve_binary_cache *cache = sieve_binary_cache_get_cache();
+	uoff_t max_size = sbin->svinst->set->binary_cache_size;
+	const char *path = sieve_binary_path(sbin);
+	struct sieve_binary_image *image;
+
+	sieve_binary_cache_apply_limit(cache, max_size);
+	if (path == NULL || max_size == 0)
+		return;
+
+	image = hash_table_lookup(cache->images, path);
+	if (image != NULL) {
+		if (image->pinned)
+			return;
+
+		/* Move it out of the LRU list */
+		DLLIST2_REMOVE(&cache->head, &cache->tail, image);
+		i_assert(cache->size >= image->size);
+		cache->size -= image->size;
+		cache->pinned_size += image->size;
+		cache->stats.pinned++;
+		image->pinned = TRUE;
+		return;
+	}
+
+	if (sieve_binary_image_read(sbin, path, max_size - cache->pinned_size,
+				    &image) <= 0) {
+		e_debug(sbin->event, "cache: binary not pinned in cache "
+			"(unreadable or larger than the remaining "
+			"sieve_binary_cache_size)");
+		return;
+	}
+
+	/* Make room for the new image */
+	sieve_binary_cache_evict(cache, max_size - image->size);
+
+	image->cached = TRUE;
+	image->pinned = TRUE;
+	hash_table_insert(cache->images, image->path, image);
+	cache->pinned_size += image->size;
+	cache->stats.count++;
+	cache->stats.pinned++;
+	if (image->mapped)
+		cache->stats.mapped++;
+	cache->stats.size = cache->size + cache->pinned_size;
+
+	e_debug(sbin->event, "cache: binary pinned in cache");
+}
+
+void sieve_binary_cache_invalidate(const char *path)
+{
+	struct sieve_binary_cache *cache = sieve_binary_cache;
+	struct sieve_binary_image *image;
+
+	if (cache == NULL || path == NULL)
+		return;
+
+	image = hash_table_lookup(cache->images, path);
+	if (image != NULL)
+		sieve_binary_cache_remove(cache, image);
+}
+
+void sieve_binary_cache_get_stats(struct sieve_binary_cache_stats *stats_r)
+{
+	if (sieve_binary_cache == NULL) {
+		i_zero(stats_r);
+		return;
+	}
+	*stats_r = sieve_binary_cache->stats;
+}
+
+void sieve_binary_cache_deinit(void)
+{
+	struct sieve_binary_cache *cache = sieve_binary_cache;
+
+	if (cache == NULL)
+		return;
+	sieve_binary_cache = NULL;
+
+	while (cache->head != NULL)
+		sieve_binary_cache_remove(cache, cache->head);
+	if (hash_table_count(cache->images) > 0) {
+		struct hash_iterate_context *hctx;
+		const char *path;
+		struct sieve_binary_image *image;
+
+		/* Pinned images */
+		hctx = hash_table_iterate_init(cache->images);
+		while (hash_table_iterate(hctx, cache->images, &path, &image))
+			sieve_binary_cache_remove(cache, image);
+		hash_table_iterate_deinit(&hctx);
+	}
+	hash_table_destroy(&cache->images);
+	i_free(cache);
+}
@@ -35,6 +35,7 @@ static inline void
 _sieve_binary_emit_data(struct sieve_binary_block *sblock,
 			const void *data, sieve_size_t size)
 {
+	sieve_binary_block_make_writable(sblock);
 	buffer_append(sblock->data, data, size);
 }
 
@@ -49,6 +50,7 @@ _sieve_binary_update_data(struct sieve_binary_block *sblock,
 			  sieve_size_t address, const void *data,
 			  sieve_size_t size)
 {
+	sieve_binary_block_make_writable(sblock);
 	buffer_write(sblock->data, address, data, size);
 }
 
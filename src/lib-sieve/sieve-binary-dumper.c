@@ -113,9 +113,10 @@ bool sieve_binary_dumper_run(struct sieve_binary_dumper *dumper,
 
 	sieve_binary_dumpf(denv,
 		"version = %"PRIu16".%"PRIu16"\n"
-		"flags = 0x%08"PRIx32"\n",
+		"flags = 0x%08"PRIx32"\n"
+		"optimization level = %u\n",
 		header->version_major, header->version_minor,
-		header->flags);
+		header->flags, sieve_binary_get_optimization_level(sbin));
 	if (header->resource_usage.update_time != 0) {
 		time_t update_time =
 			(time_t)header->resource_usage.update_time;
@@ -74,6 +74,28 @@ static bool sieve_binary_can_update(struct sieve_binary *sbin)
 	return (access(dirpath, W_OK | X_OK) == 0);
 }
 
+static ssize_t
+sieve_binary_file_image_pread(struct sieve_binary_file *file,
+			      void *buffer, size_t size, off_t offset)
+{
+	const void *data;
+	size_t data_size;
+
+	i_assert(file->image != NULL);
+	if (!sieve_binary_image_verify(file->image)) {
+		/* Report it as truncated */
+		return 0;
+	}
+	data = sieve_binary_image_get_data(file->image, &data_size);
+
+	if ((uoff_t)offset >= data_size)
+		return 0;
+	if (size > (data_size - offset))
+		size = data_size - offset;
+	memcpy(buffer, CONST_PTR_OFFSET(data, offset), size);
+	return (ssize_t)size;
+}
+
 /*
  * Header manipulation
  */
@@ -88,7 +110,13 @@ sieve_binary_file_read_header(struct sieve_binary *sbin, int fd,
 
 	sieve_error_args_init(&error_code_r, NULL);
 
-	rret = pread(fd, &header, sizeof(header), 0);
+	if (fd == -1) {
+		/* Read from file image */
+		rret = sieve_binary_file_image_pread(sbin->file, &header,
+						     sizeof(header), 0);
+	} else {
+		rret = pread(fd, &header, sizeof(header), 0);
+	}
 	if (rret == 0) {
 		e_error(sbin->event, "read: "
 			"file is not large enough to contain the header");
@@ -517,6 +545,7 @@ sieve_binary_do_save(struct sieve_binary *sbin, const char *path, bool update,
 				"unlink(%s) failed: %m", str_c(temp_path));
 		}
 	} else {
+		sieve_binary_cache_invalidate(path);
 		if (sbin->path == NULL)
 			sbin->path = p_strdup(sbin->pool, path);
 
@@ -593,16 +622,51 @@ sieve_binary_fd_open(struct sieve_binary *sbin, const char *path,
 	return fd;
 }
 
+static struct sieve_binary_file *
+sieve_binary_file_create(struct sieve_binary *sbin, const char *path,
+			 int fd, const struct stat *st)
+{
+	pool_t pool;
+	struct sieve_binary_file *file;
+
+	pool = pool_alloconly_create("sieve_binary_file", 4096);
+	file = p_new(pool, struct sieve_binary_file, 1);
+	file->pool = pool;
+	file->path = p_strdup(pool, path);
+	file->fd = fd;
+	file->st = *st;
+	file->sbin = sbin;
+
+	return file;
+}
+
 static int
 sieve_binary_file_open(struct sieve_binary *sbin, const char *path,
 		       struct sieve_binary_file **file_r,
 		       enum sieve_error *error_code_r)
 {
+	struct sieve_binary_image *image;
 	int fd, ret = 0;
 	struct stat st;
 
 	sieve_error_args_init(&error_code_r, NULL);
 
+	/* Try the process-wide cache first */
+	ret = sieve_binary_cache_get(sbin, path, &image, error_code_r);
+	if (ret < 0)
+		return -1;
+	if (ret > 0) {
+		struct sieve_binary_file *file;
+
+		file = sieve_binary_file_create(
+			sbin, path, -1, sieve_binary_image_get_stat(image));
+		file->image = image;
+
+		*file_r = file;
+		return 0;
+	}
+	ret = 0;
+
 	fd = sieve_binary_fd_open(sbin, path, O_RDONLY, error_code_r);
 	if (fd < 0)
 		return -1;
@@ -633,18 +697,23 @@ sieve_binary_file_open(struct sieve_binary *sbin, const char *path,
 		return -1;
 	}
 
-	pool_t pool;
-	struct sieve_binary_file *file;
+	/* Map the file into memory, so that the blocks can point straight
+	   into it */
+	if (sieve_binary_image_map(sbin, path, fd, &st, &image) > 0) {
+		struct sieve_binary_file *file;
 
-	pool = pool_alloconly_create("sieve_binary_file", 4096);
-	file = p_new(pool, struct sieve_binary_file, 1);
-	file->pool = pool;
-	file->path = p_strdup(pool, path);
-	file->fd = fd;
-	file->st = st;
-	file->sbin = sbin;
+		if (close(fd) < 0) {
+			e_error(sbin->event, "open: "
+				"close() failed after mmap(): %m");
+		}
+		file = sieve_binary_file_create(sbin, path, -1, &st);
+		file->image = image;
+
+		*file_r = file;
+		return 0;
+	}
 
-	*file_r = file;
+	*file_r = sieve_binary_file_create(sbin, path, fd, &st);
 	return 0;
 }
 
@@ -662,6 +731,7 @@ void sieve_binary_file_close(struct sieve_binary_file **_file)
 				"failed to close: close() failed: %m");
 		}
 	}
+	sieve_binary_image_unref(&file->image);
 
 	pool_unref(&file->pool);
 }
@@ -677,6 +747,20 @@ sieve_binary_file_read(struct sieve_binary_file *file, off_t *offset,
 
 	*offset = SIEVE_BINARY_ALIGN(*offset);
 
+	if (file->image != NULL) {
+		/* Read record from file image */
+		if (sieve_binary_file_image_pread(file, buffer, size,
+						  *offset) != (ssize_t)size) {
+			e_error(sbin->event, "read: "
+				"binary is truncated "
+				"(more data expected)");
+			return 0;
+		}
+		*offset += size;
+		file->offset = *offset;
+		return 1;
+	}
+
 	/* Seek to the correct position */
 	if (*offset != file->offset &&
 	    lseek(file->fd, *offset, SEEK_SET) == (off_t)-1) {
@@ -749,14 +833,66 @@ sieve_binary_file_load_buffer(struct sieve_binary_file *file,
 	(header *)sieve_binary_file_load_data(sbin->file, offset, \
 					      sizeof(header))
 
+static bool sieve_binary_load_mapped_block(struct sieve_binary_block *sblock)
+{
+	struct sieve_binary *sbin = sblock->sbin;
+	unsigned int id = sblock->id;
+	uoff_t offset = SIEVE_BINARY_ALIGN(sblock->offset);
+	const struct sieve_binary_block_header *header;
+	const void *data;
+	size_t size;
+
+	/* Blocks are only validated once these are actually used */
+	if (!sieve_binary_image_verify(sbin->image)) {
+		e_error(sbin->event, "load: "
+			"binary changed size while it was mapped");
+		return FALSE;
+	}
+	data = sieve_binary_image_get_data(sbin->image, &size);
+	if (offset > size || (size - offset) < sizeof(*header)) {
+		e_error(sbin->event, "load: binary is corrupt: "
+			"failed to read header of block %d", id);
+		return FALSE;
+	}
+	header = CONST_PTR_OFFSET(data, offset);
+	offset += sizeof(*header);
+
+	if (header->id != id) {
+		e_error(sbin->event, "load: binary is corrupt: "
+			"header of block %d has non-matching id %d",
+			id, header->id);
+		return FALSE;
+	}
+
+	offset = SIEVE_BINARY_ALIGN(offset);
+	if (offset > size || (size - offset) < header->size) {
+		e_error(sbin->event, "load: "
+			"failed to read block %d of binary (size=%d)",
+			id, header->size);
+		return FALSE;
+	}
+
+	/* Point the block into the image without copying */
+	sblock->data = p_new(sbin->pool, buffer_t, 1);
+	buffer_create_from_const_data(sblock->data,
+				      CONST_PTR_OFFSET(data, offset),
+				      header->size);
+	sblock->mapped = TRUE;
+	return TRUE;
+}
+
 bool sieve_binary_load_block(struct sieve_binary_block *sblock)
 {
 	struct sieve_binary *sbin = sblock->sbin;
 	unsigned int id = sblock->id;
 	off_t offset = sblock->offset;
-	const struct sieve_binary_block_header *header =
-		LOAD_HEADER(sbin, &offset,
-			    const struct sieve_binary_block_header);
+	const struct sieve_binary_block_header *header;
+
+	if (sbin->image != NULL)
+		return sieve_binary_load_mapped_block(sblock);
+
+	header = LOAD_HEADER(sbin, &offset,
+			     const struct sieve_binary_block_header);
 
 	if (header == NULL) {
 		e_error(sbin->event, "load: binary is corrupt: "
@@ -830,7 +966,7 @@ static int _read_extensions(struct sieve_binary_block *sblock)
 
 			if (sieve_binary_read_string(sblock, &offset,
 						     &extension)) {
-				ext = sieve_extension_get_by_name(
+				ext = sieve_extension_get_linked_by_name(
 					sbin->svinst, str_c(extension));
 
 				if (ext == NULL) {
@@ -941,6 +1077,10 @@ int sieve_binary_open(struct sieve_instance *svinst, const char *path,
 	}
 
 	sbin->file = file;
+	if (file->image != NULL) {
+		sbin->image = file->image;
+		sieve_binary_image_ref(sbin->image);
+	}
 
 	event_set_append_log_prefix(
 		sbin->event,
@@ -1052,6 +1192,7 @@ int sieve_binary_file_update_resource_usage(struct sieve_binary *sbin,
 
 	ret = sieve_binary_file_do_update_resource_usage(sbin, fd,
 							 error_code_r);
+	sieve_binary_cache_invalidate(sbin->path);
 	i_assert(ret == 0 || *error_code_r != SIEVE_ERROR_NONE);
 
 	if (close(fd) < 0) {
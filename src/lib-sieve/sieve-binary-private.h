@@ -1,6 +1,8 @@
 #ifndef SIEVE_BINARY_PRIVATE_H
 #define SIEVE_BINARY_PRIVATE_H
 
+#include "hash.h"
+
 #include "sieve-common.h"
 #include "sieve-binary.h"
 #include "sieve-extensions.h"
@@ -17,6 +19,11 @@ enum SIEVE_BINARY_FLAGS {
 	SIEVE_BINARY_FLAG_RESOURCE_LIMIT = BIT(0),
 };
 
+/* Optimization level the code was generated with (bits 8-11 of the flags) */
+#define SIEVE_BINARY_FLAGS_OPT_LEVEL_SHIFT 8
+#define SIEVE_BINARY_FLAGS_OPT_LEVEL_MASK \
+	(0xfU << SIEVE_BINARY_FLAGS_OPT_LEVEL_SHIFT)
+
 struct sieve_binary_header {
 	uint32_t magic;
 	uint16_t version_major;
@@ -40,10 +47,47 @@ struct sieve_binary_file {
 	struct stat st;
 	int fd;
 	off_t offset;
+
+	/* Mapped or cached file contents; fd is -1 when this is set */
+	struct sieve_binary_image *image;
 };
 
 void sieve_binary_file_close(struct sieve_binary_file **_file);
 
+/*
+ * Binary image cache
+ */
+
+struct sieve_binary_image;
+
+/* Obtain the contents of the binary file at the given path from the
+   process-wide cache. Returns 1 when the image is available, 0 when the binary
+   cannot be cached (the file needs to be read normally) and -1 upon error. */
+int sieve_binary_cache_get(struct sieve_binary *sbin, const char *path,
+			   struct sieve_binary_image **image_r,
+			   enum sieve_error *error_code_r);
+/* Drop the cached image for the given path (if any). */
+void sieve_binary_cache_invalidate(const char *path);
+
+/* Map the opened binary file into memory. Returns 1 when successful and 0
+   when the file needs to be read normally. */
+int sieve_binary_image_map(struct sieve_binary *sbin, const char *path,
+			   int fd, const struct stat *st,
+			   struct sieve_binary_image **image_r);
+
+void sieve_binary_image_ref(struct sieve_binary_image *image);
+void sieve_binary_image_unref(struct sieve_binary_image **_image);
+
+const void *
+sieve_binary_image_get_data(const struct sieve_binary_image *image,
+			    size_t *size_r);
+const struct stat *
+sieve_binary_image_get_stat(const struct sieve_binary_image *image);
+/* Returns FALSE when the size of the mapped file changed since it was mapped
+   (e.g. because it was truncated and rewritten in place), which means that its
+   data must not be accessed anymore. */
+bool sieve_binary_image_verify(const struct sieve_binary_image *image);
+
 /*
  * Internal structures
  */
@@ -80,6 +124,9 @@ struct sieve_binary_block {
 	buffer_t *data;
 
 	uoff_t offset;
+
+	/* Data points into the (read-only) file image */
+	bool mapped:1;
 };
 
 /*
@@ -95,6 +142,8 @@ struct sieve_binary {
 	struct sieve_script *script;
 
 	struct sieve_binary_file *file;
+	/* File contents the loaded blocks point into */
+	struct sieve_binary_image *image;
 	struct sieve_binary_header header;
 	struct sieve_resource_usage rusage;
 
@@ -122,6 +171,10 @@ struct sieve_binary {
 	/* Blocks */
 	ARRAY(struct sieve_binary_block *) blocks;
 
+	/* Runtime cache */
+	pool_t runtime_pool;
+	HASH_TABLE(const char *, void *) runtime_cache;
+
 	bool rusage_updated:1;
 };
 
@@ -156,6 +209,17 @@ _sieve_binary_block_get_size(const struct sieve_binary_block *sblock)
 struct sieve_binary_block *
 sieve_binary_block_create_id(struct sieve_binary *sbin, unsigned int id);
 
+void sieve_binary_block_unmap(struct sieve_binary_block *sblock);
+
+/* Blocks loaded from a file image are read-only; copy these before these are
+   modified. */
+static inline void
+sieve_binary_block_make_writable(struct sieve_binary_block *sblock)
+{
+	if (sblock->mapped)
+		sieve_binary_block_unmap(sblock);
+}
+
 buffer_t *sieve_binary_block_get_buffer(struct sieve_binary_block *sblock);
 
 /* Extension registration */
@@ -31,6 +31,8 @@ sieve_binary_extension_register(struct sieve_binary *sbin,
 				const struct sieve_extension *ext,
 				struct sieve_binary_extension_reg **reg);
 
+static void sieve_binary_runtime_cache_free(struct sieve_binary *sbin);
+
 /*
  * Binary object
  */
@@ -166,6 +168,8 @@ void sieve_binary_unref(struct sieve_binary **_sbin)
 	sieve_binary_update_resource_usage(sbin);
 	sieve_binary_extensions_free(sbin);
 
+	sieve_binary_runtime_cache_free(sbin);
+	sieve_binary_image_unref(&sbin->image);
 	sieve_script_unref(&sbin->script);
 
 	event_unref(&sbin->event);
@@ -251,6 +255,28 @@ void sieve_binary_set_resource_usage(struct sieve_binary *sbin,
 	(void)sieve_binary_check_resource_usage(sbin);
 }
 
+/*
+ * Optimization level
+ */
+
+void sieve_binary_set_optimization_level(struct sieve_binary *sbin,
+					 unsigned int level)
+{
+	struct sieve_binary_header *header = &sbin->header;
+
+	i_assert(level <= (SIEVE_BINARY_FLAGS_OPT_LEVEL_MASK >>
+			   SIEVE_BINARY_FLAGS_OPT_LEVEL_SHIFT));
+
+	header->flags &= ~SIEVE_BINARY_FLAGS_OPT_LEVEL_MASK;
+	header->flags |= (level << SIEVE_BINARY_FLAGS_OPT_LEVEL_SHIFT);
+}
+
+unsigned int sieve_binary_get_optimization_level(struct sieve_binary *sbin)
+{
+	return ((sbin->header.flags & SIEVE_BINARY_FLAGS_OPT_LEVEL_MASK) >>
+		SIEVE_BINARY_FLAGS_OPT_LEVEL_SHIFT);
+}
+
 /*
  * Accessors
  */
@@ -275,6 +301,29 @@ bool sieve_binary_saved(struct sieve_binary *sbin)
 	return (sbin->path != NULL);
 }
 
+void sieve_binary_set_script(struct sieve_binary *sbin,
+			     struct sieve_script *script)
+{
+	struct sieve_binary_block *sblock;
+
+	i_assert(sbin->file == NULL);
+
+	if (sbin->script == script)
+		return;
+
+	sieve_script_ref(script);
+	sieve_script_unref(&sbin->script);
+	sbin->script = script;
+
+	/* Rewrite script metadata block */
+	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_SCRIPT_DATA);
+	i_assert(sblock != NULL);
+	sieve_binary_block_clear(sblock);
+	sieve_script_binary_write_metadata(script, sblock);
+
+	sieve_binary_update_event(sbin, NULL);
+}
+
 bool sieve_binary_loaded(struct sieve_binary *sbin)
 {
 	return (sbin->file != NULL);
@@ -326,6 +375,58 @@ const char *sieve_binfile_from_name(const char *name)
 	return t_strconcat(name, "."SIEVE_BINARY_FILEEXT, NULL);
 }
 
+/*
+ * Runtime cache
+ */
+
+#define SIEVE_BINARY_RUNTIME_CACHE_MAX_ENTRIES 1024
+#define SIEVE_BINARY_RUNTIME_CACHE_MAX_SIZE (1024*1024)
+
+static void sieve_binary_runtime_cache_free(struct sieve_binary *sbin)
+{
+	if (sbin->runtime_pool == NULL)
+		return;
+
+	hash_table_destroy(&sbin->runtime_cache);
+	pool_unref(&sbin->runtime_pool);
+}
+
+void *sieve_binary_runtime_cache_lookup(struct sieve_binary *sbin,
+					const char *key)
+{
+	if (sbin->runtime_pool == NULL)
+		return NULL;
+	return hash_table_lookup(sbin->runtime_cache, key);
+}
+
+pool_t sieve_binary_runtime_cache_pool(struct sieve_binary *sbin)
+{
+	if (sbin->runtime_pool == NULL) {
+		sbin->runtime_pool = pool_alloconly_create(
+			"sieve_binary_runtime_cache", 4096);
+		hash_table_create(&sbin->runtime_cache, sbin->runtime_pool, 0,
+				  str_hash, strcmp);
+	}
+
+	/* Keys may be composed at runtime (e.g. from variables), so the
+	   cache needs to be bounded. */
+	if (hash_table_count(sbin->runtime_cache) >=
+		SIEVE_BINARY_RUNTIME_CACHE_MAX_ENTRIES ||
+	    pool_alloconly_get_total_used_size(sbin->runtime_pool) >=
+		SIEVE_BINARY_RUNTIME_CACHE_MAX_SIZE)
+		return NULL;
+	return sbin->runtime_pool;
+}
+
+void sieve_binary_runtime_cache_insert(struct sieve_binary *sbin,
+				       const char *key, void *object)
+{
+	i_assert(sbin->runtime_pool != NULL);
+
+	hash_table_insert(sbin->runtime_cache,
+			  p_strdup(sbin->runtime_pool, key), object);
+}
+
 /*
  * Block management
  */
@@ -365,11 +466,25 @@ sieve_binary_block_create_id(struct sieve_binary *sbin, unsigned int id)
 	return sblock;
 }
 
+void sieve_binary_block_unmap(struct sieve_binary_block *sblock)
+{
+	struct sieve_binary *sbin = sblock->sbin;
+	const void *data;
+	size_t size;
+
+	i_assert(sblock->mapped);
+
+	data = buffer_get_data(sblock->data, &size);
+	sblock->data = buffer_create_dynamic(sbin->pool, size + 64);
+	buffer_append(sblock->data, data, size);
+	sblock->mapped = FALSE;
+}
+
 static bool sieve_binary_block_fetch(struct sieve_binary_block *sblock)
 {
 	struct sieve_binary *sbin = sblock->sbin;
 
-	if (sbin->file != NULL) {
+	if (sbin->file != NULL || sbin->image != NULL) {
 		/* Try to acces the block in the binary on disk (apparently we
 		   were lazy)
 		 */
@@ -399,6 +514,11 @@ sieve_binary_block_get(struct sieve_binary *sbin, unsigned int id)
 
 void sieve_binary_block_clear(struct sieve_binary_block *sblock)
 {
+	if (sblock->mapped) {
+		sblock->data = buffer_create_dynamic(sblock->sbin->pool, 64);
+		sblock->mapped = FALSE;
+		return;
+	}
 	buffer_set_used_size(sblock->data, 0);
 }
 
@@ -407,6 +527,7 @@ buffer_t *sieve_binary_block_get_buffer(struct sieve_binary_block *sblock)
 	if (sblock->data == NULL && !sieve_binary_block_fetch(sblock))
 		return NULL;
 
+	sieve_binary_block_make_writable(sblock);
 	return sblock->data;
 }
 
@@ -37,6 +37,15 @@ bool sieve_binary_record_resource_usage(
 	ATTR_NULL(1);
 void sieve_binary_set_resource_usage(struct sieve_binary *sbin,
 				     const struct sieve_resource_usage *rusage);
+
+/*
+ * Optimization level
+ */
+
+void sieve_binary_set_optimization_level(struct sieve_binary *sbin,
+					 unsigned int level);
+unsigned int sieve_binary_get_optimization_level(struct sieve_binary *sbin);
+
 /*
  * Accessors
  */
@@ -56,12 +65,61 @@ const char *sieve_binary_source(struct sieve_binary *sbin);
 bool sieve_binary_loaded(struct sieve_binary *sbin);
 bool sieve_binary_saved(struct sieve_binary *sbin);
 
+/* Associate the (not yet saved) binary with a different script object, e.g.
+   when the script it was compiled from was moved into place. The script
+   metadata recorded in the binary is rewritten accordingly. */
+void sieve_binary_set_script(struct sieve_binary *sbin,
+			     struct sieve_script *script);
+
 /*
  * Utility
  */
 
 const char *sieve_binfile_from_name(const char *name);
 
+/*
+ * Binary cache
+ */
+
+struct sieve_binary_cache_stats {
+	/* Number of binary loads served from/not found in the cache */
+	unsigned int hits, misses;
+	/* Number of binaries dropped to stay within the size limit */
+	unsigned int evictions;
+
+	/* Current number and total size of cached binaries */
+	unsigned int count;
+	uoff_t size;
+	/* Current number of cached binaries that are pinned/mmap()ed */
+	unsigned int pinned, mapped;
+};
+
+/* Keep the image of this (saved) binary in the process-wide cache until the
+   binary file changes. The image counts against the configured cache size and
+   is only pinned while it fits; nothing is pinned when the cache is disabled.
+ */
+void sieve_binary_cache_pin(struct sieve_binary *sbin);
+/* Get the statistics of the process-wide binary cache. */
+void sieve_binary_cache_get_stats(struct sieve_binary_cache_stats *stats_r);
+/* Free all cached binaries. */
+void sieve_binary_cache_deinit(void);
+
+/*
+ * Runtime cache
+ */
+
+/* Objects derived from constant program data (e.g. compiled match keys) can
+   be cached with the binary, so that these are built only once while the
+   binary is loaded. Cached objects are allocated from the pool returned by
+   sieve_binary_runtime_cache_pool(), which returns NULL when the cache is
+   full. */
+
+void *sieve_binary_runtime_cache_lookup(struct sieve_binary *sbin,
+					const char *key);
+pool_t sieve_binary_runtime_cache_pool(struct sieve_binary *sbin);
+void sieve_binary_runtime_cache_insert(struct sieve_binary *sbin,
+				       const char *key, void *object);
+
 /*
  * Activation after code generation
  */
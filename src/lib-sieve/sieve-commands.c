@@ -14,6 +14,7 @@
 #include "sieve-commands.h"
 #include "sieve-code.h"
 #include "sieve-interpreter.h"
+#include "sieve-header-names.h"
 
 /*
  * Literal arguments
@@ -393,14 +394,17 @@ _verify_header_name_item(void *context, struct sieve_ast_argument *header)
 	struct sieve_validator *valdtr = (struct sieve_validator *)context;
 	string_t *name = sieve_ast_argument_str(header);
 
-	if (sieve_argument_is_string_literal(header) &&
-	    !rfc2822_header_field_name_verify(str_c(name), str_len(name))) {
+	if (!sieve_argument_is_string_literal(header))
+		return 1;
+	if (!rfc2822_header_field_name_verify(str_c(name), str_len(name))) {
 		sieve_argument_validate_warning(
 			valdtr, header,
 			"specified header field name '%s' is invalid",
 			str_sanitize(str_c(name), 80));
 		return 0;
 	}
+
+	sieve_header_names_add(valdtr, str_c(name));
 	return 1;
 }
 
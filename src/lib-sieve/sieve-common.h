@@ -204,6 +204,9 @@ struct sieve_instance {
 	/* Settings */
 	const struct sieve_settings *set;
 	const struct smtp_address *user_email_implicit;
+
+	/* Binary files must not be mmap()ed (mmap_disable or NFS configured) */
+	bool mmap_disable;
 };
 
 /*
@@ -45,6 +45,7 @@ struct sieve_extension_registry {
 	const struct sieve_extension *comparator_extension;
 	const struct sieve_extension *match_type_extension;
 	const struct sieve_extension *address_part_extension;
+	const struct sieve_extension *header_names_extension;
 
 	/* Preloaded extensions */
 	ARRAY(const struct sieve_extension *) preloaded_extensions;
@@ -57,6 +58,7 @@ struct sieve_extension_registry {
 extern const struct sieve_extension_def comparator_extension;
 extern const struct sieve_extension_def match_type_extension;
 extern const struct sieve_extension_def address_part_extension;
+extern const struct sieve_extension_def header_names_extension;
 
 /*
  * Dummy extensions
@@ -202,6 +204,11 @@ int sieve_extensions_init(struct sieve_instance *svinst)
 				       &ext_reg->address_part_extension);
 	i_assert(ret == 0);
 
+	/* Internal 'extension' linked only when scripts reference headers */
+	ret = sieve_extension_register(svinst, &header_names_extension, TRUE,
+				       &ext_reg->header_names_extension);
+	i_assert(ret == 0);
+
 	p_array_init(&ext_reg->preloaded_extensions, svinst->pool, 5);
 	array_append(&ext_reg->preloaded_extensions,
 		     &ext_reg->comparator_extension, 1);
@@ -258,6 +265,37 @@ void sieve_extensions_deinit(struct sieve_instance *svinst)
 	sieve_capability_registry_deinit(svinst);
 }
 
+/*
+ * Process-wide caches
+ */
+
+static ARRAY(sieve_extension_cache_deinit_func_t *) sieve_extension_caches;
+
+void sieve_extensions_register_cache(
+	sieve_extension_cache_deinit_func_t *cache_deinit)
+{
+	sieve_extension_cache_deinit_func_t *const *cache_deinitp;
+
+	if (!array_is_created(&sieve_extension_caches))
+		i_array_init(&sieve_extension_caches, 4);
+	array_foreach(&sieve_extension_caches, cache_deinitp) {
+		if (*cache_deinitp == cache_deinit)
+			return;
+	}
+	array_push_back(&sieve_extension_caches, &cache_deinit);
+}
+
+void sieve_extensions_caches_deinit(void)
+{
+	sieve_extension_cache_deinit_func_t *const *cache_deinitp;
+
+	if (!array_is_created(&sieve_extension_caches))
+		return;
+	array_foreach(&sieve_extension_caches, cache_deinitp)
+		(*cache_deinitp)();
+	array_free(&sieve_extension_caches);
+}
+
 /*
  * Pre-loaded extensions
  */
@@ -544,12 +582,13 @@ sieve_extension_get_by_id(struct sieve_instance *svinst, unsigned int ext_id)
 	return NULL;
 }
 
-const struct sieve_extension *
-sieve_extension_get_by_name(struct sieve_instance *svinst, const char *name)
+static const struct sieve_extension *
+_sieve_extension_get_by_name(struct sieve_instance *svinst, const char *name,
+			     bool linked)
 {
 	const struct sieve_extension *ext;
 
-	if (*name == '@')
+	if (*name == '@' && !linked)
 		return NULL;
 	if (strlen(name) > 128)
 		return NULL;
@@ -558,9 +597,26 @@ sieve_extension_get_by_name(struct sieve_instance *svinst, const char *name)
 	if (ext == NULL || ext->def == NULL ||
 	    (!ext->enabled && !ext->required))
 		return NULL;
+	if (*name == '@' && !ext->def->linkable)
+		return NULL;
 	return ext;
 }
 
+const struct sieve_extension *
+sieve_extension_get_by_name(struct sieve_instance *svinst, const char *name)
+{
+	return _sieve_extension_get_by_name(svinst, name, FALSE);
+}
+
+const struct sieve_extension *
+sieve_extension_get_linked_by_name(struct sieve_instance *svinst,
+				   const char *name)
+{
+	/* Internal 'extensions' cannot be required by a script, but some of
+	   them can be linked to a binary */
+	return _sieve_extension_get_by_name(svinst, name, TRUE);
+}
+
 static inline bool _sieve_extension_listable(const struct sieve_extension *ext)
 {
 	return (ext->enabled && ext->def != NULL &&
@@ -862,6 +918,12 @@ sieve_get_address_part_extension(struct sieve_instance *svinst)
 	return svinst->ext_reg->address_part_extension;
 }
 
+const struct sieve_extension *
+sieve_get_header_names_extension(struct sieve_instance *svinst)
+{
+	return svinst->ext_reg->header_names_extension;
+}
+
 void sieve_enable_debug_extension(struct sieve_instance *svinst)
 {
 	const struct sieve_extension *ext;
@@ -23,6 +23,10 @@ struct sieve_extension_def {
 	/* Version */
 	unsigned int version;
 
+	/* Internal extension (name starts with '@') that can be linked to a
+	   binary, e.g. for storing additional data about the script */
+	bool linkable:1;
+
 	/* Registration */
 	int (*load)(const struct sieve_extension *ext, void **context_r);
 	void (*unload)(const struct sieve_extension *ext);
@@ -114,6 +118,15 @@ struct sieve_extension {
 int sieve_extensions_init(struct sieve_instance *svinst);
 int sieve_extensions_load(struct sieve_instance *svinst);
 void sieve_extensions_deinit(struct sieve_instance *svinst);
+/* Free caches shared by all instances in this process */
+void sieve_extensions_caches_deinit(void);
+
+/* Register a function that frees a process-wide cache of an extension. It is
+   called (once) by sieve_extensions_caches_deinit(). */
+typedef void sieve_extension_cache_deinit_func_t(void);
+
+void sieve_extensions_register_cache(
+	sieve_extension_cache_deinit_func_t *cache_deinit);
 
 /*
  * Pre-loaded extensions
@@ -151,6 +164,9 @@ const struct sieve_extension *
 sieve_extension_get_by_id(struct sieve_instance *svinst, unsigned int ext_id);
 const struct sieve_extension *
 sieve_extension_get_by_name(struct sieve_instance *svinst, const char *name);
+const struct sieve_extension *
+sieve_extension_get_linked_by_name(struct sieve_instance *svinst,
+				   const char *name);
 
 const char *sieve_extensions_get_string(struct sieve_instance *svinst);
 int sieve_extensions_set_string(struct sieve_instance *svinst,
@@ -163,6 +179,8 @@ const struct sieve_extension *
 sieve_get_comparator_extension(struct sieve_instance *svinst);
 const struct sieve_extension *
 sieve_get_address_part_extension(struct sieve_instance *svinst);
+const struct sieve_extension *
+sieve_get_header_names_extension(struct sieve_instance *svinst);
 
 void sieve_enable_debug_extension(struct sieve_instance *svinst);
 
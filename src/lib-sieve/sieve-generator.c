@@ -100,6 +100,7 @@ sieve_generator_create(struct sieve_ast *ast,
 
 	gentr->genenv.script = script;
 	gentr->genenv.svinst = svinst;
+	gentr->genenv.optimization_level = svinst->set->optimization_level;
 
 	/* Setup storage for extension contexts */
 	p_array_init(&gentr->ext_contexts, pool,
@@ -401,11 +402,19 @@ bool sieve_generate_block(const struct sieve_codegen_env *cgenv,
 {
 	bool result = TRUE;
 	struct sieve_ast_node *cmd_node;
+	struct sieve_command *exit_cmd = NULL;
+
+	/* Commands following one that unconditionally exits this block can
+	   never be reached, so no code is generated for those. */
+	if (block->command != NULL && cgenv->optimization_level >= 1)
+		exit_cmd = block->command->block_exit_command;
 
 	T_BEGIN {
 		cmd_node = sieve_ast_command_first(block);
 		while (result && cmd_node != NULL) {
 			result = sieve_generate_command(cgenv, cmd_node);
+			if (exit_cmd != NULL && cmd_node->command == exit_cmd)
+				break;
 			cmd_node = sieve_ast_command_next(cmd_node);
 		}
 	} T_END;
@@ -479,6 +488,8 @@ sieve_generator_run(struct sieve_generator *gentr,
 					  sieve_ast_root(gentr->genenv.ast))) {
 			result = FALSE;
 		} else if (topmost) {
+			sieve_binary_set_optimization_level(
+				sbin, gentr->genenv.optimization_level);
 			sieve_binary_activate(sbin);
 		}
 	}
@@ -7,6 +7,13 @@
  * Code generator
  */
 
+/* Level of optimization applied by the code generator (sieve_optimization_level
+   setting); recorded in the header of the produced binary:
+     0 - only constant true/false tests folded
+     1 - string tests on literals folded as well, unreachable code dropped,
+         nested if exit jumps threaded to their final target
+ */
+
 struct sieve_generator;
 
 struct sieve_codegen_env {
@@ -14,6 +21,7 @@ struct sieve_codegen_env {
 
 	struct sieve_instance *svinst;
 	enum sieve_compile_flags flags;
+	unsigned int optimization_level;
 
 	struct sieve_script *script;
 	struct sieve_ast *ast;
@@ -0,0 +1,145 @@
+/* Copyright (c) Pigeonhole authors, see top-level COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+
+#include "sieve-common.h"
+#include "sieve-extensions.h"
+#include "sieve-ast.h"
+#include "sieve-validator.h"
+#include "sieve-generator.h"
+#include "sieve-binary.h"
+
+#include "sieve-header-names.h"
+
+/*
+ * Header names 'extension'
+ *
+ * Records the header field names that are referenced literally by the
+ * script, so that callers executing a binary for many messages can prefetch
+ * these headers. Names only known at runtime (e.g. from variables) are not
+ * recorded.
+ */
+
+static bool
+hdrn_generator_load(const struct sieve_extension *ext,
+		    const struct sieve_codegen_env *cgenv);
+
+const struct sieve_extension_def header_names_extension = {
+	.name = "@header-names",
+	.linkable = TRUE,
+	.generator_load = hdrn_generator_load,
+};
+
+/*
+ * AST context
+ */
+
+struct hdrn_ast_context {
+	ARRAY_TYPE(const_string) field_names;
+};
+
+static bool
+hdrn_field_names_contain(const ARRAY_TYPE(const_string) *field_names,
+			 const char *field_name)
+{
+	const char *name;
+
+	array_foreach_elem(field_names, name) {
+		if (strcasecmp(name, field_name) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+void sieve_header_names_add(struct sieve_validator *valdtr,
+			    const char *field_name)
+{
+	struct sieve_instance *svinst = sieve_validator_svinst(valdtr);
+	struct sieve_ast *ast = sieve_validator_ast(valdtr);
+	const struct sieve_extension *ext =
+		sieve_get_header_names_extension(svinst);
+	pool_t pool = sieve_ast_pool(ast);
+	struct hdrn_ast_context *actx;
+
+	actx = sieve_ast_extension_get_context(ast, ext);
+	if (actx == NULL) {
+		actx = p_new(pool, struct hdrn_ast_context, 1);
+		p_array_init(&actx->field_names, pool, 8);
+		sieve_ast_extension_set_context(ast, ext, actx);
+
+		/* Not required by the script itself */
+		sieve_ast_extension_link(ast, ext, FALSE);
+	}
+
+	if (hdrn_field_names_contain(&actx->field_names, field_name))
+		return;
+
+	field_name = p_strdup(pool, field_name);
+	array_append(&actx->field_names, &field_name, 1);
+}
+
+/*
+ * Code generation
+ */
+
+static bool
+hdrn_generator_load(const struct sieve_extension *ext,
+		    const struct sieve_codegen_env *cgenv)
+{
+	struct hdrn_ast_context *actx =
+		sieve_ast_extension_get_context(cgenv->ast, ext);
+	struct sieve_binary_block *sblock;
+	const char *field_name;
+
+	if (actx == NULL)
+		return TRUE;
+
+	/* Included scripts compiled into the same binary append their names
+	   to the same block */
+	sblock = sieve_binary_extension_get_block(cgenv->sbin, ext);
+	if (sblock == NULL)
+		sblock = sieve_binary_extension_create_block(cgenv->sbin, ext);
+
+	array_foreach_elem(&actx->field_names, field_name)
+		sieve_binary_emit_cstring(sblock, field_name);
+	return TRUE;
+}
+
+/*
+ * Binary
+ */
+
+void sieve_header_names_get(struct sieve_binary *sbin,
+			    ARRAY_TYPE(const_string) *field_names)
+{
+	struct sieve_instance *svinst = sieve_binary_svinst(sbin);
+	const struct sieve_extension *ext =
+		sieve_get_header_names_extension(svinst);
+	struct sieve_binary_block *sblock;
+	sieve_size_t offset = 0;
+	string_t *field_name;
+
+	if (sieve_binary_extension_get_index(sbin, ext) < 0)
+		return;
+	sblock = sieve_binary_extension_get_block(sbin, ext);
+	if (sblock == NULL)
+		return;
+
+	while (offset < sieve_binary_block_get_size(sblock)) {
+		const char *name;
+
+		if (!sieve_binary_read_string(sblock, &offset, &field_name)) {
+			/* Only used as a hint; ignore the rest */
+			e_debug(svinst->event,
+				"Binary %s has corrupt header names block",
+				sieve_binary_source(sbin));
+			break;
+		}
+
+		name = str_c(field_name);
+		if (!hdrn_field_names_contain(field_names, name))
+			array_append(field_names, &name, 1);
+	}
+}
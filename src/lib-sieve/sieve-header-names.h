@@ -0,0 +1,27 @@
+#ifndef SIEVE_HEADER_NAMES_H
+#define SIEVE_HEADER_NAMES_H
+
+#include "sieve-common.h"
+
+/*
+ * Header names 'extension'
+ */
+
+extern const struct sieve_extension_def header_names_extension;
+
+/*
+ * Referenced header names
+ */
+
+/* Records a header field name the script under validation references
+   literally. */
+void sieve_header_names_add(struct sieve_validator *valdtr,
+			    const char *field_name);
+
+/* Appends the header field names recorded in the binary to the array,
+   skipping names already present. The names are allocated from the data
+   stack. */
+void sieve_header_names_get(struct sieve_binary *sbin,
+			    ARRAY_TYPE(const_string) *field_names);
+
+#endif
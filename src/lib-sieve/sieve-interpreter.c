@@ -26,6 +26,7 @@
 #include "sieve-interpreter.h"
 
 #include <string.h>
+#include <time.h>
 
 static struct event_category event_category_sieve_runtime = {
 	.parent = &event_category_sieve,
@@ -58,6 +59,27 @@ struct sieve_interpreter_loop {
 	void *context;
 };
 
+/*
+ * Runtime profile
+ */
+
+struct sieve_runtime_profile_entry {
+	sieve_size_t address;
+	unsigned int line;
+	const struct sieve_operation_def *def;
+
+	unsigned int count;
+	uint64_t wall_usecs;
+	uint64_t cpu_usecs;
+};
+
+struct sieve_runtime_profile {
+	ARRAY(struct sieve_runtime_profile_entry) entries;
+
+	/* Index into entries (+1) for each executed code address (+1) */
+	HASH_TABLE(void *, void *) index;
+};
+
 /*
  * Interpreter
  */
@@ -94,6 +116,9 @@ struct sieve_interpreter {
 	/* Current operation */
 	struct sieve_operation oprtn;
 
+	/* Runtime profile; NULL when not profiling */
+	struct sieve_runtime_profile *profile;
+
 	/* Location information */
 	struct sieve_binary_debug_reader *dreader;
 	unsigned int command_line;
@@ -104,6 +129,140 @@ struct sieve_interpreter {
 	bool test_result:1;         /* Result of previous test command */
 };
 
+/*
+ * Runtime profile
+ */
+
+static void sieve_runtime_profile_init(struct sieve_interpreter *interp)
+{
+	struct sieve_runtime_profile *profile;
+
+	profile = p_new(interp->pool, struct sieve_runtime_profile, 1);
+	p_array_init(&profile->entries, interp->pool, 64);
+	hash_table_create_direct(&profile->index, interp->pool, 0);
+
+	interp->profile = profile;
+}
+
+static void sieve_runtime_profile_deinit(struct sieve_interpreter *interp)
+{
+	if (interp->profile == NULL)
+		return;
+	hash_table_destroy(&interp->profile->index);
+}
+
+static void sieve_runtime_profile_reset(struct sieve_interpreter *interp)
+{
+	struct sieve_runtime_profile *profile = interp->profile;
+
+	if (profile == NULL)
+		return;
+	array_clear(&profile->entries);
+	hash_table_clear(profile->index, TRUE);
+}
+
+static uint64_t sieve_runtime_profile_clock(clockid_t clock_id)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clock_id, &ts) < 0)
+		return 0;
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static void
+sieve_runtime_profile_add(struct sieve_interpreter *interp,
+			  const struct sieve_operation *oprtn,
+			  uint64_t wall_start, uint64_t cpu_start)
+{
+	struct sieve_runtime_profile *profile = interp->profile;
+	struct sieve_runtime_profile_entry *entry;
+	uint64_t wall_end, cpu_end;
+	void *key = POINTER_CAST(oprtn->address + 1);
+	unsigned int idx;
+
+	wall_end = sieve_runtime_profile_clock(CLOCK_MONOTONIC);
+	cpu_end = sieve_runtime_profile_clock(CLOCK_PROCESS_CPUTIME_ID);
+
+	idx = POINTER_CAST_TO(hash_table_lookup(profile->index, key),
+			      unsigned int);
+	if (idx > 0)
+		entry = array_idx_modifiable(&profile->entries, idx - 1);
+	else {
+		entry = array_append_space(&profile->entries);
+		entry->address = oprtn->address;
+		entry->line = sieve_runtime_get_source_location(
+			&interp->runenv, oprtn->address);
+		entry->def = oprtn->def;
+		hash_table_insert(profile->index, key,
+				  POINTER_CAST(array_count(&profile->entries)));
+	}
+
+	entry->count++;
+	if (wall_end > wall_start)
+		entry->wall_usecs += wall_end - wall_start;
+	if (cpu_end > cpu_start)
+		entry->cpu_usecs += cpu_end - cpu_start;
+}
+
+static void sieve_runtime_profile_emit(struct sieve_interpreter *interp)
+{
+	const struct sieve_runtime_env *renv = &interp->runenv;
+	const struct sieve_script_env *senv = renv->exec_env->scriptenv;
+	const struct sieve_runtime_profile_entry *entry, *hottest = NULL;
+	struct sieve_runtime_profile_item item;
+	uint64_t count = 0, wall_usecs = 0, cpu_usecs = 0;
+
+	if (interp->profile == NULL ||
+	    array_count(&interp->profile->entries) == 0)
+		return;
+
+	array_foreach(&interp->profile->entries, entry) {
+		count += entry->count;
+		wall_usecs += entry->wall_usecs;
+		cpu_usecs += entry->cpu_usecs;
+		if (hottest == NULL || entry->wall_usecs > hottest->wall_usecs)
+			hottest = entry;
+
+		if (senv->runtime_profile == NULL)
+			continue;
+
+		i_zero(&item);
+		item.script_name = sieve_binary_script_name(renv->sbin);
+		item.address = entry->address;
+		item.line = entry->line;
+		item.operation = entry->def->mnemonic;
+		item.count = entry->count;
+		item.wall_usecs = entry->wall_usecs;
+		item.cpu_usecs = entry->cpu_usecs;
+		senv->runtime_profile(senv, &item);
+	}
+
+	/* One summary; the individual entries only go to the callback */
+	struct event_passthrough *e =
+		event_create_passthrough(renv->event)->
+		set_name("sieve_runtime_profile")->
+		add_int("operations", array_count(&interp->profile->entries))->
+		add_int("count", count)->
+		add_int("wall_usecs", wall_usecs)->
+		add_int("cpu_usecs", cpu_usecs)->
+		add_int("hottest_line", hottest->line)->
+		add_str("hottest_operation", hottest->def->mnemonic)->
+		add_int("hottest_wall_usecs", hottest->wall_usecs);
+	e_debug(e->event(), "Profile: %u operations executed %"PRIu64" times "
+		"(wall=%"PRIu64" us, cpu=%"PRIu64" us); "
+		"hottest: line %u: %s (wall=%"PRIu64" us)",
+		array_count(&interp->profile->entries), count,
+		wall_usecs, cpu_usecs, hottest->line,
+		hottest->def->mnemonic, hottest->wall_usecs);
+
+	sieve_runtime_profile_reset(interp);
+}
+
+/*
+ * Interpreter
+ */
+
 static struct sieve_interpreter *
 _sieve_interpreter_create(struct sieve_binary *sbin,
 			  struct sieve_binary_block *sblock,
@@ -255,6 +414,10 @@ _sieve_interpreter_create(struct sieve_binary *sbin,
 		interp = NULL;
 	} else {
 		interp->reset_vector = *address;
+
+		if ((eenv->flags & SIEVE_EXECUTE_FLAG_PROFILE) != 0 ||
+		    svinst->set->runtime_profile)
+			sieve_runtime_profile_init(interp);
 	}
 
 	return interp;
@@ -327,6 +490,7 @@ void sieve_interpreter_free(struct sieve_interpreter **_interp)
 		}
 	}
 
+	sieve_runtime_profile_deinit(interp);
 	sieve_binary_debug_reader_deinit(&interp->dreader);
 	sieve_binary_unref(&renv->sbin);
 	sieve_result_unref(&interp->runenv.result);
@@ -900,9 +1064,16 @@ static int sieve_interpreter_operation_execute(struct sieve_interpreter *interp)
 {
 	struct sieve_operation *oprtn = &(interp->oprtn);
 	sieve_size_t *address = &(interp->runenv.pc);
+	uint64_t wall_start = 0, cpu_start = 0;
 
 	sieve_runtime_trace_toplevel(&interp->runenv);
 
+	if (interp->profile != NULL) {
+		wall_start = sieve_runtime_profile_clock(CLOCK_MONOTONIC);
+		cpu_start = sieve_runtime_profile_clock(
+			CLOCK_PROCESS_CPUTIME_ID);
+	}
+
 	/* Read the operation */
 	if (sieve_operation_read(interp->runenv.sblock, address, oprtn)) {
 		const struct sieve_operation_def *op = oprtn->def;
@@ -925,6 +1096,10 @@ static int sieve_interpreter_operation_execute(struct sieve_interpreter *interp)
 					    sieve_operation_mnemonic(oprtn));
 		}
 
+		if (interp->profile != NULL) {
+			sieve_runtime_profile_add(interp, oprtn,
+						  wall_start, cpu_start);
+		}
 		return result;
 	}
 
@@ -998,6 +1173,8 @@ int sieve_interpreter_continue(struct sieve_interpreter *interp,
 	if (!interp->interrupted) {
 		exec_status->resource_usage = interp->rusage;
 
+		sieve_runtime_profile_emit(interp);
+
 		struct event_passthrough *e =
 			event_create_passthrough(interp->runenv.event)->
 			set_name("sieve_runtime_script_finished");
@@ -1050,6 +1227,7 @@ int sieve_interpreter_start(struct sieve_interpreter *interp,
 	sieve_result_ref(result);
 
 	sieve_resource_usage_init(&interp->rusage);
+	sieve_runtime_profile_reset(interp);
 
 	/* Signal registered extensions that the interpreter is being run */
 	eregs = array_get_modifiable(&interp->extensions, &ext_count);
@@ -24,6 +24,12 @@
 #define SIEVE_MAX_BLOCK_NESTING                         32
 #define SIEVE_MAX_TEST_NESTING                          32
 
+/*
+ * Code generator
+ */
+
+#define SIEVE_MAX_OPTIMIZATION_LEVEL                    1
+
 /*
  * Runtime
  */
@@ -0,0 +1,557 @@
+/* Copyright (c) Pigeonhole authors, see top-level COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "sort.h"
+#include "str.h"
+#include "str-sanitize.h"
+
+#include "sieve-common.h"
+#include "sieve-stringlist.h"
+#include "sieve-binary.h"
+#include "sieve-comparators.h"
+#include "sieve-match-types.h"
+#include "sieve-interpreter.h"
+#include "sieve-runtime-trace.h"
+#include "sieve-match.h"
+
+#include "sieve-match-keyset.h"
+
+#define SIEVE_MATCH_KEYSET_NO_STATE ((unsigned int)-1)
+
+struct sieve_match_keyset_key {
+	const unsigned char *data;
+	size_t size;
+};
+ARRAY_DEFINE_TYPE(sieve_match_keyset_key, struct sieve_match_keyset_key);
+
+struct sieve_match_keyset_edge {
+	unsigned char c;
+	unsigned int target;
+};
+
+struct sieve_match_keyset_state {
+	/* Sorted list of outgoing edges */
+	unsigned int edges, edge_count;
+	/* Failure transition */
+	unsigned int fail;
+
+	/* A key ends here (or at a state reachable by failure transitions) */
+	bool match:1;
+};
+
+struct sieve_match_keyset {
+	enum sieve_match_keyset_type type;
+	bool casemap;
+
+	/* :is - sorted keys */
+	const struct sieve_match_keyset_key *keys;
+	unsigned int key_count;
+
+	/* :contains - automaton */
+	const struct sieve_match_keyset_state *states;
+	const struct sieve_match_keyset_edge *edges;
+	unsigned int root_next[256];
+};
+
+struct sieve_match_keyset_context {
+	enum sieve_match_keyset_type type;
+
+	ARRAY_TYPE(sieve_match_keyset_key) keys;
+	const struct sieve_match_keyset *kset;
+
+	/* Automaton state for streamed matching */
+	unsigned int stream_state;
+
+	bool keys_read:1;
+};
+
+static inline unsigned char
+sieve_match_keyset_fold(const struct sieve_match_keyset *kset, unsigned char c)
+{
+	return (kset->casemap ? i_tolower(c) : c);
+}
+
+/*
+ * Key set for ':is'
+ */
+
+static int
+sieve_match_keyset_key_cmp(bool casemap, const unsigned char *data,
+			   size_t size, const struct sieve_match_keyset_key *key)
+{
+	size_t min_size = I_MIN(size, key->size);
+	int ret;
+
+	ret = (casemap ? i_memcasecmp(data, key->data, min_size) :
+			 memcmp(data, key->data, min_size));
+	if (ret != 0)
+		return ret;
+	return (size < key->size ? -1 : (size > key->size ? 1 : 0));
+}
+
+static int
+sieve_match_keyset_key_cmp_octet(const struct sieve_match_keyset_key *key1,
+				 const struct sieve_match_keyset_key *key2)
+{
+	return sieve_match_keyset_key_cmp(FALSE, key1->data, key1->size, key2);
+}
+
+static int
+sieve_match_keyset_key_cmp_casemap(const struct sieve_match_keyset_key *key1,
+				   const struct sieve_match_keyset_key *key2)
+{
+	return sieve_match_keyset_key_cmp(TRUE, key1->data, key1->size, key2);
+}
+
+static void
+sieve_match_keyset_is_build(pool_t pool, struct sieve_match_keyset *kset,
+			    const struct sieve_match_keyset_key *keys,
+			    unsigned int count)
+{
+	struct sieve_match_keyset_key *sorted;
+	unsigned int i;
+
+	sorted = p_new(pool, struct sieve_match_keyset_key, I_MAX(count, 1));
+	for (i = 0; i < count; i++) {
+		sorted[i].data = p_memdup(pool, keys[i].data, keys[i].size);
+		sorted[i].size = keys[i].size;
+	}
+	if (kset->casemap)
+		i_qsort(sorted, count, sizeof(*sorted),
+			sieve_match_keyset_key_cmp_casemap);
+	else
+		i_qsort(sorted, count, sizeof(*sorted),
+			sieve_match_keyset_key_cmp_octet);
+
+	kset->keys = sorted;
+	kset->key_count = count;
+}
+
+static int
+sieve_match_keyset_is_match(const struct sieve_match_keyset *kset,
+			    const char *val, size_t val_size)
+{
+	unsigned int left = 0, right = kset->key_count;
+
+	while (left < right) {
+		unsigned int idx = (left + right) / 2;
+		int ret;
+
+		ret = sieve_match_keyset_key_cmp(
+			kset->casemap, (const unsigned char *)val, val_size,
+			&kset->keys[idx]);
+		if (ret == 0)
+			return 1;
+		if (ret < 0)
+			right = idx;
+		else
+			left = idx + 1;
+	}
+	return 0;
+}
+
+/*
+ * Key set for ':contains'
+ */
+
+struct sieve_match_keyset_trie_edge {
+	unsigned char c;
+	unsigned int target;
+	struct sieve_match_keyset_trie_edge *next;
+};
+
+struct sieve_match_keyset_trie_state {
+	struct sieve_match_keyset_trie_edge *edges;
+	unsigned int edge_count;
+	bool match;
+};
+
+static int
+sieve_match_keyset_edge_cmp(const struct sieve_match_keyset_edge *edge1,
+			    const struct sieve_match_keyset_edge *edge2)
+{
+	return (int)edge1->c - (int)edge2->c;
+}
+
+static unsigned int
+sieve_match_keyset_goto(const struct sieve_match_keyset *kset,
+			unsigned int state, unsigned char c)
+{
+	const struct sieve_match_keyset_state *st = &kset->states[state];
+	unsigned int left = st->edges, right = st->edges + st->edge_count;
+
+	if (state == 0)
+		return kset->root_next[c];
+
+	while (left < right) {
+		unsigned int idx = (left + right) / 2;
+
+		if (kset->edges[idx].c == c)
+			return kset->edges[idx].target;
+		if (kset->edges[idx].c > c)
+			right = idx;
+		else
+			left = idx + 1;
+	}
+	return SIEVE_MATCH_KEYSET_NO_STATE;
+}
+
+static void
+sieve_match_keyset_contains_build(pool_t pool, struct sieve_match_keyset *kset,
+				  const struct sieve_match_keyset_key *keys,
+				  unsigned int count)
+{
+	ARRAY(struct sieve_match_keyset_trie_state) trie;
+	struct sieve_match_keyset_trie_state *tstates;
+	struct sieve_match_keyset_state *states;
+	struct sieve_match_keyset_edge *edges;
+	unsigned int *queue, qhead, qtail;
+	unsigned int state_count, edge_count, i, j;
+
+	/* Build the trie */
+	t_array_init(&trie, 64);
+	(void)array_append_space(&trie);
+	edge_count = 0;
+	for (i = 0; i < count; i++) {
+		unsigned int state = 0;
+
+		for (j = 0; j < keys[i].size; j++) {
+			unsigned char c = sieve_match_keyset_fold(
+				kset, keys[i].data[j]);
+			struct sieve_match_keyset_trie_state *tstate;
+			struct sieve_match_keyset_trie_edge *tedge;
+
+			tstate = array_idx_modifiable(&trie, state);
+			for (tedge = tstate->edges; tedge != NULL;
+			     tedge = tedge->next) {
+				if (tedge->c == c)
+					break;
+			}
+			if (tedge == NULL) {
+				tedge = t_new(struct sieve_match_keyset_trie_edge, 1);
+				tedge->c = c;
+				tedge->target = array_count(&trie);
+				tedge->next = tstate->edges;
+				tstate->edges = tedge;
+				tstate->edge_count++;
+				edge_count++;
+				(void)array_append_space(&trie);
+			}
+			state = tedge->target;
+		}
+		array_idx_modifiable(&trie, state)->match = TRUE;
+	}
+
+	/* Flatten it into sorted edge lists */
+	tstates = array_get_modifiable(&trie, &state_count);
+	states = p_new(pool, struct sieve_match_keyset_state, state_count);
+	edges = p_new(pool, struct sieve_match_keyset_edge,
+		      I_MAX(edge_count, 1));
+	edge_count = 0;
+	for (i = 0; i < state_count; i++) {
+		struct sieve_match_keyset_trie_edge *tedge;
+
+		states[i].edges = edge_count;
+		states[i].edge_count = tstates[i].edge_count;
+		states[i].match = tstates[i].match;
+		for (tedge = tstates[i].edges; tedge != NULL;
+		     tedge = tedge->next) {
+			edges[edge_count].c = tedge->c;
+			edges[edge_count].target = tedge->target;
+			edge_count++;
+		}
+		i_qsort(&edges[states[i].edges], states[i].edge_count,
+			sizeof(*edges), sieve_match_keyset_edge_cmp);
+	}
+	for (i = 0; i < states[0].edge_count; i++) {
+		const struct sieve_match_keyset_edge *edge =
+			&edges[states[0].edges + i];
+
+		kset->root_next[edge->c] = edge->target;
+	}
+	kset->states = states;
+	kset->edges = edges;
+
+	/* Compute failure transitions breadth-first */
+	queue = t_new(unsigned int, state_count);
+	qhead = qtail = 0;
+	for (i = 0; i < states[0].edge_count; i++)
+		queue[qtail++] = edges[states[0].edges + i].target;
+	while (qhead < qtail) {
+		unsigned int state = queue[qhead++];
+
+		for (i = 0; i < states[state].edge_count; i++) {
+			const struct sieve_match_keyset_edge *edge =
+				&edges[states[state].edges + i];
+			unsigned int fail = states[state].fail, next;
+
+			while ((next = sieve_match_keyset_goto(
+					kset, fail, edge->c)) ==
+			       SIEVE_MATCH_KEYSET_NO_STATE)
+				fail = states[fail].fail;
+
+			states[edge->target].fail = next;
+			if (states[next].match)
+				states[edge->target].match = TRUE;
+			queue[qtail++] = edge->target;
+		}
+	}
+}
+
+static int
+sieve_match_keyset_contains_feed(const struct sieve_match_keyset *kset,
+				 unsigned int *_state,
+				 const char *val, size_t val_size)
+{
+	const unsigned char *vp = (const unsigned char *)val;
+	const unsigned char *vend = vp + val_size;
+	unsigned int state = *_state;
+
+	for (; vp < vend; vp++) {
+		unsigned char c = sieve_match_keyset_fold(kset, *vp);
+		unsigned int next;
+
+		while ((next = sieve_match_keyset_goto(kset, state, c)) ==
+		       SIEVE_MATCH_KEYSET_NO_STATE)
+			state = kset->states[state].fail;
+		state = next;
+
+		if (kset->states[state].match)
+			return 1;
+	}
+	*_state = state;
+	return 0;
+}
+
+static int
+sieve_match_keyset_contains_match(const struct sieve_match_keyset *kset,
+				  const char *val, size_t val_size)
+{
+	unsigned int state = 0;
+
+	/* Empty key matches anything */
+	if (kset->states[0].match)
+		return 1;
+
+	return sieve_match_keyset_contains_feed(kset, &state, val, val_size);
+}
+
+/*
+ * Key set
+ */
+
+static struct sieve_match_keyset *
+sieve_match_keyset_create(pool_t pool, enum sieve_match_keyset_type type,
+			  bool casemap,
+			  const struct sieve_match_keyset_key *keys,
+			  unsigned int count)
+{
+	struct sieve_match_keyset *kset;
+
+	kset = p_new(pool, struct sieve_match_keyset, 1);
+	kset->type = type;
+	kset->casemap = casemap;
+
+	T_BEGIN {
+		switch (type) {
+		case SIEVE_MATCH_KEYSET_IS:
+			sieve_match_keyset_is_build(pool, kset, keys, count);
+			break;
+		case SIEVE_MATCH_KEYSET_CONTAINS:
+			sieve_match_keyset_contains_build(pool, kset,
+							  keys, count);
+			break;
+		}
+	} T_END;
+	return kset;
+}
+
+static const struct sieve_match_keyset *
+sieve_match_keyset_get(struct sieve_match_context *mctx,
+		       enum sieve_match_keyset_type type,
+		       const ARRAY_TYPE(sieve_match_keyset_key) *key_array)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct sieve_binary *sbin = mctx->runenv->sbin;
+	const struct sieve_match_keyset_key *keys;
+	struct sieve_match_keyset *kset;
+	unsigned int count, i;
+	string_t *cache_key;
+	bool casemap;
+	pool_t pool;
+
+	if (sieve_comparator_is(cmp, i_octet_comparator))
+		casemap = FALSE;
+	else if (sieve_comparator_is(cmp, i_ascii_casemap_comparator))
+		casemap = TRUE;
+	else
+		return NULL;
+
+	keys = array_get(key_array, &count);
+
+	/* Compose cache key */
+	cache_key = t_str_new(256);
+	str_printfa(cache_key, "keyset:%d:%d:", type, (casemap ? 1 : 0));
+	for (i = 0; i < count; i++) {
+		if (memchr(keys[i].data, '\0', keys[i].size) != NULL) {
+			/* Cannot be cached */
+			cache_key = NULL;
+			break;
+		}
+		str_printfa(cache_key, "%zu:", keys[i].size);
+		str_append_data(cache_key, keys[i].data, keys[i].size);
+	}
+
+	pool = NULL;
+	if (sbin != NULL && cache_key != NULL) {
+		kset = sieve_binary_runtime_cache_lookup(
+			sbin, str_c(cache_key));
+		if (kset != NULL)
+			return kset;
+		pool = sieve_binary_runtime_cache_pool(sbin);
+	}
+	if (pool == NULL) {
+		/* Not cached; only used for this match */
+		return sieve_match_keyset_create(mctx->pool, type, casemap,
+						 keys, count);
+	}
+
+	kset = sieve_match_keyset_create(pool, type, casemap, keys, count);
+	sieve_binary_runtime_cache_insert(sbin, str_c(cache_key), kset);
+	return kset;
+}
+
+/*
+ * Match type implementation
+ */
+
+void sieve_match_keyset_match_init(struct sieve_match_context *mctx,
+				   enum sieve_match_keyset_type type)
+{
+	struct sieve_match_keyset_context *ctx;
+
+	ctx = p_new(mctx->pool, struct sieve_match_keyset_context, 1);
+	ctx->type = type;
+	p_array_init(&ctx->keys, mctx->pool, 16);
+
+	mctx->data = ctx;
+}
+
+static int
+sieve_match_keyset_read_keys(struct sieve_match_context *mctx,
+			     struct sieve_stringlist *key_list)
+{
+	struct sieve_match_keyset_context *ctx = mctx->data;
+	string_t *key_item = NULL;
+	int ret;
+
+	while ((ret = sieve_stringlist_next_item(key_list, &key_item)) > 0) {
+		struct sieve_match_keyset_key *key;
+
+		key = array_append_space(&ctx->keys);
+		key->data = p_memdup(mctx->pool, str_c(key_item),
+				     str_len(key_item) + 1);
+		key->size = str_len(key_item);
+	}
+	if (ret < 0) {
+		mctx->exec_status = key_list->exec_status;
+		return -1;
+	}
+
+	/* The key list is the same for all values matched with this
+	   context. */
+	ctx->keys_read = TRUE;
+	return 0;
+}
+
+int sieve_match_keyset_match_keys(struct sieve_match_context *mctx,
+				  const char *val, size_t val_size,
+				  struct sieve_stringlist *key_list)
+{
+	struct sieve_match_keyset_context *ctx = mctx->data;
+	const struct sieve_match_type *mcht = mctx->match_type;
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	const struct sieve_match_keyset_key *keys;
+	unsigned int count, i;
+	int match;
+
+	if (!ctx->keys_read) {
+		if (sieve_match_keyset_read_keys(mctx, key_list) < 0)
+			return -1;
+
+		/* Traced matching reports the result for each key */
+		if (!mctx->trace)
+			ctx->kset = sieve_match_keyset_get(mctx, ctx->type,
+							   &ctx->keys);
+	}
+
+	if (ctx->kset != NULL) {
+		switch (ctx->kset->type) {
+		case SIEVE_MATCH_KEYSET_IS:
+			return sieve_match_keyset_is_match(
+				ctx->kset, val, val_size);
+		case SIEVE_MATCH_KEYSET_CONTAINS:
+			return sieve_match_keyset_contains_match(
+				ctx->kset, val, val_size);
+		}
+		i_unreached();
+	}
+
+	/* Match each key in turn */
+	keys = array_get(&ctx->keys, &count);
+	match = 0;
+	for (i = 0; match == 0 && i < count; i++) T_BEGIN {
+		const char *key = (const char *)keys[i].data;
+
+		match = mcht->def->match_key(mctx, val, val_size,
+					     key, keys[i].size);
+		if (mctx->trace) {
+			sieve_runtime_trace(renv, 0, "with key '%s' => %d",
+					    str_sanitize(key, 80), match);
+		}
+	} T_END;
+	return match;
+}
+
+/*
+ * Streamed matching
+ */
+
+int sieve_match_keyset_stream_init(struct sieve_match_context *mctx,
+				   struct sieve_stringlist *key_list)
+{
+	struct sieve_match_keyset_context *ctx = mctx->data;
+
+	if (ctx->type != SIEVE_MATCH_KEYSET_CONTAINS)
+		return 0;
+
+	if (!ctx->keys_read) {
+		if (sieve_match_keyset_read_keys(mctx, key_list) < 0)
+			return -1;
+		ctx->kset = sieve_match_keyset_get(mctx, ctx->type,
+						   &ctx->keys);
+	}
+	return (ctx->kset != NULL ? 1 : 0);
+}
+
+int sieve_match_keyset_stream_begin(struct sieve_match_context *mctx)
+{
+	struct sieve_match_keyset_context *ctx = mctx->data;
+
+	i_assert(ctx->kset != NULL);
+	ctx->stream_state = 0;
+
+	/* Empty key matches anything */
+	return (ctx->kset->states[0].match ? 1 : 0);
+}
+
+int sieve_match_keyset_stream_more(struct sieve_match_context *mctx,
+				   const char *data, size_t size)
+{
+	struct sieve_match_keyset_context *ctx = mctx->data;
+
+	i_assert(ctx->kset != NULL);
+	return sieve_match_keyset_contains_feed(ctx->kset, &ctx->stream_state,
+						data, size);
+}
@@ -0,0 +1,42 @@
+#ifndef SIEVE_MATCH_KEYSET_H
+#define SIEVE_MATCH_KEYSET_H
+
+#include "sieve-common.h"
+
+/*
+ * Match key set
+ */
+
+/* A key set matches a value against the whole key list at once, rather than
+   matching the value against each key in turn. For ':is' the key set is a
+   sorted array of the keys and for ':contains' it is an Aho-Corasick automaton
+   that finds all keys in a single pass over the value. Only the i;octet and
+   i;ascii-casemap comparators are supported; for other comparators (and when
+   matching is traced) the match type's match_key() is used for each key.
+
+   Key sets are cached with the binary, so that constant key lists are only
+   processed once while the binary is loaded.
+ */
+
+enum sieve_match_keyset_type {
+	SIEVE_MATCH_KEYSET_IS = 0,
+	SIEVE_MATCH_KEYSET_CONTAINS,
+};
+
+/* Match type implementation */
+
+void sieve_match_keyset_match_init(struct sieve_match_context *mctx,
+				   enum sieve_match_keyset_type type);
+int sieve_match_keyset_match_keys(struct sieve_match_context *mctx,
+				  const char *val, size_t val_size,
+				  struct sieve_stringlist *key_list);
+
+/* Streamed matching is supported for ':contains'; the automaton state is
+   retained between the blocks of a value. */
+int sieve_match_keyset_stream_init(struct sieve_match_context *mctx,
+				   struct sieve_stringlist *key_list);
+int sieve_match_keyset_stream_begin(struct sieve_match_context *mctx);
+int sieve_match_keyset_stream_more(struct sieve_match_context *mctx,
+				   const char *data, size_t size);
+
+#endif
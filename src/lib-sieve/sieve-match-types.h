@@ -65,6 +65,15 @@ struct sieve_match_type_def {
 			 const char *key, size_t key_size);
 
 	void (*match_deinit)(struct sieve_match_context *mctx);
+
+	/* Streamed matching (optional); values are provided in consecutive
+	   blocks, so that large values need not be kept in memory */
+
+	int (*match_stream_init)(struct sieve_match_context *mctx,
+				 struct sieve_stringlist *key_list);
+	int (*match_stream_begin)(struct sieve_match_context *mctx);
+	int (*match_stream_more)(struct sieve_match_context *mctx,
+				 const char *data, size_t size);
 };
 
 /*
@@ -126,6 +126,60 @@ int sieve_match_value(struct sieve_match_context *mctx,
 	return match;
 }
 
+static int
+sieve_match_stream_update(struct sieve_match_context *mctx, int match)
+{
+	if (mctx->match_status < 0 || match < 0)
+		mctx->match_status = -1;
+	else {
+		mctx->match_status = (mctx->match_status > match ?
+				      mctx->match_status : match);
+	}
+	return match;
+}
+
+bool sieve_match_stream_possible(const struct sieve_runtime_env *renv,
+				 const struct sieve_match_type *mcht)
+{
+	/* Traced matching reports each value, so it needs the values in
+	   one piece */
+	return (mcht->def != NULL && mcht->def->match_stream_init != NULL &&
+		!sieve_runtime_trace_active(renv, SIEVE_TRLVL_MATCHING));
+}
+
+int sieve_match_stream_init(struct sieve_match_context *mctx,
+			    struct sieve_stringlist *key_list)
+{
+	const struct sieve_match_type *mcht = mctx->match_type;
+	int ret;
+
+	if (mcht->def->match_stream_init == NULL || mctx->trace)
+		return 0;
+
+	sieve_stringlist_reset(key_list);
+	ret = mcht->def->match_stream_init(mctx, key_list);
+	if (ret < 0)
+		mctx->match_status = -1;
+	return ret;
+}
+
+int sieve_match_stream_begin(struct sieve_match_context *mctx)
+{
+	const struct sieve_match_type *mcht = mctx->match_type;
+
+	return sieve_match_stream_update(
+		mctx, mcht->def->match_stream_begin(mctx));
+}
+
+int sieve_match_stream_more(struct sieve_match_context *mctx,
+			    const char *data, size_t size)
+{
+	const struct sieve_match_type *mcht = mctx->match_type;
+
+	return sieve_match_stream_update(
+		mctx, mcht->def->match_stream_more(mctx, data, size));
+}
+
 int sieve_match_end(struct sieve_match_context **mctx, int *exec_status)
 {
 	const struct sieve_match_type *mcht = (*mctx)->match_type;
@@ -37,6 +37,22 @@ int sieve_match_value(struct sieve_match_context *mctx,
 		      struct sieve_stringlist *key_list);
 int sieve_match_end(struct sieve_match_context **mctx, int *exec_status);
 
+/* Streamed value matching: each value is provided in consecutive blocks.
+   Only ':contains' supports this for now. sieve_match_stream_possible()
+   checks whether the match type supports this at all and whether matching
+   is not traced; call it before sieve_match_begin(), so that no trace output
+   is produced for a streamed match that is then abandoned.
+   sieve_match_stream_init() returns 0 when the match type cannot do this for
+   the given key list and comparator; the values then need to be matched
+   using sieve_match_value() instead. */
+bool sieve_match_stream_possible(const struct sieve_runtime_env *renv,
+				 const struct sieve_match_type *mcht);
+int sieve_match_stream_init(struct sieve_match_context *mctx,
+			    struct sieve_stringlist *key_list);
+int sieve_match_stream_begin(struct sieve_match_context *mctx);
+int sieve_match_stream_more(struct sieve_match_context *mctx,
+			    const char *data, size_t size);
+
 /* Default matching operation */
 int sieve_match(const struct sieve_runtime_env *renv,
 		const struct sieve_match_type *mcht,
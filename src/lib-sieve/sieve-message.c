@@ -4,6 +4,7 @@
 #include "ioloop.h"
 #include "mempool.h"
 #include "array.h"
+#include "hash.h"
 #include "str.h"
 #include "str-sanitize.h"
 #include "istream.h"
@@ -25,6 +26,7 @@
 #include "edit-mail.h"
 
 #include "sieve-common.h"
+#include "sieve-settings.h"
 #include "sieve-stringlist.h"
 #include "sieve-error.h"
 #include "sieve-extensions.h"
@@ -76,8 +78,40 @@ struct sieve_message_part {
 	size_t decoded_body_size;
 	size_t text_body_size;
 
+	/* Location of a leaf part; the header offset is relative to the start
+	   of the message body, so that it remains valid when the message
+	   header is edited */
+	uoff_t hdr_offset, hdr_size, body_size;
+
 	bool have_body:1; /* there's the empty end-of-headers line */
 	bool epilogue:1;  /* this is a multipart epilogue */
+	bool have_location:1; /* body can be decoded on its own */
+};
+
+struct sieve_message_header_cache {
+	pool_t pool;
+	HASH_TABLE(const char *, const char *const *) headers;
+};
+
+/* Parsed message body; this is either private to the message context or
+   shared with other contexts for the same message */
+struct sieve_message_body {
+	pool_t pool;
+
+	ARRAY(struct sieve_message_part *) cached_body_parts;
+	buffer_t *raw_body;
+
+	bool have_part_headers:1;
+};
+
+struct sieve_message_shared {
+	pool_t pool;
+	int refcount;
+
+	/* Header cache for the original message */
+	struct sieve_message_header_cache header_cache;
+
+	struct sieve_message_body body;
 };
 
 struct sieve_message_version {
@@ -97,26 +131,69 @@ struct sieve_message_context {
 
 	struct mail_user *mail_user;
 	const struct sieve_message_data *msgdata;
+	struct sieve_message_shared *shared;
+
+	/* Message-ID created for a message that has none */
+	const char *new_msg_id;
 
 	/* Message versioning */
 
 	struct mail_user *raw_mail_user;
 	ARRAY(struct sieve_message_version) versions;
 
+	/* Header cache (for the current version) */
+
+	struct sieve_message_header_cache header_cache;
+
 	/* Context data for extensions */
 
 	ARRAY(void *) ext_contexts;
 
 	/* Body */
 
-	ARRAY(struct sieve_message_part *) cached_body_parts;
+	struct sieve_message_body *body;
 	ARRAY(struct sieve_message_part_data) return_body_parts;
-	buffer_t *raw_body;
 
 	bool edit_snapshot:1;
 	bool substitute_snapshot:1;
 };
 
+/*
+ * Header cache
+ */
+
+static void
+sieve_message_header_cache_clear(struct sieve_message_header_cache *hcache)
+{
+	if (hcache->pool == NULL)
+		return;
+
+	hash_table_clear(hcache->headers, TRUE);
+	p_clear(hcache->pool);
+}
+
+static void
+sieve_message_header_cache_free(struct sieve_message_header_cache *hcache)
+{
+	if (hcache->pool == NULL)
+		return;
+
+	hash_table_destroy(&hcache->headers);
+	pool_unref(&hcache->pool);
+}
+
+static void
+sieve_message_header_cache_invalidate(struct sieve_message_context *msgctx)
+{
+	sieve_message_header_cache_clear(&msgctx->header_cache);
+}
+
+static void
+sieve_message_header_cache_deinit(struct sieve_message_context *msgctx)
+{
+	sieve_message_header_cache_free(&msgctx->header_cache);
+}
+
 /*
  * Message versions
  */
@@ -124,6 +201,7 @@ struct sieve_message_context {
 static inline struct sieve_message_version *
 sieve_message_version_new(struct sieve_message_context *msgctx)
 {
+	sieve_message_header_cache_invalidate(msgctx);
 	return array_append_space(&msgctx->versions);
 }
 
@@ -156,6 +234,106 @@ sieve_message_version_free(struct sieve_message_version *version)
 	}
 }
 
+/*
+ * Shared message data
+ */
+
+struct sieve_message_shared *sieve_message_shared_create(void)
+{
+	struct sieve_message_shared *shared;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sieve_message_shared", 4096);
+	shared = p_new(pool, struct sieve_message_shared, 1);
+	shared->pool = pool;
+	shared->refcount = 1;
+
+	shared->body.pool = pool;
+	p_array_init(&shared->body.cached_body_parts, pool, 8);
+	return shared;
+}
+
+void sieve_message_shared_ref(struct sieve_message_shared *shared)
+{
+	i_assert(shared->refcount > 0);
+	shared->refcount++;
+}
+
+void sieve_message_shared_unref(struct sieve_message_shared **_shared)
+{
+	struct sieve_message_shared *shared = *_shared;
+
+	*_shared = NULL;
+	if (shared == NULL)
+		return;
+
+	i_assert(shared->refcount > 0);
+	if (--shared->refcount > 0)
+		return;
+
+	sieve_message_header_cache_free(&shared->header_cache);
+	pool_unref(&shared->pool);
+}
+
+static struct sieve_message_part *
+sieve_message_body_part_map(struct sieve_message_part *const *parts,
+			    struct sieve_message_part *const *new_parts,
+			    unsigned int count, struct sieve_message_part *part)
+{
+	unsigned int i;
+
+	if (part == NULL)
+		return NULL;
+	for (i = 0; i < count; i++) {
+		if (parts[i] == part)
+			return new_parts[i];
+	}
+	i_unreached();
+}
+
+/* Make a private copy of the shared body, so that parts parsed from a
+   modified message never end up in the shared data. */
+static void sieve_message_body_detach(struct sieve_message_context *msgctx)
+{
+	struct sieve_message_body *body;
+	struct sieve_message_part *const *parts, **new_parts;
+	pool_t pool = msgctx->context_pool;
+	unsigned int i, count;
+
+	if (msgctx->shared == NULL || msgctx->body != &msgctx->shared->body)
+		return;
+
+	body = p_new(pool, struct sieve_message_body, 1);
+	body->pool = pool;
+	body->raw_body = msgctx->body->raw_body;
+	body->have_part_headers = msgctx->body->have_part_headers;
+
+	parts = array_get(&msgctx->body->cached_body_parts, &count);
+	p_array_init(&body->cached_body_parts, pool, I_MAX(count, 8));
+	new_parts = p_new(pool, struct sieve_message_part *, I_MAX(count, 1));
+	for (i = 0; i < count; i++) {
+		new_parts[i] = p_new(pool, struct sieve_message_part, 1);
+		*new_parts[i] = *parts[i];
+	}
+	for (i = 0; i < count; i++) {
+		new_parts[i]->parent = sieve_message_body_part_map(
+			parts, new_parts, count, parts[i]->parent);
+		new_parts[i]->next = sieve_message_body_part_map(
+			parts, new_parts, count, parts[i]->next);
+		new_parts[i]->children = sieve_message_body_part_map(
+			parts, new_parts, count, parts[i]->children);
+		if (array_is_created(&parts[i]->headers)) {
+			p_array_init(&new_parts[i]->headers, pool,
+				     array_count(&parts[i]->headers));
+			array_append_array(&new_parts[i]->headers,
+					   &parts[i]->headers);
+		}
+		array_push_back(&body->cached_body_parts, &new_parts[i]);
+	}
+
+	msgctx->body = body;
+}
+
 /*
  * Message context object
  */
@@ -212,9 +390,12 @@ void sieve_message_context_unref(struct sieve_message_context **msgctx)
 		mail_user_unref(&(*msgctx)->raw_mail_user);
 
 	sieve_message_context_clear(*msgctx);
+	sieve_message_header_cache_deinit(*msgctx);
 
 	if ((*msgctx)->context_pool != NULL)
 		pool_unref(&((*msgctx)->context_pool));
+	if ((*msgctx)->shared != NULL)
+		sieve_message_shared_unref(&(*msgctx)->shared);
 
 	i_free(*msgctx);
 	*msgctx = NULL;
@@ -233,16 +414,34 @@ static void sieve_message_context_flush(struct sieve_message_context *msgctx)
 	p_array_init(&msgctx->ext_contexts, pool,
 		sieve_extensions_get_count(msgctx->svinst));
 
-	p_array_init(&msgctx->cached_body_parts, pool, 8);
+	if (msgctx->shared != NULL && array_count(&msgctx->versions) == 0) {
+		/* Original message; body is parsed only once */
+		msgctx->body = &msgctx->shared->body;
+	} else {
+		msgctx->body = p_new(pool, struct sieve_message_body, 1);
+		msgctx->body->pool = pool;
+		p_array_init(&msgctx->body->cached_body_parts, pool, 8);
+	}
 	p_array_init(&msgctx->return_body_parts, pool, 8);
-	msgctx->raw_body = NULL;
+
+	sieve_message_header_cache_invalidate(msgctx);
 }
 
 void sieve_message_context_reset(struct sieve_message_context *msgctx)
 {
 	sieve_message_context_clear(msgctx);
 
+	/* The message data may now refer to a different message */
+	if (msgctx->shared != msgctx->msgdata->shared) {
+		if (msgctx->shared != NULL)
+			sieve_message_shared_unref(&msgctx->shared);
+		msgctx->shared = msgctx->msgdata->shared;
+		if (msgctx->shared != NULL)
+			sieve_message_shared_ref(msgctx->shared);
+	}
+
 	msgctx->pool = pool_alloconly_create("sieve_message_context", 1024);
+	msgctx->new_msg_id = NULL;
 
 	p_array_init(&msgctx->versions, msgctx->pool, 4);
 
@@ -260,6 +459,16 @@ void sieve_message_context_time(struct sieve_message_context *msgctx,
 	*time = msgctx->time;
 }
 
+const char *
+sieve_message_context_get_new_id(struct sieve_message_context *msgctx)
+{
+	if (msgctx->new_msg_id == NULL) {
+		msgctx->new_msg_id = p_strdup(
+			msgctx->pool, sieve_message_get_new_id(msgctx->svinst));
+	}
+	return msgctx->new_msg_id;
+}
+
 /* Extension support */
 
 void sieve_message_context_extension_set(struct sieve_message_context *msgctx,
@@ -407,6 +616,10 @@ struct edit_mail *sieve_message_edit(struct sieve_message_context *msgctx)
 
 	version = sieve_message_version_get(msgctx);
 
+	/* The caller is about to modify the message */
+	sieve_message_header_cache_invalidate(msgctx);
+	sieve_message_body_detach(msgctx);
+
 	if (version->edit_mail == NULL) {
 		version->edit_mail = edit_mail_wrap(
 			(version->mail == NULL ?
@@ -475,23 +688,70 @@ sieve_message_header_list_create(const struct sieve_runtime_env *renv,
 }
 
 // NOTE: get rid of this once we have a proper Sieve string type
-static inline string_t *_header_right_trim(const char *raw)
+static inline const char *_header_right_trim(pool_t pool, const char *raw)
 {
-	string_t *result;
 	const char *p, *pend;
 
 	pend = raw + strlen(raw);
-	if (raw == pend) {
-		result = t_str_new(1);
-	} else {
-		for (p = pend-1; p >= raw; p--) {
-			if (*p != ' ' && *p != '\t')
-				break;
-		}
-		result = t_str_new(p - raw + 1);
-		str_append_data(result, raw, p - raw + 1);
+	for (p = pend; p > raw; p--) {
+		if (p[-1] != ' ' && p[-1] != '\t')
+			break;
 	}
-	return result;
+	return p_strdup_until(pool, raw, p);
+}
+
+/* Scripts commonly test the same few headers (From, To, Subject, ...) in many
+   different places. The header values are therefore fetched and trimmed only
+   once for each message version; the cache is invalidated once the message is
+   modified or substituted. */
+
+static int
+sieve_message_header_cache_get(struct sieve_message_context *msgctx,
+			       struct mail *mail, const char *field_name,
+			       bool mime_decode,
+			       const char *const **values_r)
+{
+	const char *key = t_strconcat((mime_decode ? "1:" : "0:"),
+				      field_name, NULL);
+	struct sieve_message_header_cache *hcache = &msgctx->header_cache;
+	const char *const *headers;
+	const char **values;
+	unsigned int count, i;
+	int ret;
+
+	/* The original message is shared with other contexts */
+	if (msgctx->shared != NULL && mail == msgctx->msgdata->mail)
+		hcache = &msgctx->shared->header_cache;
+
+	if (hcache->pool == NULL) {
+		hcache->pool = pool_alloconly_create(
+			"sieve_message_header_cache", 1024);
+		hash_table_create(&hcache->headers, default_pool, 0,
+				  strcase_hash, strcasecmp);
+	}
+
+	*values_r = hash_table_lookup(hcache->headers, key);
+	if (*values_r != NULL)
+		return ((*values_r)[0] == NULL ? 0 : 1);
+
+	/* Fetch all matching headers from the e-mail */
+	if (mime_decode)
+		ret = mail_get_headers_utf8(mail, field_name, &headers);
+	else
+		ret = mail_get_headers(mail, field_name, &headers);
+	if (ret < 0)
+		return -1;
+
+	i_assert(headers != NULL);
+	count = (ret == 0 ? 0 : str_array_length(headers));
+	values = p_new(hcache->pool, const char *, count + 1);
+	for (i = 0; i < count; i++)
+		values[i] = _header_right_trim(hcache->pool, headers[i]);
+
+	hash_table_insert(hcache->headers, p_strdup(hcache->pool, key),
+			  values);
+	*values_r = values;
+	return (count == 0 ? 0 : 1);
 }
 
 /* String list implementation */
@@ -504,6 +764,7 @@ sieve_message_header_list_next_item(struct sieve_header_list *_hdrlist,
 		(struct sieve_message_header_list *)_hdrlist;
 	const struct sieve_runtime_env *renv = _hdrlist->strlist.runenv;
 	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	const char *value;
 
 	if (name_r != NULL)
 		*name_r = NULL;
@@ -537,14 +798,9 @@ sieve_message_header_list_next_item(struct sieve_header_list *_hdrlist,
 		}
 
 		/* Fetch all matching headers from the e-mail */
-		if (hdrlist->mime_decode) {
-			ret = mail_get_headers_utf8(mail, str_c(hdr_item),
-						    &hdrlist->headers);
-		} else {
-			ret = mail_get_headers(mail, str_c(hdr_item),
-					       &hdrlist->headers);
-		}
-
+		ret = sieve_message_header_cache_get(
+			renv->msgctx, mail, str_c(hdr_item),
+			hdrlist->mime_decode, &hdrlist->headers);
 		if (ret < 0) {
 			_hdrlist->strlist.exec_status =
 				sieve_runtime_mail_error(
@@ -564,8 +820,8 @@ sieve_message_header_list_next_item(struct sieve_header_list *_hdrlist,
 	/* Return next item */
 	if (name_r != NULL)
 		*name_r = hdrlist->header_name;
-	*value_r = _header_right_trim(
-		hdrlist->headers[hdrlist->headers_index++]);
+	value = hdrlist->headers[hdrlist->headers_index++];
+	*value_r = t_str_new_const(value, strlen(value));
 	return 1;
 }
 
@@ -840,26 +1096,6 @@ int sieve_message_part_get_first_header(struct sieve_message_part *mpart,
 	return 0;
 }
 
-void sieve_message_part_get_data(struct sieve_message_part *mpart,
-				 struct sieve_message_part_data *data,
-				 bool text)
-{
-	i_zero(data);
-	data->content_type = mpart->content_type;
-	data->content_disposition = mpart->content_disposition;
-
-	if (!text) {
-		data->content = mpart->decoded_body;
-		data->size = mpart->decoded_body_size;
-	} else if (mpart->children != NULL) {
-		data->content = "";
-		data->size = 0;
-	} else {
-		data->content = mpart->text_body;
-		data->size = mpart->text_body_size;
-	}
-}
-
 /*
  * Message body
  */
@@ -926,7 +1162,7 @@ sieve_message_body_get_return_parts(const struct sieve_runtime_env *renv,
 	struct sieve_message_part_data *return_part;
 
 	/* Check whether any body parts are cached already */
-	body_parts = array_get(&msgctx->cached_body_parts, &count);
+	body_parts = array_get(&msgctx->body->cached_body_parts, &count);
 	if (count == 0)
 		return FALSE;
 
@@ -978,7 +1214,7 @@ sieve_message_part_save(const struct sieve_runtime_env *renv, buffer_t *buf,
 			struct sieve_message_part *body_part, bool extract_text)
 {
 	struct sieve_message_context *msgctx = renv->msgctx;
-	pool_t pool = msgctx->context_pool;
+	pool_t pool = msgctx->body->pool;
 	buffer_t *result_buf, *text_buf = NULL;
 	char *part_data;
 	size_t part_size;
@@ -1077,16 +1313,230 @@ _parse_content_disposition(const struct message_header_line *hdr)
 	return str_c(content_disp);
 }
 
+/* sieve_message_part_decode():
+ *   Decode the body of a single (leaf) part on demand. The part header is
+ *   parsed once more to determine the transfer encoding and charset.
+ */
+static int
+sieve_message_part_decode(const struct sieve_runtime_env *renv,
+			  struct sieve_message_part *body_part,
+			  bool extract_text)
+{
+	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	struct message_header_parser_ctx *hparser;
+	struct message_header_line *hdr;
+	struct message_decoder_context *decoder;
+	struct message_part mpart;
+	struct message_block block, decoded;
+	struct message_size hdr_size;
+	struct istream *input, *part_input;
+	const unsigned char *data;
+	uoff_t hdr_offset, hdr_psize;
+	size_t size;
+	buffer_t *buf;
+	int ret;
+
+	i_assert(body_part->have_location);
+
+	/* Get the message stream */
+	if (mail_get_stream(mail, &hdr_size, NULL, &input) < 0) {
+		return sieve_runtime_mail_error(
+			renv, mail, "failed to open input message");
+	}
+
+	/* The header of the root part is the (possibly edited) message
+	   header */
+	if (body_part->parent == NULL) {
+		hdr_offset = 0;
+		hdr_psize = hdr_size.physical_size;
+	} else {
+		hdr_offset = hdr_size.physical_size + body_part->hdr_offset;
+		hdr_psize = body_part->hdr_size;
+	}
+
+	i_zero(&mpart);
+	i_zero(&block);
+	block.part = &mpart;
+
+	decoder = message_decoder_init(NULL, 0);
+	buf = buffer_create_dynamic(default_pool, 4096);
+
+	/* Feed the part header to the decoder */
+	part_input = i_stream_create_range(input, hdr_offset, hdr_psize);
+	hparser = message_parse_header_init(
+		part_input, NULL, MESSAGE_HEADER_PARSER_FLAG_SKIP_INITIAL_LWSP);
+	while ((ret = message_parse_header_next(hparser, &hdr)) > 0) {
+		if (hdr->eoh)
+			continue;
+		block.hdr = hdr;
+		(void)message_decoder_decode_next_block(decoder, &block,
+							&decoded);
+	}
+	message_parse_header_deinit(&hparser);
+
+	if (part_input->stream_errno == 0) {
+		/* End of headers */
+		block.hdr = NULL;
+		block.data = NULL;
+		block.size = 0;
+		(void)message_decoder_decode_next_block(decoder, &block,
+							&decoded);
+
+		/* Decode the body */
+		i_stream_unref(&part_input);
+		part_input = i_stream_create_range(
+			input, hdr_offset + hdr_psize, body_part->body_size);
+		while ((ret = i_stream_read_more(part_input,
+						 &data, &size)) > 0) {
+			block.data = data;
+			block.size = size;
+			(void)message_decoder_decode_next_block(
+				decoder, &block, &decoded);
+			buffer_append(buf, decoded.data, decoded.size);
+			i_stream_skip(part_input, size);
+		}
+	}
+
+	if (part_input->stream_errno != 0) {
+		sieve_runtime_critical(renv, NULL,
+				       "failed to read input message",
+				       "read(%s) failed: %s",
+				       i_stream_get_name(part_input),
+				       i_stream_get_error(part_input));
+		ret = SIEVE_EXEC_TEMP_FAILURE;
+	} else {
+		sieve_message_part_save(renv, buf, body_part, extract_text);
+		ret = SIEVE_EXEC_OK;
+	}
+
+	i_stream_unref(&part_input);
+	message_decoder_deinit(&decoder);
+	buffer_free(&buf);
+	return ret;
+}
+
+/* sieve_message_parts_decode_missing():
+ *   Decode the requested body parts that are missing from the cache one by
+ *   one. This is only possible once the structure of the message is known
+ *   and only for leaf parts. Returns 0 when a full pass over the message is
+ *   needed instead.
+ */
+static int
+sieve_message_parts_decode_missing(const struct sieve_runtime_env *renv,
+				   const char *const *content_types,
+				   bool extract_text) ATTR_NULL(2)
+{
+	struct sieve_message_context *msgctx = renv->msgctx;
+	struct sieve_message_part *const *body_parts;
+	unsigned int i, count;
+	int ret;
+
+	body_parts = array_get(&msgctx->body->cached_body_parts, &count);
+	if (count == 0)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		const char *body = (extract_text ?
+				    body_parts[i]->text_body :
+				    body_parts[i]->decoded_body);
+
+		if (body != NULL || !body_parts[i]->have_body ||
+		    !_is_wanted_content_type(content_types,
+					     body_parts[i]->content_type))
+			continue;
+		if (!body_parts[i]->have_location)
+			return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		const char *body = (extract_text ?
+				    body_parts[i]->text_body :
+				    body_parts[i]->decoded_body);
+
+		if (body != NULL || !body_parts[i]->have_body ||
+		    !_is_wanted_content_type(content_types,
+					     body_parts[i]->content_type))
+			continue;
+
+		ret = sieve_message_part_decode(renv, body_parts[i],
+						extract_text);
+		if (ret <= 0)
+			return ret;
+	}
+	return SIEVE_EXEC_OK;
+}
+
+static void sieve_message_parts_clear_context(struct message_part *parts)
+{
+	for (; parts != NULL; parts = parts->next) {
+		parts->context = NULL;
+		sieve_message_parts_clear_context(parts->children);
+	}
+}
+
+/* Streamed body part content */
+
+struct sieve_message_body_stream {
+	const struct sieve_message_body_stream_callbacks *callbacks;
+	void *context;
+
+	/* The part that currently receives content */
+	struct sieve_message_part *part;
+
+	/* The consumer needs no more content */
+	bool done:1;
+};
+
+static void
+sieve_message_body_stream_part_begin(struct sieve_message_body_stream *stream,
+				     struct sieve_message_part *part)
+{
+	stream->part = NULL;
+	if (stream->done)
+		return;
+	if (!stream->callbacks->part_begin(stream->context)) {
+		stream->done = TRUE;
+		return;
+	}
+	stream->part = part;
+}
+
+static void
+sieve_message_body_stream_part_more(struct sieve_message_body_stream *stream,
+				    struct sieve_message_part *part,
+				    const void *data, size_t size)
+{
+	if (stream->done || stream->part != part || size == 0)
+		return;
+	if (!stream->callbacks->part_more(stream->context, data, size))
+		stream->done = TRUE;
+}
+
+static inline void
+sieve_message_part_append(struct sieve_message_body_stream *stream,
+			  buffer_t *buf, struct sieve_message_part *part,
+			  const void *data, size_t size)
+{
+	if (stream == NULL)
+		buffer_append(buf, data, size);
+	else
+		sieve_message_body_stream_part_more(stream, part, data, size);
+}
+
 /* sieve_message_parts_add_missing():
- *   Add requested message body parts to the cache that are missing.
+ *   Add requested message body parts to the cache that are missing. When a
+ *   stream is provided, the content of the requested body parts is passed to
+ *   its callbacks instead (only the part structure is cached then).
  */
 static int
 sieve_message_parts_add_missing(const struct sieve_runtime_env *renv,
 				const char *const *content_types,
-				bool extract_text, bool iter_all) ATTR_NULL(2)
+				bool extract_text, bool iter_all,
+				struct sieve_message_body_stream *stream)
+				ATTR_NULL(2, 5)
 {
 	struct sieve_message_context *msgctx = renv->msgctx;
-	pool_t pool = msgctx->context_pool;
+	pool_t pool = msgctx->body->pool;
 	struct mail *mail = sieve_message_get_mail(renv->msgctx);
 	struct message_parser_settings mparser_set = {
 		.hdr_flags = MESSAGE_HEADER_PARSER_FLAG_SKIP_INITIAL_LWSP,
@@ -1100,15 +1550,32 @@ sieve_message_parts_add_missing(const struct sieve_runtime_env *renv,
 	struct message_part *mparts, *prev_mpart = NULL;
 	buffer_t *buf;
 	struct istream *input;
+	uoff_t root_hdr_size;
 	unsigned int idx = 0;
 	bool save_body = FALSE, have_all;
 	string_t *hdr_content = NULL;
+	const char *error;
+	int ret;
 
-	/* First check whether any are missing */
-	if (!iter_all && sieve_message_body_get_return_parts(
-		renv, content_types, extract_text)) {
-		/* Cache hit; all are present */
-		return SIEVE_EXEC_OK;
+	if (!iter_all && stream == NULL) {
+		/* First check whether any are missing */
+		if (sieve_message_body_get_return_parts(
+			renv, content_types, extract_text)) {
+			/* Cache hit; all are present */
+			return SIEVE_EXEC_OK;
+		}
+
+		/* Decode the missing parts individually if possible */
+		ret = sieve_message_parts_decode_missing(
+			renv, content_types, extract_text);
+		if (ret != 0) {
+			if (ret > 0) {
+				have_all = sieve_message_body_get_return_parts(
+					renv, content_types, extract_text);
+				i_assert(have_all);
+			}
+			return ret;
+		}
 	}
 
 	/* Get the message stream */
@@ -1135,11 +1602,11 @@ sieve_message_parts_add_missing(const struct sieve_runtime_env *renv,
 	/* Initialize body decoder */
 	decoder = message_decoder_init(NULL, 0);
 
-	// FIXME: currently not tested with edit-mail.
-		//parser = message_parser_init_from_parts(parts, input,
-		// hparser_flags, mparser_flags);
-	parser = message_parser_init(pool_datastack_create(),
-				     input, &mparser_set);
+	/* Parse the message using the known MIME structure; the context of
+	   each part refers to its sieve_message_part during the parse. */
+	root_hdr_size = mparts->header_size.physical_size;
+	sieve_message_parts_clear_context(mparts);
+	parser = message_parser_init_from_parts(mparts, input, &mparser_set);
 	while (message_parser_parse_next_block(parser, &block) > 0) {
 		struct sieve_message_part **body_part_idx;
 		struct message_header_line *hdr = block.hdr;
@@ -1157,7 +1624,7 @@ sieve_message_parts_add_missing(const struct sieve_runtime_env *renv,
 				    strcmp(body_part->content_type,
 					   "message/rfc822") == 0) {
 					message_rfc822 = TRUE;
-				} else if (save_body) {
+				} else if (save_body && stream == NULL) {
 					sieve_message_part_save(
 						renv, buf, body_part,
 						extract_text);
@@ -1173,9 +1640,13 @@ sieve_message_parts_add_missing(const struct sieve_runtime_env *renv,
 				}
 			}
 
+			/* Content that follows belongs to the next part */
+			if (stream != NULL && !message_rfc822)
+				stream->part = NULL;
+
 			/* Start processing next part */
 			body_part_idx = array_idx_get_space(
-				&msgctx->cached_body_parts, idx);
+				&msgctx->body->cached_body_parts, idx);
 			if (*body_part_idx == NULL) {
 				*body_part_idx = p_new(
 					pool, struct sieve_message_part, 1);
@@ -1196,10 +1667,12 @@ sieve_message_parts_add_missing(const struct sieve_runtime_env *renv,
 				body_part->content_type = epipart->content_type;
 				body_part->have_body = TRUE;
 				body_part->epilogue = TRUE;
-				save_body = iter_all ||
-					_is_wanted_content_type(content_types,
-								body_part->content_type);
-
+				save_body = _is_wanted_content_type(
+					content_types, body_part->content_type);
+				if (stream != NULL && save_body) {
+					sieve_message_body_stream_part_begin(
+						stream, body_part);
+				}
 			} else {
 				struct sieve_message_part *parent = NULL;
 
@@ -1212,6 +1685,21 @@ sieve_message_parts_add_missing(const struct sieve_runtime_env *renv,
 				/* new part */
 				block.part->context = body_part;
 
+				/* Record the location of leaf parts */
+				if ((block.part->flags &
+				     (MESSAGE_PART_FLAG_MULTIPART |
+				      MESSAGE_PART_FLAG_MESSAGE_RFC822)) == 0) {
+					body_part->hdr_offset =
+						(parent == NULL ? 0 :
+						 block.part->physical_pos -
+						 root_hdr_size);
+					body_part->hdr_size = block.part->
+						header_size.physical_size;
+					body_part->body_size = block.part->
+						body_size.physical_size;
+					body_part->have_location = TRUE;
+				}
+
 				if (last_part != NULL) {
 					i_assert(parent != NULL);
 					if (last_part->parent == parent) {
@@ -1235,7 +1723,7 @@ sieve_message_parts_add_missing(const struct sieve_runtime_env *renv,
 			if (message_rfc822) {
 				i_assert(idx > 0);
 				body_part_idx = array_idx_modifiable(
-					&msgctx->cached_body_parts, idx-1);
+					&msgctx->body->cached_body_parts, idx-1);
 				header_part = *body_part_idx;
 			} else {
 				header_part = NULL;
@@ -1263,17 +1751,23 @@ sieve_message_parts_add_missing(const struct sieve_runtime_env *renv,
 			if (hdr == NULL) {
 				/* Save headers for message/rfc822 part */
 				if (header_part != NULL) {
-					sieve_message_part_save(renv, buf,
-								header_part,
-								FALSE);
+					if (stream == NULL) {
+						sieve_message_part_save(
+							renv, buf, header_part,
+							FALSE);
+					}
 					header_part = NULL;
 				}
 
 				/* Save bodies only if we have a wanted content
 				   type */
-				save_body = iter_all ||
-					_is_wanted_content_type(content_types,
-								body_part->content_type);
+				save_body = _is_wanted_content_type(
+					content_types, body_part->content_type);
+				if (stream != NULL && save_body &&
+				    body_part->have_body) {
+					sieve_message_body_stream_part_begin(
+						stream, body_part);
+				}
 				continue;
 			}
 
@@ -1286,18 +1780,25 @@ sieve_message_parts_add_missing(const struct sieve_runtime_env *renv,
 			} else if (header_part != NULL) {
 				/* Save message/rfc822 header as part content */
 				if (hdr->continued) {
-					buffer_append(buf, hdr->value,
-						      hdr->value_len);
+					sieve_message_part_append(
+						stream, buf, header_part,
+						hdr->value, hdr->value_len);
 				} else {
-					buffer_append(buf, hdr->name,
-						      hdr->name_len);
-					buffer_append(buf, hdr->middle,
-						      hdr->middle_len);
-					buffer_append(buf, hdr->value,
-						      hdr->value_len);
+					sieve_message_part_append(
+						stream, buf, header_part,
+						hdr->name, hdr->name_len);
+					sieve_message_part_append(
+						stream, buf, header_part,
+						hdr->middle, hdr->middle_len);
+					sieve_message_part_append(
+						stream, buf, header_part,
+						hdr->value, hdr->value_len);
+				}
+				if (!hdr->no_newline) {
+					sieve_message_part_append(
+						stream, buf, header_part,
+						"\r\n", 2);
 				}
-				if (!hdr->no_newline)
-					buffer_append(buf, "\r\n", 2);
 			}
 
 			if (strcasecmp(hdr->name, "Content-Type") == 0)
@@ -1396,10 +1897,11 @@ sieve_message_parts_add_missing(const struct sieve_runtime_env *renv,
 		}
 
 		/* Reading body */
-		if (save_body) {
+		if (save_body && (stream == NULL || stream->part == body_part)) {
 			(void)message_decoder_decode_next_block(
 				decoder, &block, &decoded);
-			buffer_append(buf, decoded.data, decoded.size);
+			sieve_message_part_append(stream, buf, body_part,
+						  decoded.data, decoded.size);
 		}
 	}
 
@@ -1408,10 +1910,15 @@ sieve_message_parts_add_missing(const struct sieve_runtime_env *renv,
 	i_assert(body_part != NULL);
 
 	/* Save last body part if necessary */
-	if (header_part != NULL)
-		sieve_message_part_save(renv, buf, header_part, FALSE);
-	else if (save_body)
-		sieve_message_part_save(renv, buf, body_part, extract_text);
+	if (stream == NULL) {
+		if (header_part != NULL) {
+			sieve_message_part_save(renv, buf, header_part,
+						FALSE);
+		} else if (save_body) {
+			sieve_message_part_save(renv, buf, body_part,
+						extract_text);
+		}
+	}
 
 	if (iter_all && !array_is_created(&body_part->headers) &&
 	    array_count(&headers) > 0) {
@@ -1421,15 +1928,19 @@ sieve_message_parts_add_missing(const struct sieve_runtime_env *renv,
 	}
 
 	/* Try to fill the return_body_parts array once more */
-	have_all = iter_all ||
+	have_all = iter_all || stream != NULL ||
 		sieve_message_body_get_return_parts(renv, content_types,
 						    extract_text);
 
 	/* This time, failure is a bug */
 	i_assert(have_all);
 
+	if (iter_all)
+		msgctx->body->have_part_headers = TRUE;
+
 	/* Cleanup */
-	(void)message_parser_deinit(&parser, &mparts);
+	ret = message_parser_deinit_from_parts(&parser, &mparts, &error);
+	sieve_message_parts_clear_context(mparts);
 	message_decoder_deinit(&decoder);
 	buffer_free(&buf);
 
@@ -1442,6 +1953,58 @@ sieve_message_parts_add_missing(const struct sieve_runtime_env *renv,
 				       i_stream_get_error(input));
 		return SIEVE_EXEC_TEMP_FAILURE;
 	}
+	if (ret < 0) {
+		/* The cached MIME structure does not match the message; it
+		   will be parsed again next time. */
+		mail_set_cache_corrupted(mail, MAIL_FETCH_MESSAGE_PARTS,
+					 error);
+		sieve_runtime_critical(renv, NULL,
+				       "failed to parse input message",
+				       "%s", error);
+		return SIEVE_EXEC_TEMP_FAILURE;
+	}
+	return SIEVE_EXEC_OK;
+}
+
+int sieve_message_part_get_data(const struct sieve_runtime_env *renv,
+				struct sieve_message_part *mpart,
+				struct sieve_message_part_data *data,
+				bool text)
+{
+	const char *body;
+	int ret;
+
+	i_zero(data);
+	data->content_type = mpart->content_type;
+	data->content_disposition = mpart->content_disposition;
+
+	if ((text && mpart->children != NULL) || !mpart->have_body) {
+		/* Part has no (textual) body */
+		data->content = "";
+		data->size = 0;
+		return SIEVE_EXEC_OK;
+	}
+
+	/* Body parts are only decoded once they are needed */
+	body = (text ? mpart->text_body : mpart->decoded_body);
+	if (body == NULL) {
+		if (mpart->have_location)
+			ret = sieve_message_part_decode(renv, mpart, text);
+		else T_BEGIN {
+			ret = sieve_message_parts_add_missing(
+				renv, NULL, text, FALSE, NULL);
+		} T_END;
+		if (ret <= 0)
+			return ret;
+	}
+
+	if (!text) {
+		data->content = mpart->decoded_body;
+		data->size = mpart->decoded_body_size;
+	} else {
+		data->content = mpart->text_body;
+		data->size = mpart->text_body_size;
+	}
 	return SIEVE_EXEC_OK;
 }
 
@@ -1455,7 +2018,7 @@ int sieve_message_body_get_content(const struct sieve_runtime_env *renv,
 	T_BEGIN {
 		/* Fill the return_body_parts array */
 		status = sieve_message_parts_add_missing(renv, content_types,
-							 FALSE, FALSE);
+							 FALSE, FALSE, NULL);
 	} T_END;
 
 	/* Check status */
@@ -1488,7 +2051,7 @@ int sieve_message_body_get_text(const struct sieve_runtime_env *renv,
 	T_BEGIN {
 		/* Fill the return_body_parts array */
 		status = sieve_message_parts_add_missing(
-			renv, _text_content_types, TRUE, FALSE);
+			renv, _text_content_types, TRUE, FALSE, NULL);
 	} T_END;
 
 	/* Check status */
@@ -1509,7 +2072,7 @@ int sieve_message_body_get_raw(const struct sieve_runtime_env *renv,
 	struct sieve_message_part_data *return_part;
 	buffer_t *buf;
 
-	if (msgctx->raw_body == NULL) {
+	if (msgctx->body->raw_body == NULL) {
 		struct mail *mail = sieve_message_get_mail(renv->msgctx);
 		struct istream *input;
 		struct message_size hdr_size, body_size;
@@ -1517,8 +2080,8 @@ int sieve_message_body_get_raw(const struct sieve_runtime_env *renv,
 		size_t size;
 		int ret;
 
-		msgctx->raw_body = buf =
-			buffer_create_dynamic(msgctx->context_pool, 1024*64);
+		msgctx->body->raw_body = buf =
+			buffer_create_dynamic(msgctx->body->pool, 1024*64);
 
 		/* Get stream for message */
  		if (mail_get_stream(mail, &hdr_size, &body_size, &input) < 0) {
@@ -1549,7 +2112,7 @@ int sieve_message_body_get_raw(const struct sieve_runtime_env *renv,
 		buffer_append_c(buf, '\0');
 
 	} else {
-		buf = msgctx->raw_body;
+		buf = msgctx->body->raw_body;
 	}
 
 	/* Clear result array */
@@ -1574,6 +2137,127 @@ int sieve_message_body_get_raw(const struct sieve_runtime_env *renv,
 	return SIEVE_EXEC_OK;
 }
 
+/*
+ * Streamed message body
+ */
+
+bool sieve_message_body_stream_wanted(const struct sieve_runtime_env *renv)
+{
+	struct sieve_message_context *msgctx = renv->msgctx;
+	uoff_t min_size = msgctx->svinst->set->body_stream_min_size;
+	struct mail *mail;
+	uoff_t size;
+
+	if (min_size == 0)
+		return FALSE;
+
+	mail = sieve_message_get_mail(msgctx);
+	if (mail_get_physical_size(mail, &size) < 0)
+		return FALSE;
+	return (size >= min_size);
+}
+
+static void
+sieve_message_body_stream_parts(struct sieve_message_body_stream *stream,
+				const struct sieve_message_part_data *parts)
+{
+	for (; parts->content != NULL && !stream->done; parts++) {
+		sieve_message_body_stream_part_begin(stream, NULL);
+		sieve_message_body_stream_part_more(stream, NULL,
+						    parts->content,
+						    parts->size);
+	}
+}
+
+int sieve_message_body_stream_content(
+	const struct sieve_runtime_env *renv, const char *const *content_types,
+	const struct sieve_message_body_stream_callbacks *callbacks,
+	void *context)
+{
+	struct sieve_message_context *msgctx = renv->msgctx;
+	struct sieve_message_body_stream stream;
+	int status;
+
+	i_zero(&stream);
+	stream.callbacks = callbacks;
+	stream.context = context;
+
+	/* Use the decoded body parts if these are all in memory already */
+	if (sieve_message_body_get_return_parts(renv, content_types, FALSE)) {
+		(void)array_append_space(&msgctx->return_body_parts);
+		sieve_message_body_stream_parts(
+			&stream, array_front(&msgctx->return_body_parts));
+		return SIEVE_EXEC_OK;
+	}
+
+	T_BEGIN {
+		status = sieve_message_parts_add_missing(renv, content_types,
+							 FALSE, FALSE, &stream);
+	} T_END;
+	return status;
+}
+
+int sieve_message_body_stream_raw(
+	const struct sieve_runtime_env *renv,
+	const struct sieve_message_body_stream_callbacks *callbacks,
+	void *context)
+{
+	struct sieve_message_context *msgctx = renv->msgctx;
+	struct sieve_message_body_stream stream;
+	struct mail *mail = sieve_message_get_mail(msgctx);
+	struct istream *input;
+	struct message_size hdr_size, body_size;
+	const unsigned char *data;
+	size_t size;
+	bool begun = FALSE;
+	int ret;
+
+	i_zero(&stream);
+	stream.callbacks = callbacks;
+	stream.context = context;
+
+	/* Use the raw body if it is in memory already */
+	if (msgctx->body->raw_body != NULL) {
+		if (msgctx->body->raw_body->used > 1) {
+			sieve_message_body_stream_part_begin(&stream, NULL);
+			sieve_message_body_stream_part_more(
+				&stream, NULL, msgctx->body->raw_body->data,
+				msgctx->body->raw_body->used - 1);
+		}
+		return SIEVE_EXEC_OK;
+	}
+
+	/* Get stream for message */
+	if (mail_get_stream(mail, &hdr_size, &body_size, &input) < 0) {
+		return sieve_runtime_mail_error(
+			renv, mail, "failed to open input message");
+	}
+
+	/* Skip stream to beginning of body */
+	i_stream_skip(input, hdr_size.physical_size);
+
+	/* Read raw message body; an empty body is not a body part */
+	while (!stream.done &&
+	       (ret = i_stream_read_more(input, &data, &size)) > 0) {
+		if (!begun) {
+			sieve_message_body_stream_part_begin(&stream, NULL);
+			begun = TRUE;
+		}
+		sieve_message_body_stream_part_more(&stream, NULL, data, size);
+		i_stream_skip(input, size);
+	}
+
+	if (!stream.done && ret < 0 && input->stream_errno != 0) {
+		sieve_runtime_critical(
+			renv, NULL, "failed to read input message",
+			"read(%s) failed: %s",
+			i_stream_get_name(input),
+			i_stream_get_error(input));
+		return SIEVE_EXEC_TEMP_FAILURE;
+	}
+	return SIEVE_EXEC_OK;
+}
+
 /*
  * Message part iterator
  */
@@ -1581,27 +2265,31 @@ int sieve_message_body_get_raw(const struct sieve_runtime_env *renv,
 int sieve_message_part_iter_init(struct sieve_message_part_iter *iter,
 				 const struct sieve_runtime_env *renv)
 {
+	static const char *const _no_content_types[] = { NULL };
 	struct sieve_message_context *msgctx = renv->msgctx;
 	struct sieve_message_part *const *parts;
 	unsigned int count;
 	int status;
 
-	T_BEGIN {
-		/* Fill the return_body_parts array */
-		status = sieve_message_parts_add_missing(
-			renv, NULL, TRUE, TRUE);
-	} T_END;
-
-	/* Check status */
-	if (status <= 0)
-		return status;
+	/* Collect the structure and headers of all parts; the bodies are
+	   decoded once these are needed. */
+	if (!msgctx->body->have_part_headers) {
+		T_BEGIN {
+			status = sieve_message_parts_add_missing(
+				renv, _no_content_types, FALSE, TRUE, NULL);
+		} T_END;
+
+		/* Check status */
+		if (status <= 0)
+			return status;
+	}
 
 	i_zero(iter);
 	iter->renv = renv;
 	iter->index = 0;
 	iter->offset = 0;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);
+	parts = array_get(&msgctx->body->cached_body_parts, &count);
 	if (count == 0)
 		iter->root = NULL;
 	else
@@ -1620,7 +2308,7 @@ void sieve_message_part_iter_subtree(struct sieve_message_part_iter *iter,
 
 	*subtree = *iter;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);
+	parts = array_get(&msgctx->body->cached_body_parts, &count);
 	if (subtree->index >= count)
 		subtree->root = NULL;
 	else
@@ -1638,7 +2326,7 @@ void sieve_message_part_iter_children(struct sieve_message_part_iter *iter,
 
 	*child = *iter;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);
+	parts = array_get(&msgctx->body->cached_body_parts, &count);
 	if ((child->index+1) >= count || parts[child->index]->children == NULL)
 		child->root = NULL;
 	else
@@ -1657,7 +2345,7 @@ sieve_message_part_iter_current(struct sieve_message_part_iter *iter)
 	if (iter->root == NULL)
 		return NULL;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);
+	parts = array_get(&msgctx->body->cached_body_parts, &count);
 	if (iter->index >= count)
 		return NULL;
 	do {
@@ -1677,7 +2365,7 @@ sieve_message_part_iter_next(struct sieve_message_part_iter *iter)
 	const struct sieve_runtime_env *renv = iter->renv;
 	struct sieve_message_context *msgctx = renv->msgctx;
 
-	if (iter->index >= array_count(&msgctx->cached_body_parts))
+	if (iter->index >= array_count(&msgctx->body->cached_body_parts))
 		return NULL;
 	iter->index++;
 
@@ -24,12 +24,20 @@ sieve_message_context_create(struct sieve_instance *svinst,
 void sieve_message_context_ref(struct sieve_message_context *msgctx);
 void sieve_message_context_unref(struct sieve_message_context **msgctx);
 
+/* Drop all message versions and the data parsed from them. The shared
+   message data (if any) is obtained from the message data again, so the
+   message can be substituted by changing the message data before calling
+   this. */
 void sieve_message_context_reset(struct sieve_message_context *msgctx);
 
 pool_t sieve_message_context_pool(
 	struct sieve_message_context *msgctx) ATTR_PURE;
 void sieve_message_context_time(struct sieve_message_context *msgctx,
 				struct timeval *time);
+/* Get a new Message-ID for a message that has none. This is created once, so
+   all messages sent for this message (e.g. redirects) carry the same ID. */
+const char *
+sieve_message_context_get_new_id(struct sieve_message_context *msgctx);
 
 /* Extension support */
 
@@ -222,9 +230,11 @@ int sieve_message_part_get_first_header(struct sieve_message_part *mpart,
 					const char *field,
 					const char **value_r);
 
-void sieve_message_part_get_data(struct sieve_message_part *mpart,
-				 struct sieve_message_part_data *data,
-				 bool text);
+/* Body parts are decoded when their data is first requested */
+int sieve_message_part_get_data(const struct sieve_runtime_env *renv,
+				struct sieve_message_part *mpart,
+				struct sieve_message_part_data *data,
+				bool text);
 
 /*
  * Message body
@@ -238,6 +248,31 @@ int sieve_message_body_get_text(const struct sieve_runtime_env *renv,
 int sieve_message_body_get_raw(const struct sieve_runtime_env *renv,
 			       struct sieve_message_part_data **parts_r);
 
+/* Streamed message body: rather than collecting the decoded body parts in
+   memory, their content is passed to the callbacks block by block while the
+   message is read. Both callbacks return FALSE once no more content is
+   needed. */
+
+struct sieve_message_body_stream_callbacks {
+	/* Start of the next body part */
+	bool (*part_begin)(void *context);
+	/* Next block of content for the current body part */
+	bool (*part_more)(void *context, const void *data, size_t size);
+};
+
+/* Returns TRUE when the message is large enough to read the body in a
+   streamed fashion (sieve_body_stream_min_size setting). */
+bool sieve_message_body_stream_wanted(const struct sieve_runtime_env *renv);
+
+int sieve_message_body_stream_content(
+	const struct sieve_runtime_env *renv, const char *const *content_types,
+	const struct sieve_message_body_stream_callbacks *callbacks,
+	void *context);
+int sieve_message_body_stream_raw(
+	const struct sieve_runtime_env *renv,
+	const struct sieve_message_body_stream_callbacks *callbacks,
+	void *context);
+
 /*
  * Message part iterator
  */
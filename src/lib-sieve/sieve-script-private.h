@@ -29,6 +29,7 @@ struct sieve_script_vfuncs {
 			   struct sieve_binary **sbin_r);
 	int (*binary_save)(struct sieve_script *script,
 			   struct sieve_binary *sbin, bool update);
+	void (*binary_mark_current)(struct sieve_script *script);
 	const char *(*binary_get_prefix)(struct sieve_script *script);
 
 	/* management */
@@ -792,6 +792,12 @@ int sieve_script_binary_save(struct sieve_script *script,
 	return 0;
 }
 
+void sieve_script_binary_mark_current(struct sieve_script *script)
+{
+	if (script->v.binary_mark_current != NULL)
+		script->v.binary_mark_current(script);
+}
+
 const char *sieve_script_binary_get_prefix(struct sieve_script *script)
 {
 	struct sieve_storage *storage = script->storage;
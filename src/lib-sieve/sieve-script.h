@@ -99,6 +99,10 @@ int sieve_script_binary_load(struct sieve_script *script,
 int sieve_script_binary_save(struct sieve_script *script,
 			     struct sieve_binary *sbin, bool update,
 			     enum sieve_error *error_code_r);
+/* Make sure the saved binary is considered up-to-date with the script. Only
+   use this when the binary was compiled from exactly the current script
+   content, e.g. right after uploading it. */
+void sieve_script_binary_mark_current(struct sieve_script *script);
 
 const char *sieve_script_binary_get_prefix(struct sieve_script *script);
 
@@ -28,6 +28,10 @@ static const struct setting_define sieve_setting_defines[] = {
 	DEF(UINT, max_redirects),
 	DEF(TIME, max_cpu_time),
 	DEF(TIME, resource_usage_timeout),
+	DEF(SIZE, binary_cache_size),
+	DEF(SIZE, body_stream_min_size),
+	DEF(BOOL, runtime_profile),
+	DEF(UINT, optimization_level),
 
 	DEF(STR, redirect_envelope_from),
 	DEF(UINT, redirect_duplicate_period),
@@ -59,6 +63,10 @@ const struct sieve_settings sieve_default_settings = {
 	.max_cpu_time = 30,
 
 	.resource_usage_timeout = (60 * 60),
+	.binary_cache_size = 0,
+	.body_stream_min_size = (1 << 20),
+	.runtime_profile = FALSE,
+	.optimization_level = SIEVE_MAX_OPTIMIZATION_LEVEL,
 	.redirect_envelope_from = "",
 	.redirect_duplicate_period = DEFAULT_REDIRECT_DUPLICATE_PERIOD,
 
@@ -111,6 +119,13 @@ sieve_settings_check(void *_set, pool_t pool, const char **error_r)
 	struct smtp_address *address = NULL;
 	const char *error;
 
+	if (set->optimization_level > SIEVE_MAX_OPTIMIZATION_LEVEL) {
+		*error_r = t_strdup_printf(
+			"sieve_optimization_level: Must be at most %u",
+			SIEVE_MAX_OPTIMIZATION_LEVEL);
+		return FALSE;
+	}
+
 	if (!sieve_address_source_parse(
 		pool, set->redirect_envelope_from,
 		&set->parsed.redirect_envelope_from)) {
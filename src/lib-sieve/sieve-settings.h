@@ -18,6 +18,10 @@ struct sieve_settings {
 	unsigned int max_redirects;
 	unsigned int max_cpu_time;
 	unsigned int resource_usage_timeout;
+	uoff_t binary_cache_size;
+	uoff_t body_stream_min_size;
+	bool runtime_profile;
+	unsigned int optimization_level;
 
 	const char* redirect_envelope_from;
 	unsigned int redirect_duplicate_period;
@@ -193,6 +193,7 @@ struct sieve_storage_save_context {
 
 	const char *scriptname, *active_scriptname;
 	struct sieve_script *scriptobject;
+	struct sieve_binary *binary;
 
 	struct istream *input;
 
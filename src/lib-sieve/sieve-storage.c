@@ -14,6 +14,7 @@
 
 #include "sieve-common.h"
 #include "sieve-error-private.h"
+#include "sieve-binary.h"
 
 #include "sieve-script-private.h"
 #include "sieve-storage-private.h"
@@ -1465,6 +1466,7 @@ static void sieve_storage_save_deinit(struct sieve_storage_save_context **_sctx)
 		return;
 
 	sieve_storage_save_cleanup(sctx);
+	sieve_binary_unref(&sctx->binary);
 	event_unref(&sctx->event);
 	pool_unref(&sctx->pool);
 }
@@ -1576,6 +1578,27 @@ void sieve_storage_save_set_mtime(struct sieve_storage_save_context *sctx,
 	sctx->mtime = mtime;
 }
 
+void sieve_storage_save_set_binary(struct sieve_storage_save_context *sctx,
+				   struct sieve_binary *sbin,
+				   struct sieve_error_handler *ehandler)
+{
+	i_assert(sctx->scriptname != NULL);
+
+	if (sieve_get_errors(ehandler) > 0 ||
+	    sieve_get_warnings(ehandler) > 0) {
+		e_debug(sctx->event, "Not saving binary: "
+			"Compilation reported %u errors and %u warnings",
+			sieve_get_errors(ehandler),
+			sieve_get_warnings(ehandler));
+		sieve_binary_unref(&sctx->binary);
+		return;
+	}
+
+	sieve_binary_ref(sbin);
+	sieve_binary_unref(&sctx->binary);
+	sctx->binary = sbin;
+}
+
 struct sieve_script *
 sieve_storage_save_get_tempscript(struct sieve_storage_save_context *sctx)
 {
@@ -1658,6 +1681,36 @@ sieve_storage_save_is_activating_default(
 	return ret;
 }
 
+static void
+sieve_storage_save_commit_binary(struct sieve_storage_save_context *sctx)
+{
+	struct sieve_storage *storage = sctx->storage;
+	struct sieve_script *script;
+	enum sieve_error error_code;
+
+	/* The binary was compiled from the temporary script; associate it with
+	   the committed one and store it alongside. Failure is not fatal: the
+	   script is then just compiled again when it is first used. */
+	if (sieve_storage_open_script(storage, sctx->scriptname,
+				      &script, &error_code) < 0) {
+		e_debug(sctx->event, "Not saving binary: "
+			"Failed to open committed script: %s",
+			storage->error);
+	} else {
+		sieve_binary_set_script(sctx->binary, script);
+		if (sieve_script_binary_save(script, sctx->binary, TRUE,
+					     &error_code) < 0) {
+			e_debug(sctx->event, "Failed to save binary: %s",
+				storage->error);
+		} else {
+			sieve_script_binary_mark_current(script);
+			e_debug(sctx->event, "Saved binary");
+		}
+		sieve_script_unref(&script);
+	}
+	sieve_storage_clear_error(storage);
+}
+
 int sieve_storage_save_commit(struct sieve_storage_save_context **_sctx)
 {
 	struct sieve_storage_save_context *sctx = *_sctx;
@@ -1723,6 +1776,9 @@ int sieve_storage_save_commit(struct sieve_storage_save_context **_sctx)
 			set_name("sieve_storage_save_finished");
 		e_debug(e->event(), "Finished saving script");
 
+		if (sctx->binary != NULL)
+			sieve_storage_save_commit_binary(sctx);
+
 		/* set INBOX mailbox attribute */
 		(void)sieve_storage_sync_script_save(storage, scriptname);
 	} else {
@@ -140,6 +140,15 @@ bool sieve_storage_save_will_activate(struct sieve_storage_save_context *sctx);
 
 void sieve_storage_save_set_mtime(struct sieve_storage_save_context *sctx,
 				  time_t mtime);
+/* Provide the binary compiled from the temporary script. Upon a successful
+   commit it is saved for the stored script, so that it does not need to be
+   compiled again when it is first used. The binary is ignored when the
+   compilation reported any error or warning to ehandler: leniency applied
+   while uploading a script is always reported as a warning and such a binary
+   must not be used for delivery. */
+void sieve_storage_save_set_binary(struct sieve_storage_save_context *sctx,
+				   struct sieve_binary *sbin,
+				   struct sieve_error_handler *ehandler);
 
 void sieve_storage_save_cancel(struct sieve_storage_save_context **sctx);
 
@@ -20,6 +20,7 @@ struct sieve_script;
 struct sieve_binary;
 
 struct sieve_message_data;
+struct sieve_message_shared;
 struct sieve_script_env;
 struct sieve_exec_status;
 struct sieve_trace_log;
@@ -151,6 +152,10 @@ struct sieve_message_data {
 		const struct smtp_address *rcpt_to;
 		const struct smtp_params_rcpt *rcpt_params;
 	} envelope;
+
+	/* Parsed message data shared with other executions for the same
+	   message (optional) */
+	struct sieve_message_shared *shared;
 };
 
 /*
@@ -170,6 +175,9 @@ enum sieve_execute_flags {
 	SIEVE_EXECUTE_FLAG_SKIP_RESPONSES = (1<<3),
 	/* Log result as info (when absent, only debug logging is performed) */
 	SIEVE_EXECUTE_FLAG_LOG_RESULT = (1<<4),
+	/* Collect a runtime profile for each executed operation (also enabled
+	   by the sieve_runtime_profile setting) */
+	SIEVE_EXECUTE_FLAG_PROFILE = (1<<5),
 };
 
 /*
@@ -205,6 +213,25 @@ enum sieve_duplicate_check_result {
 	SIEVE_DUPLICATE_CHECK_RESULT_TEMP_FAILURE = -2,
 };
 
+/*
+ * Runtime profile
+ */
+
+struct sieve_runtime_profile_item {
+	/* Script the operation belongs to */
+	const char *script_name;
+	/* Code address and source line (0 if unknown) of the operation */
+	size_t address;
+	unsigned int line;
+	const char *operation;
+
+	/* Number of times the operation was executed and the total time it
+	   took (including any included scripts it executed) */
+	unsigned int count;
+	uint64_t wall_usecs;
+	uint64_t cpu_usecs;
+};
+
 /*
  * Script invocation cause
  */
@@ -272,6 +299,11 @@ struct sieve_script_env {
 				    enum log_type log_type,
 				    const char *message);
 
+	/* Optional: receives the runtime profile of each executed script when
+	   profiling is enabled. The item is only valid during the call. */
+	void (*runtime_profile)(const struct sieve_script_env *senv,
+				const struct sieve_runtime_profile_item *item);
+
 	/* Execution status record */
 	struct sieve_exec_status *exec_status;
 
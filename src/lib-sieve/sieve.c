@@ -12,6 +12,7 @@
 #include "settings.h"
 #include "message-address.h"
 #include "mail-user.h"
+#include "mail-storage-settings.h"
 
 #include "sieve-extensions.h"
 #include "sieve-plugins.h"
@@ -29,6 +30,7 @@
 #include "sieve-generator.h"
 #include "sieve-interpreter.h"
 #include "sieve-binary-dumper.h"
+#include "sieve-header-names.h"
 
 #include "sieve.h"
 #include "sieve-common.h"
@@ -50,6 +52,28 @@ struct event_category event_category_sieve = {
  * Main Sieve library interface
  */
 
+static bool sieve_mmap_disabled(struct event *event)
+{
+	const struct mail_storage_settings *mail_set;
+	const char *error;
+	bool disabled;
+
+	/* Binary files can be modified in place by other processes or hosts,
+	   so don't map them where Dovecot wouldn't map its own files either.
+	 */
+	if (settings_get(event, &mail_storage_setting_parser_info,
+			 SETTINGS_GET_FLAG_FAKE_EXPAND,
+			 &mail_set, &error) < 0) {
+		e_debug(event, "Failed to get mail storage settings "
+			"(not using mmap() for binaries): %s", error);
+		return TRUE;
+	}
+	disabled = (mail_set->mmap_disable || mail_set->mail_nfs_storage ||
+		    mail_set->mail_nfs_index);
+	settings_free(mail_set);
+	return disabled;
+}
+
 int sieve_init(const struct sieve_environment *env,
 	       const struct sieve_callbacks *callbacks, void *context,
 	       bool debug, struct sieve_instance **svinst_r)
@@ -117,6 +141,7 @@ int sieve_init(const struct sieve_environment *env,
 	svinst->delivery_phase = env->delivery_phase;
 	svinst->event = event;
 	svinst->set = set;
+	svinst->mmap_disable = sieve_mmap_disabled(event);
 
 	/* Determine domain */
 	if (env->domainname != NULL && *(env->domainname) != '\0')
@@ -192,6 +217,12 @@ void sieve_deinit(struct sieve_instance **_svinst)
 	pool_unref(&(svinst)->pool);
 }
 
+void sieve_caches_deinit(void)
+{
+	sieve_binary_cache_deinit();
+	sieve_extensions_caches_deinit();
+}
+
 int sieve_settings_reload(struct sieve_instance *svinst)
 {
 	struct sieve_settings *set;
@@ -205,6 +236,7 @@ int sieve_settings_reload(struct sieve_instance *svinst)
 
 	settings_free(svinst->set);
 	svinst->set = set;
+	svinst->mmap_disable = sieve_mmap_disabled(svinst->event);
 	return 0;
 }
 
@@ -581,6 +613,12 @@ bool sieve_is_loaded(struct sieve_binary *sbin)
 	return sieve_binary_loaded(sbin);
 }
 
+void sieve_get_header_names(struct sieve_binary *sbin,
+			    ARRAY_TYPE(const_string) *field_names)
+{
+	sieve_header_names_get(sbin, field_names);
+}
+
 int sieve_save_as(struct sieve_binary *sbin, const char *bin_path, bool update,
 		  mode_t save_mode, enum sieve_error *error_code_r)
 {
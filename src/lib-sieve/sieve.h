@@ -21,6 +21,11 @@ int sieve_init(const struct sieve_environment *env,
 /* Free all memory allocated by the sieve engine. */
 void sieve_deinit(struct sieve_instance **_svinst);
 
+/* Free the caches that are shared by all Sieve instances in this process
+   (e.g. binaries and compiled regular expressions). Long-running processes that create
+   several instances must call this before unloading the Sieve library. */
+void sieve_caches_deinit(void);
+
 /* Reload main engine settings */
 int sieve_settings_reload(struct sieve_instance *svinst);
 
@@ -119,6 +124,11 @@ void sieve_close(struct sieve_binary **_sbin);
 const char *sieve_get_source(struct sieve_binary *sbin);
 /* Indicates whether the binary was loaded from a pre-compiled file. */
 bool sieve_is_loaded(struct sieve_binary *sbin);
+/* Appends the header field names the binary references literally to the
+   array (allocated from the data stack). This is only a hint for
+   prefetching; headers can also be accessed by name at runtime. */
+void sieve_get_header_names(struct sieve_binary *sbin,
+			    ARRAY_TYPE(const_string) *field_names);
 
 /*
  * Debugging
@@ -153,6 +163,18 @@ int sieve_execute(struct sieve_binary *sbin,
 		  struct sieve_error_handler *action_ehandler,
 		  enum sieve_execute_flags flags);
 
+/*
+ * Shared message data
+ */
+
+/* Creates an object that holds the parsed headers and body of an unmodified
+   message. Assigning it to sieve_message_data.shared for several executions
+   involving the same message (e.g. for multiple recipients) makes these
+   parse the message only once. */
+struct sieve_message_shared *sieve_message_shared_create(void);
+void sieve_message_shared_ref(struct sieve_message_shared *shared);
+void sieve_message_shared_unref(struct sieve_message_shared **_shared);
+
 /*
  * Multiscript support
  */
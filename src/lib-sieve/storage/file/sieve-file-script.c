@@ -19,6 +19,7 @@
 #include <ctype.h>
 #include <time.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 /*
  * Filename to name/name to filename
@@ -589,16 +590,81 @@ sieve_file_script_binary_load(struct sieve_script *script,
 						sbin_r);
 }
 
+static void
+sieve_file_script_binary_mark_current(struct sieve_script *script)
+{
+	struct sieve_file_script *fscript =
+		container_of(script, struct sieve_file_script, script);
+	const struct stat *sstat;
+	struct stat bstat;
+	struct timespec ts[2];
+
+	/* The binary is only used when it is strictly newer than the script.
+	   When it is saved right after the script (as happens at upload),
+	   both can end up with the same file timestamp. This is only called
+	   for a binary that was compiled from exactly the committed script, so
+	   it is safe to set its mtime just past that of the script. On file
+	   systems with one-second timestamps the extra nanosecond is lost and
+	   this has no effect; the binary is then just compiled again when it
+	   is first used. */
+	if (fscript->st.st_mtime > fscript->lnk_st.st_mtime ||
+	    (fscript->st.st_mtime == fscript->lnk_st.st_mtime &&
+	     ST_MTIME_NSEC(fscript->st) >= ST_MTIME_NSEC(fscript->lnk_st)))
+		sstat = &fscript->st;
+	else
+		sstat = &fscript->lnk_st;
+
+	if (stat(fscript->bin_path, &bstat) < 0) {
+		e_debug(script->event, "stat(%s) failed: %m",
+			fscript->bin_path);
+		return;
+	}
+	if (bstat.st_mtime > sstat->st_mtime ||
+	    (bstat.st_mtime == sstat->st_mtime &&
+	     ST_MTIME_NSEC(bstat) > ST_MTIME_NSEC(*sstat)))
+		return;
+
+	ts[0].tv_sec = 0;
+	ts[0].tv_nsec = UTIME_OMIT;
+	ts[1].tv_sec = sstat->st_mtime;
+	ts[1].tv_nsec = ST_MTIME_NSEC(*sstat) + 1;
+	if (ts[1].tv_nsec >= 1000000000) {
+		ts[1].tv_sec++;
+		ts[1].tv_nsec = 0;
+	}
+	if (utimensat(AT_FDCWD, fscript->bin_path, ts, 0) < 0) {
+		e_debug(script->event, "utimensat(%s) failed: %m",
+			fscript->bin_path);
+	}
+}
+
 static int
 sieve_file_script_binary_save(struct sieve_script *script,
 			      struct sieve_binary *sbin, bool update)
 {
 	struct sieve_file_script *fscript =
 		container_of(script, struct sieve_file_script, script);
+	struct sieve_file_storage *fstorage =
+		container_of(script->storage, struct sieve_file_storage,
+			     storage);
+	struct sieve_file_quota_index *qindex = NULL;
+	int ret;
 
-	return sieve_script_binary_save_default(
+	/* A binary stored next to the scripts modifies the script directory,
+	   which would otherwise invalidate the quota index */
+	if (script->storage->bin_path == NULL && fstorage->path != NULL &&
+	    null_strcmp(fscript->dir_path, fstorage->path) == 0)
+		qindex = sieve_file_storage_quota_index_lock(fstorage, NULL);
+
+	ret = sieve_script_binary_save_default(
 		script, sbin, fscript->bin_path, update,
 		(fscript->st.st_mode & 0777));
+
+	if (ret == 0)
+		sieve_file_storage_quota_index_update(&qindex, NULL, NULL);
+	else
+		sieve_file_storage_quota_index_unlock(&qindex);
+	return ret;
 }
 
 static const char *
@@ -641,13 +707,23 @@ static int sieve_file_storage_script_delete(struct sieve_script *script)
 {
 	struct sieve_file_script *fscript =
 		container_of(script, struct sieve_file_script, script);
+	struct sieve_file_storage *fstorage =
+		container_of(script->storage, struct sieve_file_storage,
+			     storage);
+	struct sieve_file_quota_index *qindex;
 	int ret = 0;
 
 	if (sieve_file_storage_pre_modify(script->storage) < 0)
 		return -1;
 
+	qindex = sieve_file_storage_quota_index_lock(fstorage,
+						     fscript->filename);
+
 	ret = unlink(fscript->path);
-	if (ret < 0) {
+	if (ret == 0) {
+		sieve_file_storage_quota_index_update(
+			&qindex, fscript->filename, NULL);
+	} else {
 		if (errno == ENOENT) {
 			sieve_script_set_error(script, SIEVE_ERROR_NOT_FOUND,
 					       "Sieve script does not exist.");
@@ -657,6 +733,7 @@ static int sieve_file_storage_script_delete(struct sieve_script *script)
 				"Performing unlink() failed on sieve file '%s': %m",
 				fscript->path);
 		}
+		sieve_file_storage_quota_index_unlock(&qindex);
 	}
 	return ret;
 }
@@ -750,12 +827,16 @@ sieve_file_storage_script_rename(struct sieve_script *script,
 	struct sieve_storage *storage = script->storage;
 	struct sieve_file_storage *fstorage =
 		container_of(storage, struct sieve_file_storage, storage);
+	struct sieve_file_quota_index *qindex;
 	const char *newpath, *newfile, *link_path;
 	int ret = 0;
 
 	if (sieve_file_storage_pre_modify(storage) < 0)
 		return -1;
 
+	qindex = sieve_file_storage_quota_index_lock(fstorage,
+						     fscript->filename);
+
 	T_BEGIN {
 		newfile = sieve_script_file_from_name(newname);
 		newpath = t_strconcat(fstorage->path, "/", newfile, NULL);
@@ -788,6 +869,10 @@ sieve_file_storage_script_rename(struct sieve_script *script,
 						"Failed to clean up after rename: "
 						"unlink(%s) failed: %m",
 						fscript->path);
+				} else {
+					sieve_file_storage_quota_index_update(
+						&qindex, fscript->filename,
+						newfile);
 				}
 
 				if (script->name != NULL && *script->name != '\0')
@@ -825,6 +910,7 @@ sieve_file_storage_script_rename(struct sieve_script *script,
 		}
 	} T_END;
 
+	sieve_file_storage_quota_index_unlock(&qindex);
 	return ret;
 }
 
@@ -918,6 +1004,7 @@ const struct sieve_script sieve_file_script = {
 		.binary_dump_metadata = sieve_file_script_binary_dump_metadata,
 		.binary_load = sieve_file_script_binary_load,
 		.binary_save = sieve_file_script_binary_save,
+		.binary_mark_current = sieve_file_script_binary_mark_current,
 		.binary_get_prefix = sieve_file_script_binary_get_prefix,
 
 		.rename = sieve_file_storage_script_rename,
@@ -1,7 +1,14 @@
 /* Copyright (c) Pigeonhole authors, see top-level COPYING file */
 
 #include "lib.h"
+#include "ioloop.h"
+#include "array.h"
 #include "str.h"
+#include "strnum.h"
+#include "strescape.h"
+#include "istream.h"
+#include "file-lock.h"
+#include "write-full.h"
 
 #include "sieve.h"
 #include "sieve-script.h"
@@ -14,18 +21,353 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-int sieve_file_storage_quota_havespace(struct sieve_storage *storage,
-				       const char *scriptname, size_t size,
-				       enum sieve_storage_quota *quota_r,
-				       uint64_t *limit_r)
+/* The size and modification time of every script are recorded in an index
+   file, so that quota checks don't need to list and stat() the whole script
+   directory. The index is only valid as long as the script directory has not
+   changed since it was written; the directory's mtime and ctime are recorded
+   for that purpose. It resides in the tmp/ directory, so that writing it does
+   not change the script directory itself. Once it is found to be invalid (or
+   missing), it is rebuilt by scanning the directory. Saving a script binary
+   in the script directory records the new directory stamp as well.
+
+   Rewriting a script file in place does not change the directory. Therefore,
+   the recorded entry of a script is compared to the actual file whenever the
+   storage replaces, deletes or renames that script or checks the quota for
+   replacing it. Such rewrites of other scripts are noticed once the index is
+   rebuilt, which happens at the latest SIEVE_FILE_QUOTA_INDEX_MAX_AGE seconds
+   after the last directory scan and always before a quota check fails. */
+
+#define SIEVE_FILE_QUOTA_INDEX_FNAME "dovecot.svquota"
+#define SIEVE_FILE_QUOTA_INDEX_LOCK_TIMEOUT 10
+#define SIEVE_FILE_QUOTA_INDEX_MAX_AGE (15*60)
+
+struct sieve_file_quota_entry {
+	const char *fname;
+	uoff_t size;
+	const char *mtime;
+};
+
+struct sieve_file_quota_index {
+	pool_t pool;
+	struct sieve_file_storage *fstorage;
+	const char *path;
+	int fd;
+	struct file_lock *lock;
+
+	const char *dir_stamp;
+	time_t scan_time;
+	ARRAY(struct sieve_file_quota_entry) entries;
+};
+
+static bool sieve_file_storage_quota_enabled(struct sieve_storage *storage)
 {
-	struct sieve_file_storage *fstorage =
-		container_of(storage, struct sieve_file_storage, storage);
+	return (storage->max_scripts != SET_UINT_UNLIMITED ||
+		storage->max_storage != SET_SIZE_UNLIMITED);
+}
+
+static int
+sieve_file_storage_quota_dir_stamp(struct sieve_file_storage *fstorage,
+				   const char **stamp_r)
+{
+	struct stat st;
+
+	if (stat(fstorage->path, &st) < 0) {
+		e_error(fstorage->storage.event,
+			"quota: stat(%s) failed: %m", fstorage->path);
+		return -1;
+	}
+
+	*stamp_r = t_strdup_printf("%ld.%09ld %ld.%09ld",
+				   (long)st.st_mtime, (long)ST_MTIME_NSEC(st),
+				   (long)st.st_ctime, (long)ST_CTIME_NSEC(st));
+	return 0;
+}
+
+static const char *sieve_file_storage_quota_mtime(const struct stat *st)
+{
+	return t_strdup_printf("%ld.%09ld",
+			       (long)st->st_mtime, (long)ST_MTIME_NSEC(*st));
+}
+
+static int
+sieve_file_storage_quota_stat(struct sieve_file_storage *fstorage,
+			      const char *fname, struct stat *st_r)
+{
+	const char *path;
+
+	path = t_strconcat(fstorage->path, "/", fname, NULL);
+	if (stat(path, st_r) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		e_warning(fstorage->storage.event,
+			  "quota: stat(%s) failed: %m", path);
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ * Quota index
+ */
+
+static struct sieve_file_quota_index *
+sieve_file_quota_index_alloc(struct sieve_file_storage *fstorage)
+{
+	struct sieve_file_quota_index *qindex;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sieve_file_quota_index", 1024);
+	qindex = p_new(pool, struct sieve_file_quota_index, 1);
+	qindex->pool = pool;
+	qindex->fstorage = fstorage;
+	qindex->fd = -1;
+	p_array_init(&qindex->entries, pool, 16);
+	return qindex;
+}
+
+static void
+sieve_file_quota_index_close(struct sieve_file_quota_index **_qindex)
+{
+	struct sieve_file_quota_index *qindex = *_qindex;
+
+	*_qindex = NULL;
+	if (qindex == NULL)
+		return;
+
+	file_lock_free(&qindex->lock);
+	i_close_fd(&qindex->fd);
+	pool_unref(&qindex->pool);
+}
+
+/* Open and lock the index file. Read-only access takes a shared lock, whereas
+   any other access takes an exclusive lock. */
+static struct sieve_file_quota_index *
+sieve_file_quota_index_open(struct sieve_file_storage *fstorage, int flags)
+{
+	struct sieve_storage *storage = &fstorage->storage;
+	struct sieve_file_quota_index *qindex;
+	struct file_lock_settings lock_set = {
+		.lock_method = FILE_LOCK_METHOD_FCNTL,
+	};
+	const char *error;
+	int lock_type;
+
+	qindex = sieve_file_quota_index_alloc(fstorage);
+	qindex->path = p_strconcat(qindex->pool, fstorage->path, "/tmp/",
+				   SIEVE_FILE_QUOTA_INDEX_FNAME, NULL);
+	qindex->fd = open(qindex->path, flags, fstorage->file_create_mode);
+	if (qindex->fd < 0) {
+		/* Without the index (or without tmp/ directory when creating
+		   it), the index is simply not used */
+		if (errno != ENOENT) {
+			e_error(storage->event,
+				"quota: open(%s) failed: %m", qindex->path);
+		}
+		sieve_file_quota_index_close(&qindex);
+		return NULL;
+	}
+
+	lock_type = ((flags & O_ACCMODE) == O_RDONLY ? F_RDLCK : F_WRLCK);
+	if (file_wait_lock(qindex->fd, qindex->path, lock_type, &lock_set,
+			   SIEVE_FILE_QUOTA_INDEX_LOCK_TIMEOUT,
+			   &qindex->lock, &error) <= 0) {
+		e_error(storage->event, "quota: %s", error);
+		sieve_file_quota_index_close(&qindex);
+		return NULL;
+	}
+	return qindex;
+}
+
+static const struct sieve_file_quota_entry *
+sieve_file_quota_index_find(struct sieve_file_quota_index *qindex,
+			    const char *fname, unsigned int *idx_r)
+{
+	const struct sieve_file_quota_entry *entries;
+	unsigned int count, i;
+
+	entries = array_get(&qindex->entries, &count);
+	for (i = 0; i < count; i++) {
+		if (strcmp(entries[i].fname, fname) == 0) {
+			if (idx_r != NULL)
+				*idx_r = i;
+			return &entries[i];
+		}
+	}
+	return NULL;
+}
+
+static void
+sieve_file_quota_index_remove(struct sieve_file_quota_index *qindex,
+			      const char *fname)
+{
+	unsigned int idx;
+
+	if (sieve_file_quota_index_find(qindex, fname, &idx) != NULL)
+		array_delete(&qindex->entries, idx, 1);
+}
+
+static void
+sieve_file_quota_index_add(struct sieve_file_quota_index *qindex,
+			   const char *fname, const struct stat *st)
+{
+	struct sieve_file_quota_entry *entry;
+
+	entry = array_append_space(&qindex->entries);
+	entry->fname = p_strdup(qindex->pool, fname);
+	if (st != NULL) {
+		entry->size = st->st_size;
+		entry->mtime = p_strdup(qindex->pool,
+					sieve_file_storage_quota_mtime(st));
+	} else {
+		entry->mtime = "";
+	}
+}
+
+static void
+sieve_file_quota_index_sum(struct sieve_file_quota_index *qindex,
+			   const char *skip_fname,
+			   uint64_t *count_r, uint64_t *bytes_r)
+{
+	const struct sieve_file_quota_entry *entry;
+
+	*count_r = *bytes_r = 0;
+	array_foreach(&qindex->entries, entry) {
+		if (skip_fname != NULL && strcmp(entry->fname, skip_fname) == 0)
+			continue;
+		*count_r += 1;
+		*bytes_r += entry->size;
+	}
+}
+
+static int
+sieve_file_quota_index_read(struct sieve_file_quota_index *qindex)
+{
+	struct sieve_storage *storage = &qindex->fstorage->storage;
+	struct istream *input;
+	const char *line, *const *args;
+	uoff_t size;
+	int ret = 1;
+
+	array_clear(&qindex->entries);
+
+	input = i_stream_create_fd(qindex->fd, SIZE_MAX);
+
+	/* <dir mtime> <dir ctime> TAB <scan time> */
+	line = i_stream_read_next_line(input);
+	if (line == NULL) {
+		ret = 0;
+	} else {
+		args = t_strsplit_tabescaped(line);
+		if (str_array_length(args) != 2 ||
+		    str_to_time(args[1], &qindex->scan_time) < 0)
+			ret = 0;
+		else
+			qindex->dir_stamp = p_strdup(qindex->pool, args[0]);
+	}
+
+	/* <file name> TAB <size> TAB <mtime> */
+	while (ret > 0 && (line = i_stream_read_next_line(input)) != NULL) {
+		struct sieve_file_quota_entry *entry;
+
+		args = t_strsplit_tabescaped(line);
+		if (str_array_length(args) != 3 ||
+		    str_to_uoff(args[1], &size) < 0) {
+			ret = 0;
+			break;
+		}
+
+		entry = array_append_space(&qindex->entries);
+		entry->fname = p_strdup(qindex->pool, args[0]);
+		entry->size = size;
+		entry->mtime = p_strdup(qindex->pool, args[2]);
+	}
+
+	if (input->stream_errno != 0) {
+		e_error(storage->event, "quota: read(%s) failed: %s",
+			qindex->path, i_stream_get_error(input));
+		ret = -1;
+	}
+	i_stream_unref(&input);
+	return ret;
+}
+
+static void
+sieve_file_quota_index_write(struct sieve_file_quota_index *qindex)
+{
+	struct sieve_storage *storage = &qindex->fstorage->storage;
+	const struct sieve_file_quota_entry *entry;
+	string_t *data;
+
+	i_assert(qindex->dir_stamp != NULL);
+
+	data = t_str_new(256);
+	str_append_tabescaped(data, qindex->dir_stamp);
+	str_printfa(data, "\t%ld\n", (long)qindex->scan_time);
+	array_foreach(&qindex->entries, entry) {
+		str_append_tabescaped(data, entry->fname);
+		str_printfa(data, "\t%"PRIuUOFF_T"\t", entry->size);
+		str_append_tabescaped(data, entry->mtime);
+		str_append_c(data, '\n');
+	}
+
+	if (pwrite_full(qindex->fd, str_data(data), str_len(data), 0) < 0 ||
+	    ftruncate(qindex->fd, str_len(data)) < 0) {
+		e_error(storage->event, "quota: write(%s) failed: %m",
+			qindex->path);
+	}
+}
+
+/* Check whether the recorded entry for the script file still matches the
+   file itself */
+static bool
+sieve_file_quota_index_entry_valid(struct sieve_file_quota_index *qindex,
+				   const char *fname)
+{
+	const struct sieve_file_quota_entry *entry;
+	struct stat st;
+	int ret;
+
+	entry = sieve_file_quota_index_find(qindex, fname, NULL);
+	ret = sieve_file_storage_quota_stat(qindex->fstorage, fname, &st);
+	if (ret <= 0)
+		return (ret == 0 && entry == NULL);
+	return (entry != NULL && entry->size == (uoff_t)st.st_size &&
+		strcmp(entry->mtime, sieve_file_storage_quota_mtime(&st)) == 0);
+}
+
+static bool
+sieve_file_quota_index_valid(struct sieve_file_quota_index *qindex,
+			     const char *fname)
+{
+	const char *dir_stamp;
+
+	if (sieve_file_quota_index_read(qindex) <= 0)
+		return FALSE;
+	if (sieve_file_storage_quota_dir_stamp(qindex->fstorage,
+					       &dir_stamp) < 0 ||
+	    strcmp(qindex->dir_stamp, dir_stamp) != 0)
+		return FALSE;
+	if (qindex->scan_time > ioloop_time ||
+	    (ioloop_time - qindex->scan_time) >= SIEVE_FILE_QUOTA_INDEX_MAX_AGE)
+		return FALSE;
+	return (fname == NULL ||
+		sieve_file_quota_index_entry_valid(qindex, fname));
+}
+
+/*
+ * Directory scan
+ */
+
+static int
+sieve_file_storage_quota_scan(struct sieve_file_quota_index *qindex)
+{
+	struct sieve_file_storage *fstorage = qindex->fstorage;
+	struct sieve_storage *storage = &fstorage->storage;
 	struct dirent *dp;
 	DIR *dirp;
-	uint64_t script_count = 1;
-	uint64_t script_storage = size;
-	int result = 1;
+	int result = 0;
+
+	array_clear(&qindex->entries);
 
 	/* Open the directory */
 	dirp = opendir(fstorage->path);
@@ -39,7 +381,7 @@ int sieve_file_storage_quota_havespace(struct sieve_storage *storage,
 	/* Scan all files */
 	for (;;) {
 		const char *name;
-		bool replaced = FALSE;
+		struct stat st;
 
 		/* Read next entry */
 		errno = 0;
@@ -70,54 +412,217 @@ int sieve_file_storage_quota_havespace(struct sieve_storage *storage,
 		    strcmp(fstorage->active_fname, dp->d_name) == 0)
 			continue;
 
-		if (strcmp(name, scriptname) == 0)
-			replaced = TRUE;
+		/* A script that cannot be stat()ed still counts */
+		if (sieve_file_storage_quota_stat(fstorage, dp->d_name,
+						  &st) <= 0)
+			sieve_file_quota_index_add(qindex, dp->d_name, NULL);
+		else
+			sieve_file_quota_index_add(qindex, dp->d_name, &st);
+	}
 
-		/* Check count quota if necessary */
-		if (storage->max_scripts != SET_UINT_UNLIMITED) {
-			if (!replaced) {
-				script_count++;
+	/* Close directory */
+	if (closedir(dirp) < 0) {
+		sieve_storage_set_critical(storage,
+					   "quota: closedir(%s) failed: %m",
+					   fstorage->path);
+	}
+	return result;
+}
 
-				if (script_count > storage->max_scripts) {
-					*quota_r = SIEVE_STORAGE_QUOTA_MAXSCRIPTS;
-					*limit_r = storage->max_scripts;
-					result = 0;
-					break;
-				}
-			}
+/*
+ * Index maintenance
+ */
+
+struct sieve_file_quota_index *
+sieve_file_storage_quota_index_lock(struct sieve_file_storage *fstorage,
+				    const char *fname)
+{
+	struct sieve_file_quota_index *qindex;
+	bool valid;
+
+	if (!sieve_file_storage_quota_enabled(&fstorage->storage))
+		return NULL;
+
+	/* The index is only updated when it exists; it is created by the next
+	   quota check otherwise */
+	qindex = sieve_file_quota_index_open(fstorage, O_RDWR);
+	if (qindex == NULL)
+		return NULL;
+
+	/* Only a valid index can be updated; otherwise, it is rebuilt by the
+	   next quota check. */
+	T_BEGIN {
+		valid = sieve_file_quota_index_valid(qindex, fname);
+	} T_END;
+	if (!valid)
+		sieve_file_quota_index_close(&qindex);
+	return qindex;
+}
+
+void sieve_file_storage_quota_index_update(
+	struct sieve_file_quota_index **_qindex,
+	const char *old_fname, const char *new_fname)
+{
+	struct sieve_file_quota_index *qindex = *_qindex;
+	const char *dir_stamp;
+	struct stat st;
+
+	if (qindex == NULL)
+		return;
+
+	T_BEGIN {
+		bool valid = TRUE;
+
+		if (old_fname != NULL)
+			sieve_file_quota_index_remove(qindex, old_fname);
+		if (new_fname != NULL) {
+			sieve_file_quota_index_remove(qindex, new_fname);
+			if (sieve_file_storage_quota_stat(qindex->fstorage,
+							  new_fname, &st) > 0)
+				sieve_file_quota_index_add(qindex, new_fname, &st);
+			else
+				valid = FALSE;
 		}
 
-		/* Check storage quota if necessary */
-		if (storage->max_storage != SET_SIZE_UNLIMITED) {
-			const char *path;
-			struct stat st;
-
-			path = t_strconcat(fstorage->path, "/", dp->d_name,
-					   NULL);
-			if (stat(path, &st) < 0) {
-				e_warning(storage->event,
-					  "quota: stat(%s) failed: %m", path);
-				continue;
-			}
+		/* Leaving the index as it is invalidates it, since the
+		   directory was modified */
+		if (valid &&
+		    sieve_file_storage_quota_dir_stamp(qindex->fstorage,
+						       &dir_stamp) == 0) {
+			qindex->dir_stamp = dir_stamp;
+			sieve_file_quota_index_write(qindex);
+		}
+	} T_END;
 
-			if (!replaced) {
-				script_storage += st.st_size;
+	sieve_file_quota_index_close(_qindex);
+}
 
-				if (script_storage > storage->max_storage) {
-					*quota_r = SIEVE_STORAGE_QUOTA_MAXSTORAGE;
-					*limit_r = storage->max_storage;
-					result = 0;
-					break;
-				}
-			}
+void sieve_file_storage_quota_index_unlock(
+	struct sieve_file_quota_index **_qindex)
+{
+	sieve_file_quota_index_close(_qindex);
+}
+
+/*
+ * Quota checking
+ */
+
+/* Determine the number of scripts and their total size, not counting the
+   script file that is about to be replaced. Returns 1 when this was taken
+   from the index, 0 when the directory was scanned and -1 on error. */
+static int
+sieve_file_storage_quota_get(struct sieve_file_storage *fstorage,
+			     const char *fname, bool rebuild,
+			     uint64_t *count_r, uint64_t *bytes_r)
+{
+	struct sieve_file_quota_index *qindex;
+	const char *dir_stamp, *new_dir_stamp;
+	int ret;
+
+	if (!rebuild) {
+		qindex = sieve_file_quota_index_open(fstorage, O_RDONLY);
+		if (qindex != NULL &&
+		    sieve_file_quota_index_valid(qindex, fname)) {
+			sieve_file_quota_index_sum(qindex, fname,
+						   count_r, bytes_r);
+			sieve_file_quota_index_close(&qindex);
+			return 1;
 		}
+		sieve_file_quota_index_close(&qindex);
 	}
 
-	/* Close directory */
-	if (closedir(dirp) < 0) {
-		sieve_storage_set_critical(storage,
-					   "quota: closedir(%s) failed: %m",
-					   fstorage->path);
+	/* Rebuild */
+	qindex = sieve_file_quota_index_open(fstorage, O_RDWR | O_CREAT);
+	if (qindex == NULL) {
+		/* Scan without recording the result */
+		qindex = sieve_file_quota_index_alloc(fstorage);
+	} else if (!rebuild && sieve_file_quota_index_valid(qindex, fname)) {
+		/* Another process rebuilt it in the meantime */
+		sieve_file_quota_index_sum(qindex, fname, count_r, bytes_r);
+		sieve_file_quota_index_close(&qindex);
+		return 1;
 	}
-	return result;
+
+	if (sieve_file_storage_quota_dir_stamp(fstorage, &dir_stamp) < 0)
+		dir_stamp = NULL;
+	ret = sieve_file_storage_quota_scan(qindex);
+	if (ret == 0)
+		sieve_file_quota_index_sum(qindex, fname, count_r, bytes_r);
+
+	/* Record the result only when the directory didn't change meanwhile */
+	if (ret == 0 && qindex->fd != -1 && dir_stamp != NULL &&
+	    sieve_file_storage_quota_dir_stamp(fstorage, &new_dir_stamp) == 0 &&
+	    strcmp(dir_stamp, new_dir_stamp) == 0) {
+		qindex->dir_stamp = dir_stamp;
+		qindex->scan_time = ioloop_time;
+		sieve_file_quota_index_write(qindex);
+	}
+	sieve_file_quota_index_close(&qindex);
+	return ret;
+}
+
+static int
+sieve_file_storage_quota_check(struct sieve_storage *storage,
+			       uint64_t count, uint64_t bytes, size_t size,
+			       enum sieve_storage_quota *quota_r,
+			       uint64_t *limit_r)
+{
+	uint64_t script_count = 1;
+	uint64_t script_storage = size;
+
+	/* Check count quota if necessary */
+	if (storage->max_scripts != SET_UINT_UNLIMITED && count > 0) {
+		script_count += count;
+		if (script_count > storage->max_scripts) {
+			*quota_r = SIEVE_STORAGE_QUOTA_MAXSCRIPTS;
+			*limit_r = storage->max_scripts;
+			return 0;
+		}
+	}
+
+	/* Check storage quota if necessary */
+	if (storage->max_storage != SET_SIZE_UNLIMITED && bytes > 0) {
+		script_storage += bytes;
+		if (script_storage > storage->max_storage) {
+			*quota_r = SIEVE_STORAGE_QUOTA_MAXSTORAGE;
+			*limit_r = storage->max_storage;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int sieve_file_storage_quota_havespace(struct sieve_storage *storage,
+				       const char *scriptname, size_t size,
+				       enum sieve_storage_quota *quota_r,
+				       uint64_t *limit_r)
+{
+	struct sieve_file_storage *fstorage =
+		container_of(storage, struct sieve_file_storage, storage);
+	const char *fname;
+	uint64_t count, bytes;
+	int ret;
+
+	if (!sieve_file_storage_quota_enabled(storage))
+		return 1;
+
+	/* A script with the same name is replaced */
+	fname = sieve_script_file_from_name(scriptname);
+
+	ret = sieve_file_storage_quota_get(fstorage, fname, FALSE,
+					   &count, &bytes);
+	if (ret < 0)
+		return -1;
+	if (sieve_file_storage_quota_check(storage, count, bytes, size,
+					   quota_r, limit_r) > 0)
+		return 1;
+	if (ret == 0)
+		return 0;
+
+	/* Never refuse based on an index that may be outdated */
+	if (sieve_file_storage_quota_get(fstorage, fname, TRUE,
+					 &count, &bytes) < 0)
+		return -1;
+	return sieve_file_storage_quota_check(storage, count, bytes, size,
+					      quota_r, limit_r);
 }
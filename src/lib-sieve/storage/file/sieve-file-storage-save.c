@@ -147,21 +147,30 @@ sieve_file_storage_create_tmp(struct sieve_file_storage *fstorage,
 
 static int
 sieve_file_storage_script_move(struct sieve_file_save_context *fsctx,
-			       const char *dst)
+			       const char *dst_fname)
 {
 	struct sieve_storage_save_context *sctx = &fsctx->context;
 	struct sieve_storage *storage = sctx->storage;
+	struct sieve_file_storage *fstorage =
+		container_of(storage, struct sieve_file_storage, storage);
+	struct sieve_file_quota_index *qindex;
+	const char *dst;
 	int result = 0;
 
+	dst = t_strconcat(fstorage->path, "/", dst_fname, NULL);
+	qindex = sieve_file_storage_quota_index_lock(fstorage, dst_fname);
+
 	T_BEGIN {
 		/* Using rename() to ensure existing files are replaced without
 		   conflicts with other processes using the same file. The
 		   kernel wont fully delete the original until all processes
 		   have closed the file.
 		 */
-		if (rename(fsctx->tmp_path, dst) == 0)
+		if (rename(fsctx->tmp_path, dst) == 0) {
 			result = 0;
-		else {
+			sieve_file_storage_quota_index_update(
+				&qindex, NULL, dst_fname);
+		} else {
 			result = -1;
 			if (ENOQUOTA(errno)) {
 				sieve_storage_set_error(
@@ -187,6 +196,7 @@ sieve_file_storage_script_move(struct sieve_file_save_context *fsctx,
 		}
 	} T_END;
 
+	sieve_file_storage_quota_index_unlock(&qindex);
 	return result;
 }
 
@@ -407,23 +417,20 @@ int sieve_file_storage_save_commit(struct sieve_storage_save_context *sctx)
 	struct sieve_file_save_context *fsctx =
 		container_of(sctx, struct sieve_file_save_context, context);
 	struct sieve_storage *storage = sctx->storage;
-	struct sieve_file_storage *fstorage =
-		container_of(storage, struct sieve_file_storage, storage);
-	const char *dest_path;
 	bool failed = FALSE;
 
 	i_assert(fsctx->output == NULL);
 
 	T_BEGIN {
-		dest_path = t_strconcat(
-			fstorage->path, "/",
-			sieve_script_file_from_name(sctx->scriptname), NULL);
-
-		failed = (sieve_file_storage_script_move(fsctx, dest_path) < 0);
+		/* Set the modification time before the script is moved into
+		   place, so that the quota index records the final one */
 		if (sctx->mtime != (time_t)-1) {
-			sieve_file_storage_update_mtime(storage, dest_path,
+			sieve_file_storage_update_mtime(storage, fsctx->tmp_path,
 							sctx->mtime);
 		}
+
+		failed = (sieve_file_storage_script_move(
+			fsctx, sieve_script_file_from_name(sctx->scriptname)) < 0);
 	} T_END;
 
 	return (failed ? -1 : 0);
@@ -447,9 +454,10 @@ void sieve_file_storage_save_cancel(struct sieve_storage_save_context *sctx)
 static int
 sieve_file_storage_save_to(struct sieve_file_storage *fstorage,
 			   string_t *temp_path, struct istream *input,
-			   const char *target)
+			   const char *target, const char *target_fname)
 {
 	struct sieve_storage *storage = &fstorage->storage;
+	struct sieve_file_quota_index *qindex;
 	struct ostream *output;
 	int fd;
 
@@ -496,6 +504,11 @@ sieve_file_storage_save_to(struct sieve_file_storage *fstorage,
 	}
 	o_stream_destroy(&output);
 
+	/* The target is either a script (target_fname) or the active script
+	   file, which is not counted even if it resides in the script
+	   directory */
+	qindex = sieve_file_storage_quota_index_lock(fstorage, target_fname);
+
 	if (rename(str_c(temp_path), target) < 0) {
 		if (ENOQUOTA(errno)) {
 			sieve_storage_set_error(
@@ -511,6 +524,10 @@ sieve_file_storage_save_to(struct sieve_file_storage *fstorage,
 				str_c(temp_path), target);
 		}
 		i_unlink(str_c(temp_path));
+		sieve_file_storage_quota_index_unlock(&qindex);
+	} else {
+		sieve_file_storage_quota_index_update(
+			&qindex, NULL, target_fname);
 	}
 	return 0;
 }
@@ -521,19 +538,20 @@ int sieve_file_storage_save_as(struct sieve_storage *storage,
 	struct sieve_file_storage *fstorage =
 		container_of(storage, struct sieve_file_storage, storage);
 	string_t *temp_path;
-	const char *dest_path;
+	const char *dest_fname, *dest_path;
+
+	dest_fname = sieve_script_file_from_name(name);
 
 	temp_path = t_str_new(256);
 	str_append(temp_path, fstorage->path);
 	str_append(temp_path, "/tmp/");
-	str_append(temp_path, sieve_script_file_from_name(name));
+	str_append(temp_path, dest_fname);
 	str_append_c(temp_path, '.');
 
-	dest_path = t_strconcat(fstorage->path, "/",
-				sieve_script_file_from_name(name), NULL);
+	dest_path = t_strconcat(fstorage->path, "/", dest_fname, NULL);
 
 	return sieve_file_storage_save_to(fstorage, temp_path, input,
-					  dest_path);
+					  dest_path, dest_fname);
 }
 
 int sieve_file_storage_save_as_active(struct sieve_storage *storage,
@@ -548,7 +566,7 @@ int sieve_file_storage_save_as_active(struct sieve_storage *storage,
 	str_append_c(temp_path, '.');
 
 	if (sieve_file_storage_save_to(fstorage, temp_path, input,
-				       fstorage->active_path) < 0)
+				       fstorage->active_path, NULL) < 0)
 		return -1;
 
 	sieve_file_storage_update_mtime(storage, fstorage->active_path, mtime);
@@ -837,6 +837,7 @@ sieve_file_storage_set_modified(struct sieve_storage *storage, time_t mtime)
 {
 	struct sieve_file_storage *fstorage =
 		container_of(storage, struct sieve_file_storage, storage);
+	struct sieve_file_quota_index *qindex;
 	struct utimbuf times;
 	time_t cur_mtime;
 
@@ -848,6 +849,10 @@ sieve_file_storage_set_modified(struct sieve_storage *storage, time_t mtime)
 		mtime = ioloop_time;
 	}
 
+	/* Keep the quota index valid across the change of the directory
+	   timestamps */
+	qindex = sieve_file_storage_quota_index_lock(fstorage, NULL);
+
 	times.actime = mtime;
 	times.modtime = mtime;
 	if (utime(fstorage->path, &times) < 0) {
@@ -865,6 +870,7 @@ sieve_file_storage_set_modified(struct sieve_storage *storage, time_t mtime)
 	} else {
 		fstorage->prev_mtime = mtime;
 	}
+	sieve_file_storage_quota_index_update(&qindex, NULL, NULL);
 }
 
 /*
@@ -111,11 +111,30 @@ int sieve_file_storage_save_as_active(struct sieve_storage *storage,
 
 /* Quota */
 
+struct sieve_file_quota_index;
+
 int sieve_file_storage_quota_havespace(struct sieve_storage *storage,
 				       const char *scriptname, size_t size,
 				       enum sieve_storage_quota *quota_r,
 				       uint64_t *limit_r);
 
+/* Lock the quota index before the script directory is modified. The recorded
+   entry of the script file fname (if not NULL) is verified against the file
+   itself. Returns NULL when there is no valid index to update. */
+struct sieve_file_quota_index *
+sieve_file_storage_quota_index_lock(struct sieve_file_storage *fstorage,
+				    const char *fname);
+/* Record the modification of the script directory and unlock the index. The
+   script file old_fname is removed from the index and new_fname is (re)added
+   with its current size; either can be NULL. */
+void sieve_file_storage_quota_index_update(
+	struct sieve_file_quota_index **_qindex,
+	const char *old_fname, const char *new_fname);
+/* Unlock the index without recording anything; the index becomes invalid if
+   the directory was modified nevertheless */
+void sieve_file_storage_quota_index_unlock(
+	struct sieve_file_quota_index **_qindex);
+
 /*
  * Sieve script filenames
  */
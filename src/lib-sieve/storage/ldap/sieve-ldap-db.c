@@ -1098,6 +1098,10 @@ struct sieve_ldap_script_lookup_request {
 	unsigned int entries;
 	const char *result_dn;
 	const char *result_modattr;
+	struct istream *result_script;
+
+	bool fetch_script:1;
+	bool failed:1;
 };
 
 static void
@@ -1111,6 +1115,7 @@ sieve_ldap_lookup_script_callback(struct ldap_connection *conn,
 			     request);
 
 	if (res == NULL) {
+		srequest->failed = TRUE;
 		io_loop_stop(conn->ioloop);
 		return;
 	}
@@ -1122,6 +1127,10 @@ sieve_ldap_lookup_script_callback(struct ldap_connection *conn,
 			(void)sieve_ldap_db_get_script_modattr(
 				conn, res, request->pool,
 				&srequest->result_modattr);
+			if (srequest->fetch_script) {
+				(void)sieve_ldap_db_get_script(
+					conn, res, &srequest->result_script);
+			}
 		} else if (srequest->entries++ == 0) {
 			e_warning(storage->event, "db: "
 				  "Search returned more than one entry for Sieve script; "
@@ -1134,7 +1143,8 @@ sieve_ldap_lookup_script_callback(struct ldap_connection *conn,
 }
 
 int sieve_ldap_db_lookup_script(struct ldap_connection *conn, const char *name,
-				const char **dn_r, const char **modattr_r)
+				const char **dn_r, const char **modattr_r,
+				struct istream **script_r)
 {
 	struct sieve_ldap_storage *lstorage = conn->lstorage;
 	struct sieve_storage *storage = &lstorage->storage;
@@ -1162,9 +1172,12 @@ int sieve_ldap_db_lookup_script(struct ldap_connection *conn, const char *name,
 		return -1;
 	}
 	request->request.base = p_strdup(pool, str_c(str));
+	request->fetch_script = (script_r != NULL);
 
 	attr_names = p_new(pool, char *, 3);
 	attr_names[0] = p_strdup(pool, set->modified_attribute);
+	if (request->fetch_script)
+		attr_names[1] = p_strdup(pool, set->script_attribute);
 
 	str_truncate(str, 0);
 	if (var_expand(str, set->filter, &params, &error) < 0) {
@@ -1187,8 +1200,18 @@ int sieve_ldap_db_lookup_script(struct ldap_connection *conn, const char *name,
 	db_ldap_request(conn, &request->request);
 	db_ldap_wait(conn);
 
+	/* A failed search must not be mistaken for a missing entry; it would
+	   end up in the negative lookup cache otherwise */
+	if (request->failed) {
+		i_stream_unref(&request->result_script);
+		pool_unref(&request->request.pool);
+		return -1;
+	}
+
 	*dn_r = t_strdup(request->result_dn);
 	*modattr_r = t_strdup(request->result_modattr);
+	if (script_r != NULL)
+		*script_r = request->result_script;
 	pool_unref(&request->request.pool);
 	return (*dn_r == NULL ? 0 : 1);
 }
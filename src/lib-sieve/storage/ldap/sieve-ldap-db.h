@@ -126,8 +126,12 @@ struct ldap_connection *
 sieve_ldap_db_init(struct sieve_ldap_storage *lstorage);
 void sieve_ldap_db_unref(struct ldap_connection **conn);
 
+/* Look up the script entry. When script_r is not NULL, the script itself is
+   fetched in the same search, which saves a round trip when it is going to be
+   read anyway. */
 int sieve_ldap_db_lookup_script(struct ldap_connection *conn, const char *name,
-				const char **dn_r, const char **modattr_r);
+				const char **dn_r, const char **modattr_r,
+				struct istream **script_r);
 int sieve_ldap_db_read_script(struct ldap_connection *conn, const char *dn,
 			      struct istream **script_r);
 
@@ -0,0 +1,114 @@
+/* Copyright (c) Pigeonhole authors, see top-level COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "strnum.h"
+#include "strescape.h"
+#include "istream.h"
+#include "write-full.h"
+#include "safe-mkstemp.h"
+
+#include "sieve-ldap-script-cache.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+/* The result of the script entry lookup (DN and modified attribute) is cached
+   in a small file next to the compiled binary. The file contains a single
+   line:
+
+   <expire time> [<dn> <modattr>]   (tab-separated and tab-escaped)
+
+   An entry without DN is a negative entry: the script was not found.
+ */
+
+int sieve_ldap_script_cache_read(struct event *event, const char *path,
+				 time_t now, const char **dn_r,
+				 const char **modattr_r)
+{
+	struct istream *input;
+	const char *line, *const *args;
+	time_t expire;
+	int ret = 0;
+
+	*dn_r = *modattr_r = NULL;
+
+	input = i_stream_create_file(path, 1024);
+	line = i_stream_read_next_line(input);
+	if (line == NULL) {
+		if (input->stream_errno != 0 && input->stream_errno != ENOENT) {
+			e_warning(event, "ldap cache: read(%s) failed: %s",
+				  path, i_stream_get_error(input));
+		}
+		i_stream_unref(&input);
+		return 0;
+	}
+
+	args = t_strsplit_tabescaped(line);
+	if (args[0] == NULL || str_to_time(args[0], &expire) < 0) {
+		e_warning(event, "ldap cache: "
+			  "Invalid cache file %s", path);
+	} else if (expire <= now) {
+		e_debug(event, "ldap cache: Entry expired");
+	} else if (args[1] == NULL) {
+		e_debug(event, "ldap cache: Negative entry");
+		ret = -1;
+	} else if (args[2] == NULL || args[3] != NULL) {
+		e_warning(event, "ldap cache: "
+			  "Invalid cache file %s", path);
+	} else {
+		e_debug(event, "ldap cache: "
+			"Found script entry (dn=%s, modattr=%s)",
+			args[1], args[2]);
+		*dn_r = t_strdup(args[1]);
+		*modattr_r = t_strdup_empty(args[2]);
+		ret = 1;
+	}
+	i_stream_unref(&input);
+	return ret;
+}
+
+int sieve_ldap_script_cache_write(struct event *event, const char *path,
+				  time_t now, unsigned int ttl,
+				  const char *dn, const char *modattr)
+{
+	string_t *temp_path, *data;
+	int fd;
+
+	data = t_str_new(256);
+	str_printfa(data, "%ld", (long)(now + ttl));
+	if (dn != NULL) {
+		str_append_c(data, '\t');
+		str_append_tabescaped(data, dn);
+		str_append_c(data, '\t');
+		if (modattr != NULL)
+			str_append_tabescaped(data, modattr);
+	}
+	str_append_c(data, '\n');
+
+	/* Replace the file atomically */
+	temp_path = t_str_new(256);
+	str_append(temp_path, path);
+	str_append_c(temp_path, '.');
+	fd = safe_mkstemp_hostpid(temp_path, 0600, (uid_t)-1, (gid_t)-1);
+	if (fd < 0) {
+		e_warning(event, "ldap cache: "
+			  "safe_mkstemp(%s) failed: %m", str_c(temp_path));
+		return -1;
+	}
+	if (write_full(fd, str_data(data), str_len(data)) < 0) {
+		e_warning(event, "ldap cache: "
+			  "write(%s) failed: %m", str_c(temp_path));
+		i_close_fd(&fd);
+		i_unlink(str_c(temp_path));
+		return -1;
+	}
+	i_close_fd(&fd);
+	if (rename(str_c(temp_path), path) < 0) {
+		e_warning(event, "ldap cache: "
+			  "rename(%s, %s) failed: %m", str_c(temp_path), path);
+		i_unlink(str_c(temp_path));
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef SIEVE_LDAP_SCRIPT_CACHE_H
+#define SIEVE_LDAP_SCRIPT_CACHE_H
+
+/*
+ * Script entry lookup cache
+ */
+
+/* Read the cache file at path. Returns 1 if a positive entry is found that
+   has not expired at time now, 0 if there is no usable entry (missing,
+   invalid or expired) and -1 for a negative entry that has not expired. The
+   returned DN and modified attribute are allocated from the data stack. */
+int sieve_ldap_script_cache_read(struct event *event, const char *path,
+				 time_t now, const char **dn_r,
+				 const char **modattr_r);
+/* Atomically replace the cache file at path with an entry that expires ttl
+   seconds after now. A NULL dn records a negative entry. */
+int sieve_ldap_script_cache_write(struct event *event, const char *path,
+				  time_t now, unsigned int ttl,
+				  const char *dn, const char *modattr);
+
+#endif
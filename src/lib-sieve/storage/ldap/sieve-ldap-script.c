@@ -8,6 +8,7 @@
 
 #if defined(SIEVE_BUILTIN_LDAP) || defined(PLUGIN_BUILD)
 
+#include "ioloop.h"
 #include "str.h"
 #include "strfuncs.h"
 
@@ -15,6 +16,8 @@
 #include "sieve-dump.h"
 #include "sieve-binary.h"
 
+#include "sieve-ldap-script-cache.h"
+
 /*
  * Script file implementation
  */
@@ -46,6 +49,88 @@ sieve_ldap_script_init(struct sieve_ldap_storage *lstorage, const char *name)
 	return lscript;
 }
 
+/*
+ * Lookup cache
+ */
+
+/* As long as the cached lookup result has not expired, the LDAP search is
+   skipped and the cached modified attribute is compared with the binary's
+   metadata instead. A lookup that finds no entry is cached as well. */
+
+static const char *
+sieve_ldap_script_cache_path(struct sieve_ldap_script *lscript)
+{
+	struct sieve_script *script = &lscript->script;
+	struct sieve_storage *storage = script->storage;
+	struct sieve_ldap_storage *lstorage =
+		container_of(storage, struct sieve_ldap_storage, storage);
+
+	if (storage->bin_path == NULL)
+		return NULL;
+	if (lstorage->set->cache_ttl == 0 &&
+	    lstorage->set->cache_negative_ttl == 0)
+		return NULL;
+	return t_strconcat(storage->bin_path, "/", script->name, ".ldapcache",
+			   NULL);
+}
+
+/* Returns 1 if a valid positive entry is found, 0 if not cached (or expired)
+   and -1 for a valid negative entry. */
+static int sieve_ldap_script_cache_lookup(struct sieve_ldap_script *lscript)
+{
+	struct sieve_script *script = &lscript->script;
+	const char *path, *dn, *modattr;
+	int ret;
+
+	path = sieve_ldap_script_cache_path(lscript);
+	if (path == NULL)
+		return 0;
+
+	ret = sieve_ldap_script_cache_read(script->event, path, ioloop_time,
+					   &dn, &modattr);
+	if (ret > 0) {
+		lscript->dn = p_strdup(script->pool, dn);
+		lscript->modattr = p_strdup(script->pool, modattr);
+	}
+	return ret;
+}
+
+static void sieve_ldap_script_cache_update(struct sieve_ldap_script *lscript)
+{
+	struct sieve_script *script = &lscript->script;
+	struct sieve_storage *storage = script->storage;
+	struct sieve_ldap_storage *lstorage =
+		container_of(storage, struct sieve_ldap_storage, storage);
+	const char *path;
+	unsigned int ttl;
+
+	path = sieve_ldap_script_cache_path(lscript);
+	if (path == NULL)
+		return;
+
+	ttl = (lscript->dn != NULL ?
+	       lstorage->set->cache_ttl : lstorage->set->cache_negative_ttl);
+	if (ttl == 0)
+		return;
+	if (sieve_storage_setup_bin_path(storage, 0700) < 0)
+		return;
+
+	(void)sieve_ldap_script_cache_write(script->event, path, ioloop_time,
+					    ttl, lscript->dn, lscript->modattr);
+}
+
+/*
+ * Script
+ */
+
+static void sieve_ldap_script_destroy(struct sieve_script *script)
+{
+	struct sieve_ldap_script *lscript =
+		container_of(script, struct sieve_ldap_script, script);
+
+	i_stream_unref(&lscript->input);
+}
+
 static int
 sieve_ldap_script_open(struct sieve_script *script)
 {
@@ -56,14 +141,31 @@ sieve_ldap_script_open(struct sieve_script *script)
 		container_of(storage, struct sieve_ldap_storage, storage);
 	int ret;
 
+	T_BEGIN {
+		ret = sieve_ldap_script_cache_lookup(lscript);
+	} T_END;
+	if (ret > 0)
+		return 0;
+	if (ret < 0) {
+		e_debug(script->event, "Script entry not found (cached)");
+		sieve_script_set_not_found_error(script, NULL);
+		return -1;
+	}
+
 	if (sieve_ldap_db_connect(lstorage->conn) < 0) {
 		sieve_storage_set_critical(
 			storage, "Failed to connect to LDAP database");
 		return -1;
 	}
 
-	ret = sieve_ldap_db_lookup_script(lstorage->conn, script->name,
-					  &lscript->dn, &lscript->modattr);
+	/* Without stored binaries, the script is always compiled, so it is
+	   read right away */
+	ret = sieve_ldap_db_lookup_script(
+		lstorage->conn, script->name, &lscript->dn, &lscript->modattr,
+		(storage->bin_path == NULL ? &lscript->input : NULL));
+	if (ret >= 0) T_BEGIN {
+		sieve_ldap_script_cache_update(lscript);
+	} T_END;
 	if (ret <= 0) {
 		if (ret == 0) {
 			e_debug(script->event, "Script entry not found");
@@ -90,6 +192,12 @@ sieve_ldap_script_get_stream(struct sieve_script *script,
 
 	i_assert(lscript->dn != NULL);
 
+	if (lscript->input != NULL) {
+		*stream_r = lscript->input;
+		lscript->input = NULL;
+		return 0;
+	}
+
 	ret = sieve_ldap_db_read_script(lstorage->conn, lscript->dn, stream_r);
 	if (ret <= 0) {
 		if (ret == 0) {
@@ -244,6 +352,8 @@ sieve_ldap_script_binary_save(struct sieve_script *script,
 const struct sieve_script sieve_ldap_script = {
 	.driver_name = SIEVE_LDAP_STORAGE_DRIVER_NAME,
 	.v = {
+		.destroy = sieve_ldap_script_destroy,
+
 		.open = sieve_ldap_script_open,
 
 		.get_stream = sieve_ldap_script_get_stream,
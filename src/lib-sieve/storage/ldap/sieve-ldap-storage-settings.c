@@ -79,6 +79,8 @@ static const struct setting_define sieve_ldap_storage_setting_defines[] = {
 	DEF(STR, script_attribute),
 	DEF(STR, modified_attribute),
 	DEF(STR, filter),
+	DEF(TIME, cache_ttl),
+	DEF(TIME, cache_negative_ttl),
 
 	SETTING_DEFINE_LIST_END
 };
@@ -87,6 +89,8 @@ static struct sieve_ldap_storage_settings sieve_ldap_storage_server_default_sett
 	.script_attribute = "",
 	.modified_attribute = "",
 	.filter = "",
+	.cache_ttl = 0,
+	.cache_negative_ttl = 0,
 };
 
 const struct setting_parser_info sieve_ldap_storage_setting_parser_info = {
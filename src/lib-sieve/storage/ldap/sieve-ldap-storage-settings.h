@@ -32,6 +32,9 @@ struct sieve_ldap_storage_settings {
 	const char *script_attribute;
 	const char *modified_attribute;
 	const char *filter;
+
+	unsigned int cache_ttl;
+	unsigned int cache_negative_ttl;
 };
 
 extern const struct setting_parser_info sieve_ldap_setting_parser_info;
@@ -41,6 +41,8 @@ struct sieve_ldap_script {
 
 	const char *dn;
 	const char *modattr;
+	/* Script fetched along with the lookup */
+	struct istream *input;
 
 	const char *bin_path;
 };
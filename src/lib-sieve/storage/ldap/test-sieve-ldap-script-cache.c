@@ -0,0 +1,169 @@
+/* Copyright (c) Pigeonhole authors, see top-level COPYING file */
+
+#include "lib.h"
+#include "unlink-directory.h"
+#include "write-full.h"
+#include "test-common.h"
+
+#include "sieve-ldap-script-cache.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-sieve-ldap-script-cache"
+#define TEST_PATH TEST_DIR"/script.ldapcache"
+
+#define TEST_NOW 1000000
+
+static struct event *test_event;
+
+static void test_cache_write_raw(const char *data)
+{
+	int fd;
+
+	fd = open(TEST_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		i_fatal("open(%s) failed: %m", TEST_PATH);
+	if (write_full(fd, data, strlen(data)) < 0)
+		i_fatal("write(%s) failed: %m", TEST_PATH);
+	i_close_fd(&fd);
+}
+
+static int
+test_cache_read(time_t now, const char **dn_r, const char **modattr_r)
+{
+	return sieve_ldap_script_cache_read(test_event, TEST_PATH, now,
+					    dn_r, modattr_r);
+}
+
+static void test_cache_missing(void)
+{
+	const char *dn, *modattr;
+
+	test_begin("ldap script cache missing");
+	i_unlink_if_exists(TEST_PATH);
+	test_assert(test_cache_read(TEST_NOW, &dn, &modattr) == 0);
+	test_assert(dn == NULL && modattr == NULL);
+	test_end();
+}
+
+static void test_cache_positive_ttl(void)
+{
+	const char *dn, *modattr;
+
+	test_begin("ldap script cache positive entry ttl");
+	test_assert(sieve_ldap_script_cache_write(
+		test_event, TEST_PATH, TEST_NOW, 60,
+		"cn=sieve,uid=user,dc=example", "20240101000000Z") == 0);
+
+	/* Valid until the ttl has passed */
+	test_assert(test_cache_read(TEST_NOW, &dn, &modattr) == 1);
+	test_assert(null_strcmp(dn, "cn=sieve,uid=user,dc=example") == 0);
+	test_assert(null_strcmp(modattr, "20240101000000Z") == 0);
+	test_assert(test_cache_read(TEST_NOW + 59, &dn, &modattr) == 1);
+	test_assert(null_strcmp(dn, "cn=sieve,uid=user,dc=example") == 0);
+
+	/* Expired */
+	test_assert(test_cache_read(TEST_NOW + 60, &dn, &modattr) == 0);
+	test_assert(dn == NULL && modattr == NULL);
+	test_assert(test_cache_read(TEST_NOW + 3600, &dn, &modattr) == 0);
+	test_end();
+}
+
+static void test_cache_positive_escaping(void)
+{
+	const char *dn, *modattr;
+
+	test_begin("ldap script cache positive entry escaping");
+	test_assert(sieve_ldap_script_cache_write(
+		test_event, TEST_PATH, TEST_NOW, 60,
+		"cn=tab\there,dc=example", NULL) == 0);
+	test_assert(test_cache_read(TEST_NOW, &dn, &modattr) == 1);
+	test_assert(null_strcmp(dn, "cn=tab\there,dc=example") == 0);
+	test_assert(modattr == NULL);
+	test_end();
+}
+
+static void test_cache_negative_ttl(void)
+{
+	const char *dn, *modattr;
+
+	test_begin("ldap script cache negative entry ttl");
+	test_assert(sieve_ldap_script_cache_write(
+		test_event, TEST_PATH, TEST_NOW, 10, NULL, NULL) == 0);
+
+	/* Negative until the ttl has passed */
+	test_assert(test_cache_read(TEST_NOW, &dn, &modattr) == -1);
+	test_assert(dn == NULL && modattr == NULL);
+	test_assert(test_cache_read(TEST_NOW + 9, &dn, &modattr) == -1);
+
+	/* Expired: a new lookup is needed */
+	test_assert(test_cache_read(TEST_NOW + 10, &dn, &modattr) == 0);
+	test_end();
+}
+
+static void test_cache_replace(void)
+{
+	const char *dn, *modattr;
+
+	test_begin("ldap script cache replace");
+	test_assert(sieve_ldap_script_cache_write(
+		test_event, TEST_PATH, TEST_NOW, 10, NULL, NULL) == 0);
+	test_assert(sieve_ldap_script_cache_write(
+		test_event, TEST_PATH, TEST_NOW, 60, "cn=sieve", "1") == 0);
+	test_assert(test_cache_read(TEST_NOW + 30, &dn, &modattr) == 1);
+	test_assert(null_strcmp(dn, "cn=sieve") == 0);
+	test_assert(null_strcmp(modattr, "1") == 0);
+	test_end();
+}
+
+static void test_cache_invalid(void)
+{
+	static const char *invalid[] = {
+		"notatime\tcn=sieve\t1\n",
+		"2000000\tcn=sieve\n",
+		"2000000\tcn=sieve\t1\textra\n",
+	};
+	const char *dn, *modattr;
+	unsigned int i;
+
+	test_begin("ldap script cache invalid");
+	test_cache_write_raw("");
+	test_assert(test_cache_read(TEST_NOW, &dn, &modattr) == 0);
+	for (i = 0; i < N_ELEMENTS(invalid); i++) {
+		test_cache_write_raw(invalid[i]);
+		test_expect_errors(1);
+		test_assert_idx(test_cache_read(TEST_NOW, &dn, &modattr) == 0,
+				i);
+	}
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_cache_missing,
+		test_cache_positive_ttl,
+		test_cache_positive_escaping,
+		test_cache_negative_ttl,
+		test_cache_replace,
+		test_cache_invalid,
+		NULL
+	};
+	const char *error;
+	int ret;
+
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	test_event = event_create(NULL);
+	ret = test_run(test_functions);
+	event_unref(&test_event);
+
+	if (unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0)
+		i_error("unlink_directory(%s) failed: %s", TEST_DIR, error);
+	return ret;
+}
@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "array.h"
+#include "hash.h"
 #include "str.h"
 #include "mempool.h"
 #include "llist.h"
@@ -38,6 +39,14 @@ struct istream *edit_mail_istream_create(struct edit_mail *edmail);
 static struct _header_index *
 edit_mail_header_clone(struct edit_mail *edmail, struct _header *header);
 
+static int
+edit_mail_get_headers(struct mail *mail, const char *field_name,
+		      bool decode_to_utf8, const char *const **value_r);
+static int
+edit_mail_get_stream(struct mail *mail, bool get_body ATTR_UNUSED,
+		     struct message_size *hdr_size,
+		     struct message_size *body_size, struct istream **stream_r);
+
 /*
  * Raw storage
  */
@@ -114,6 +123,9 @@ struct _header_index {
 	struct _header_field_index *first, *last;
 
 	unsigned int count;
+
+	/* Cached result of edit_mail_get_headers() (raw and utf8) */
+	const char *const *values[2];
 };
 
 static inline struct _header *_header_create(const char *name)
@@ -191,6 +203,7 @@ struct edit_mail {
 	struct istream *stream;
 
 	struct _header_index *headers_head, *headers_tail;
+	HASH_TABLE(const char *, struct _header_index *) header_index;
 	struct _header_field_index *header_fields_head, *header_fields_tail;
 	struct message_size hdr_size, body_size;
 
@@ -199,6 +212,10 @@ struct edit_mail {
 	struct _header_field_index *header_fields_appended;
 	struct message_size appended_hdr_size;
 
+	/* MIME structure of the modified message */
+	pool_t parts_pool;
+	struct message_part *parts;
+
 	bool modified:1;
 	bool snapshot_modified:1;
 	bool crlf:1;
@@ -349,6 +366,12 @@ struct edit_mail *edit_mail_snapshot(struct edit_mail *edmail)
 	return edmail_new;
 }
 
+static inline void edit_mail_parts_invalidate(struct edit_mail *edmail)
+{
+	/* The header changed, so the cached structure is no longer valid */
+	edmail->parts = NULL;
+}
+
 void edit_mail_reset(struct edit_mail *edmail)
 {
 	struct _header_index *header_idx;
@@ -366,6 +389,9 @@ void edit_mail_reset(struct edit_mail *edmail)
 		field_idx = next;
 	}
 
+	if (hash_table_is_created(edmail->header_index))
+		hash_table_clear(edmail->header_index, TRUE);
+
 	header_idx = edmail->headers_head;
 	while (header_idx != NULL) {
 		struct _header_index *next = header_idx->next;
@@ -375,7 +401,9 @@ void edit_mail_reset(struct edit_mail *edmail)
 
 		header_idx = next;
 	}
+	edmail->headers_head = edmail->headers_tail = NULL;
 
+	edit_mail_parts_invalidate(edmail);
 	edmail->modified = FALSE;
 }
 
@@ -388,7 +416,9 @@ void edit_mail_unwrap(struct edit_mail **edmail)
 		return;
 
 	edit_mail_reset(*edmail);
+	hash_table_destroy(&(*edmail)->header_index);
 	i_stream_unref(&(*edmail)->wrapped_stream);
+	pool_unref(&(*edmail)->parts_pool);
 
 	parent = (*edmail)->parent;
 
@@ -420,6 +450,7 @@ struct mail *edit_mail_get_mail(struct edit_mail *edmail)
 
 static inline void edit_mail_modify(struct edit_mail *edmail)
 {
+	edit_mail_parts_invalidate(edmail);
 	edmail->mail.mail.seq++;
 	edmail->modified = TRUE;
 	edmail->snapshot_modified = TRUE;
@@ -464,20 +495,49 @@ static inline char *_header_value_unfold(const char *value)
 	return i_strndup(str_c(out), str_len(out));
 }
 
-static struct _header_index *
-edit_mail_header_find(struct edit_mail *edmail, const char *field_name)
+/* The header index items are listed in the headers_head list and they are
+   indexed by (case-insensitive) name in the header_index hash table. Both are
+   always updated together. */
+
+static void
+edit_mail_header_index_add(struct edit_mail *edmail,
+			   struct _header_index *header_idx)
 {
-	struct _header_index *header_idx;
+	if (!hash_table_is_created(edmail->header_index)) {
+		hash_table_create(&edmail->header_index, default_pool, 0,
+				  strcase_hash, strcasecmp);
+	}
 
-	header_idx = edmail->headers_head;
-	while (header_idx != NULL) {
-		if (strcasecmp(header_idx->header->name, field_name) == 0)
-			return header_idx;
+	DLLIST2_APPEND(&edmail->headers_head, &edmail->headers_tail,
+		       header_idx);
+	hash_table_insert(edmail->header_index, header_idx->header->name,
+			  header_idx);
+}
 
-		header_idx = header_idx->next;
-	}
+static void
+edit_mail_header_index_remove(struct edit_mail *edmail,
+			      struct _header_index *header_idx)
+{
+	hash_table_remove(edmail->header_index, header_idx->header->name);
+	DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail,
+		       header_idx);
 
-	return NULL;
+	_header_unref(header_idx->header);
+	i_free(header_idx);
+}
+
+static inline void _header_index_invalidate(struct _header_index *header_idx)
+{
+	header_idx->values[0] = header_idx->values[1] = NULL;
+}
+
+static struct _header_index *
+edit_mail_header_find(struct edit_mail *edmail, const char *field_name)
+{
+	if (field_name == NULL || !hash_table_is_created(edmail->header_index))
+		return NULL;
+
+	return hash_table_lookup(edmail->header_index, field_name);
 }
 
 static struct _header_index *
@@ -490,8 +550,7 @@ edit_mail_header_create(struct edit_mail *edmail, const char *field_name)
 		header_idx = i_new(struct _header_index, 1);
 		header_idx->header = _header_create(field_name);
 
-		DLLIST2_APPEND(&edmail->headers_head, &edmail->headers_tail,
-			       header_idx);
+		edit_mail_header_index_add(edmail, header_idx);
 	}
 
 	return header_idx;
@@ -502,19 +561,17 @@ edit_mail_header_clone(struct edit_mail *edmail, struct _header *header)
 {
 	struct _header_index *header_idx;
 
-	header_idx = edmail->headers_head;
-	while (header_idx != NULL) {
-		if (header_idx->header == header)
-			return header_idx;
-
-		header_idx = header_idx->next;
+	/* Header names are unique within the edit mail being cloned */
+	header_idx = edit_mail_header_find(edmail, header->name);
+	if (header_idx != NULL) {
+		i_assert(header_idx->header == header);
+		return header_idx;
 	}
 
 	header_idx = i_new(struct _header_index, 1);
 	header_idx->header = header;
 	_header_ref(header);
-	DLLIST2_APPEND(&edmail->headers_head, &edmail->headers_tail,
-		       header_idx);
+	edit_mail_header_index_add(edmail, header_idx);
 
 	return header_idx;
 }
@@ -532,6 +589,7 @@ edit_mail_header_field_create(struct edit_mail *edmail, const char *field_name,
 	/* Get/create header index item */
 	header_idx = edit_mail_header_create(edmail, field_name);
 	header = header_idx->header;
+	_header_index_invalidate(header_idx);
 
 	/* Create new field index item */
 	field_idx = i_new(struct _header_field_index, 1);
@@ -574,6 +632,7 @@ edit_mail_header_field_delete(struct edit_mail *edmail,
 	struct _header_field *field = field_idx->field;
 
 	i_assert(header_idx != NULL);
+	_header_index_invalidate(header_idx);
 
 	edmail->hdr_size.physical_size -= field->size;
 	edmail->hdr_size.virtual_size -= field->virtual_size;
@@ -582,10 +641,7 @@ edit_mail_header_field_delete(struct edit_mail *edmail,
 	header_idx->count--;
 	if (update_index) {
 		if (header_idx->count == 0) {
-			DLLIST2_REMOVE(&edmail->headers_head,
-				       &edmail->headers_tail, header_idx);
-			_header_unref(header_idx->header);
-			i_free(header_idx);
+			edit_mail_header_index_remove(edmail, header_idx);
 		} else if (header_idx->first == field_idx) {
 			struct _header_field_index *hfield =
 				header_idx->first->next;
@@ -625,6 +681,7 @@ edit_mail_header_field_replace(struct edit_mail *edmail,
 
 	i_assert(header_idx != NULL);
 	i_assert(newname != NULL || newvalue != NULL);
+	_header_index_invalidate(header_idx);
 
 	if (newname == NULL)
 		newname = header_idx->header->name;
@@ -666,11 +723,8 @@ edit_mail_header_field_replace(struct edit_mail *edmail,
 
 		if (update_index) {
 			if (header_idx->count == 0) {
-				DLLIST2_REMOVE(&edmail->headers_head,
-					       &edmail->headers_tail,
-					       header_idx);
-				_header_unref(header_idx->header);
-				i_free(header_idx);
+				edit_mail_header_index_remove(edmail,
+							      header_idx);
 			} else if (header_idx->first == field_idx) {
 				struct _header_field_index *hfield =
 					header_idx->first->next;
@@ -895,10 +949,13 @@ static int edit_mail_headers_parse(struct edit_mail *edmail)
 		if (current->header->first == NULL)
 			current->header->first = current;
 		current->header->last = current;
+		_header_index_invalidate(current->header);
 
 		current = current->next;
 	}
 
+	edit_mail_parts_invalidate(edmail);
+
 	/* Clear appended headers */
 	edmail->header_fields_appended = NULL;
 	edmail->appended_hdr_size.physical_size = 0;
@@ -1016,10 +1073,7 @@ int edit_mail_header_delete(struct edit_mail *edmail, const char *field_name,
 	}
 
 	if (index == 0 || header_idx->count == 0) {
-		DLLIST2_REMOVE(&edmail->headers_head,
-			       &edmail->headers_tail, header_idx);
-		_header_unref(header_idx->header);
-		i_free(header_idx);
+		edit_mail_header_index_remove(edmail, header_idx);
 	} else if (header_idx->first == NULL || header_idx->last == NULL) {
 		struct _header_field_index *current =
 			edmail->header_fields_head;
@@ -1098,10 +1152,7 @@ int edit_mail_header_replace(struct edit_mail *edmail,
 
 	/* Update old header index */
 	if (header_idx->count == 0) {
-		DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail,
-			       header_idx);
-		_header_unref(header_idx->header);
-		i_free(header_idx);
+		edit_mail_header_index_remove(edmail, header_idx);
 	} else if (header_idx->first == NULL || header_idx->last == NULL) {
 		struct _header_field_index *current =
 			edmail->header_fields_head;
@@ -1347,11 +1398,154 @@ static uint64_t edit_mail_get_pvt_modseq(struct mail *mail)
 	return edmail->wrapped->v.get_pvt_modseq(&edmail->wrapped->mail);
 }
 
+static void
+edit_mail_get_hdr_size(struct edit_mail *edmail,
+		       struct message_size *hdr_size_r)
+{
+	if (!edmail->headers_parsed) {
+		/* Original header is still used as a whole */
+		*hdr_size_r = edmail->wrapped_hdr_size;
+	} else {
+		/* Only the end-of-header line remains of the original header
+		 */
+		i_zero(hdr_size_r);
+		hdr_size_r->physical_size = (edmail->eoh_crlf ? 2 : 1);
+		hdr_size_r->virtual_size = 2;
+		hdr_size_r->lines = 1;
+	}
+
+	hdr_size_r->physical_size += edmail->hdr_size.physical_size;
+	hdr_size_r->virtual_size += edmail->hdr_size.virtual_size;
+	hdr_size_r->lines += edmail->hdr_size.lines;
+}
+
+static bool
+edit_mail_header_values_equal(const char *const *values1,
+			      const char *const *values2)
+{
+	for (; *values1 != NULL && *values2 != NULL; values1++, values2++) {
+		if (strcmp(*values1, *values2) != 0)
+			return FALSE;
+	}
+	return (*values1 == NULL && *values2 == NULL);
+}
+
+static struct message_part *
+edit_mail_parts_copy(pool_t pool, const struct message_part *part,
+		     struct message_part *parent, uoff_t old_hdr_size,
+		     uoff_t new_hdr_size)
+{
+	struct message_part *first = NULL, **next_p = &first;
+
+	for (; part != NULL; part = part->next) {
+		struct message_part *copy;
+
+		copy = p_new(pool, struct message_part, 1);
+		*copy = *part;
+		copy->parent = parent;
+		copy->next = NULL;
+		copy->context = NULL;
+
+		/* Body parts are moved along with the end of the header */
+		if (parent != NULL) {
+			i_assert(part->physical_pos >= old_hdr_size);
+			copy->physical_pos = (part->physical_pos -
+					      old_hdr_size + new_hdr_size);
+		}
+
+		copy->children = edit_mail_parts_copy(pool, part->children,
+						      copy, old_hdr_size,
+						      new_hdr_size);
+
+		*next_p = copy;
+		next_p = &copy->next;
+	}
+	return first;
+}
+
+static int
+edit_mail_parts_parse(struct edit_mail *edmail, struct message_part **parts_r)
+{
+	const struct message_parser_settings parser_set = {
+		.hdr_flags = MESSAGE_HEADER_PARSER_FLAG_SKIP_INITIAL_LWSP,
+		.flags = MESSAGE_PARSER_FLAG_SKIP_BODY_BLOCK,
+	};
+	struct message_parser_ctx *parser;
+	struct message_block block;
+	struct istream *input;
+	int ret;
+
+	if (edit_mail_get_stream(&edmail->mail.mail, TRUE,
+				 NULL, NULL, &input) < 0)
+		return -1;
+
+	parser = message_parser_init(edmail->parts_pool, input, &parser_set);
+	while ((ret = message_parser_parse_next_block(parser, &block)) > 0);
+	message_parser_deinit(&parser, parts_r);
+
+	if (input->stream_errno != 0) {
+		mail_set_critical(&edmail->mail.mail,
+				  "read(%s) failed: %s",
+				  i_stream_get_name(input),
+				  i_stream_get_error(input));
+		return -1;
+	}
+	return 0;
+}
+
 static int edit_mail_get_parts(struct mail *mail, struct message_part **parts_r)
 {
 	struct edit_mail *edmail = (struct edit_mail *)mail;
+	struct mail *wrapped_mail = &edmail->wrapped->mail;
+	const char *const *ctypes, *const *wrapped_ctypes;
+	struct message_part *wrapped_parts;
+	struct message_size hdr_size;
+
+	if (!edmail->modified)
+		return edmail->wrapped->v.get_parts(wrapped_mail, parts_r);
+
+	/* The parts are determined once; any change to the header clears
+	   them (edit_mail_parts_invalidate()) */
+	if (edmail->parts != NULL) {
+		*parts_r = edmail->parts;
+		return 0;
+	}
+
+	if (edmail->parts_pool == NULL) {
+		edmail->parts_pool =
+			pool_alloconly_create("edit_mail parts", 1024);
+	} else {
+		p_clear(edmail->parts_pool);
+	}
+	edmail->parts = NULL;
+
+	/* Only the header of the message is ever modified, so the structure
+	   of the original message can be used as long as the Content-Type
+	   header is unchanged; only the header size differs. Otherwise, the
+	   MIME structure of the modified message needs to be parsed. */
+	if (edit_mail_get_headers(mail, "Content-Type", TRUE, &ctypes) < 0 ||
+	    edmail->wrapped->v.get_headers(wrapped_mail, "Content-Type", TRUE,
+					   &wrapped_ctypes) < 0)
+		return -1;
+
+	if (edit_mail_header_values_equal(ctypes, wrapped_ctypes)) {
+		if (edmail->wrapped->v.get_parts(wrapped_mail,
+						 &wrapped_parts) < 0)
+			return -1;
+
+		edit_mail_get_hdr_size(edmail, &hdr_size);
+		edmail->parts = edit_mail_parts_copy(
+			edmail->parts_pool, wrapped_parts, NULL,
+			wrapped_parts->header_size.physical_size,
+			hdr_size.physical_size);
+		edmail->parts->header_size = hdr_size;
+	} else if (edit_mail_parts_parse(edmail, &edmail->parts) < 0) {
+		edmail->parts = NULL;
+		return -1;
+	}
 
-	return edmail->wrapped->v.get_parts(&edmail->wrapped->mail, parts_r);
+	*parts_r = edmail->parts;
+	return 0;
 }
 
 static int
@@ -1523,6 +1717,12 @@ edit_mail_get_headers(struct mail *mail, const char *field_name,
 		return 0;
 	}
 
+	/* Use cached values if the header was not modified since */
+	if (header_idx->values[decode_to_utf8 ? 1 : 0] != NULL) {
+		*value_r = header_idx->values[decode_to_utf8 ? 1 : 0];
+		return 1;
+	}
+
 	/* Merge */
 
 	/* Read original headers too if message headers are not parsed */
@@ -1578,6 +1778,8 @@ edit_mail_get_headers(struct mail *mail, const char *field_name,
 
 	(void)array_append_space(&header_values);
 	*value_r = array_idx(&header_values, 0);
+
+	header_idx->values[decode_to_utf8 ? 1 : 0] = *value_r;
 	return 1;
 }
 
@@ -1601,12 +1803,8 @@ edit_mail_get_stream(struct mail *mail, bool get_body ATTR_UNUSED,
 	if (edmail->stream == NULL)
 		edmail->stream = edit_mail_istream_create(edmail);
 
-	if (hdr_size != NULL) {
-		*hdr_size = edmail->wrapped_hdr_size;
-		hdr_size->physical_size += edmail->hdr_size.physical_size;
-		hdr_size->virtual_size += edmail->hdr_size.virtual_size;
-		hdr_size->lines += edmail->hdr_size.lines;
-	}
+	if (hdr_size != NULL)
+		edit_mail_get_hdr_size(edmail, hdr_size);
 
 	if (body_size != NULL)
 		*body_size = edmail->wrapped_body_size;
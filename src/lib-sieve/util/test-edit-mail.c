@@ -13,6 +13,7 @@
 #include "master-service.h"
 #include "master-service-settings.h"
 #include "istream-header-filter.h"
+#include "message-parser.h"
 #include "mail-storage.h"
 #include "mail-storage-service.h"
 #include "mail-user.h"
@@ -926,6 +927,211 @@ static void test_edit_mail_empty2(void)
 	test_end();
 }
 
+static void test_edit_mail_header_lookup(void)
+{
+	static const char *msg =
+		"From: stephan@example.com\n"
+		"X-Test: Frop\n"
+		"Subject: Frop!\n"
+		"x-test: Friep\n"
+		"\n"
+		"Frop!\n";
+	struct istream *input_msg;
+	struct mail_raw *rawmail;
+	struct edit_mail *edmail;
+	struct mail *mail;
+	const char *const *values;
+
+	test_begin("edit-mail - header lookup");
+	test_edit_mail_init();
+
+	/* Compose the message */
+
+	input_msg = i_stream_create_from_data(msg, strlen(msg));
+
+	rawmail = mail_raw_open_stream(test_raw_mail_user, input_msg);
+
+	edmail = edit_mail_wrap(rawmail->mail);
+	mail = edit_mail_get_mail(edmail);
+
+	/* Add header */
+
+	edit_mail_header_add(edmail, "X-TEST", "Frml", TRUE);
+
+	test_assert(mail_get_headers_utf8(mail, "X-Test", &values) > 0 &&
+		    str_array_length(values) == 3 &&
+		    strcmp(values[0], "Frop") == 0 &&
+		    strcmp(values[1], "Friep") == 0 &&
+		    strcmp(values[2], "Frml") == 0);
+	/* Repeated lookup */
+	test_assert(mail_get_headers_utf8(mail, "x-TEST", &values) > 0 &&
+		    str_array_length(values) == 3);
+
+	/* Delete header */
+
+	test_assert(edit_mail_header_delete(edmail, "x-test", 2) == 1);
+	test_assert(mail_get_headers_utf8(mail, "X-Test", &values) > 0 &&
+		    str_array_length(values) == 2 &&
+		    strcmp(values[0], "Frop") == 0 &&
+		    strcmp(values[1], "Frml") == 0);
+
+	/* Replace header */
+
+	test_assert(edit_mail_header_replace(edmail, "X-Test", 0,
+					     "X-Other", "Frup") == 2);
+	test_assert(mail_get_headers_utf8(mail, "X-Test", &values) == 0 &&
+		    values[0] == NULL);
+	test_assert(mail_get_headers_utf8(mail, "x-other", &values) > 0 &&
+		    str_array_length(values) == 2 &&
+		    strcmp(values[0], "Frup") == 0 &&
+		    strcmp(values[1], "Frup") == 0);
+	test_assert(mail_get_headers_utf8(mail, "Subject", &values) > 0 &&
+		    str_array_length(values) == 1 &&
+		    strcmp(values[0], "Frop!") == 0);
+
+	/* Clean up */
+
+	edit_mail_unwrap(&edmail);
+	mail_raw_close(&rawmail);
+	i_stream_unref(&input_msg);
+	test_edit_mail_deinit();
+	test_end();
+}
+
+static bool
+test_message_parts_equal(const struct message_part *part1,
+			 const struct message_part *part2)
+{
+	for (; part1 != NULL && part2 != NULL;
+	     part1 = part1->next, part2 = part2->next) {
+		if (part1->physical_pos != part2->physical_pos ||
+		    part1->header_size.physical_size !=
+			part2->header_size.physical_size ||
+		    part1->header_size.virtual_size !=
+			part2->header_size.virtual_size ||
+		    part1->header_size.lines != part2->header_size.lines ||
+		    part1->body_size.physical_size !=
+			part2->body_size.physical_size ||
+		    part1->flags != part2->flags ||
+		    part1->children_count != part2->children_count)
+			return FALSE;
+		if (!test_message_parts_equal(part1->children,
+					      part2->children))
+			return FALSE;
+	}
+	return (part1 == NULL && part2 == NULL);
+}
+
+static void test_message_parts_check(struct mail *mail)
+{
+	const struct message_parser_settings parser_set = {
+		.hdr_flags = MESSAGE_HEADER_PARSER_FLAG_SKIP_INITIAL_LWSP,
+		.flags = MESSAGE_PARSER_FLAG_INCLUDE_MULTIPART_BLOCKS,
+	};
+	struct message_parser_ctx *parser;
+	struct message_block block;
+	struct message_part *parts, *parsed_parts;
+	struct istream *input;
+	const char *error;
+	pool_t pool;
+
+	if (mail_get_stream(mail, NULL, NULL, &input) < 0) {
+		i_fatal("Failed to open mail stream: %s",
+			mailbox_get_last_error(mail->box, NULL));
+	}
+	test_assert(mail_get_parts(mail, &parts) == 0);
+
+	/* Parts must match those of the actual message */
+	pool = pool_alloconly_create("test message parts", 1024);
+	i_stream_seek(input, 0);
+	parser = message_parser_init(pool, input, &parser_set);
+	while (message_parser_parse_next_block(parser, &block) > 0);
+	message_parser_deinit(&parser, &parsed_parts);
+	test_assert(input->stream_errno == 0);
+	test_assert(test_message_parts_equal(parts, parsed_parts));
+	pool_unref(&pool);
+
+	/* Parts must be usable for parsing the message */
+	i_stream_seek(input, 0);
+	parser = message_parser_init_from_parts(parts, input, &parser_set);
+	while (message_parser_parse_next_block(parser, &block) > 0);
+	test_assert(message_parser_deinit_from_parts(
+		&parser, &parts, &error) == 0);
+	test_assert(input->stream_errno == 0);
+}
+
+static void test_edit_mail_parts(void)
+{
+	static const char *msg =
+		"From: stephan@example.com\r\n"
+		"Subject: Frop!\r\n"
+		"Content-Type: multipart/mixed; boundary=AA\r\n"
+		"\r\n"
+		"Prologue\r\n"
+		"--AA\r\n"
+		"Content-Type: text/plain\r\n"
+		"\r\n"
+		"Frop!\r\n"
+		"--AA\r\n"
+		"Content-Type: message/rfc822\r\n"
+		"\r\n"
+		"Subject: Friep!\r\n"
+		"\r\n"
+		"Friep!\r\n"
+		"--AA--\r\n"
+		"Epilogue\r\n";
+	struct istream *input_msg;
+	struct mail_raw *rawmail;
+	struct edit_mail *edmail;
+	struct mail *mail;
+	struct message_part *parts;
+
+	test_begin("edit-mail - MIME parts");
+	test_edit_mail_init();
+
+	/* Compose the message */
+
+	input_msg = i_stream_create_from_data(msg, strlen(msg));
+
+	rawmail = mail_raw_open_stream(test_raw_mail_user, input_msg);
+
+	edmail = edit_mail_wrap(rawmail->mail);
+
+	/* Add header */
+
+	edit_mail_header_add(edmail, "X-Frop", "Frop", FALSE);
+	mail = edit_mail_get_mail(edmail);
+	test_message_parts_check(mail);
+
+	/* Add header at the end */
+
+	edit_mail_header_add(edmail, "X-Friep",
+			     "A somewhat longer header field value", TRUE);
+	test_message_parts_check(mail);
+
+	/* Delete header */
+
+	test_assert(edit_mail_header_delete(edmail, "Subject", 0) == 1);
+	test_message_parts_check(mail);
+
+	/* Replace Content-Type; structure changes */
+
+	test_assert(edit_mail_header_delete(
+		edmail, "Content-Type", 0) == 1);
+	edit_mail_header_add(edmail, "Content-Type", "text/plain", TRUE);
+	test_message_parts_check(mail);
+	test_assert(mail_get_parts(mail, &parts) == 0 &&
+		    parts->children == NULL);
+
+	/* Clean up */
+
+	edit_mail_unwrap(&edmail);
+	mail_raw_close(&rawmail);
+	i_stream_unref(&input_msg);
+	test_edit_mail_deinit();
+	test_end();
+}
+
 int main(int argc, char *argv[])
 {
 	static void (*test_functions[])(void) = {
@@ -934,6 +1140,8 @@ int main(int argc, char *argv[])
 		test_edit_mail_small_buffer,
 		test_edit_mail_empty,
 		test_edit_mail_empty2,
+		test_edit_mail_header_lookup,
+		test_edit_mail_parts,
 		NULL
 	};
 	const enum master_service_flags service_flags =
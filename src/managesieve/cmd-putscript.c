@@ -237,6 +237,11 @@ cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
 
 		success = FALSE;
 	} else {
+		/* Have the binary stored along with the script */
+		if (ctx->scriptname != NULL) {
+			sieve_storage_save_set_binary(ctx->save_ctx, sbin,
+						      ehandler);
+		}
 		sieve_close(&sbin);
 
 		if (!cmd_putscript_save(ctx))
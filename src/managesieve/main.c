@@ -21,6 +21,8 @@
 #include "mail-user.h"
 #include "mail-storage-service.h"
 
+#include "sieve.h"
+
 #include "managesieve-quote.h"
 #include "managesieve-common.h"
 #include "managesieve-commands.h"
@@ -414,6 +416,7 @@ int main(int argc, char *argv[])
 	mail_storage_service_deinit(&storage_service);
 
 	commands_deinit();
+	sieve_caches_deinit();
 
 	master_service_deinit(&master_service);
 	return 0;
@@ -101,6 +101,9 @@ static int cmd_sieve_put_run(struct doveadm_sieve_cmd_context *_ctx)
 					_ctx, error_code);
 				ret = -1;
 			} else {
+				/* Store the binary along with the script */
+				sieve_storage_save_set_binary(save_ctx, sbin,
+							      ehandler);
 				sieve_close(&sbin);
 
 				/* Script is valid; commit it to storage */
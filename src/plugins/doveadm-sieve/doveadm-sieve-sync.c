@@ -278,6 +278,33 @@ sieve_attribute_set_default(struct mail_storage *storage,
 	return -1;
 }
 
+static void
+sieve_attribute_compile_script(struct sieve_instance *svinst,
+			       struct sieve_storage_save_context *save_ctx)
+{
+	struct sieve_error_handler *ehandler;
+	struct sieve_script *script;
+	struct sieve_binary *sbin;
+	string_t *errors;
+
+	/* Compile the synchronized script now, so that the binary is stored
+	   along with it rather than compiled at the first delivery. The script
+	   itself is stored regardless of whether it compiles. */
+	script = sieve_storage_save_get_tempscript(save_ctx);
+	if (script == NULL)
+		return;
+
+	errors = str_new(default_pool, 256);
+	ehandler = sieve_strbuf_ehandler_create(svinst, errors, FALSE, 1);
+	if (sieve_compile_script(script, ehandler, SIEVE_COMPILE_FLAG_NOGLOBAL,
+				 &sbin, NULL) == 0) {
+		sieve_storage_save_set_binary(save_ctx, sbin, ehandler);
+		sieve_close(&sbin);
+	}
+	sieve_error_handler_unref(&ehandler);
+	str_free(&errors);
+}
+
 static int
 sieve_attribute_set_sieve(struct mail_storage *storage,
 			  const char *key,
@@ -363,6 +390,12 @@ sieve_attribute_set_sieve(struct mail_storage *storage,
 			sieve_storage_get_last_error(svstorage, NULL));
 		ret = -1;
 	}
+	if (ret == 0) {
+		struct sieve_mail_user *suser =
+			SIEVE_USER_CONTEXT(storage->user);
+
+		sieve_attribute_compile_script(suser->svinst, save_ctx);
+	}
 	if (ret < 0)
 		sieve_storage_save_cancel(&save_ctx);
 	else if (sieve_storage_save_commit(&save_ctx) < 0) {
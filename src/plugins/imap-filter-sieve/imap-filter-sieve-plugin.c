@@ -3,6 +3,8 @@
 #include "imap-common.h"
 #include "str.h"
 
+#include "sieve.h"
+
 #include "imap-filter-sieve.h"
 #include "imap-filter-sieve-plugin.h"
 
@@ -53,4 +55,6 @@ void imap_filter_sieve_plugin_deinit(void)
 
 	imap_filter_sieve_deinit();
 	imap_client_created_hook_set(next_hook_client_created);
+
+	sieve_caches_deinit();
 }
@@ -4,6 +4,7 @@
 #include "array.h"
 #include "hash.h"
 #include "str.h"
+#include "ioloop.h"
 #include "istream.h"
 #include "ostream.h"
 #include "module-context.h"
@@ -22,6 +23,11 @@
 #define MAILBOX_ATTRIBUTE_IMAPSIEVE_SCRIPT "imapsieve/script"
 #define MAIL_SERVER_ATTRIBUTE_IMAPSIEVE_SCRIPT "imapsieve/script"
 
+/* Maximum time a resolved script name is used without looking it up again.
+   Changes made by this process invalidate the cached names immediately;
+   this only bounds the delay for changes made by other processes. */
+#define IMAP_SIEVE_SCRIPT_CACHE_SECS 30
+
 #define IMAP_SIEVE_USER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, imap_sieve_user_module)
 #define IMAP_SIEVE_USER_CONTEXT_REQUIRE(obj) \
@@ -58,7 +64,17 @@ struct imap_sieve_user {
 
 	enum imap_sieve_command cur_cmd;
 
+	/* Cached /shared/imapsieve/script server attribute */
+	char *server_script;
+	time_t server_script_expire;
+	/* Incremented whenever an imapsieve/script attribute is changed by
+	   this process; cached script names from older generations are
+	   stale. */
+	unsigned int script_cache_gen;
+	unsigned int server_script_gen;
+
 	bool sieve_active:1;
+	bool server_script_cached:1;
 	bool user_script:1;
 	bool expunge_discarded:1;
 };
@@ -68,6 +84,13 @@ struct imap_sieve_mailbox {
 	struct imap_sieve_user *user;
 
 	struct event *event;
+
+	/* Cached /shared/imapsieve/script mailbox attribute */
+	char *script;
+	time_t script_expire;
+	unsigned int script_gen;
+
+	bool script_cached:1;
 };
 
 struct imap_sieve_mailbox_event {
@@ -116,11 +139,77 @@ struct event_category event_category_imap_sieve = {
  * Events
  */
 
+static bool
+imap_sieve_script_cache_valid(struct imap_sieve_user *isuser, bool cached,
+			      unsigned int gen, time_t expire)
+{
+	return (cached && gen == isuser->script_cache_gen &&
+		ioloop_time < expire);
+}
+
+static int
+imap_sieve_user_get_server_script(struct imap_sieve_mailbox *isbox,
+				  struct mail_user *user,
+				  const char **script_name_r)
+{
+	struct imap_sieve_user *isuser = isbox->user;
+	struct mail_attribute_value value;
+	struct mail_namespace *ns;
+	struct mailbox *inbox;
+	int ret;
+
+	*script_name_r = NULL;
+
+	if (imap_sieve_script_cache_valid(isuser, isuser->server_script_cached,
+					  isuser->server_script_gen,
+					  isuser->server_script_expire)) {
+		*script_name_r = isuser->server_script;
+		return (*script_name_r == NULL ? 0 : 1);
+	}
+
+	ns = mail_namespace_find_inbox(user->namespaces);
+	inbox = mailbox_alloc(ns->list, "INBOX", MAILBOX_FLAG_READONLY);
+	ret = mailbox_attribute_get(
+		inbox, MAIL_ATTRIBUTE_TYPE_SHARED,
+		MAILBOX_ATTRIBUTE_PREFIX_DOVECOT_PVT_SERVER
+		MAILBOX_ATTRIBUTE_IMAPSIEVE_SCRIPT, &value);
+
+	if (ret <= 0) {
+		if (ret < 0) {
+			e_error(isbox->event, "Failed to read /shared/"
+				MAIL_SERVER_ATTRIBUTE_IMAPSIEVE_SCRIPT" "
+				"server attribute: %s",
+				mailbox_get_last_internal_error(inbox, NULL));
+			mailbox_free(&inbox);
+			return -1;
+		}
+		e_debug(isbox->event,
+			"Server attribute /shared/"
+			MAIL_SERVER_ATTRIBUTE_IMAPSIEVE_SCRIPT" "
+			"not found");
+		value.value = NULL;
+	} else {
+		e_debug(isbox->event, "Server attribute /shared/"
+			MAIL_SERVER_ATTRIBUTE_IMAPSIEVE_SCRIPT" "
+			"points to Sieve script '%s'", value.value);
+	}
+
+	i_free(isuser->server_script);
+	isuser->server_script = i_strdup(value.value);
+	isuser->server_script_gen = isuser->script_cache_gen;
+	isuser->server_script_expire =
+		ioloop_time + IMAP_SIEVE_SCRIPT_CACHE_SECS;
+	isuser->server_script_cached = TRUE;
+	mailbox_free(&inbox);
+
+	*script_name_r = isuser->server_script;
+	return ret;
+}
+
 static int
 imap_sieve_mailbox_get_script_real(struct mailbox *box,
 				   const char **script_name_r)
 {
-	struct mail_user *user = box->storage->user;
 	struct imap_sieve_mailbox *isbox = IMAP_SIEVE_CONTEXT_REQUIRE(box);
 	struct mail_attribute_value value;
 	int ret;
@@ -142,56 +231,45 @@ imap_sieve_mailbox_get_script_real(struct mailbox *box,
 		e_debug(isbox->event, "Mailbox attribute /shared/"
 			MAILBOX_ATTRIBUTE_IMAPSIEVE_SCRIPT" "
 			"points to Sieve script '%s'", value.value);
-	/* If not found, get the name of the Sieve script from server METADATA.
-	 */
 	} else {
-		struct mail_namespace *ns;
-		struct mailbox *inbox;
-
 		e_debug(isbox->event, "Mailbox attribute /shared/"
 			MAILBOX_ATTRIBUTE_IMAPSIEVE_SCRIPT" "
 			"not found");
-
-		ns = mail_namespace_find_inbox(user->namespaces);
-		inbox = mailbox_alloc(ns->list, "INBOX", MAILBOX_FLAG_READONLY);
-		ret = mailbox_attribute_get(
-			inbox, MAIL_ATTRIBUTE_TYPE_SHARED,
-			MAILBOX_ATTRIBUTE_PREFIX_DOVECOT_PVT_SERVER
-			MAILBOX_ATTRIBUTE_IMAPSIEVE_SCRIPT, &value);
-
-		if (ret <= 0) {
-			if (ret < 0) {
-				e_error(isbox->event, "Failed to read /shared/"
-					MAIL_SERVER_ATTRIBUTE_IMAPSIEVE_SCRIPT" "
-					"server attribute: %s",
-					mailbox_get_last_internal_error(inbox, NULL));
-			} else if (ret == 0) {
-				e_debug(isbox->event,
-					"Server attribute /shared/"
-					MAIL_SERVER_ATTRIBUTE_IMAPSIEVE_SCRIPT" "
-					"not found");
-			}
-			mailbox_free(&inbox);
-			return ret;
-		}
-		mailbox_free(&inbox);
-
-		e_debug(isbox->event, "Server attribute /shared/"
-			MAIL_SERVER_ATTRIBUTE_IMAPSIEVE_SCRIPT" "
-			"points to Sieve script '%s'", value.value);
+		value.value = NULL;
 	}
 
-	*script_name_r = value.value;
-	return 1;
+	i_free(isbox->script);
+	isbox->script = i_strdup(value.value);
+	isbox->script_gen = isbox->user->script_cache_gen;
+	isbox->script_expire = ioloop_time + IMAP_SIEVE_SCRIPT_CACHE_SECS;
+	isbox->script_cached = TRUE;
+
+	*script_name_r = isbox->script;
+	return ret;
 }
 
 static int
 imap_sieve_mailbox_get_script(struct mailbox *box, const char **script_name_r)
 {
+	struct imap_sieve_mailbox *isbox = IMAP_SIEVE_CONTEXT_REQUIRE(box);
 	int ret;
 
-	ret = imap_sieve_mailbox_get_script_real(box, script_name_r);
-	return ret;
+	/* Use the cached mailbox attribute if it is still valid */
+	if (imap_sieve_script_cache_valid(isbox->user, isbox->script_cached,
+					  isbox->script_gen,
+					  isbox->script_expire)) {
+		*script_name_r = isbox->script;
+		ret = (*script_name_r == NULL ? 0 : 1);
+	} else {
+		ret = imap_sieve_mailbox_get_script_real(box, script_name_r);
+	}
+	if (ret != 0)
+		return ret;
+
+	/* If not found, get the name of the Sieve script from server METADATA.
+	 */
+	return imap_sieve_user_get_server_script(isbox, box->storage->user,
+						 script_name_r);
 }
 
 static struct imap_sieve_mailbox_event *
@@ -653,7 +731,23 @@ imap_sieve_mailbox_transaction_run(
 
 	/* Create transaction for event messages */
 	st = mailbox_transaction_begin(sbox, 0, __func__);
-	headers_ctx = mailbox_header_lookup_init(sbox, wanted_headers);
+	T_BEGIN {
+		ARRAY_TYPE(const_string) headers;
+
+		/* Prefetch the headers the scripts actually reference as well;
+		   this also opens all binaries once for the whole batch. */
+		t_array_init(&headers, 16);
+		array_append(&headers, wanted_headers,
+			     N_ELEMENTS(wanted_headers) - 1);
+		if (isrun != NULL)
+			imap_sieve_run_get_wanted_headers(isrun, &headers);
+		if (isrun_iflag != NULL)
+			imap_sieve_run_get_wanted_headers(isrun_iflag, &headers);
+		array_append_zero(&headers);
+
+		headers_ctx = mailbox_header_lookup_init(
+			sbox, array_front(&headers));
+	} T_END;
 	mail = mail_alloc(st, 0, headers_ctx);
 	mailbox_header_lookup_unref(&headers_ctx);
 
@@ -794,11 +888,29 @@ imap_sieve_mailbox_transaction_rollback(struct mailbox_transaction_context *t)
 		imap_sieve_mailbox_transaction_free(ismt);
 }
 
+static int
+imap_sieve_mailbox_attribute_set(struct mailbox_transaction_context *t,
+				 enum mail_attribute_type type, const char *key,
+				 const struct mail_attribute_value *value)
+{
+	struct imap_sieve_mailbox *isbox = IMAP_SIEVE_CONTEXT_REQUIRE(t->box);
+
+	/* Invalidate cached script names when the mailbox or server
+	   imapsieve/script attribute changes */
+	if (strcmp(key, MAILBOX_ATTRIBUTE_IMAPSIEVE_SCRIPT) == 0 ||
+	    strcmp(key, MAILBOX_ATTRIBUTE_PREFIX_DOVECOT_PVT_SERVER
+			MAIL_SERVER_ATTRIBUTE_IMAPSIEVE_SCRIPT) == 0)
+		isbox->user->script_cache_gen++;
+
+	return isbox->module_ctx.super.attribute_set(t, type, key, value);
+}
+
 static void imap_sieve_mailbox_free(struct mailbox *box)
 {
 	struct imap_sieve_mailbox *isbox = IMAP_SIEVE_CONTEXT_REQUIRE(box);
 
 	event_unref(&isbox->event);
+	i_free(isbox->script);
 
 	isbox->module_ctx.super.free(box);
 }
@@ -830,6 +942,7 @@ static void imap_sieve_mailbox_allocated(struct mailbox *box)
 	v->transaction_begin = imap_sieve_mailbox_transaction_begin;
 	v->transaction_commit = imap_sieve_mailbox_transaction_commit;
 	v->transaction_rollback = imap_sieve_mailbox_transaction_rollback;
+	v->attribute_set = imap_sieve_mailbox_attribute_set;
 	v->free = imap_sieve_mailbox_free;
 	MODULE_CONTEXT_SET(box, imap_sieve_storage_module, isbox);
 }
@@ -846,6 +959,7 @@ static void imap_sieve_user_deinit(struct mail_user *user)
 		imap_sieve_deinit(&isuser->isieve);
 
 	event_unref(&isuser->event);
+	i_free(isuser->server_script);
 
 	isuser->module_ctx.super.deinit(user);
 }
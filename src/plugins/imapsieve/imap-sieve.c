@@ -312,10 +312,14 @@ struct imap_sieve_run {
 	struct sieve_trace_config trace_config;
 	struct sieve_trace_log *trace_log;
 
+	/* Script environment shared by all messages of the run */
+	struct sieve_script_env scriptenv;
+
 	struct imap_sieve_run_script *scripts;
 	unsigned int scripts_count;
 
 	bool trace_log_initialized:1;
+	bool scriptenv_initialized:1;
 };
 
 ARRAY_DEFINE_TYPE(imap_sieve_run_script, struct imap_sieve_run_script);
@@ -696,6 +700,42 @@ imap_sieve_run_open_script(struct imap_sieve_run *isrun,
 	return sbin;
 }
 
+static enum sieve_compile_flags
+imap_sieve_run_script_compile_flags(const struct imap_sieve_run_script *rscript)
+{
+	if (rscript->user_script)
+		return SIEVE_COMPILE_FLAG_NOGLOBAL;
+	return SIEVE_COMPILE_FLAG_NO_ENVELOPE;
+}
+
+void imap_sieve_run_get_wanted_headers(struct imap_sieve_run *isrun,
+				       ARRAY_TYPE(const_string) *headers)
+{
+	struct imap_sieve_run_script *scripts = isrun->scripts;
+	unsigned int i;
+
+	for (i = 0; i < isrun->scripts_count; i++) {
+		enum sieve_error compile_error = SIEVE_ERROR_NONE;
+
+		if (scripts[i].binary == NULL) {
+			/* Already known to fail */
+			if (scripts[i].compile_error != SIEVE_ERROR_NONE)
+				continue;
+
+			/* Open the binary once for the whole batch */
+			scripts[i].binary = imap_sieve_run_open_script(
+				isrun, &scripts[i],
+				imap_sieve_run_script_compile_flags(&scripts[i]),
+				FALSE, &compile_error);
+			if (scripts[i].binary == NULL) {
+				scripts[i].compile_error = compile_error;
+				continue;
+			}
+		}
+		sieve_get_header_names(scripts[i].binary, headers);
+	}
+}
+
 static int
 imap_sieve_handle_exec_status(struct imap_sieve_run *isrun,
 			      struct imap_sieve_run_script *rscript, int status,
@@ -810,7 +850,7 @@ imap_sieve_run_scripts(struct imap_sieve_run *isrun,
 		bool user_script = scripts[i].user_script;
 		int mstatus;
 
-		cpflags = 0;
+		cpflags = imap_sieve_run_script_compile_flags(&scripts[i]);
 		exflags = SIEVE_EXECUTE_FLAG_NO_ENVELOPE |
 			  SIEVE_EXECUTE_FLAG_SKIP_RESPONSES;
 
@@ -823,11 +863,9 @@ imap_sieve_run_scripts(struct imap_sieve_run *isrun,
 
 		sieve_resource_usage_init(rusage);
 		if (user_script) {
-			cpflags |= SIEVE_COMPILE_FLAG_NOGLOBAL;
 			exflags |= SIEVE_EXECUTE_FLAG_NOGLOBAL;
 			ehandler = isrun->user_ehandler;
 		} else {
-			cpflags |= SIEVE_COMPILE_FLAG_NO_ENVELOPE;
 			ehandler = isieve->master_ehandler;
 		}
 
@@ -933,11 +971,46 @@ imap_sieve_run_scripts(struct imap_sieve_run *isrun,
 					     scriptenv->exec_status, fatal_r);
 }
 
+static int
+imap_sieve_run_init_scriptenv(struct imap_sieve_run *isrun)
+{
+	struct imap_sieve *isieve = isrun->isieve;
+	struct sieve_script_env *scriptenv = &isrun->scriptenv;
+	const char *error;
+
+	if (isrun->scriptenv_initialized)
+		return 0;
+
+	if (sieve_script_env_init(scriptenv, isieve->client->user,
+				  &error) < 0) {
+		e_error(sieve_get_event(isieve->svinst),
+			"Failed to initialize script execution: %s", error);
+		return -1;
+	}
+	scriptenv->smtp_start = imap_sieve_smtp_start;
+	scriptenv->smtp_add_rcpt = imap_sieve_smtp_add_rcpt;
+	scriptenv->smtp_send = imap_sieve_smtp_send;
+	scriptenv->smtp_abort = imap_sieve_smtp_abort;
+	scriptenv->smtp_finish = imap_sieve_smtp_finish;
+	scriptenv->duplicate_transaction_begin =
+		imap_sieve_duplicate_transaction_begin;
+	scriptenv->duplicate_transaction_commit =
+		imap_sieve_duplicate_transaction_commit;
+	scriptenv->duplicate_transaction_rollback =
+		imap_sieve_duplicate_transaction_rollback;
+	scriptenv->duplicate_mark = imap_sieve_duplicate_mark;
+	scriptenv->duplicate_check = imap_sieve_duplicate_check;
+	scriptenv->result_amend_log_message =
+		imap_sieve_result_amend_log_message;
+
+	isrun->scriptenv_initialized = TRUE;
+	return 0;
+}
+
 int imap_sieve_run_mail(struct imap_sieve_run *isrun, struct mail *mail,
 			const char *changed_flags, bool *fatal_r)
 {
 	struct imap_sieve *isieve = isrun->isieve;
-	struct sieve_instance *svinst = isieve->svinst;
 	struct mail_user *user = isieve->client->user;
 	struct sieve_message_data msgdata;
 	struct sieve_script_env scriptenv;
@@ -945,7 +1018,6 @@ int imap_sieve_run_mail(struct imap_sieve_run *isrun, struct mail *mail,
 	struct imap_sieve_context context;
 	struct sieve_trace_config trace_config;
 	struct sieve_trace_log *trace_log;
-	const char *error;
 	int ret;
 
 	*fatal_r = FALSE;
@@ -983,29 +1055,12 @@ int imap_sieve_run_mail(struct imap_sieve_run *isrun, struct mail *mail,
 
 		/* Compose script execution environment */
 
-		if (sieve_script_env_init(&scriptenv, user, &error) < 0) {
-			e_error(sieve_get_event(svinst),
-				"Failed to initialize script execution: %s",
-				error);
+		if (imap_sieve_run_init_scriptenv(isrun) < 0) {
 			ret = -1;
 		} else {
+			scriptenv = isrun->scriptenv;
 			scriptenv.default_mailbox =
 				mailbox_get_vname(mail->box);
-			scriptenv.smtp_start = imap_sieve_smtp_start;
-			scriptenv.smtp_add_rcpt = imap_sieve_smtp_add_rcpt;
-			scriptenv.smtp_send = imap_sieve_smtp_send;
-			scriptenv.smtp_abort = imap_sieve_smtp_abort;
-			scriptenv.smtp_finish = imap_sieve_smtp_finish;
-			scriptenv.duplicate_transaction_begin =
-				imap_sieve_duplicate_transaction_begin;
-			scriptenv.duplicate_transaction_commit =
-				imap_sieve_duplicate_transaction_commit;
-			scriptenv.duplicate_transaction_rollback =
-				imap_sieve_duplicate_transaction_rollback;
-			scriptenv.duplicate_mark = imap_sieve_duplicate_mark;
-			scriptenv.duplicate_check = imap_sieve_duplicate_check;
-			scriptenv.result_amend_log_message =
-				imap_sieve_result_amend_log_message;
 			scriptenv.trace_log = trace_log;
 			scriptenv.trace_config = trace_config;
 			scriptenv.script_context = &context;
@@ -53,6 +53,12 @@ int imap_sieve_run_init(struct imap_sieve *isieve,
 			const char *before_type, const char *after_type,
 			struct imap_sieve_run **isrun_r);
 
+/* Opens the binaries of all scripts for the run up front, so that these are
+   reused for every message, and appends the header fields these scripts
+   reference to the array. The names are allocated from the data stack. */
+void imap_sieve_run_get_wanted_headers(struct imap_sieve_run *isrun,
+				       ARRAY_TYPE(const_string) *headers);
+
 int imap_sieve_run_mail(struct imap_sieve_run *isrun, struct mail *mail,
 			const char *changed_flags, bool *fatal_r);
 
@@ -0,0 +1,72 @@
+/* Copyright (c) Pigeonhole authors, see top-level COPYING file */
+
+#include "lib.h"
+#include "message-size.h"
+#include "mail-storage.h"
+#include "mail-deliver.h"
+
+#include "sieve.h"
+
+#include "lda-sieve-msg-shared.h"
+
+/* Parsed data of the message delivered in the current session. A delivery
+   session covers exactly one message (one LMTP DATA command or one LDA run),
+   but the source mail of each recipient can still differ, e.g. when a
+   per-recipient header is added. Therefore, the data is only shared by the
+   recipients whose source mail has the same header and body size. */
+struct lda_sieve_msg_shared {
+	/* Reference to the pool of the delivery session; this keeps the
+	   session allocated, so that its address cannot be reused by a later
+	   session while the shared data is still around */
+	pool_t session_pool;
+	struct mail_deliver_session *session;
+
+	uoff_t hdr_size, body_size;
+
+	struct sieve_message_shared *shared;
+};
+
+static struct lda_sieve_msg_shared lda_sieve_msg_shared;
+
+static void lda_sieve_msg_shared_free(void)
+{
+	sieve_message_shared_unref(&lda_sieve_msg_shared.shared);
+	if (lda_sieve_msg_shared.session_pool != NULL)
+		pool_unref(&lda_sieve_msg_shared.session_pool);
+	i_zero(&lda_sieve_msg_shared);
+}
+
+struct sieve_message_shared *
+lda_sieve_msg_shared_get(struct mail_deliver_session *session,
+			 struct mail *mail)
+{
+	struct message_size hdr_size, body_size;
+	struct istream *input;
+
+	if (mail_get_stream(mail, &hdr_size, &body_size, &input) < 0) {
+		/* Script execution reports the actual error */
+		lda_sieve_msg_shared_free();
+		return NULL;
+	}
+
+	if (lda_sieve_msg_shared.shared != NULL &&
+	    lda_sieve_msg_shared.session == session &&
+	    lda_sieve_msg_shared.hdr_size == hdr_size.physical_size &&
+	    lda_sieve_msg_shared.body_size == body_size.physical_size)
+		return lda_sieve_msg_shared.shared;
+
+	/* Different session or different source mail */
+	lda_sieve_msg_shared_free();
+	lda_sieve_msg_shared.shared = sieve_message_shared_create();
+	lda_sieve_msg_shared.session = session;
+	lda_sieve_msg_shared.session_pool = session->pool;
+	pool_ref(lda_sieve_msg_shared.session_pool);
+	lda_sieve_msg_shared.hdr_size = hdr_size.physical_size;
+	lda_sieve_msg_shared.body_size = body_size.physical_size;
+	return lda_sieve_msg_shared.shared;
+}
+
+void lda_sieve_msg_shared_deinit(void)
+{
+	lda_sieve_msg_shared_free();
+}
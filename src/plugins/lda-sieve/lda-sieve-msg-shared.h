@@ -0,0 +1,16 @@
+#ifndef LDA_SIEVE_MSG_SHARED_H
+#define LDA_SIEVE_MSG_SHARED_H
+
+struct mail;
+struct mail_deliver_session;
+struct sieve_message_shared;
+
+/* Get the parsed message data shared by the recipients of this delivery
+   session that see the same source mail. Returns NULL when the mail cannot be
+   read. */
+struct sieve_message_shared *
+lda_sieve_msg_shared_get(struct mail_deliver_session *session,
+			 struct mail *mail);
+void lda_sieve_msg_shared_deinit(void);
+
+#endif
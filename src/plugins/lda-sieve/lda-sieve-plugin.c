@@ -20,6 +20,7 @@
 #include "sieve-script.h"
 #include "sieve-storage.h"
 
+#include "lda-sieve-msg-shared.h"
 #include "lda-sieve-plugin.h"
 
 #include <sys/stat.h>
@@ -915,6 +916,8 @@ lda_sieve_execute(struct lda_sieve_run_context *srctx,
 	msgdata.envelope.rcpt_to = mdctx->rcpt_to;
 	msgdata.envelope.rcpt_params = &mdctx->rcpt_params;
 	(void)mail_get_message_id(msgdata.mail, &msgdata.id);
+	msgdata.shared = lda_sieve_msg_shared_get(mdctx->session,
+						  mdctx->src_mail);
 
 	srctx->msgdata = &msgdata;
 
@@ -1052,4 +1055,7 @@ void sieve_plugin_deinit(void)
 {
 	/* Remove hook */
 	mail_deliver_hook_set(next_deliver_mail);
+
+	lda_sieve_msg_shared_deinit();
+	sieve_caches_deinit();
 }
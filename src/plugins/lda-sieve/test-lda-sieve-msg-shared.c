@@ -0,0 +1,242 @@
+/* Copyright (c) Pigeonhole authors, see top-level COPYING file */
+
+#include "lib.h"
+#include "test-common.h"
+#include "test-dir.h"
+#include "istream.h"
+#include "unlink-directory.h"
+#include "master-service.h"
+#include "master-service-settings.h"
+#include "mail-storage.h"
+#include "mail-storage-service.h"
+#include "mail-user.h"
+#include "mail-deliver.h"
+
+#include "sieve.h"
+#include "mail-raw.h"
+
+#include "lda-sieve-msg-shared.h"
+
+#include <time.h>
+#include <unistd.h>
+
+static pool_t test_pool;
+
+static struct mail_storage_service_ctx *mail_storage_service = NULL;
+static struct mail_user *test_mail_user = NULL;
+static struct mail_storage_service_user *test_service_user = NULL;
+static const char *mail_home;
+
+static struct mail_user *test_raw_mail_user = NULL;
+
+static const char *test_message =
+	"From: stephan@example.org\r\n"
+	"To: team@example.org\r\n"
+	"Subject: Frop\r\n"
+	"\r\n"
+	"Frop!\r\n";
+/* The same message as delivered to another recipient */
+static const char *test_message_rcpt =
+	"Delivered-To: timo@example.org\r\n"
+	"From: stephan@example.org\r\n"
+	"To: team@example.org\r\n"
+	"Subject: Frop\r\n"
+	"\r\n"
+	"Frop!\r\n";
+
+static int test_init_mail_user(void)
+{
+	const char *error;
+
+	mail_home = p_strdup_printf(test_pool, "%s/test_user.%ld.%ld",
+				    test_dir_get(), (long)time(NULL),
+				    (long)getpid());
+
+	struct mail_storage_service_input input = {
+		.userdb_fields = (const char*const[]){
+			"mail_driver=maildir",
+			"mail_path=~/",
+			t_strdup_printf("home=%s", mail_home),
+			NULL
+		},
+		.username = "test@example.com",
+		.no_userdb_lookup = TRUE,
+		.debug = TRUE,
+	};
+
+	mail_storage_service = mail_storage_service_init(
+		master_service,
+		(MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+		 MAIL_STORAGE_SERVICE_FLAG_NO_LOG_INIT |
+		 MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS));
+
+	if (mail_storage_service_lookup(mail_storage_service, &input,
+					&test_service_user, &error) < 0) {
+		i_error("Cannot lookup test user: %s", error);
+		return -1;
+	}
+
+	if (mail_storage_service_next(mail_storage_service, test_service_user,
+				      &test_mail_user, &error) < 0) {
+		i_error("Cannot lookup test user: %s", error);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void test_deinit_mail_user(void)
+{
+	const char *error;
+
+	mail_user_unref(&test_mail_user);
+	mail_storage_service_user_unref(&test_service_user);
+	mail_storage_service_deinit(&mail_storage_service);
+	if (unlink_directory(mail_home, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0)
+		i_error("unlink_directory(%s) failed: %s", mail_home, error);
+}
+
+static void test_msg_shared_init(void)
+{
+	test_pool = pool_alloconly_create(MEMPOOL_GROWING"test pool", 128);
+
+	test_init_mail_user();
+	test_raw_mail_user = mail_raw_user_create(test_mail_user);
+}
+
+static void test_msg_shared_deinit(void)
+{
+	lda_sieve_msg_shared_deinit();
+	mail_user_unref(&test_raw_mail_user);
+	test_deinit_mail_user();
+	pool_unref(&test_pool);
+}
+
+static struct mail_raw *test_mail_open(const char *message)
+{
+	struct istream *input;
+	struct mail_raw *rawmail;
+
+	input = i_stream_create_from_data(message, strlen(message));
+	rawmail = mail_raw_open_stream(test_raw_mail_user, input);
+	i_stream_unref(&input);
+	return rawmail;
+}
+
+static void test_msg_shared_same_mail(void)
+{
+	struct mail_deliver_session *session;
+	struct mail_raw *rawmail1, *rawmail2;
+	struct sieve_message_shared *shared1, *shared2;
+
+	test_begin("lda-sieve shared message - same source mail");
+	test_msg_shared_init();
+
+	/* Each recipient has its own mail object for the same message */
+	session = mail_deliver_session_init();
+	rawmail1 = test_mail_open(test_message);
+	rawmail2 = test_mail_open(test_message);
+
+	shared1 = lda_sieve_msg_shared_get(session, rawmail1->mail);
+	shared2 = lda_sieve_msg_shared_get(session, rawmail2->mail);
+	test_assert(shared1 != NULL);
+	test_assert(shared1 == shared2);
+
+	mail_raw_close(&rawmail1);
+	mail_raw_close(&rawmail2);
+	mail_deliver_session_deinit(&session);
+
+	test_msg_shared_deinit();
+	test_end();
+}
+
+static void test_msg_shared_different_mail(void)
+{
+	struct mail_deliver_session *session;
+	struct mail_raw *rawmail1, *rawmail2;
+	struct sieve_message_shared *shared1, *shared2;
+
+	test_begin("lda-sieve shared message - different source mail");
+	test_msg_shared_init();
+
+	/* The second recipient sees an additional header */
+	session = mail_deliver_session_init();
+	rawmail1 = test_mail_open(test_message);
+	rawmail2 = test_mail_open(test_message_rcpt);
+
+	shared1 = lda_sieve_msg_shared_get(session, rawmail1->mail);
+	test_assert(shared1 != NULL);
+	sieve_message_shared_ref(shared1);
+	shared2 = lda_sieve_msg_shared_get(session, rawmail2->mail);
+	test_assert(shared2 != NULL);
+	test_assert(shared1 != shared2);
+	sieve_message_shared_unref(&shared1);
+
+	mail_raw_close(&rawmail1);
+	mail_raw_close(&rawmail2);
+	mail_deliver_session_deinit(&session);
+
+	test_msg_shared_deinit();
+	test_end();
+}
+
+static void test_msg_shared_different_session(void)
+{
+	struct mail_deliver_session *session1, *session2;
+	struct mail_raw *rawmail;
+	struct sieve_message_shared *shared1, *shared2;
+
+	test_begin("lda-sieve shared message - different session");
+	test_msg_shared_init();
+
+	rawmail = test_mail_open(test_message);
+
+	session1 = mail_deliver_session_init();
+	shared1 = lda_sieve_msg_shared_get(session1, rawmail->mail);
+	test_assert(shared1 != NULL);
+	sieve_message_shared_ref(shared1);
+	mail_deliver_session_deinit(&session1);
+
+	session2 = mail_deliver_session_init();
+	shared2 = lda_sieve_msg_shared_get(session2, rawmail->mail);
+	test_assert(shared2 != NULL);
+	test_assert(shared1 != shared2);
+	sieve_message_shared_unref(&shared1);
+	mail_deliver_session_deinit(&session2);
+
+	mail_raw_close(&rawmail);
+
+	test_msg_shared_deinit();
+	test_end();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*test_functions[])(void) = {
+		test_msg_shared_same_mail,
+		test_msg_shared_different_mail,
+		test_msg_shared_different_session,
+		NULL
+	};
+	const enum master_service_flags service_flags =
+		MASTER_SERVICE_FLAG_STANDALONE |
+		MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+		MASTER_SERVICE_FLAG_CONFIG_BUILTIN;
+	const char *error;
+	int ret;
+
+	master_service = master_service_init("test-lda-sieve-msg-shared",
+					     service_flags, &argc, &argv, "");
+	if (master_service_settings_read_simple(master_service, &error) < 0)
+		i_fatal("%s", error);
+	master_service_init_finish(master_service);
+
+	test_init();
+	test_dir_init("lda-sieve-msg-shared");
+	ret = test_run(test_functions);
+
+	master_service_deinit(&master_service);
+
+	return ret;
+}
@@ -0,0 +1,605 @@
+/* Copyright (c) Pigeonhole authors, see top-level COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "ostream.h"
+#include "read-full.h"
+#include "time-util.h"
+#include "stats-dist.h"
+#include "mail-storage.h"
+#include "master-service.h"
+
+#include "sieve.h"
+#include "sieve-binary.h"
+#include "sieve-execute.h"
+#include "sieve-interpreter.h"
+#include "sieve-result.h"
+
+#include "sieve-tool.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+
+/*
+ * Configuration
+ */
+
+#define DEFAULT_ITERATIONS 100
+
+/*
+ * Print help
+ */
+
+static void print_help(void)
+{
+	printf(
+"Usage: sieve-bench [-a <orig-recipient-address>] [-c <config-file>]\n"
+"                   [-D] [-e] [-f <envelope-sender>] [-m <default-mailbox>]\n"
+"                   [-n <iterations>] [-P <plugin>]\n"
+"                   [-r <recipient-address>] [-x <extensions>]\n"
+"                   <script-file> <mail-file|mail-dir> [...]\n"
+	);
+}
+
+/*
+ * Benchmark state
+ */
+
+struct sieve_bench_message {
+	const char *path;
+	string_t *data;
+};
+
+struct sieve_bench {
+	struct sieve_instance *svinst;
+	struct sieve_error_handler *ehandler;
+	struct sieve_script_env scriptenv;
+	struct sieve_exec_status estatus;
+
+	ARRAY(struct sieve_bench_message) messages;
+	unsigned int iterations;
+
+	struct stats_dist *compile_time;
+	struct stats_dist *load_time;
+	struct stats_dist *execute_time;
+	struct stats_dist *commit_time;
+	struct stats_dist *execute_alloc;
+
+	unsigned int failures;
+
+	bool commit:1;
+};
+
+static void sieve_bench_time_add(struct stats_dist *dist,
+				 const struct timeval *start)
+{
+	struct timeval end;
+
+	i_gettimeofday(&end);
+	stats_dist_add(dist, timeval_diff_usecs(&end, start));
+}
+
+/*
+ * Dummy SMTP session
+ */
+
+struct sieve_bench_smtp {
+	buffer_t *buffer;
+	struct ostream *output;
+};
+
+static void *
+sieve_smtp_start(const struct sieve_script_env *senv ATTR_UNUSED,
+		 const struct smtp_address *mail_from ATTR_UNUSED)
+{
+	struct sieve_bench_smtp *smtp;
+
+	smtp = i_new(struct sieve_bench_smtp, 1);
+	smtp->buffer = buffer_create_dynamic(default_pool, 1024);
+	smtp->output = o_stream_create_buffer(smtp->buffer);
+	return smtp;
+}
+
+static void
+sieve_smtp_add_rcpt(const struct sieve_script_env *senv ATTR_UNUSED,
+		    void *handle ATTR_UNUSED,
+		    const struct smtp_address *rcpt_to ATTR_UNUSED)
+{
+}
+
+static struct ostream *
+sieve_smtp_send(const struct sieve_script_env *senv ATTR_UNUSED, void *handle)
+{
+	struct sieve_bench_smtp *smtp = handle;
+
+	return smtp->output;
+}
+
+static void sieve_smtp_free(struct sieve_bench_smtp *smtp)
+{
+	o_stream_unref(&smtp->output);
+	buffer_free(&smtp->buffer);
+	i_free(smtp);
+}
+
+static void
+sieve_smtp_abort(const struct sieve_script_env *senv ATTR_UNUSED, void *handle)
+{
+	sieve_smtp_free(handle);
+}
+
+static int
+sieve_smtp_finish(const struct sieve_script_env *senv ATTR_UNUSED, void *handle,
+		  const char **error_r ATTR_UNUSED)
+{
+	sieve_smtp_free(handle);
+	return 1;
+}
+
+/*
+ * Dummy duplicate check implementation
+ */
+
+static void *
+duplicate_transaction_begin(const struct sieve_script_env *senv ATTR_UNUSED)
+{
+	return NULL;
+}
+
+static void duplicate_transaction_commit(void **_dup_trans ATTR_UNUSED)
+{
+}
+
+static void duplicate_transaction_rollback(void **_dup_trans ATTR_UNUSED)
+{
+}
+
+static int
+duplicate_check(void *_dup_trans ATTR_UNUSED,
+		const struct sieve_script_env *senv ATTR_UNUSED,
+		const void *id ATTR_UNUSED, size_t id_size ATTR_UNUSED)
+{
+	return 0;
+}
+
+static void
+duplicate_mark(void *_dup_trans ATTR_UNUSED,
+	       const struct sieve_script_env *senv ATTR_UNUSED,
+	       const void *id ATTR_UNUSED, size_t id_size ATTR_UNUSED,
+	       time_t time ATTR_UNUSED)
+{
+}
+
+/*
+ * Message corpus
+ */
+
+static void
+sieve_bench_message_read(struct sieve_bench *bench, const char *path)
+{
+	struct sieve_bench_message *msg;
+	struct stat st;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		i_fatal("open(%s) failed: %m", path);
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", path);
+
+	msg = array_append_space(&bench->messages);
+	msg->path = i_strdup(path);
+	msg->data = str_new(default_pool, st.st_size + 1);
+	if (st.st_size > 0) {
+		ret = read_full(fd, buffer_append_space_unsafe(
+					msg->data, st.st_size), st.st_size);
+		if (ret < 0)
+			i_fatal("read(%s) failed: %m", path);
+		if (ret == 0)
+			i_fatal("read(%s) failed: file was truncated", path);
+	}
+	i_close_fd(&fd);
+}
+
+static void
+sieve_bench_corpus_add(struct sieve_bench *bench, const char *path)
+{
+	struct dirent *dp;
+	struct stat st;
+	DIR *dir;
+
+	if (stat(path, &st) < 0)
+		i_fatal("stat(%s) failed: %m", path);
+	if (!S_ISDIR(st.st_mode)) {
+		sieve_bench_message_read(bench, path);
+		return;
+	}
+
+	/* Read all regular files in the directory (e.g. a Maildir cur/) */
+	dir = opendir(path);
+	if (dir == NULL)
+		i_fatal("opendir(%s) failed: %m", path);
+	while ((dp = readdir(dir)) != NULL) T_BEGIN {
+		const char *file;
+
+		if (dp->d_name[0] != '.') {
+			file = t_strconcat(path, "/", dp->d_name, NULL);
+			if (stat(file, &st) < 0)
+				i_fatal("stat(%s) failed: %m", file);
+			if (S_ISREG(st.st_mode))
+				sieve_bench_message_read(bench, file);
+		}
+	} T_END;
+	if (closedir(dir) < 0)
+		i_error("closedir(%s) failed: %m", path);
+}
+
+static void sieve_bench_corpus_free(struct sieve_bench *bench)
+{
+	struct sieve_bench_message *msg;
+
+	array_foreach_modifiable(&bench->messages, msg) {
+		i_free(msg->path);
+		str_free(&msg->data);
+	}
+	array_free(&bench->messages);
+}
+
+/*
+ * Benchmark phases
+ */
+
+static struct sieve_binary *
+sieve_bench_compile(struct sieve_bench *bench, const char *scriptfile)
+{
+	struct sieve_binary *sbin = NULL;
+	struct timeval start;
+	unsigned int i;
+
+	for (i = 0; i < bench->iterations; i++) {
+		if (sbin != NULL)
+			sieve_close(&sbin);
+
+		i_gettimeofday(&start);
+		sbin = sieve_tool_script_compile(sieve_tool, scriptfile);
+		sieve_bench_time_add(bench->compile_time, &start);
+	}
+	return sbin;
+}
+
+static void
+sieve_bench_load(struct sieve_bench *bench, const char *bin_path)
+{
+	struct sieve_binary *sbin;
+	enum sieve_error error_code;
+	struct timeval start;
+	unsigned int i;
+
+	for (i = 0; i < bench->iterations; i++) {
+		i_gettimeofday(&start);
+		if (sieve_load(bench->svinst, bin_path,
+			       &sbin, &error_code) < 0) {
+			i_error("failed to load binary %s", bin_path);
+			bench->failures++;
+			return;
+		}
+		sieve_bench_time_add(bench->load_time, &start);
+		sieve_close(&sbin);
+	}
+}
+
+static int
+sieve_bench_execute_once(struct sieve_bench *bench, struct sieve_binary *sbin,
+			 const struct sieve_message_data *msgdata)
+{
+	struct sieve_interpreter *interp;
+	struct sieve_result *result;
+	struct sieve_result_execution *rexec;
+	struct sieve_execute_env eenv;
+	struct timeval start;
+	pool_t pool;
+	int ret;
+
+	pool = pool_alloconly_create("sieve execution", 4096);
+	sieve_execute_init(&eenv, bench->svinst, pool, msgdata,
+			   &bench->scriptenv, 0);
+	result = sieve_result_create(bench->svinst, pool, &eenv);
+
+	/* Run the interpreter */
+	i_gettimeofday(&start);
+	interp = sieve_interpreter_create(sbin, NULL, &eenv, bench->ehandler);
+	if (interp == NULL)
+		ret = SIEVE_EXEC_BIN_CORRUPT;
+	else {
+		ret = sieve_interpreter_run(interp, result);
+		sieve_interpreter_free(&interp);
+	}
+	sieve_bench_time_add(bench->execute_time, &start);
+
+	/* Execute and commit the result */
+	if (bench->commit) {
+		i_gettimeofday(&start);
+		rexec = sieve_result_execution_create(result, pool);
+		ret = sieve_result_execute(rexec, ret, TRUE,
+					   bench->ehandler, NULL);
+		sieve_result_execution_destroy(&rexec);
+		sieve_bench_time_add(bench->commit_time, &start);
+	}
+
+	stats_dist_add(bench->execute_alloc,
+		       pool_alloconly_get_total_used_size(pool));
+
+	sieve_result_unref(&result);
+	sieve_execute_finish(&eenv, ret);
+	sieve_execute_deinit(&eenv);
+	pool_unref(&pool);
+
+	return ret;
+}
+
+static void
+sieve_bench_execute(struct sieve_bench *bench, struct sieve_binary *sbin,
+		    const struct smtp_address *mail_from,
+		    const struct smtp_address *rcpt_to,
+		    const struct smtp_address *final_rcpt_to,
+		    const char *mailbox)
+{
+	const struct sieve_bench_message *msg;
+	unsigned int i;
+
+	bench->scriptenv.default_mailbox = mailbox;
+
+	for (i = 0; i < bench->iterations; i++) {
+		array_foreach(&bench->messages, msg) T_BEGIN {
+			struct sieve_message_data msgdata;
+			struct mail *mail;
+			int ret;
+
+			/* Every run gets a fresh mail object, so that nothing
+			   parsed in an earlier run is reused */
+			mail = sieve_tool_open_data_as_mail(sieve_tool,
+							    msg->data);
+
+			i_zero(&msgdata);
+			msgdata.mail = mail;
+			msgdata.auth_user = sieve_tool_get_username(sieve_tool);
+			(void)mail_get_message_id(mail, &msgdata.id);
+
+			sieve_tool_get_envelope_data(&msgdata, mail, mail_from,
+						     rcpt_to, final_rcpt_to);
+
+			i_zero(&bench->estatus);
+			ret = sieve_bench_execute_once(bench, sbin, &msgdata);
+			if (ret != SIEVE_EXEC_OK) {
+				if (bench->failures == 0) {
+					i_error("%s: execution failed: %s",
+						msg->path,
+						sieve_execution_exitcode_to_str(ret));
+				}
+				bench->failures++;
+			}
+		} T_END;
+	}
+}
+
+/*
+ * Report
+ */
+
+static void
+sieve_bench_report_line(const char *name, const char *unit,
+			const struct stats_dist *dist)
+{
+	if (stats_dist_get_count(dist) == 0) {
+		printf("%-16s %10s\n", name, "-");
+		return;
+	}
+
+	printf("%-16s %10u %10"PRIu64" %10"PRIu64" %10"PRIu64
+	       " %10"PRIu64"  %s\n", name, stats_dist_get_count(dist),
+	       stats_dist_get_min(dist), stats_dist_get_median(dist),
+	       stats_dist_get_percentile(dist, 0.99),
+	       stats_dist_get_max(dist), unit);
+}
+
+static void sieve_bench_report(struct sieve_bench *bench)
+{
+	struct sieve_binary_cache_stats cache_stats;
+
+	printf("%-16s %10s %10s %10s %10s %10s\n",
+	       "phase", "count", "min", "p50", "p99", "max");
+	sieve_bench_report_line("compile", "usecs", bench->compile_time);
+	sieve_bench_report_line("load", "usecs", bench->load_time);
+	sieve_bench_report_line("execute", "usecs", bench->execute_time);
+	sieve_bench_report_line("result-commit", "usecs", bench->commit_time);
+	sieve_bench_report_line("execute-alloc", "bytes",
+				bench->execute_alloc);
+
+	/* Only used when sieve_binary_cache_size is set */
+	sieve_binary_cache_get_stats(&cache_stats);
+	printf("\nbinary cache: hits=%u misses=%u evictions=%u "
+	       "count=%u size=%"PRIuUOFF_T"\n",
+	       cache_stats.hits, cache_stats.misses, cache_stats.evictions,
+	       cache_stats.count, cache_stats.size);
+	if (bench->failures > 0)
+		printf("\n%u failed runs\n", bench->failures);
+}
+
+/*
+ * Tool implementation
+ */
+
+int main(int argc, char **argv)
+{
+	struct sieve_bench bench;
+	const char *scriptfile, *mailbox, *bin_path, *errstr;
+	struct smtp_address *rcpt_to, *final_rcpt_to, *mail_from;
+	struct sieve_binary *sbin;
+	unsigned int sample_count;
+	int exit_status = EXIT_SUCCESS;
+	int c;
+
+	sieve_tool = sieve_tool_init("sieve-bench", &argc, &argv,
+				     "r:a:f:m:n:eu:", FALSE);
+
+	i_zero(&bench);
+	bench.iterations = DEFAULT_ITERATIONS;
+	i_array_init(&bench.messages, 16);
+
+	/* Parse arguments */
+	mailbox = NULL;
+	mail_from = final_rcpt_to = rcpt_to = NULL;
+	while ((c = sieve_tool_getopt(sieve_tool)) > 0) {
+		switch (c) {
+		case 'r':
+			/* final recipient address */
+			if (smtp_address_parse_mailbox(
+				pool_datastack_create(), optarg,
+				SMTP_ADDRESS_PARSE_FLAG_ALLOW_LOCALPART,
+				&final_rcpt_to, &errstr) < 0)
+				i_fatal("Invalid -r parameter: %s", errstr);
+			break;
+		case 'a':
+			/* original recipient address */
+			if (smtp_address_parse_mailbox(
+				pool_datastack_create(), optarg,
+				SMTP_ADDRESS_PARSE_FLAG_ALLOW_LOCALPART,
+				&rcpt_to, &errstr) < 0)
+				i_fatal("Invalid -a parameter: %s", errstr);
+			break;
+		case 'f':
+			/* envelope sender address */
+			if (smtp_address_parse_mailbox(
+				pool_datastack_create(), optarg,
+				0, &mail_from, &errstr) < 0)
+				i_fatal("Invalid -f parameter: %s", errstr);
+			break;
+		case 'm':
+			/* default mailbox (keep box) */
+			mailbox = optarg;
+			break;
+		case 'n':
+			/* number of iterations */
+			if (str_to_uint(optarg, &bench.iterations) < 0 ||
+			    bench.iterations == 0) {
+				i_fatal_status(EX_USAGE,
+					"Invalid -n parameter: %s", optarg);
+			}
+			break;
+		case 'e':
+			/* execute and commit the result */
+			bench.commit = TRUE;
+			break;
+		default:
+			/* unrecognized option */
+			print_help();
+			i_fatal_status(EX_USAGE, "Unknown argument: %c", c);
+			break;
+		}
+	}
+
+	if (optind < argc)
+		scriptfile = argv[optind++];
+	else {
+		print_help();
+		i_fatal_status(EX_USAGE, "Missing <script-file> argument");
+	}
+
+	if (optind >= argc) {
+		print_help();
+		i_fatal_status(EX_USAGE, "Missing <mail-file> argument");
+	}
+	for (; optind < argc; optind++)
+		sieve_bench_corpus_add(&bench, argv[optind]);
+	if (array_count(&bench.messages) == 0)
+		i_fatal("No messages found in the provided corpus");
+
+	/* Finish tool initialization */
+	bench.svinst = sieve_tool_init_finish(sieve_tool, bench.commit, FALSE);
+
+	/* Create error handler */
+	bench.ehandler = sieve_stderr_ehandler_create(bench.svinst, 0);
+	sieve_error_handler_accept_infolog(bench.ehandler, FALSE);
+	sieve_error_handler_accept_debuglog(bench.ehandler,
+					    bench.svinst->debug);
+
+	/* Compose script environment */
+	if (sieve_script_env_init(&bench.scriptenv,
+				  sieve_tool_get_mail_user(sieve_tool),
+				  &errstr) < 0) {
+		i_fatal("Failed to initialize script execution: %s",
+			errstr);
+	}
+
+	bench.scriptenv.smtp_start = sieve_smtp_start;
+	bench.scriptenv.smtp_add_rcpt = sieve_smtp_add_rcpt;
+	bench.scriptenv.smtp_send = sieve_smtp_send;
+	bench.scriptenv.smtp_abort = sieve_smtp_abort;
+	bench.scriptenv.smtp_finish = sieve_smtp_finish;
+	bench.scriptenv.duplicate_transaction_begin =
+		duplicate_transaction_begin;
+	bench.scriptenv.duplicate_transaction_commit =
+		duplicate_transaction_commit;
+	bench.scriptenv.duplicate_transaction_rollback =
+		duplicate_transaction_rollback;
+	bench.scriptenv.duplicate_mark = duplicate_mark;
+	bench.scriptenv.duplicate_check = duplicate_check;
+	bench.scriptenv.exec_status = &bench.estatus;
+
+	/* Keep all samples, so that the percentiles are exact */
+	sample_count = bench.iterations * array_count(&bench.messages);
+	bench.compile_time = stats_dist_init_with_size(bench.iterations);
+	bench.load_time = stats_dist_init_with_size(bench.iterations);
+	bench.execute_time = stats_dist_init_with_size(sample_count);
+	bench.commit_time = stats_dist_init_with_size(sample_count);
+	bench.execute_alloc = stats_dist_init_with_size(sample_count);
+
+	/* Compile; sieve_tool_script_compile() is fatal upon failure */
+	sbin = sieve_bench_compile(&bench, scriptfile);
+
+	/* Save and load the binary */
+	if (sieve_save(sbin, TRUE, NULL) < 0) {
+		i_error("failed to save binary; "
+			"skipping load benchmark");
+		exit_status = EXIT_FAILURE;
+	} else {
+		bin_path = t_strdup(sieve_binary_path(sbin));
+		sieve_close(&sbin);
+
+		sieve_bench_load(&bench, bin_path);
+		if (sieve_load(bench.svinst, bin_path, &sbin, NULL) < 0) {
+			i_fatal("failed to load binary %s", bin_path);
+		}
+	}
+
+	/* Execute */
+	if (mailbox == NULL)
+		mailbox = "INBOX";
+	sieve_bench_execute(&bench, sbin, mail_from, rcpt_to, final_rcpt_to,
+			    mailbox);
+	sieve_close(&sbin);
+
+	sieve_bench_report(&bench);
+	if (bench.failures > 0)
+		exit_status = EXIT_FAILURE;
+
+	stats_dist_deinit(&bench.compile_time);
+	stats_dist_deinit(&bench.load_time);
+	stats_dist_deinit(&bench.execute_time);
+	stats_dist_deinit(&bench.commit_time);
+	stats_dist_deinit(&bench.execute_alloc);
+	sieve_bench_corpus_free(&bench);
+
+	/* Cleanup error handler */
+	sieve_error_handler_unref(&bench.ehandler);
+
+	sieve_tool_deinit(&sieve_tool);
+
+	return exit_status;
+}
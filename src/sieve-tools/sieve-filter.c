@@ -8,6 +8,11 @@
 #include "str-sanitize.h"
 #include "ostream.h"
 #include "array.h"
+#include "read-full.h"
+#include "safe-mkstemp.h"
+#include "write-full.h"
+#include "time-util.h"
+#include "seq-range-array.h"
 #include "mail-namespace.h"
 #include "mail-storage.h"
 #include "mail-search-build.h"
@@ -23,6 +28,13 @@
 #include <fcntl.h>
 #include <pwd.h>
 #include <sysexits.h>
+#include <sys/wait.h>
+
+/*
+ * Configuration
+ */
+
+#define DEFAULT_BATCH_SIZE 1000
 
 /*
  * Print help
@@ -31,8 +43,9 @@
 static void print_help(void)
 {
 	printf(
-"Usage: sieve-filter [-c <config-file>] [-C] [-D] [-e] [-m <default-mailbox>]\n"
-"                    [-P <plugin>] [-q <output-mailbox>] [-Q <mail-command>]\n"
+"Usage: sieve-filter [-b <batch-size>] [-c <config-file>] [-C] [-D] [-e]\n"
+"                    [-j <jobs>] [-m <default-mailbox>] [-P <plugin>]\n"
+"                    [-q <output-mailbox>] [-Q <mail-command>]\n"
 "                    [-s <script-file>] [-u <user>] [-v] [-W] [-x <extensions>]\n"
 "                    <script-file> <source-mailbox> [<discard-action>]\n"
 	);
@@ -47,23 +60,45 @@ enum sieve_filter_discard_action {
 
 struct sieve_filter_data {
 	enum sieve_filter_discard_action discard_action;
-	struct mailbox *move_mailbox;
+	const char *src_mailbox;
+	const char *move_mailbox;
+	enum mailbox_flags open_flags;
 
+	struct mail_user *mail_user;
 	struct sieve_script_env *senv;
 	struct sieve_binary *main_sbin;
 	struct sieve_error_handler *ehandler;
 
+	/* Number of worker processes (0 = no -j argument) */
+	unsigned int jobs;
+	/* Number of messages filtered in one mailbox transaction */
+	unsigned int batch_size;
+
 	bool execute:1;
 	bool source_write:1;
 	bool default_move:1;
 };
 
+struct sieve_filter_progress {
+	unsigned int total, done;
+	struct timeval start;
+	time_t last_report;
+};
+
 struct sieve_filter_context {
 	const struct sieve_filter_data *data;
 
+	struct mailbox *src_box;
+	struct mailbox *move_box;
 	struct mailbox_transaction_context *move_trans;
 
 	struct ostream *teststream;
+	/* Test output goes here (stdout unless this is a worker) */
+	int output_fd;
+
+	/* Workers report progress to the parent through this pipe */
+	int progress_fd;
+	struct sieve_filter_progress progress;
 };
 
 static const char *
@@ -163,7 +198,7 @@ static int filter_message(struct sieve_filter_context *sfctx, struct mail *mail)
 
 	/* Handle message in source folder */
 	if (ret > 0) {
-		struct mailbox *move_box = sfctx->data->move_mailbox;
+		struct mailbox *move_box = sfctx->move_box;
 		enum sieve_filter_discard_action discard_action =
 			sfctx->data->discard_action;
 
@@ -290,48 +325,195 @@ mail_search_build_add_flags(struct mail_search_args *args,
 	args->args = arg;
 }
 
+static void
+mail_search_build_add_uids(struct mail_search_args *args,
+			   const uint32_t *uids, unsigned int count)
+{
+	struct mail_search_arg *arg;
+	unsigned int i;
+
+	arg = p_new(args->pool, struct mail_search_arg, 1);
+	arg->type = SEARCH_UIDSET;
+	p_array_init(&arg->value.seqset, args->pool, 16);
+	for (i = 0; i < count; i++)
+		seq_range_array_add(&arg->value.seqset, uids[i]);
+
+	arg->next = args->args;
+	args->args = arg;
+}
+
+/*
+ * Progress
+ */
+
+static void
+filter_progress_init(struct sieve_filter_progress *progress,
+		     unsigned int total)
+{
+	i_zero(progress);
+	progress->total = total;
+	i_gettimeofday(&progress->start);
+}
+
+static void
+filter_progress_update(struct sieve_filter_progress *progress,
+		       unsigned int count, bool final)
+{
+	struct timeval now;
+	long long msecs;
+	unsigned int percentage;
+
+	progress->done += count;
+
+	i_gettimeofday(&now);
+	if (!final && now.tv_sec == progress->last_report)
+		return;
+	progress->last_report = now.tv_sec;
+
+	msecs = timeval_diff_msecs(&now, &progress->start);
+	percentage = (progress->total == 0 ? 100 :
+		      (unsigned int)((uint64_t)progress->done * 100 /
+				     progress->total));
+	i_info("%s: %u/%u messages (%u%%) in %lld.%03lld s, "
+	       "%llu messages/s", (final ? "finished" : "progress"),
+	       progress->done, progress->total, percentage,
+	       msecs / 1000, msecs % 1000,
+	       (msecs <= 0 ? (unsigned long long)progress->done :
+		(unsigned long long)progress->done * 1000 / msecs));
+}
+
+static void
+filter_progress_report(struct sieve_filter_context *sfctx, unsigned int count)
+{
+	if (sfctx->progress_fd != -1) {
+		if (write_full(sfctx->progress_fd, &count, sizeof(count)) < 0)
+			i_error("write(progress pipe) failed: %m");
+	} else if (sfctx->data->jobs > 0) {
+		filter_progress_update(&sfctx->progress, count, FALSE);
+	}
+}
+
+/*
+ * Mailbox filtering
+ */
+
+static void
+filter_mailboxes_open(struct sieve_filter_context *sfctx)
+{
+	const struct sieve_filter_data *sfdata = sfctx->data;
+	struct mail_user *mail_user = sfdata->mail_user;
+	struct mail_namespace *ns;
+	enum mail_error error;
+
+	/* Open the source mailbox */
+
+	ns = mail_namespace_find(mail_user->namespaces, sfdata->src_mailbox);
+	if (ns == NULL) {
+		i_fatal("Unknown namespace for source mailbox '%s'",
+			sfdata->src_mailbox);
+	}
+
+	sfctx->src_box = mailbox_alloc(ns->list, sfdata->src_mailbox,
+				       sfdata->open_flags);
+	if (mailbox_open(sfctx->src_box) < 0) {
+		i_fatal("Couldn't open source mailbox '%s': %s",
+			sfdata->src_mailbox,
+			mailbox_get_last_internal_error(sfctx->src_box,
+							&error));
+	}
+
+	/* Open move box if necessary */
+
+	if (sfdata->execute &&
+	    sfdata->discard_action == SIEVE_FILTER_DACT_MOVE &&
+	    sfdata->move_mailbox != NULL) {
+		ns = mail_namespace_find(mail_user->namespaces,
+					 sfdata->move_mailbox);
+		if (ns == NULL)
+			i_fatal("Unknown namespace for mailbox '%s'",
+				sfdata->move_mailbox);
+
+		sfctx->move_box = mailbox_alloc(ns->list, sfdata->move_mailbox,
+						sfdata->open_flags);
+		if (mailbox_open(sfctx->move_box) < 0) {
+			i_fatal("Couldn't open mailbox '%s': %s",
+				sfdata->move_mailbox,
+				mailbox_get_last_internal_error(
+					sfctx->move_box, &error));
+		}
+
+		if (mailbox_backends_equal(sfctx->src_box, sfctx->move_box))
+			i_fatal("Source mailbox and mailbox for move action are identical.");
+	}
+}
+
+static void
+filter_mailboxes_close(struct sieve_filter_context *sfctx)
+{
+	/* Close the source mailbox */
+	if (sfctx->src_box != NULL)
+		mailbox_free(&sfctx->src_box);
+
+	/* Close the move mailbox */
+	if (sfctx->move_box != NULL)
+		mailbox_free(&sfctx->move_box);
+}
+
 static int
-filter_mailbox(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
+filter_mailbox_get_uids(struct sieve_filter_context *sfctx,
+			ARRAY_TYPE(uint32_t) *uids)
 {
-	struct sieve_filter_context sfctx;
-	struct mailbox *move_box = sfdata->move_mailbox;
-	struct sieve_error_handler *ehandler = sfdata->ehandler;
 	struct mail_search_args *search_args;
 	struct mailbox_transaction_context *t;
 	struct mail_search_context *search_ctx;
 	struct mail *mail;
-	int ret = 1;
+	int ret = 0;
 
-	/* Sync source mailbox */
+	/* Search non-deleted messages in the source folder */
 
-	if (mailbox_sync(src_box, MAILBOX_SYNC_FLAG_FULL_READ) < 0) {
-		sieve_error(ehandler, NULL, "failed to sync source mailbox");
-		return -1;
-	}
+	search_args = mail_search_build_init();
+	mail_search_build_add_flags(search_args, MAIL_DELETED, TRUE);
 
-	/* Initialize */
+	t = mailbox_transaction_begin(sfctx->src_box, 0,
+				      "sieve_filter_data src_box uids");
+	search_ctx = mailbox_search_init(t, search_args, NULL, 0, NULL);
+	mail_search_args_unref(&search_args);
 
-	i_zero(&sfctx);
-	sfctx.data = sfdata;
+	while (mailbox_search_next(search_ctx, &mail))
+		array_append(uids, &mail->uid, 1);
 
-	/* Create test stream */
-	if (!sfdata->execute) {
-		sfctx.teststream = o_stream_create_fd(1, 0);
-		o_stream_set_no_error_handling(sfctx.teststream, TRUE);
-	}
+	if (mailbox_search_deinit(&search_ctx) < 0)
+		ret = -1;
+	if (mailbox_transaction_commit(&t) < 0)
+		ret = -1;
+	return ret;
+}
+
+static int
+filter_mailbox_batch(struct sieve_filter_context *sfctx,
+		     const uint32_t *uids, unsigned int count)
+{
+	struct mailbox *src_box = sfctx->src_box;
+	struct mailbox *move_box = sfctx->move_box;
+	struct mail_search_args *search_args;
+	struct mailbox_transaction_context *t;
+	struct mail_search_context *search_ctx;
+	struct mail *mail;
+	int ret = 1;
 
 	/* Start move mailbox transaction */
 
 	if (move_box != NULL) {
-		sfctx.move_trans = mailbox_transaction_begin(
+		sfctx->move_trans = mailbox_transaction_begin(
 			move_box, MAILBOX_TRANSACTION_FLAG_EXTERNAL,
 			"sieve_filter_data move_box");
 	}
 
-	/* Search non-deleted messages in the source folder */
+	/* Search the non-deleted messages of this batch */
 
 	search_args = mail_search_build_init();
 	mail_search_build_add_flags(search_args, MAIL_DELETED, TRUE);
+	mail_search_build_add_uids(search_args, uids, count);
 
 	t = mailbox_transaction_begin(src_box, 0,
 				      "sieve_filter_data src_box");
@@ -341,30 +523,56 @@ filter_mailbox(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
 	/* Iterate through all requested messages */
 
 	while (ret >= 0 && mailbox_search_next(search_ctx, &mail))
-		ret = filter_message(&sfctx, mail);
+		ret = filter_message(sfctx, mail);
 
 	/* Cleanup */
 
 	if (mailbox_search_deinit(&search_ctx) < 0)
 		ret = -1;
 
-	if (sfctx.move_trans != NULL) {
-		if (mailbox_transaction_commit(&sfctx.move_trans) < 0)
+	if (sfctx->move_trans != NULL) {
+		if (mailbox_transaction_commit(&sfctx->move_trans) < 0)
 			ret = -1;
 	}
 
 	if (mailbox_transaction_commit(&t) < 0)
 		ret = -1;
 
-	if (sfctx.teststream != NULL)
-		o_stream_destroy(&sfctx.teststream);
+	return ret;
+}
+
+static int
+filter_mailbox_uids(struct sieve_filter_context *sfctx,
+		    const uint32_t *uids, unsigned int count)
+{
+	const struct sieve_filter_data *sfdata = sfctx->data;
+	struct sieve_error_handler *ehandler = sfdata->ehandler;
+	unsigned int i, batch;
+	int ret = 1;
+
+	/* Create test stream */
+	if (!sfdata->execute) {
+		sfctx->teststream = o_stream_create_fd(sfctx->output_fd, 0);
+		o_stream_set_no_error_handling(sfctx->teststream, TRUE);
+	}
+
+	/* Filter the messages in batches; moves and flag changes are committed
+	   at the end of each batch */
+	for (i = 0; i < count && ret >= 0; i += batch) {
+		batch = I_MIN(sfdata->batch_size, count - i);
+		ret = filter_mailbox_batch(sfctx, uids + i, batch);
+		filter_progress_report(sfctx, batch);
+	}
+
+	if (sfctx->teststream != NULL)
+		o_stream_destroy(&sfctx->teststream);
 
 	if (ret < 0) return ret;
 
 	/* Sync mailbox */
 
 	if (sfdata->execute) {
-		if (mailbox_sync(src_box, 0) < 0) {
+		if (mailbox_sync(sfctx->src_box, 0) < 0) {
 			sieve_error(ehandler, NULL,
 				    "failed to sync source mailbox");
 			return -1;
@@ -374,6 +582,242 @@ filter_mailbox(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
 	return ret;
 }
 
+static int
+filter_worker_run(const struct sieve_filter_data *parent_sfdata,
+		  const uint32_t *uids, unsigned int count,
+		  int progress_fd, int output_fd)
+{
+	struct sieve_filter_data sfdata = *parent_sfdata;
+	struct sieve_filter_context sfctx;
+	struct sieve_script_env scriptenv;
+	struct mail_user *mail_user;
+	const char *errstr;
+	int ret;
+
+	/* The mail user of the parent was set up before the fork. Leave it
+	   and everything it holds (index state, connections, file
+	   descriptors) alone and set up storage again for this worker. */
+	mail_user = sieve_tool_create_mail_user(sieve_tool);
+	if (sieve_script_env_init(&scriptenv, mail_user, &errstr) < 0)
+		i_fatal("Failed to initialize script execution: %s", errstr);
+	scriptenv.mailbox_autocreate = parent_sfdata->senv->mailbox_autocreate;
+	scriptenv.default_mailbox = parent_sfdata->senv->default_mailbox;
+	scriptenv.result_amend_log_message =
+		parent_sfdata->senv->result_amend_log_message;
+
+	sfdata.mail_user = mail_user;
+	sfdata.senv = &scriptenv;
+
+	i_zero(&sfctx);
+	sfctx.data = &sfdata;
+	sfctx.progress_fd = progress_fd;
+	sfctx.output_fd = output_fd;
+
+	filter_mailboxes_open(&sfctx);
+	if (mailbox_sync(sfctx.src_box, 0) < 0) {
+		sieve_error(sfdata.ehandler, NULL,
+			    "failed to sync source mailbox");
+		ret = -1;
+	} else {
+		ret = filter_mailbox_uids(&sfctx, uids, count);
+	}
+	filter_mailboxes_close(&sfctx);
+	mail_user_unref(&mail_user);
+	return ret;
+}
+
+static int filter_output_create(const struct sieve_filter_data *sfdata)
+{
+	string_t *path;
+	int fd;
+
+	path = t_str_new(128);
+	mail_user_set_get_temp_prefix(path, sfdata->mail_user->set);
+	fd = safe_mkstemp(path, 0600, (uid_t)-1, (gid_t)-1);
+	if (fd == -1) {
+		i_error("safe_mkstemp(%s) failed: %m", str_c(path));
+		return -1;
+	}
+
+	/* we just want the fd, unlink it */
+	if (i_unlink(str_c(path)) < 0) {
+		i_close_fd(&fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int filter_output_flush(int fd)
+{
+	unsigned char buf[IO_BLOCK_SIZE];
+	ssize_t ret;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		i_error("lseek(worker output) failed: %m");
+		return -1;
+	}
+	while ((ret = read(fd, buf, sizeof(buf))) > 0) {
+		if (write_full(STDOUT_FILENO, buf, ret) < 0) {
+			i_error("write(stdout) failed: %m");
+			return -1;
+		}
+	}
+	if (ret < 0) {
+		i_error("read(worker output) failed: %m");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+filter_mailbox_parallel(const struct sieve_filter_data *sfdata,
+			const uint32_t *uids, unsigned int count)
+{
+	struct sieve_filter_progress progress;
+	unsigned int i, jobs = I_MIN(sfdata->jobs, count), started = 0;
+	unsigned int batch;
+	pid_t *pids;
+	int *output_fds;
+	int fd[2], status, ret = 1;
+
+	if (pipe(fd) < 0) {
+		i_error("pipe() failed: %m");
+		return -1;
+	}
+
+	/* Without -e, the test output of each worker is collected in a
+	   temporary file and written to stdout in worker order afterwards, so
+	   that the output of concurrent workers does not interleave. */
+	output_fds = t_new(int, jobs);
+	for (i = 0; i < jobs; i++) {
+		output_fds[i] = STDOUT_FILENO;
+		if (sfdata->execute)
+			continue;
+		output_fds[i] = filter_output_create(sfdata);
+		if (output_fds[i] < 0) {
+			while (i-- > 0)
+				i_close_fd(&output_fds[i]);
+			i_close_fd(&fd[0]);
+			i_close_fd(&fd[1]);
+			return -1;
+		}
+	}
+
+	/* Each worker filters a contiguous part of the UID range using its
+	   own mail user and mailbox instances; the parent only collects
+	   progress reports. */
+	pids = t_new(pid_t, jobs);
+	for (i = 0; i < jobs; i++) {
+		unsigned int first = (uint64_t)count * i / jobs;
+		unsigned int last = (uint64_t)count * (i + 1) / jobs;
+
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			i_error("fork() failed: %m");
+			ret = -1;
+			break;
+		}
+		if (pids[i] == 0) {
+			i_close_fd(&fd[0]);
+			ret = filter_worker_run(sfdata, uids + first,
+						last - first, fd[1],
+						output_fds[i]);
+			_exit(ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+		started++;
+	}
+	i_close_fd(&fd[1]);
+
+	filter_progress_init(&progress, count);
+	while ((status = read_full(fd[0], &batch, sizeof(batch))) > 0)
+		filter_progress_update(&progress, batch, FALSE);
+	if (status < 0)
+		i_error("read(progress pipe) failed: %m");
+	i_close_fd(&fd[0]);
+
+	for (i = 0; i < started; i++) {
+		while (waitpid(pids[i], &status, 0) < 0) {
+			if (errno != EINTR) {
+				i_error("waitpid() failed: %m");
+				status = -1;
+				break;
+			}
+		}
+		if (status == -1 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != EXIT_SUCCESS) {
+			i_error("worker %u (pid %s) failed",
+				i + 1, dec2str(pids[i]));
+			ret = -1;
+		}
+	}
+
+	if (!sfdata->execute) {
+		for (i = 0; i < jobs; i++) {
+			if (i < started && filter_output_flush(output_fds[i]) < 0)
+				ret = -1;
+			i_close_fd(&output_fds[i]);
+		}
+	}
+
+	filter_progress_update(&progress, 0, TRUE);
+	return ret;
+}
+
+static int filter_mailbox(const struct sieve_filter_data *sfdata)
+{
+	struct sieve_filter_context sfctx;
+	struct sieve_error_handler *ehandler = sfdata->ehandler;
+	ARRAY_TYPE(uint32_t) uids;
+	const uint32_t *uid_list;
+	unsigned int count;
+	int ret;
+
+	/* Initialize */
+
+	i_zero(&sfctx);
+	sfctx.data = sfdata;
+	sfctx.progress_fd = -1;
+	sfctx.output_fd = STDOUT_FILENO;
+
+	filter_mailboxes_open(&sfctx);
+
+	/* Sync source mailbox */
+
+	if (mailbox_sync(sfctx.src_box, MAILBOX_SYNC_FLAG_FULL_READ) < 0) {
+		sieve_error(ehandler, NULL, "failed to sync source mailbox");
+		filter_mailboxes_close(&sfctx);
+		return -1;
+	}
+
+	/* Determine which messages need to be filtered */
+
+	i_array_init(&uids, 1024);
+	if (filter_mailbox_get_uids(&sfctx, &uids) < 0) {
+		sieve_error(ehandler, NULL,
+			    "failed to search source mailbox");
+		filter_mailboxes_close(&sfctx);
+		array_free(&uids);
+		return -1;
+	}
+	uid_list = array_get(&uids, &count);
+
+	if (sfdata->jobs > 1 && count > 1) {
+		/* Workers set up their own storage; don't share the index
+		   state of this process with them. */
+		filter_mailboxes_close(&sfctx);
+		ret = filter_mailbox_parallel(sfdata, uid_list, count);
+	} else {
+		filter_progress_init(&sfctx.progress, count);
+		ret = filter_mailbox_uids(&sfctx, uid_list, count);
+		if (sfdata->jobs > 0)
+			filter_progress_update(&sfctx.progress, 0, TRUE);
+		filter_mailboxes_close(&sfctx);
+	}
+
+	array_free(&uids);
+	return ret;
+}
+
 /*
  * Tool implementation
  */
@@ -391,15 +835,13 @@ int main(int argc, char **argv)
 	struct sieve_script_env scriptenv;
 	struct sieve_error_handler *ehandler;
 	bool force_compile, execute, source_write, verbose, default_move;
-	struct mail_namespace *ns;
-	struct mailbox *src_box = NULL, *move_box = NULL;
 	enum mailbox_flags open_flags = MAILBOX_FLAG_IGNORE_ACLS;
-	enum mail_error error;
+	unsigned int jobs = 0, batch_size = DEFAULT_BATCH_SIZE;
 	const char *errstr;
 	int c;
 
 	sieve_tool = sieve_tool_init("sieve-filter", &argc, &argv,
-				     "m:s:u:q:Q:CevW", FALSE);
+				     "m:s:u:q:Q:CevWj:b:", FALSE);
 
 	t_array_init(&scriptfiles, 16);
 
@@ -453,6 +895,21 @@ int main(int argc, char **argv)
 			/* enable verbose output */
 			verbose = TRUE;
 			break;
+		case 'j':
+			/* number of worker processes */
+			if (str_to_uint(optarg, &jobs) < 0 || jobs == 0) {
+				i_fatal_status(EX_USAGE,
+					"Invalid -j argument: %s", optarg);
+			}
+			break;
+		case 'b':
+			/* number of messages per transaction */
+			if (str_to_uint(optarg, &batch_size) < 0 ||
+			    batch_size == 0) {
+				i_fatal_status(EX_USAGE,
+					"Invalid -b argument: %s", optarg);
+			}
+			break;
 		default:
 			/* unrecognized option */
 			print_help();
@@ -540,43 +997,9 @@ int main(int argc, char **argv)
 	/* Initialize mail user */
 	mail_user = sieve_tool_get_mail_user(sieve_tool);
 
-	/* Open the source mailbox */
-
-	ns = mail_namespace_find(mail_user->namespaces, src_mailbox);
-	if (ns == NULL) {
-		i_fatal("Unknown namespace for source mailbox '%s'",
-			src_mailbox);
-	}
-
 	if (!source_write || !execute)
 		open_flags |= MAILBOX_FLAG_READONLY;
 
-	src_box = mailbox_alloc(ns->list, src_mailbox, open_flags);
-	if (mailbox_open(src_box) < 0) {
-		i_fatal("Couldn't open source mailbox '%s': %s",
-			src_mailbox, mailbox_get_last_internal_error(src_box, &error));
-	}
-
-	/* Open move box if necessary */
-
-	if (execute && discard_action == SIEVE_FILTER_DACT_MOVE &&
-	    move_mailbox != NULL) {
-		ns = mail_namespace_find(mail_user->namespaces, move_mailbox);
-		if (ns == NULL)
-			i_fatal("Unknown namespace for mailbox '%s'",
-				move_mailbox);
-
-		move_box = mailbox_alloc(ns->list, move_mailbox, open_flags);
-		if (mailbox_open(move_box) < 0) {
-			i_fatal("Couldn't open mailbox '%s': %s",
-				move_mailbox,
-				mailbox_get_last_internal_error(move_box, &error));
-		}
-
-		if (mailbox_backends_equal(src_box, move_box))
-			i_fatal("Source mailbox and mailbox for move action are identical.");
-	}
-
 	/* Compose script environment */
 	if (sieve_script_env_init(&scriptenv, mail_user, &errstr) < 0)
 		i_fatal("Failed to initialize script execution: %s", errstr);
@@ -588,7 +1011,12 @@ int main(int argc, char **argv)
 	i_zero(&sfdata);
 	sfdata.senv = &scriptenv;
 	sfdata.discard_action = discard_action;
-	sfdata.move_mailbox = move_box;
+	sfdata.src_mailbox = src_mailbox;
+	sfdata.move_mailbox = move_mailbox;
+	sfdata.open_flags = open_flags;
+	sfdata.mail_user = mail_user;
+	sfdata.jobs = jobs;
+	sfdata.batch_size = batch_size;
 	sfdata.main_sbin = main_sbin;
 	sfdata.ehandler = ehandler;
 	sfdata.execute = execute;
@@ -596,15 +1024,7 @@ int main(int argc, char **argv)
 	sfdata.default_move = default_move;
 
 	/* Apply Sieve filter to all messages found */
-	(void)filter_mailbox(&sfdata, src_box);
-
-	/* Close the source mailbox */
-	if (src_box != NULL)
-		mailbox_free(&src_box);
-
-	/* Close the move mailbox */
-	if (move_box != NULL)
-		mailbox_free(&move_box);
+	(void)filter_mailbox(&sfdata);
 
 	/* Close the script binary */
 	if (main_sbin != NULL)
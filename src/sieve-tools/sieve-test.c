@@ -42,7 +42,7 @@ static void print_help(void)
 "Usage: sieve-test [-a <orig-recipient-address] [-c <config-file>]\n"
 "                  [-C] [-D] [-d <dump-filename>] [-e]\n"
 "                  [-f <envelope-sender>] [-l <mail-location>]\n"
-"                  [-m <default-mailbox>] [-P <plugin>]\n"
+"                  [-m <default-mailbox>] [-p] [-P <plugin>]\n"
 "                  [-r <recipient-address>] [-s <script-file>]\n"
 "                  [-t <trace-file>] [-T <trace-option>] [-x <extensions>]\n"
 "                  <script-file> <mail-file>\n"
@@ -161,6 +161,73 @@ result_amend_log_message(const struct sieve_script_env *senv,
 	return str_c(str);
 }
 
+/*
+ * Runtime profile
+ */
+
+struct sieve_test_profile_item {
+	char *script_name;
+	unsigned int line;
+	const char *operation;
+	unsigned int count;
+	uint64_t wall_usecs, cpu_usecs;
+};
+
+static ARRAY(struct sieve_test_profile_item) profile_items;
+
+static void
+sieve_test_runtime_profile(const struct sieve_script_env *senv ATTR_UNUSED,
+			   const struct sieve_runtime_profile_item *item)
+{
+	struct sieve_test_profile_item *pitem;
+
+	pitem = array_append_space(&profile_items);
+	pitem->script_name = i_strdup(item->script_name == NULL ?
+				      "" : item->script_name);
+	pitem->line = item->line;
+	pitem->operation = item->operation;
+	pitem->count = item->count;
+	pitem->wall_usecs = item->wall_usecs;
+	pitem->cpu_usecs = item->cpu_usecs;
+}
+
+static int
+sieve_test_profile_item_cmp(const struct sieve_test_profile_item *pitem1,
+			    const struct sieve_test_profile_item *pitem2)
+{
+	if (pitem1->wall_usecs != pitem2->wall_usecs)
+		return (pitem1->wall_usecs > pitem2->wall_usecs ? -1 : 1);
+	if (pitem1->cpu_usecs != pitem2->cpu_usecs)
+		return (pitem1->cpu_usecs > pitem2->cpu_usecs ? -1 : 1);
+	return 0;
+}
+
+static void sieve_test_profile_print(void)
+{
+	struct sieve_test_profile_item *pitem;
+
+	array_sort(&profile_items, sieve_test_profile_item_cmp);
+
+	printf("\nRuntime profile (hot spots first):\n\n");
+	printf("%10s %10s %8s  %-24s %s\n",
+	       "wall(us)", "cpu(us)", "count", "operation", "location");
+	array_foreach_modifiable(&profile_items, pitem) {
+		if (pitem->line > 0) {
+			printf("%10"PRIu64" %10"PRIu64" %8u  %-24s %s:%u\n",
+			       pitem->wall_usecs, pitem->cpu_usecs,
+			       pitem->count, pitem->operation,
+			       pitem->script_name, pitem->line);
+		} else {
+			printf("%10"PRIu64" %10"PRIu64" %8u  %-24s %s\n",
+			       pitem->wall_usecs, pitem->cpu_usecs,
+			       pitem->count, pitem->operation,
+			       pitem->script_name);
+		}
+		i_free(pitem->script_name);
+	}
+	array_free(&profile_items);
+}
+
 /*
  * Tool implementation
  */
@@ -182,12 +249,12 @@ int main(int argc, char **argv)
 	struct sieve_error_handler *ehandler;
 	struct ostream *teststream = NULL;
 	struct sieve_trace_log *trace_log = NULL;
-	bool force_compile = FALSE, execute = FALSE;
+	bool force_compile = FALSE, execute = FALSE, profile = FALSE;
 	int exit_status = EXIT_SUCCESS;
 	int ret, c;
 
 	sieve_tool = sieve_tool_init("sieve-test", &argc, &argv,
-				     "r:a:f:m:d:s:eCt:T:u:", FALSE);
+				     "r:a:f:m:d:s:eCpt:T:u:", FALSE);
 
 	ehandler = NULL;
 	t_array_init(&scriptfiles, 16);
@@ -255,6 +322,11 @@ int main(int argc, char **argv)
 		case 'C':
 			force_compile = TRUE;
 			break;
+			/* runtime profile */
+		case 'p':
+			profile = TRUE;
+			exflags |= SIEVE_EXECUTE_FLAG_PROFILE;
+			break;
 		default:
 			/* unrecognized option */
 			print_help();
@@ -362,6 +434,10 @@ int main(int argc, char **argv)
 		scriptenv.trace_log = trace_log;
 		scriptenv.trace_config = trace_config;
 		scriptenv.script_context = &msgdata;
+		if (profile) {
+			i_array_init(&profile_items, 64);
+			scriptenv.runtime_profile = sieve_test_runtime_profile;
+		}
 
 		i_zero(&estatus);
 		scriptenv.exec_status = &estatus;
@@ -488,6 +564,8 @@ int main(int argc, char **argv)
 
 		if (teststream != NULL)
 			o_stream_destroy(&teststream);
+		if (profile)
+			sieve_test_profile_print();
 		if (trace_log != NULL)
 			sieve_trace_log_free(&trace_log);
 
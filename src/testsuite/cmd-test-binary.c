@@ -58,6 +58,23 @@ const struct sieve_command_def cmd_test_binary_save = {
 	.generate = cmd_test_binary_generate,
 };
 
+/* Test_binary_pin command
+ *
+ * Syntax:
+ *   test_binary_pin <binary-name: string>
+ */
+
+const struct sieve_command_def cmd_test_binary_pin = {
+	.identifier = "test_binary_pin",
+	.type = SCT_COMMAND,
+	.positional_args = 1,
+	.subtests = 0,
+	.block_allowed = FALSE,
+	.block_required = FALSE,
+	.validate = cmd_test_binary_validate,
+	.generate = cmd_test_binary_generate,
+};
+
 /*
  * Operations
  */
@@ -89,6 +106,16 @@ const struct sieve_operation_def test_binary_save_operation = {
 	.execute = cmd_test_binary_operation_execute,
 };
 
+/* test_binary_pin operation */
+
+const struct sieve_operation_def test_binary_pin_operation = {
+	.mnemonic = "TEST_BINARY_PIN",
+	.ext_def = &testsuite_extension,
+	.code = TESTSUITE_OPERATION_TEST_BINARY_PIN,
+	.dump = cmd_test_binary_operation_dump,
+	.execute = cmd_test_binary_operation_execute,
+};
+
 /*
  * Validation
  */
@@ -121,6 +148,9 @@ cmd_test_binary_generate(const struct sieve_codegen_env *cgenv,
 	} else if (sieve_command_is(cmd, cmd_test_binary_save)) {
 		sieve_operation_emit(cgenv->sblock, cmd->ext,
 				     &test_binary_save_operation);
+	} else if (sieve_command_is(cmd, cmd_test_binary_pin)) {
+		sieve_operation_emit(cgenv->sblock, cmd->ext,
+				     &test_binary_pin_operation);
 	} else {
 		i_unreached();
 	}
@@ -213,6 +243,26 @@ cmd_test_binary_operation_execute(const struct sieve_runtime_env *renv,
 				str_c(binary_name));
 			return SIEVE_EXEC_FAILURE;
 		}
+	} else if (sieve_operation_is(oprtn, test_binary_pin_operation)) {
+		struct sieve_binary *sbin =
+			testsuite_binary_load(str_c(binary_name));
+
+		if (sieve_runtime_trace_active(renv, SIEVE_TRLVL_COMMANDS)) {
+			sieve_runtime_trace(renv, 0, "testsuite: "
+					    "test_binary_pin command");
+			sieve_runtime_trace_descend(renv);
+			sieve_runtime_trace(renv, 0, "pin binary '%s'",
+					    str_c(binary_name));
+		}
+
+		if (sbin != NULL) {
+			sieve_binary_cache_pin(sbin);
+			sieve_binary_unref(&sbin);
+		} else {
+			e_error(testsuite_sieve_instance->event,
+				"failed to load binary %s", str_c(binary_name));
+			return SIEVE_EXEC_FAILURE;
+		}
 	} else {
 		i_unreached();
 	}
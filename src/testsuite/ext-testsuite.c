@@ -73,7 +73,14 @@ const struct sieve_operation_def *testsuite_operations[] = {
 	&test_mailbox_delete_operation,
 	&test_binary_load_operation,
 	&test_binary_save_operation,
+	&test_binary_pin_operation,
 	&test_imap_metadata_set_operation,
+	&test_storage_putscript_operation,
+	&test_storage_deletescript_operation,
+	&test_storage_renamescript_operation,
+	&test_storage_havespace_operation,
+	&test_storage_write_operation,
+	&test_storage_load_operation,
 };
 
 /*
@@ -138,6 +145,7 @@ ext_testsuite_validator_load(const struct sieve_extension *ext,
 	sieve_validator_register_command(valdtr, ext, &cmd_test_mailbox_delete);
 	sieve_validator_register_command(valdtr, ext, &cmd_test_binary_load);
 	sieve_validator_register_command(valdtr, ext, &cmd_test_binary_save);
+	sieve_validator_register_command(valdtr, ext, &cmd_test_binary_pin);
 	sieve_validator_register_command(valdtr, ext,
 					 &cmd_test_imap_metadata_set);
 
@@ -147,6 +155,16 @@ ext_testsuite_validator_load(const struct sieve_extension *ext,
 	sieve_validator_register_command(valdtr, ext, &tst_test_error);
 	sieve_validator_register_command(valdtr, ext, &tst_test_result_action);
 	sieve_validator_register_command(valdtr, ext, &tst_test_result_execute);
+	sieve_validator_register_command(valdtr, ext,
+					 &tst_test_storage_putscript);
+	sieve_validator_register_command(valdtr, ext,
+					 &tst_test_storage_deletescript);
+	sieve_validator_register_command(valdtr, ext,
+					 &tst_test_storage_renamescript);
+	sieve_validator_register_command(valdtr, ext,
+					 &tst_test_storage_havespace);
+	sieve_validator_register_command(valdtr, ext, &tst_test_storage_write);
+	sieve_validator_register_command(valdtr, ext, &tst_test_storage_load);
 
 #if 0
 	sieve_validator_argument_override(valdtr, SAT_VAR_STRING, ext,
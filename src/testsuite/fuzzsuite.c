@@ -28,6 +28,7 @@
 #include "testsuite-message.h"
 #include "testsuite-script.h"
 #include "testsuite-smtp.h"
+#include "testsuite-duplicate.h"
 #include "testsuite-mailstore.h"
 
 #include <stdio.h>
@@ -239,6 +240,8 @@ FUZZ_BEGIN_DATA(const unsigned char *data, size_t size)
 		scriptenv.smtp_send = testsuite_smtp_send;
 		scriptenv.smtp_abort = testsuite_smtp_abort;
 		scriptenv.smtp_finish = testsuite_smtp_finish;
+		scriptenv.duplicate_check = testsuite_duplicate_check;
+		scriptenv.duplicate_mark = testsuite_duplicate_mark;
 #ifdef FUZZSUITE_DEBUG
 		scriptenv.trace_log = trace_log;
 		scriptenv.trace_config = trace_config;
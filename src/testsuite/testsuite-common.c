@@ -32,6 +32,8 @@
 #include "testsuite-binary.h"
 #include "testsuite-result.h"
 #include "testsuite-smtp.h"
+#include "testsuite-duplicate.h"
+#include "testsuite-storage.h"
 
 #include <string.h>
 #include <fcntl.h>
@@ -388,6 +390,8 @@ void testsuite_init(struct sieve_instance *svinst, const char *test_path,
 	testsuite_script_init();
 	testsuite_binary_init();
 	testsuite_smtp_init();
+	testsuite_duplicate_init();
+	testsuite_storage_init();
 
 	ret = sieve_extension_register(svinst, &testsuite_extension, TRUE,
 				       &testsuite_ext);
@@ -422,6 +426,8 @@ void testsuite_deinit(void)
 {
 	i_free(testsuite_test_path);
 
+	testsuite_storage_deinit();
+	testsuite_duplicate_deinit();
 	testsuite_smtp_deinit();
 	testsuite_binary_deinit();
 	testsuite_script_deinit();
@@ -80,6 +80,7 @@ extern const struct sieve_command_def cmd_test_mailbox_create;
 extern const struct sieve_command_def cmd_test_mailbox_delete;
 extern const struct sieve_command_def cmd_test_binary_load;
 extern const struct sieve_command_def cmd_test_binary_save;
+extern const struct sieve_command_def cmd_test_binary_pin;
 extern const struct sieve_command_def cmd_test_imap_metadata_set;
 
 /*
@@ -92,6 +93,12 @@ extern const struct sieve_command_def tst_test_multiscript;
 extern const struct sieve_command_def tst_test_error;
 extern const struct sieve_command_def tst_test_result_action;
 extern const struct sieve_command_def tst_test_result_execute;
+extern const struct sieve_command_def tst_test_storage_putscript;
+extern const struct sieve_command_def tst_test_storage_deletescript;
+extern const struct sieve_command_def tst_test_storage_renamescript;
+extern const struct sieve_command_def tst_test_storage_havespace;
+extern const struct sieve_command_def tst_test_storage_write;
+extern const struct sieve_command_def tst_test_storage_load;
 
 /*
  * Operations
@@ -120,7 +127,14 @@ enum testsuite_operation_code {
 	TESTSUITE_OPERATION_TEST_MAILBOX_DELETE,
 	TESTSUITE_OPERATION_TEST_BINARY_LOAD,
 	TESTSUITE_OPERATION_TEST_BINARY_SAVE,
-	TESTSUITE_OPERATION_TEST_IMAP_METADATA_SET
+	TESTSUITE_OPERATION_TEST_BINARY_PIN,
+	TESTSUITE_OPERATION_TEST_IMAP_METADATA_SET,
+	TESTSUITE_OPERATION_TEST_STORAGE_PUTSCRIPT,
+	TESTSUITE_OPERATION_TEST_STORAGE_DELETESCRIPT,
+	TESTSUITE_OPERATION_TEST_STORAGE_RENAMESCRIPT,
+	TESTSUITE_OPERATION_TEST_STORAGE_HAVESPACE,
+	TESTSUITE_OPERATION_TEST_STORAGE_WRITE,
+	TESTSUITE_OPERATION_TEST_STORAGE_LOAD
 };
 
 extern const struct sieve_operation_def test_operation;
@@ -145,7 +159,14 @@ extern const struct sieve_operation_def test_mailbox_create_operation;
 extern const struct sieve_operation_def test_mailbox_delete_operation;
 extern const struct sieve_operation_def test_binary_load_operation;
 extern const struct sieve_operation_def test_binary_save_operation;
+extern const struct sieve_operation_def test_binary_pin_operation;
 extern const struct sieve_operation_def test_imap_metadata_set_operation;
+extern const struct sieve_operation_def test_storage_putscript_operation;
+extern const struct sieve_operation_def test_storage_deletescript_operation;
+extern const struct sieve_operation_def test_storage_renamescript_operation;
+extern const struct sieve_operation_def test_storage_havespace_operation;
+extern const struct sieve_operation_def test_storage_write_operation;
+extern const struct sieve_operation_def test_storage_load_operation;
 
 /*
  * Operands
@@ -0,0 +1,63 @@
+/* Copyright (c) Pigeonhole authors, see top-level COPYING file */
+
+#include "lib.h"
+#include "hash.h"
+#include "hex-binary.h"
+
+#include "sieve-common.h"
+
+#include "testsuite-common.h"
+#include "testsuite-duplicate.h"
+
+/*
+ * State
+ */
+
+static pool_t testsuite_duplicate_pool;
+static HASH_TABLE(char *, char *) testsuite_duplicate_ids;
+
+/*
+ * Initialization
+ */
+
+void testsuite_duplicate_init(void)
+{
+	testsuite_duplicate_pool =
+		pool_alloconly_create("testsuite_duplicate", 4096);
+	hash_table_create(&testsuite_duplicate_ids, testsuite_duplicate_pool,
+			  0, str_hash, strcmp);
+}
+
+void testsuite_duplicate_deinit(void)
+{
+	hash_table_destroy(&testsuite_duplicate_ids);
+	pool_unref(&testsuite_duplicate_pool);
+}
+
+/*
+ * Simulated duplicate database
+ */
+
+enum sieve_duplicate_check_result
+testsuite_duplicate_check(void *dup_trans ATTR_UNUSED,
+			  const struct sieve_script_env *senv ATTR_UNUSED,
+			  const void *id, size_t id_size)
+{
+	const char *key = binary_to_hex(id, id_size);
+
+	if (hash_table_lookup(testsuite_duplicate_ids, key) != NULL)
+		return SIEVE_DUPLICATE_CHECK_RESULT_EXISTS;
+	return SIEVE_DUPLICATE_CHECK_RESULT_NOT_FOUND;
+}
+
+void testsuite_duplicate_mark(void *dup_trans ATTR_UNUSED,
+			      const struct sieve_script_env *senv ATTR_UNUSED,
+			      const void *id, size_t id_size,
+			      time_t time ATTR_UNUSED)
+{
+	char *key;
+
+	key = p_strdup(testsuite_duplicate_pool, binary_to_hex(id, id_size));
+	if (hash_table_lookup(testsuite_duplicate_ids, key) == NULL)
+		hash_table_insert(testsuite_duplicate_ids, key, key);
+}
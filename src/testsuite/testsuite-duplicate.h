@@ -0,0 +1,27 @@
+#ifndef TESTSUITE_DUPLICATE_H
+#define TESTSUITE_DUPLICATE_H
+
+#include "sieve-common.h"
+
+void testsuite_duplicate_init(void);
+void testsuite_duplicate_deinit(void);
+
+/*
+ * Simulated duplicate database
+ */
+
+/* There is no transaction support: marks take effect immediately and last
+   for the whole test run. The duplicate_transaction_begin() callback is
+   left unset, so that the vacation and duplicate extensions keep behaving
+   as if no duplicate database were available. */
+
+enum sieve_duplicate_check_result
+testsuite_duplicate_check(void *dup_trans ATTR_UNUSED,
+			  const struct sieve_script_env *senv ATTR_UNUSED,
+			  const void *id, size_t id_size);
+void testsuite_duplicate_mark(void *dup_trans ATTR_UNUSED,
+			      const struct sieve_script_env *senv ATTR_UNUSED,
+			      const void *id, size_t id_size,
+			      time_t time ATTR_UNUSED);
+
+#endif
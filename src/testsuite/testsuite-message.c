@@ -117,8 +117,13 @@ static void testsuite_message_set_data(struct mail *mail)
 	(void)mail_get_message_id(mail, &msg_id);
 	testsuite_msg_id = i_strdup(msg_id);
 
+	/* Like deliveries to several recipients, all executions for the same
+	   test message share the parsed message data */
+	sieve_message_shared_unref(&testsuite_msgdata.shared);
+
 	i_zero(&testsuite_msgdata);
 	testsuite_msgdata.mail = mail;
+	testsuite_msgdata.shared = sieve_message_shared_create();
 	testsuite_msgdata.auth_user = sieve_tool_get_username(sieve_tool);
 	testsuite_msgdata.envelope.mail_from = testsuite_env_mail_from;
 	testsuite_msgdata.envelope.rcpt_to = testsuite_env_rcpt_to;
@@ -204,38 +209,39 @@ void testsuite_message_init(void)
 
 void testsuite_message_set_default(const struct sieve_runtime_env *renv)
 {
-	sieve_message_context_reset(renv->msgctx);
-
 	testsuite_message_new_string(testsuite_msg_default);
+
+	sieve_message_context_reset(renv->msgctx);
 }
 
 void testsuite_message_set_string(const struct sieve_runtime_env *renv,
 				  string_t *message)
 {
-	sieve_message_context_reset(renv->msgctx);
-
 	testsuite_message_new_string(message);
+
+	sieve_message_context_reset(renv->msgctx);
 }
 
 void testsuite_message_set_file(const struct sieve_runtime_env *renv,
 				const char *file_path)
 {
-	sieve_message_context_reset(renv->msgctx);
-
 	testsuite_message_new_file(file_path);
+
+	sieve_message_context_reset(renv->msgctx);
 }
 
 void testsuite_message_set_mail(const struct sieve_runtime_env *renv,
 				struct mail *mail)
 {
-	sieve_message_context_reset(renv->msgctx);
-
 	testsuite_message_set_data(mail);
+
+	sieve_message_context_reset(renv->msgctx);
 }
 
 void testsuite_message_deinit(void)
 {
 	testsuite_message_free(TRUE);
+	sieve_message_shared_unref(&testsuite_msgdata.shared);
 
 	i_free(testsuite_env_mail_from);
 	i_free(testsuite_env_rcpt_to);
@@ -18,6 +18,11 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+/* Recipients in these domains simulate SMTP failures: the transaction fails
+   permanently or temporarily. */
+#define TESTSUITE_SMTP_REJECT_DOMAIN "reject.example.com"
+#define TESTSUITE_SMTP_FAIL_DOMAIN "fail.example.com"
+
 struct testsuite_smtp_message {
 	const struct smtp_address *envelope_from, *envelope_to;
 	const char *file;
@@ -26,6 +31,7 @@ struct testsuite_smtp_message {
 static pool_t testsuite_smtp_pool;
 static const char *testsuite_smtp_tmp;
 static ARRAY(struct testsuite_smtp_message) testsuite_smtp_messages;
+static unsigned int testsuite_smtp_files, testsuite_smtp_transactions;
 
 /*
  * Initialize
@@ -47,6 +53,8 @@ void testsuite_smtp_init(void)
 	}
 
 	p_array_init(&testsuite_smtp_messages, pool, 16);
+	testsuite_smtp_files = 0;
+	testsuite_smtp_transactions = 0;
 }
 
 void testsuite_smtp_deinit(void)
@@ -72,8 +80,10 @@ void testsuite_smtp_reset(void)
  */
 
 struct testsuite_smtp {
-	char *msg_file;
+	pool_t pool;
+	const char *msg_file;
 	struct smtp_address *mail_from;
+	ARRAY(struct smtp_address *) rcpts;
 	struct ostream *output;
 };
 
@@ -81,16 +91,19 @@ void *testsuite_smtp_start(const struct sieve_script_env *senv ATTR_UNUSED,
 			   const struct smtp_address *mail_from)
 {
 	struct testsuite_smtp *smtp;
-	unsigned int smtp_count = array_count(&testsuite_smtp_messages);
+	pool_t pool;
 	int fd;
 
-	smtp = i_new(struct testsuite_smtp, 1);
+	pool = pool_alloconly_create("testsuite_smtp transaction", 1024);
+	smtp = p_new(pool, struct testsuite_smtp, 1);
+	smtp->pool = pool;
 
-	smtp->msg_file = i_strdup_printf("%s/%d.eml", testsuite_smtp_tmp,
-					 smtp_count);
-	smtp->mail_from = smtp_address_clone(default_pool, mail_from);
+	smtp->msg_file = p_strdup_printf(pool, "%s/%u.eml", testsuite_smtp_tmp,
+					 testsuite_smtp_files++);
+	smtp->mail_from = smtp_address_clone(pool, mail_from);
+	p_array_init(&smtp->rcpts, pool, 4);
 
-	fd = open(smtp->msg_file, O_WRONLY | O_CREAT, 0600);
+	fd = open(smtp->msg_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
 	if (fd < 0) {
 		i_fatal("failed create tmp file for SMTP simulation: "
 			"open(%s) failed: %m", smtp->msg_file);
@@ -105,14 +118,10 @@ void testsuite_smtp_add_rcpt(const struct sieve_script_env *senv ATTR_UNUSED,
 			     void *handle, const struct smtp_address *rcpt_to)
 {
 	struct testsuite_smtp *smtp = (struct testsuite_smtp *)handle;
-	struct testsuite_smtp_message *msg;
-
-	msg = array_append_space(&testsuite_smtp_messages);
+	struct smtp_address *rcpt;
 
-	msg->file = p_strdup(testsuite_smtp_pool, smtp->msg_file);
-	msg->envelope_from = smtp_address_clone(testsuite_smtp_pool,
-						smtp->mail_from);
-	msg->envelope_to = smtp_address_clone(testsuite_smtp_pool, rcpt_to);
+	rcpt = smtp_address_clone(smtp->pool, rcpt_to);
+	array_append(&smtp->rcpts, &rcpt, 1);
 }
 
 struct ostream *
@@ -124,6 +133,11 @@ testsuite_smtp_send(const struct sieve_script_env *senv ATTR_UNUSED,
 	return smtp->output;
 }
 
+static void testsuite_smtp_free(struct testsuite_smtp *smtp)
+{
+	pool_unref(&smtp->pool);
+}
+
 void testsuite_smtp_abort(const struct sieve_script_env *senv ATTR_UNUSED,
 			  void *handle)
 {
@@ -132,27 +146,76 @@ void testsuite_smtp_abort(const struct sieve_script_env *senv ATTR_UNUSED,
 	o_stream_ignore_last_errors(smtp->output);
 	o_stream_unref(&smtp->output);
 	i_unlink(smtp->msg_file);
-	i_free(smtp->msg_file);
-	i_free(smtp->mail_from);
-	i_free(smtp);
+	testsuite_smtp_free(smtp);
+}
+
+static int testsuite_smtp_rcpt_status(const struct smtp_address *rcpt)
+{
+	if (rcpt->domain == NULL)
+		return 1;
+	if (strcasecmp(rcpt->domain, TESTSUITE_SMTP_FAIL_DOMAIN) == 0)
+		return -1;
+	if (strcasecmp(rcpt->domain, TESTSUITE_SMTP_REJECT_DOMAIN) == 0)
+		return 0;
+	return 1;
 }
 
 int testsuite_smtp_finish(const struct sieve_script_env *senv ATTR_UNUSED,
-			  void *handle, const char **error_r ATTR_UNUSED)
+			  void *handle, const char **error_r)
 {
 	struct testsuite_smtp *smtp = (struct testsuite_smtp *)handle;
+	struct smtp_address *const *rcpts;
+	struct testsuite_smtp_message *msg;
+	unsigned int count, i;
 	int ret = 1;
 
-	if (o_stream_finish(smtp->output) < 0) {
+	/* Simulate failures */
+	rcpts = array_get(&smtp->rcpts, &count);
+	for (i = 0; i < count && ret > 0; i++) {
+		switch (testsuite_smtp_rcpt_status(rcpts[i])) {
+		case -1:
+			*error_r = t_strdup_printf(
+				"Simulated temporary failure for <%s>",
+				smtp_address_encode(rcpts[i]));
+			ret = -1;
+			break;
+		case 0:
+			*error_r = t_strdup_printf(
+				"Simulated rejection of <%s>",
+				smtp_address_encode(rcpts[i]));
+			ret = 0;
+			break;
+		}
+	}
+
+	if (ret > 0 && o_stream_finish(smtp->output) < 0) {
 		i_error("write(%s) failed: %s", smtp->msg_file,
 			o_stream_get_error(smtp->output));
+		*error_r = "Failed to write message";
 		ret = -1;
 	}
+	if (ret <= 0) {
+		o_stream_ignore_last_errors(smtp->output);
+		o_stream_unref(&smtp->output);
+		i_unlink(smtp->msg_file);
+		testsuite_smtp_free(smtp);
+		return ret;
+	}
 	o_stream_unref(&smtp->output);
-	i_free(smtp->msg_file);
-	i_free(smtp->mail_from);
-	i_free(smtp);
-	return ret;
+
+	/* Record the message for each recipient */
+	for (i = 0; i < count; i++) {
+		msg = array_append_space(&testsuite_smtp_messages);
+		msg->file = p_strdup(testsuite_smtp_pool, smtp->msg_file);
+		msg->envelope_from = smtp_address_clone(testsuite_smtp_pool,
+							smtp->mail_from);
+		msg->envelope_to = smtp_address_clone(testsuite_smtp_pool,
+						      rcpts[i]);
+	}
+	testsuite_smtp_transactions++;
+
+	testsuite_smtp_free(smtp);
+	return 1;
 }
 
 /*
@@ -174,3 +237,8 @@ bool testsuite_smtp_get(const struct sieve_runtime_env *renv,
 	testsuite_envelope_set_recipient_address(renv, smtp_msg->envelope_to);
 	return TRUE;
 }
+
+unsigned int testsuite_smtp_get_transaction_count(void)
+{
+	return testsuite_smtp_transactions;
+}
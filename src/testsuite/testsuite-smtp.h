@@ -27,5 +27,7 @@ int testsuite_smtp_finish(const struct sieve_script_env *senv ATTR_UNUSED,
 
 bool testsuite_smtp_get(const struct sieve_runtime_env *renv,
 			unsigned int index);
+/* Number of SMTP transactions that succeeded since the last reset */
+unsigned int testsuite_smtp_get_transaction_count(void);
 
 #endif
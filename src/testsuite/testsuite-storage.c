@@ -0,0 +1,337 @@
+/* Copyright (c) Pigeonhole authors, see top-level COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "istream.h"
+#include "write-full.h"
+#include "settings.h"
+
+#include "sieve.h"
+#include "sieve-common.h"
+#include "sieve-error.h"
+#include "sieve-script.h"
+#include "sieve-binary.h"
+#include "sieve-storage.h"
+#include "sieve-interpreter.h"
+#include "sieve-runtime-trace.h"
+
+#include "testsuite-common.h"
+#include "testsuite-log.h"
+#include "testsuite-storage.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#define TESTSUITE_STORAGE_NAME "testsuite-storage"
+#define TESTSUITE_STORAGE_MAX_COMPILE_ERRORS 10
+
+/*
+ * State
+ */
+
+static char *testsuite_storage_path = NULL;
+
+/*
+ * Initialization
+ */
+
+void testsuite_storage_init(void)
+{
+	struct sieve_instance *svinst = testsuite_sieve_instance;
+	struct settings_instance *set_instance =
+		settings_instance_find(svinst->event);
+
+	testsuite_storage_path = i_strconcat(testsuite_tmp_dir_get(),
+					     "/sieve", NULL);
+
+	settings_override(set_instance, "sieve_script+", TESTSUITE_STORAGE_NAME,
+			  SETTINGS_OVERRIDE_TYPE_2ND_CLI_PARAM);
+	settings_override(set_instance,
+			  "sieve_script/"TESTSUITE_STORAGE_NAME
+			  "/sieve_script_storage",
+			  TESTSUITE_STORAGE_NAME,
+			  SETTINGS_OVERRIDE_TYPE_2ND_CLI_PARAM);
+	settings_override(set_instance,
+			  "sieve_script/"TESTSUITE_STORAGE_NAME
+			  "/sieve_script_type",
+			  "testsuite", SETTINGS_OVERRIDE_TYPE_2ND_CLI_PARAM);
+	settings_override(set_instance,
+			  "sieve_script/"TESTSUITE_STORAGE_NAME
+			  "/sieve_script_driver",
+			  "file", SETTINGS_OVERRIDE_TYPE_2ND_CLI_PARAM);
+	settings_override(set_instance,
+			  "sieve_script/"TESTSUITE_STORAGE_NAME
+			  "/sieve_script_path",
+			  testsuite_storage_path,
+			  SETTINGS_OVERRIDE_TYPE_2ND_CLI_PARAM);
+}
+
+void testsuite_storage_deinit(void)
+{
+	i_free(testsuite_storage_path);
+}
+
+/*
+ * Storage access
+ */
+
+static struct sieve_storage *
+testsuite_storage_open(const struct sieve_runtime_env *renv)
+{
+	struct sieve_instance *svinst = testsuite_sieve_instance;
+	struct sieve_storage *storage;
+	const char *error;
+
+	if (sieve_storage_create(svinst, svinst->event, SIEVE_SCRIPT_CAUSE_ANY,
+				 TESTSUITE_STORAGE_NAME,
+				 SIEVE_STORAGE_FLAG_READWRITE,
+				 &storage, NULL, &error) < 0) {
+		sieve_runtime_error(renv, NULL,
+				    "failed to open test script storage: %s",
+				    error);
+		return NULL;
+	}
+	return storage;
+}
+
+static void
+testsuite_storage_error(const struct sieve_runtime_env *renv,
+			struct sieve_storage *storage, const char *action)
+{
+	sieve_runtime_error(renv, NULL, "failed to %s: %s", action,
+			    sieve_storage_get_last_error(storage, NULL));
+}
+
+/*
+ * Script management
+ */
+
+static bool
+testsuite_storage_compile_commit(const struct sieve_runtime_env *renv,
+				 struct sieve_storage *storage,
+				 struct sieve_storage_save_context **_sctx)
+{
+	struct sieve_instance *svinst = testsuite_sieve_instance;
+	struct sieve_storage_save_context *sctx = *_sctx;
+	struct sieve_error_handler *ehandler;
+	struct sieve_script *script;
+	struct sieve_binary *sbin;
+	string_t *errors;
+	bool result = TRUE;
+
+	script = sieve_storage_save_get_tempscript(sctx);
+	if (script == NULL) {
+		testsuite_storage_error(renv, storage, "save script");
+		return FALSE;
+	}
+
+	/* Compile the script like ManageSieve PUTSCRIPT does */
+	errors = t_str_new(1024);
+	ehandler = sieve_strbuf_ehandler_create(
+		svinst, errors, TRUE, TESTSUITE_STORAGE_MAX_COMPILE_ERRORS);
+	if (sieve_compile_script(script, ehandler,
+				 SIEVE_COMPILE_FLAG_NOGLOBAL |
+				 SIEVE_COMPILE_FLAG_UPLOADED,
+				 &sbin, NULL) < 0) {
+		sieve_runtime_error(renv, NULL,
+				    "failed to compile uploaded script: %s",
+				    str_c(errors));
+		result = FALSE;
+	} else {
+		sieve_storage_save_set_binary(sctx, sbin, ehandler);
+		sieve_close(&sbin);
+
+		if (sieve_storage_save_commit(_sctx) < 0) {
+			testsuite_storage_error(renv, storage, "save script");
+			result = FALSE;
+		}
+	}
+	sieve_error_handler_unref(&ehandler);
+	return result;
+}
+
+bool testsuite_storage_putscript(const struct sieve_runtime_env *renv,
+				 const char *name, const char *data)
+{
+	struct sieve_storage *storage;
+	struct sieve_storage_save_context *sctx;
+	struct istream *input;
+	bool result = TRUE;
+	ssize_t ret;
+
+	storage = testsuite_storage_open(renv);
+	if (storage == NULL)
+		return FALSE;
+
+	/* Scripts beyond quota are refused before they are uploaded */
+	if (!testsuite_storage_havespace(renv, name, strlen(data))) {
+		sieve_storage_unref(&storage);
+		return FALSE;
+	}
+
+	input = i_stream_create_from_data(data, strlen(data));
+	sctx = sieve_storage_save_init(storage, name, input);
+	if (sctx == NULL) {
+		testsuite_storage_error(renv, storage, "save script");
+		i_stream_unref(&input);
+		sieve_storage_unref(&storage);
+		return FALSE;
+	}
+
+	while ((ret = i_stream_read(input)) > 0 || ret == -2) {
+		if (sieve_storage_save_continue(sctx) < 0) {
+			result = FALSE;
+			break;
+		}
+	}
+	if (result && sieve_storage_save_finish(sctx) < 0)
+		result = FALSE;
+	if (!result)
+		testsuite_storage_error(renv, storage, "save script");
+	else
+		result = testsuite_storage_compile_commit(renv, storage,
+							  &sctx);
+
+	if (sctx != NULL)
+		sieve_storage_save_cancel(&sctx);
+	i_stream_unref(&input);
+	sieve_storage_unref(&storage);
+	return result;
+}
+
+bool testsuite_storage_deletescript(const struct sieve_runtime_env *renv,
+				    const char *name)
+{
+	struct sieve_storage *storage;
+	struct sieve_script *script;
+	bool result = TRUE;
+
+	storage = testsuite_storage_open(renv);
+	if (storage == NULL)
+		return FALSE;
+
+	if (sieve_storage_open_script(storage, name, &script, NULL) < 0)
+		result = FALSE;
+	else {
+		if (sieve_script_delete(script, FALSE) < 0)
+			result = FALSE;
+		sieve_script_unref(&script);
+	}
+	if (!result)
+		testsuite_storage_error(renv, storage, "delete script");
+
+	sieve_storage_unref(&storage);
+	return result;
+}
+
+bool testsuite_storage_renamescript(const struct sieve_runtime_env *renv,
+				    const char *name, const char *newname)
+{
+	struct sieve_storage *storage;
+	struct sieve_script *script;
+	bool result = TRUE;
+
+	storage = testsuite_storage_open(renv);
+	if (storage == NULL)
+		return FALSE;
+
+	if (sieve_storage_open_script(storage, name, &script, NULL) < 0)
+		result = FALSE;
+	else {
+		if (sieve_script_rename(script, newname) < 0)
+			result = FALSE;
+		sieve_script_unref(&script);
+	}
+	if (!result)
+		testsuite_storage_error(renv, storage, "rename script");
+
+	sieve_storage_unref(&storage);
+	return result;
+}
+
+bool testsuite_storage_havespace(const struct sieve_runtime_env *renv,
+				 const char *name, sieve_number_t size)
+{
+	struct sieve_storage *storage;
+	enum sieve_storage_quota quota;
+	uint64_t limit;
+	int ret;
+
+	storage = testsuite_storage_open(renv);
+	if (storage == NULL)
+		return FALSE;
+
+	ret = sieve_storage_quota_havespace(storage, name, size,
+					    &quota, &limit);
+	if (ret < 0)
+		testsuite_storage_error(renv, storage, "check quota");
+
+	sieve_storage_unref(&storage);
+	return (ret > 0);
+}
+
+bool testsuite_storage_write(const struct sieve_runtime_env *renv,
+			     const char *name, const char *data)
+{
+	const char *path;
+	int fd;
+
+	path = t_strdup_printf("%s/%s."SIEVE_SCRIPT_FILEEXT,
+			       testsuite_storage_path, name);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		sieve_runtime_error(renv, NULL, "open(%s) failed: %m", path);
+		return FALSE;
+	}
+	if (write_full(fd, data, strlen(data)) < 0) {
+		sieve_runtime_error(renv, NULL, "write(%s) failed: %m", path);
+		i_close_fd(&fd);
+		return FALSE;
+	}
+	i_close_fd(&fd);
+	return TRUE;
+}
+
+bool testsuite_storage_load(const struct sieve_runtime_env *renv,
+			    const char *name)
+{
+	struct testsuite_interpreter_context *ictx =
+		testsuite_interpreter_context_get(renv->interp, testsuite_ext);
+	struct sieve_storage *storage;
+	struct sieve_script *script;
+	struct sieve_binary *sbin;
+	enum sieve_error error_code;
+	bool result = TRUE;
+
+	i_assert(ictx != NULL);
+	testsuite_log_clear_messages();
+
+	storage = testsuite_storage_open(renv);
+	if (storage == NULL)
+		return FALSE;
+
+	if (sieve_storage_open_script(storage, name, &script, NULL) < 0) {
+		testsuite_storage_error(renv, storage, "open script");
+		sieve_storage_unref(&storage);
+		return FALSE;
+	}
+
+	if (sieve_script_binary_load(script, &sbin, &error_code) < 0) {
+		sieve_runtime_trace(renv, SIEVE_TRLVL_TESTS,
+				    "no stored binary for script '%s'", name);
+		result = FALSE;
+	} else if (!sieve_binary_up_to_date(sbin, 0)) {
+		sieve_runtime_trace(renv, SIEVE_TRLVL_TESTS,
+				    "stored binary for script '%s' "
+				    "is not up-to-date", name);
+		sieve_binary_close(&sbin);
+		result = FALSE;
+	} else {
+		sieve_binary_unref(&ictx->compiled_script);
+		ictx->compiled_script = sbin;
+	}
+
+	sieve_script_unref(&script);
+	sieve_storage_unref(&storage);
+	return result;
+}
@@ -0,0 +1,36 @@
+#ifndef TESTSUITE_STORAGE_H
+#define TESTSUITE_STORAGE_H
+
+#include "sieve-common.h"
+
+void testsuite_storage_init(void);
+void testsuite_storage_deinit(void);
+
+/*
+ * Script management
+ */
+
+/* These emulate the corresponding ManageSieve commands on a personal script
+   storage in the testsuite's temporary directory. */
+
+bool testsuite_storage_putscript(const struct sieve_runtime_env *renv,
+				 const char *name, const char *data);
+bool testsuite_storage_deletescript(const struct sieve_runtime_env *renv,
+				    const char *name);
+bool testsuite_storage_renamescript(const struct sieve_runtime_env *renv,
+				    const char *name, const char *newname);
+bool testsuite_storage_havespace(const struct sieve_runtime_env *renv,
+				 const char *name, sieve_number_t size);
+
+/* Rewrites the script file in place, bypassing the storage (as an external
+   editor would) */
+bool testsuite_storage_write(const struct sieve_runtime_env *renv,
+			     const char *name, const char *data);
+
+/* Loads the binary stored for the script, like delivery does, and makes it
+   the one executed by test_script_run. Fails when there is no stored binary
+   or when it is not up-to-date; the script is never compiled. */
+bool testsuite_storage_load(const struct sieve_runtime_env *renv,
+			    const char *name);
+
+#endif
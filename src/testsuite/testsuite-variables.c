@@ -1,6 +1,7 @@
 /* Copyright (c) Pigeonhole authors, see top-level COPYING file */
 
 #include "lib.h"
+#include "str.h"
 
 #include "sieve-common.h"
 #include "sieve-ast.h"
@@ -15,6 +16,7 @@
 #include "sieve-ext-variables.h"
 
 #include "testsuite-common.h"
+#include "testsuite-smtp.h"
 #include "testsuite-variables.h"
 
 /*
@@ -135,6 +137,36 @@ bool testsuite_varnamespace_dump_variable(
 	return TRUE;
 }
 
+static void
+testsuite_binary_cache_variable(const char *name, string_t **str_r)
+{
+	struct sieve_binary_cache_stats stats;
+	uoff_t value;
+
+	sieve_binary_cache_get_stats(&stats);
+	if (strcmp(name, "hits") == 0)
+		value = stats.hits;
+	else if (strcmp(name, "misses") == 0)
+		value = stats.misses;
+	else if (strcmp(name, "evictions") == 0)
+		value = stats.evictions;
+	else if (strcmp(name, "count") == 0)
+		value = stats.count;
+	else if (strcmp(name, "size") == 0)
+		value = stats.size;
+	else if (strcmp(name, "pinned") == 0)
+		value = stats.pinned;
+	else if (strcmp(name, "mapped") == 0)
+		value = stats.mapped;
+	else {
+		*str_r = t_str_new_const("", 0);
+		return;
+	}
+
+	*str_r = t_str_new(16);
+	str_printfa(*str_r, "%"PRIuUOFF_T, value);
+}
+
 int testsuite_varnamespace_read_variable(
 	const struct sieve_runtime_env *renv,
 	const struct sieve_variables_namespace *nspc ATTR_UNUSED,
@@ -142,6 +174,7 @@ int testsuite_varnamespace_read_variable(
 	string_t **str_r)
 {
 	string_t *var_name;
+	const char *name;
 
 	if (!sieve_binary_read_string(renv->sblock, address, &var_name)) {
 		sieve_runtime_trace_operand_error(renv, oprnd,
@@ -153,6 +186,17 @@ int testsuite_varnamespace_read_variable(
 		if (strcmp(str_c(var_name), "path") == 0) {
 			*str_r = t_str_new_const(testsuite_test_path,
 						 strlen(testsuite_test_path));
+		} else if (strcmp(str_c(var_name), "tmpdir") == 0) {
+			const char *tmp_dir = testsuite_tmp_dir_get();
+
+			*str_r = t_str_new_const(tmp_dir, strlen(tmp_dir));
+		} else if (strcmp(str_c(var_name), "smtp_transactions") == 0) {
+			*str_r = t_str_new(16);
+			str_printfa(*str_r, "%u",
+				    testsuite_smtp_get_transaction_count());
+		} else if (str_begins(str_c(var_name), "binary_cache_",
+				      &name)) {
+			testsuite_binary_cache_variable(name, str_r);
 		} else {
 			*str_r = t_str_new_const("", 0);
 		}
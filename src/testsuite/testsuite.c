@@ -27,6 +27,7 @@
 #include "testsuite-message.h"
 #include "testsuite-script.h"
 #include "testsuite-smtp.h"
+#include "testsuite-duplicate.h"
 #include "testsuite-mailstore.h"
 
 #include <stdio.h>
@@ -260,6 +261,8 @@ int main(int argc, char **argv)
 		scriptenv.smtp_send = testsuite_smtp_send;
 		scriptenv.smtp_abort = testsuite_smtp_abort;
 		scriptenv.smtp_finish = testsuite_smtp_finish;
+		scriptenv.duplicate_check = testsuite_duplicate_check;
+		scriptenv.duplicate_mark = testsuite_duplicate_mark;
 		scriptenv.trace_log = trace_log;
 		scriptenv.trace_config = trace_config;
 		scriptenv.exec_status = &exec_status;
@@ -0,0 +1,372 @@
+/* Copyright (c) Pigeonhole authors, see top-level COPYING file */
+
+#include "lib.h"
+
+#include "sieve-common.h"
+#include "sieve-commands.h"
+#include "sieve-validator.h"
+#include "sieve-generator.h"
+#include "sieve-interpreter.h"
+#include "sieve-code.h"
+#include "sieve-binary.h"
+#include "sieve-dump.h"
+
+#include "testsuite-common.h"
+#include "testsuite-storage.h"
+
+/*
+ * Tests
+ */
+
+static bool
+tst_test_storage_validate(struct sieve_validator *valdtr,
+			  struct sieve_command *tst);
+static bool
+tst_test_storage_generate(const struct sieve_codegen_env *cgenv,
+			  struct sieve_command *tst);
+
+/* Test_storage_putscript test
+ *
+ * Syntax:
+ *   test_storage_putscript <name: string> <script: string>
+ */
+
+const struct sieve_command_def tst_test_storage_putscript = {
+	.identifier = "test_storage_putscript",
+	.type = SCT_TEST,
+	.positional_args = 2,
+	.subtests = 0,
+	.block_allowed = FALSE,
+	.block_required = FALSE,
+	.validate = tst_test_storage_validate,
+	.generate = tst_test_storage_generate,
+};
+
+/* Test_storage_deletescript test
+ *
+ * Syntax:
+ *   test_storage_deletescript <name: string>
+ */
+
+const struct sieve_command_def tst_test_storage_deletescript = {
+	.identifier = "test_storage_deletescript",
+	.type = SCT_TEST,
+	.positional_args = 1,
+	.subtests = 0,
+	.block_allowed = FALSE,
+	.block_required = FALSE,
+	.validate = tst_test_storage_validate,
+	.generate = tst_test_storage_generate,
+};
+
+/* Test_storage_renamescript test
+ *
+ * Syntax:
+ *   test_storage_renamescript <name: string> <new-name: string>
+ */
+
+const struct sieve_command_def tst_test_storage_renamescript = {
+	.identifier = "test_storage_renamescript",
+	.type = SCT_TEST,
+	.positional_args = 2,
+	.subtests = 0,
+	.block_allowed = FALSE,
+	.block_required = FALSE,
+	.validate = tst_test_storage_validate,
+	.generate = tst_test_storage_generate,
+};
+
+/* Test_storage_havespace test
+ *
+ * Syntax:
+ *   test_storage_havespace <name: string> <size: number>
+ */
+
+const struct sieve_command_def tst_test_storage_havespace = {
+	.identifier = "test_storage_havespace",
+	.type = SCT_TEST,
+	.positional_args = 2,
+	.subtests = 0,
+	.block_allowed = FALSE,
+	.block_required = FALSE,
+	.validate = tst_test_storage_validate,
+	.generate = tst_test_storage_generate,
+};
+
+/* Test_storage_write test
+ *
+ * Syntax:
+ *   test_storage_write <name: string> <script: string>
+ */
+
+const struct sieve_command_def tst_test_storage_write = {
+	.identifier = "test_storage_write",
+	.type = SCT_TEST,
+	.positional_args = 2,
+	.subtests = 0,
+	.block_allowed = FALSE,
+	.block_required = FALSE,
+	.validate = tst_test_storage_validate,
+	.generate = tst_test_storage_generate,
+};
+
+/* Test_storage_load test
+ *
+ * Syntax:
+ *   test_storage_load <name: string>
+ */
+
+const struct sieve_command_def tst_test_storage_load = {
+	.identifier = "test_storage_load",
+	.type = SCT_TEST,
+	.positional_args = 1,
+	.subtests = 0,
+	.block_allowed = FALSE,
+	.block_required = FALSE,
+	.validate = tst_test_storage_validate,
+	.generate = tst_test_storage_generate,
+};
+
+/*
+ * Operations
+ */
+
+static bool
+tst_test_storage_operation_dump(const struct sieve_dumptime_env *denv,
+				sieve_size_t *address);
+static int
+tst_test_storage_operation_execute(const struct sieve_runtime_env *renv,
+				   sieve_size_t *address);
+
+/* Test_storage_putscript operation */
+
+const struct sieve_operation_def test_storage_putscript_operation = {
+	.mnemonic = "TEST_STORAGE_PUTSCRIPT",
+	.ext_def = &testsuite_extension,
+	.code = TESTSUITE_OPERATION_TEST_STORAGE_PUTSCRIPT,
+	.dump = tst_test_storage_operation_dump,
+	.execute = tst_test_storage_operation_execute,
+};
+
+/* Test_storage_deletescript operation */
+
+const struct sieve_operation_def test_storage_deletescript_operation = {
+	.mnemonic = "TEST_STORAGE_DELETESCRIPT",
+	.ext_def = &testsuite_extension,
+	.code = TESTSUITE_OPERATION_TEST_STORAGE_DELETESCRIPT,
+	.dump = tst_test_storage_operation_dump,
+	.execute = tst_test_storage_operation_execute,
+};
+
+/* Test_storage_renamescript operation */
+
+const struct sieve_operation_def test_storage_renamescript_operation = {
+	.mnemonic = "TEST_STORAGE_RENAMESCRIPT",
+	.ext_def = &testsuite_extension,
+	.code = TESTSUITE_OPERATION_TEST_STORAGE_RENAMESCRIPT,
+	.dump = tst_test_storage_operation_dump,
+	.execute = tst_test_storage_operation_execute,
+};
+
+/* Test_storage_havespace operation */
+
+const struct sieve_operation_def test_storage_havespace_operation = {
+	.mnemonic = "TEST_STORAGE_HAVESPACE",
+	.ext_def = &testsuite_extension,
+	.code = TESTSUITE_OPERATION_TEST_STORAGE_HAVESPACE,
+	.dump = tst_test_storage_operation_dump,
+	.execute = tst_test_storage_operation_execute,
+};
+
+/* Test_storage_write operation */
+
+const struct sieve_operation_def test_storage_write_operation = {
+	.mnemonic = "TEST_STORAGE_WRITE",
+	.ext_def = &testsuite_extension,
+	.code = TESTSUITE_OPERATION_TEST_STORAGE_WRITE,
+	.dump = tst_test_storage_operation_dump,
+	.execute = tst_test_storage_operation_execute,
+};
+
+/* Test_storage_load operation */
+
+const struct sieve_operation_def test_storage_load_operation = {
+	.mnemonic = "TEST_STORAGE_LOAD",
+	.ext_def = &testsuite_extension,
+	.code = TESTSUITE_OPERATION_TEST_STORAGE_LOAD,
+	.dump = tst_test_storage_operation_dump,
+	.execute = tst_test_storage_operation_execute,
+};
+
+/*
+ * Validation
+ */
+
+static bool
+tst_test_storage_validate(struct sieve_validator *valdtr,
+			  struct sieve_command *tst)
+{
+	struct sieve_ast_argument *arg = tst->first_positional;
+
+	if (!sieve_validate_positional_argument(valdtr, tst, arg, "name", 1,
+						SAAT_STRING))
+		return FALSE;
+	if (!sieve_validator_argument_activate(valdtr, tst, arg, FALSE))
+		return FALSE;
+
+	if (sieve_command_is(tst, tst_test_storage_deletescript) ||
+	    sieve_command_is(tst, tst_test_storage_load))
+		return TRUE;
+
+	arg = sieve_ast_argument_next(arg);
+
+	if (sieve_command_is(tst, tst_test_storage_havespace)) {
+		if (!sieve_validate_positional_argument(valdtr, tst, arg,
+							"size", 2, SAAT_NUMBER))
+			return FALSE;
+	} else if (sieve_command_is(tst, tst_test_storage_renamescript)) {
+		if (!sieve_validate_positional_argument(valdtr, tst, arg,
+							"new-name", 2,
+							SAAT_STRING))
+			return FALSE;
+	} else {
+		if (!sieve_validate_positional_argument(valdtr, tst, arg,
+							"script", 2,
+							SAAT_STRING))
+			return FALSE;
+	}
+	return sieve_validator_argument_activate(valdtr, tst, arg, FALSE);
+}
+
+/*
+ * Code generation
+ */
+
+static bool
+tst_test_storage_generate(const struct sieve_codegen_env *cgenv,
+			  struct sieve_command *tst)
+{
+	/* Emit operation */
+	if (sieve_command_is(tst, tst_test_storage_putscript)) {
+		sieve_operation_emit(cgenv->sblock, tst->ext,
+				     &test_storage_putscript_operation);
+	} else if (sieve_command_is(tst, tst_test_storage_deletescript)) {
+		sieve_operation_emit(cgenv->sblock, tst->ext,
+				     &test_storage_deletescript_operation);
+	} else if (sieve_command_is(tst, tst_test_storage_renamescript)) {
+		sieve_operation_emit(cgenv->sblock, tst->ext,
+				     &test_storage_renamescript_operation);
+	} else if (sieve_command_is(tst, tst_test_storage_havespace)) {
+		sieve_operation_emit(cgenv->sblock, tst->ext,
+				     &test_storage_havespace_operation);
+	} else if (sieve_command_is(tst, tst_test_storage_write)) {
+		sieve_operation_emit(cgenv->sblock, tst->ext,
+				     &test_storage_write_operation);
+	} else if (sieve_command_is(tst, tst_test_storage_load)) {
+		sieve_operation_emit(cgenv->sblock, tst->ext,
+				     &test_storage_load_operation);
+	} else {
+		i_unreached();
+	}
+
+	/* Generate arguments */
+	return sieve_generate_arguments(cgenv, tst, NULL);
+}
+
+/*
+ * Code dump
+ */
+
+static bool
+tst_test_storage_operation_dump(const struct sieve_dumptime_env *denv,
+				sieve_size_t *address)
+{
+	const struct sieve_operation *oprtn = denv->oprtn;
+
+	sieve_code_dumpf(denv, "%s:", sieve_operation_mnemonic(oprtn));
+	sieve_code_descend(denv);
+
+	if (!sieve_opr_string_dump(denv, address, "name"))
+		return FALSE;
+
+	if (sieve_operation_is(oprtn, test_storage_deletescript_operation) ||
+	    sieve_operation_is(oprtn, test_storage_load_operation))
+		return TRUE;
+	if (sieve_operation_is(oprtn, test_storage_havespace_operation))
+		return sieve_opr_number_dump(denv, address, "size");
+	if (sieve_operation_is(oprtn, test_storage_renamescript_operation))
+		return sieve_opr_string_dump(denv, address, "new-name");
+	return sieve_opr_string_dump(denv, address, "script");
+}
+
+/*
+ * Intepretation
+ */
+
+static int
+tst_test_storage_operation_execute(const struct sieve_runtime_env *renv,
+				   sieve_size_t *address)
+{
+	const struct sieve_operation *oprtn = renv->oprtn;
+	string_t *name, *arg = NULL;
+	sieve_number_t size = 0;
+	bool result;
+	int ret;
+
+	/*
+	 * Read operands
+	 */
+
+	ret = sieve_opr_string_read(renv, address, "name", &name);
+	if (ret <= 0)
+		return ret;
+
+	if (sieve_operation_is(oprtn, test_storage_deletescript_operation) ||
+	    sieve_operation_is(oprtn, test_storage_load_operation))
+		ret = SIEVE_EXEC_OK;
+	else if (sieve_operation_is(oprtn, test_storage_havespace_operation))
+		ret = sieve_opr_number_read(renv, address, "size", &size);
+	else if (sieve_operation_is(oprtn, test_storage_renamescript_operation))
+		ret = sieve_opr_string_read(renv, address, "new-name", &arg);
+	else
+		ret = sieve_opr_string_read(renv, address, "script", &arg);
+	if (ret <= 0)
+		return ret;
+
+	/*
+	 * Perform operation
+	 */
+
+	if (sieve_runtime_trace_active(renv, SIEVE_TRLVL_TESTS)) {
+		sieve_runtime_trace(renv, 0, "testsuite: %s test",
+				    sieve_operation_mnemonic(oprtn));
+		sieve_runtime_trace_descend(renv);
+		sieve_runtime_trace(renv, 0, "script '%s'", str_c(name));
+	}
+
+	if (sieve_operation_is(oprtn, test_storage_putscript_operation)) {
+		result = testsuite_storage_putscript(renv, str_c(name),
+						     str_c(arg));
+	} else if (sieve_operation_is(oprtn,
+				      test_storage_deletescript_operation)) {
+		result = testsuite_storage_deletescript(renv, str_c(name));
+	} else if (sieve_operation_is(oprtn,
+				      test_storage_renamescript_operation)) {
+		result = testsuite_storage_renamescript(renv, str_c(name),
+							str_c(arg));
+	} else if (sieve_operation_is(oprtn,
+				      test_storage_havespace_operation)) {
+		result = testsuite_storage_havespace(renv, str_c(name), size);
+	} else if (sieve_operation_is(oprtn, test_storage_write_operation)) {
+		result = testsuite_storage_write(renv, str_c(name),
+						 str_c(arg));
+	} else if (sieve_operation_is(oprtn, test_storage_load_operation)) {
+		result = testsuite_storage_load(renv, str_c(name));
+	} else {
+		i_unreached();
+	}
+
+	/* Set result */
+	sieve_interpreter_set_test_result(renv->interp, result);
+	return SIEVE_EXEC_OK;
+}
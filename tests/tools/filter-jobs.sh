@@ -0,0 +1,66 @@
+#!/bin/sh
+
+# Checks that sieve-filter produces the same moves and flags with worker
+# processes (-j 2) as without them (-j 1). Small batches (-b) make sure that
+# each worker commits several transactions.
+#
+# Usage: filter-jobs.sh <sieve-filter command> <source dir> <work dir>
+
+set -e
+
+SIEVE_FILTER=$1
+SRCDIR=$2
+WORKDIR=$3
+
+MESSAGES="$SRCDIR/tests/benchmark/messages"
+SCRIPT="$SRCDIR/tests/tools/filter-jobs.sieve"
+
+# Print one line per message: folder, Message-ID and maildir flags
+mailbox_summary() {
+	maildir=$1
+
+	find "$maildir" -type f \( -path '*/cur/*' -o -path '*/new/*' \) |
+	while read -r file; do
+		folder=$(dirname "$(dirname "$file")")
+		folder=${folder#"$maildir"}
+		folder=${folder:-INBOX}
+		flags=$(basename "$file" | sed -n 's/^.*:2,//p')
+		msgid=$(grep -i -m 1 '^Message-ID:' "$file" | tr -d '\r')
+		echo "$folder $msgid $flags"
+	done | sort
+}
+
+for jobs in 1 2; do
+	maildir="$WORKDIR/jobs$jobs/Maildir"
+	mkdir -p "$maildir/cur" "$maildir/new" "$maildir/tmp"
+
+	# Several copies of each message, so that each worker gets some of
+	# each kind
+	i=0
+	for copy in 1 2 3 4; do
+		for msg in "$MESSAGES"/*.eml; do
+			i=$((i + 1))
+			cp "$msg" "$maildir/new/$i.$copy.filter-jobs"
+		done
+	done
+
+	$SIEVE_FILTER \
+		-o mail_driver=maildir -o "mail_path=$maildir" \
+		-o "mail_home=$WORKDIR/jobs$jobs" \
+		-e -W -j $jobs -b 5 "$SCRIPT" INBOX expunge \
+		> "$WORKDIR/jobs$jobs.output"
+
+	mailbox_summary "$maildir" > "$WORKDIR/jobs$jobs.summary"
+done
+
+if ! cmp -s "$WORKDIR/jobs1.summary" "$WORKDIR/jobs2.summary"; then
+	diff -u "$WORKDIR/jobs1.summary" "$WORKDIR/jobs2.summary" || true
+	echo "sieve-filter -j 2 result differs from -j 1"
+	exit 1
+fi
+if ! grep -q '^/\.Lists ' "$WORKDIR/jobs1.summary" ||
+   ! grep -q ' [A-Z]*F[A-Z]*$' "$WORKDIR/jobs1.summary"; then
+	cat "$WORKDIR/jobs1.summary"
+	echo "sieve-filter did not move or flag any messages"
+	exit 1
+fi